@@ -0,0 +1,383 @@
+/*
+ *
+ * Copyright (c) 2007-2019 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libwandio.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libwandio is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwandio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wandio.h"
+#include "wandio_internal.h"
+#ifdef HAVE_SYS_PRCTL_H
+#include <sys/prctl.h>
+#endif
+
+/* Splits what a reader returns into chunks and hands them to a set of worker
+ * threads, so that a caller whose processing is slower than decompression can
+ * spread it across several cores.
+ *
+ * When the reader is threaded, each chunk is a slice of the threaded reader
+ * itself, which isn't refilled until the worker has finished with it, so
+ * nothing is copied. Otherwise each chunk is read into a buffer of its own.
+ *
+ * If the caller gives us a boundary callback, each chunk is cut at the end of
+ * the last whole record in it. The partial record that is left over is
+ * copied, and joined up with the start of the next slice into a chunk of its
+ * own, after which we go back to handing out the next slice directly.
+ */
+
+/* How much of the next slice to add to a partial record at first, which is
+ * doubled until the record is complete */
+#define STITCH_SIZE (64 * 1024)
+
+/* A slice from the reader, which is given back once every chunk that points
+ * into it has been processed */
+struct dispatch_slice_t {
+        struct wandio_loan_t loan;
+        int refs;
+};
+
+struct dispatch_item_t {
+        struct wandio_chunk chunk;
+        /* The slice that the chunk points into, or the copy it was made
+         * from */
+        struct dispatch_slice_t *slice;
+        char *copy;
+};
+
+struct dispatch_t {
+        wandio_chunk_cb_t *cb;
+        wandio_boundary_cb_t *boundary;
+        void *data;
+        pthread_mutex_t mutex;
+        pthread_cond_t ready;
+        pthread_cond_t space;
+        /* Chunks waiting for a worker */
+        struct dispatch_item_t *queue;
+        int capacity;
+        int head;
+        int count;
+        /* No more chunks are coming */
+        bool done;
+        /* A callback asked us to stop */
+        bool stopped;
+        uint64_t seq;
+        int64_t offset;
+        /* The partial record left over from the last slice */
+        char *carry;
+        int64_t carry_len;
+        int64_t carry_size;
+};
+
+/* Drops a reference to a slice. Must be called with the mutex held */
+static void dispatch_release(struct dispatch_slice_t *slice) {
+        if (--slice->refs > 0)
+                return;
+        wandio_unlend(&slice->loan);
+        free(slice);
+}
+
+static void *dispatch_worker(void *userdata) {
+        struct dispatch_t *d = (struct dispatch_t *)userdata;
+        struct dispatch_item_t item;
+        bool stopped;
+
+#ifdef PR_SET_NAME
+        prctl(PR_SET_NAME, "wandio [chunk]", 0, 0, 0);
+#endif
+
+        pthread_mutex_lock(&d->mutex);
+        while (true) {
+                while (d->count == 0 && !d->done)
+                        pthread_cond_wait(&d->ready, &d->mutex);
+                if (d->count == 0)
+                        break;
+                item = d->queue[d->head];
+                d->head = (d->head + 1) % d->capacity;
+                d->count--;
+                pthread_cond_signal(&d->space);
+                stopped = d->stopped;
+                pthread_mutex_unlock(&d->mutex);
+
+                /* Once we have been told to stop, the rest of the chunks
+                 * are just thrown away */
+                if (!stopped && d->cb(&item.chunk, d->data) != 0)
+                        stopped = true;
+
+                pthread_mutex_lock(&d->mutex);
+                if (stopped)
+                        d->stopped = true;
+                if (item.slice)
+                        dispatch_release(item.slice);
+                free(item.copy);
+        }
+        pthread_mutex_unlock(&d->mutex);
+        return NULL;
+}
+
+/* Queues a chunk for the workers. The chunk either points into slice, which
+ * it takes a reference to, or into copy, which it takes ownership of */
+static int dispatch_submit(struct dispatch_t *d, const char *data,
+                           int64_t len, struct dispatch_slice_t *slice,
+                           char *copy) {
+        struct dispatch_item_t *item;
+
+        pthread_mutex_lock(&d->mutex);
+        while (d->count == d->capacity && !d->stopped)
+                pthread_cond_wait(&d->space, &d->mutex);
+        if (d->stopped) {
+                pthread_mutex_unlock(&d->mutex);
+                free(copy);
+                errno = ECANCELED;
+                return -1;
+        }
+
+        item = &d->queue[(d->head + d->count) % d->capacity];
+        item->chunk.seq = d->seq++;
+        item->chunk.offset = d->offset;
+        item->chunk.data = data;
+        item->chunk.len = len;
+        item->slice = slice;
+        item->copy = copy;
+        if (slice)
+                slice->refs++;
+        d->offset += len;
+        d->count++;
+        pthread_cond_signal(&d->ready);
+        pthread_mutex_unlock(&d->mutex);
+        return 0;
+}
+
+static int dispatch_carry(struct dispatch_t *d, const char *data,
+                          int64_t len) {
+        char *carry;
+
+        if (d->carry_len + len > d->carry_size) {
+                d->carry_size = (d->carry_len + len) * 2;
+                carry = realloc(d->carry, d->carry_size);
+                if (!carry)
+                        return -1;
+                d->carry = carry;
+        }
+        memcpy(d->carry + d->carry_len, data, len);
+        d->carry_len += len;
+        return 0;
+}
+
+/* Hands the carried over partial record to the workers, with the first len
+ * bytes of it that make up whole records as a chunk of its own, and keeps
+ * whatever is left */
+static int dispatch_stitched(struct dispatch_t *d, int64_t len) {
+        char *chunk = d->carry;
+        int64_t rest = d->carry_len - len;
+
+        d->carry = NULL;
+        d->carry_len = 0;
+        d->carry_size = 0;
+        if (rest > 0 && dispatch_carry(d, chunk + len, rest) < 0) {
+                free(chunk);
+                return -1;
+        }
+        return dispatch_submit(d, chunk, len, NULL, chunk);
+}
+
+/* Splits a slice into chunks for the workers */
+static int dispatch_slice(struct dispatch_t *d,
+                          struct dispatch_slice_t *slice) {
+        const char *data = slice->loan.data;
+        int64_t len = slice->loan.len;
+        int64_t pos = 0;
+        int64_t take, used, rest;
+
+        if (!d->boundary)
+                return dispatch_submit(d, data, len, slice, NULL);
+
+        while (pos < len) {
+                if (d->carry_len > 0) {
+                        /* Finish off the record that was cut short by the
+                         * end of the last slice */
+                        take = d->carry_len > STITCH_SIZE ? d->carry_len
+                                                          : STITCH_SIZE;
+                        if (take > len - pos)
+                                take = len - pos;
+                        if (dispatch_carry(d, data + pos, take) < 0)
+                                return -1;
+                        pos += take;
+                        used = d->boundary(d->carry, d->carry_len, d->data);
+                        if (used <= 0)
+                                continue;
+                        if (used > d->carry_len)
+                                used = d->carry_len;
+                        /* If what is left all came from this slice, hand
+                         * it out from the slice instead of copying it */
+                        rest = d->carry_len - used;
+                        if (rest <= take) {
+                                d->carry_len -= rest;
+                                pos -= rest;
+                        }
+                        if (dispatch_stitched(d, used) < 0)
+                                return -1;
+                        continue;
+                }
+
+                used = d->boundary(data + pos, len - pos, d->data);
+                if (used > len - pos)
+                        used = len - pos;
+                if (used > 0) {
+                        if (dispatch_submit(d, data + pos, used, slice,
+                                            NULL) < 0)
+                                return -1;
+                        pos += used;
+                }
+                if (pos < len) {
+                        if (dispatch_carry(d, data + pos, len - pos) < 0)
+                                return -1;
+                        pos = len;
+                }
+        }
+        return 0;
+}
+
+/* Gets the next slice from the reader, without copying it if we can */
+static int64_t dispatch_next(io_t *io, struct dispatch_slice_t *slice,
+                             bool *lend) {
+        int64_t ret;
+
+        if (*lend) {
+                ret = wandio_lend(io, &slice->loan);
+                if (ret >= 0 || errno != ENOTSUP)
+                        return ret;
+                *lend = false;
+        }
+
+        slice->loan.owner = NULL;
+        slice->loan.memory = malloc(WANDIO_BUFFER_SIZE);
+        if (!slice->loan.memory)
+                return -1;
+        slice->loan.data = slice->loan.memory;
+        ret = wandio_read(io, slice->loan.memory, WANDIO_BUFFER_SIZE);
+        slice->loan.len = ret > 0 ? ret : 0;
+        if (ret <= 0)
+                free(slice->loan.memory);
+        return ret;
+}
+
+DLLEXPORT int64_t wandio_dispatch(io_t *io, int workers,
+                                  wandio_chunk_cb_t *cb,
+                                  wandio_boundary_cb_t *boundary,
+                                  void *data) {
+        struct dispatch_t d;
+        struct dispatch_slice_t *slice;
+        pthread_t *threads;
+        bool lend = true;
+        int64_t ret = 0;
+        int err = 0;
+        int started;
+
+        if (workers <= 0 || !cb) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        memset(&d, 0, sizeof(d));
+        d.cb = cb;
+        d.boundary = boundary;
+        d.data = data;
+        d.capacity = workers * 2;
+        d.queue = calloc(d.capacity, sizeof(struct dispatch_item_t));
+        threads = calloc(workers, sizeof(pthread_t));
+        if (!d.queue || !threads) {
+                free(d.queue);
+                free(threads);
+                errno = ENOMEM;
+                return -1;
+        }
+        pthread_mutex_init(&d.mutex, NULL);
+        pthread_cond_init(&d.ready, NULL);
+        pthread_cond_init(&d.space, NULL);
+
+        for (started = 0; started < workers; started++) {
+                if (wandio_thread_create(&threads[started], dispatch_worker,
+                                         &d) != 0) {
+                        err = EAGAIN;
+                        break;
+                }
+        }
+
+        while (!err) {
+                slice = malloc(sizeof(struct dispatch_slice_t));
+                if (!slice) {
+                        err = ENOMEM;
+                        break;
+                }
+                ret = dispatch_next(io, slice, &lend);
+                if (ret <= 0) {
+                        if (ret < 0)
+                                err = errno ? errno : EIO;
+                        free(slice);
+                        break;
+                }
+                /* We hold a reference while we are cutting it up */
+                slice->refs = 1;
+                ret = dispatch_slice(&d, slice);
+                if (ret < 0)
+                        err = errno ? errno : ENOMEM;
+                pthread_mutex_lock(&d.mutex);
+                dispatch_release(slice);
+                pthread_mutex_unlock(&d.mutex);
+                if (ret < 0)
+                        break;
+        }
+
+        /* A record that never finished still gets handed out at the end */
+        if (!err && d.carry_len > 0 &&
+            dispatch_stitched(&d, d.carry_len) < 0)
+                err = errno ? errno : ENOMEM;
+        free(d.carry);
+
+        pthread_mutex_lock(&d.mutex);
+        d.done = true;
+        pthread_cond_broadcast(&d.ready);
+        pthread_mutex_unlock(&d.mutex);
+        while (started > 0)
+                pthread_join(threads[--started], NULL);
+
+        pthread_mutex_destroy(&d.mutex);
+        pthread_cond_destroy(&d.ready);
+        pthread_cond_destroy(&d.space);
+        free(d.queue);
+        free(threads);
+
+        /* The last chunks may have been thrown away without us noticing */
+        if (d.stopped)
+                err = ECANCELED;
+        if (err) {
+                errno = err;
+                return -1;
+        }
+        return (int64_t)d.seq;
+}
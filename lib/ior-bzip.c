@@ -33,6 +33,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include "wandio.h"
+#include "wandio_internal.h"
 
 /* Libwandio IO module implementing a bzip reader */
 
@@ -58,7 +59,11 @@ DLLEXPORT io_t *bz_open(io_t *parent) {
                 return NULL;
         io = malloc(sizeof(io_t));
         io->source = &bz_source;
-        io->data = malloc(sizeof(struct bz_t));
+        io->data = wandio_alloc_buffer(sizeof(struct bz_t));
+        if (!io->data) {
+                free(io);
+                return NULL;
+        }
 
         DATA(io)->parent = parent;
 
@@ -90,9 +95,13 @@ static int64_t bz_read(io_t *io, void *buffer, int64_t len) {
 
         while (DATA(io)->err == ERR_OK && DATA(io)->strm.avail_out > 0) {
                 while (DATA(io)->strm.avail_in <= 0) {
+                        /* Decompress straight out of our parent's memory if
+                         * we can, otherwise read into inbuff */
+                        const void *in;
                         int bytes_read =
-                            wandio_read(DATA(io)->parent, DATA(io)->inbuff,
-                                        sizeof(DATA(io)->inbuff));
+                            wandio_borrow(DATA(io)->parent, &in,
+                                          DATA(io)->inbuff,
+                                          sizeof(DATA(io)->inbuff));
                         if (bytes_read == 0) /* EOF */
                                 return len - DATA(io)->strm.avail_out;
                         if (bytes_read < 0) { /* Error */
@@ -105,7 +114,7 @@ static int64_t bz_read(io_t *io, void *buffer, int64_t len) {
                                 /* Now return error */
                                 return -1;
                         }
-                        DATA(io)->strm.next_in = DATA(io)->inbuff;
+                        DATA(io)->strm.next_in = (char *)in;
                         DATA(io)->strm.avail_in = bytes_read;
                 }
                 /* Decompress some data into the output buffer */
@@ -135,11 +144,11 @@ static void bz_close(io_t *io) {
                 BZ2_bzDecompressEnd(&DATA(io)->strm);
         }
         wandio_destroy(DATA(io)->parent);
-        free(io->data);
+        wandio_free_buffer(io->data);
         free(io);
 }
 
 io_source_t bz_source = {"bzip",  bz_read, NULL, /* peek */
                          NULL,                   /* tell */
                          NULL,                   /* seek */
-                         bz_close};
+                         bz_close, NULL, NULL};
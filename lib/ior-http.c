@@ -50,6 +50,7 @@
 #define FILL_FINISHED 0
 #define FILL_RETRY -1
 #define FILL_RETRY_ERROR -2
+#define FILL_CANCELLED -3
 
 struct http_t {
         /* cURL multi handler */
@@ -167,6 +168,15 @@ static int fill_buffer(io_t *io) {
                         else
                                 to.tv_usec = (curl_to % 1000) * 1000;
                 }
+                /* Keep an eye out for being told to give up, e.g. because
+                 * the threaded reader above us is being closed */
+                if (wandio_read_cancelled())
+                        return FILL_CANCELLED;
+                if (wandio_cancellable() && (to.tv_sec > 0 ||
+                                             to.tv_usec > 100000)) {
+                        to.tv_sec = 0;
+                        to.tv_usec = 100000;
+                }
                 FD_ZERO(&fdr);
                 FD_ZERO(&fdw);
                 FD_ZERO(&fde);
@@ -443,4 +453,4 @@ static void http_close(io_t *io) {
 }
 
 io_source_t http_source = {"http",    http_read, NULL,
-                           http_tell, http_seek, http_close};
+                           http_tell, http_seek, http_close, NULL, NULL};
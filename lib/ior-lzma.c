@@ -33,6 +33,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include "wandio.h"
+#include "wandio_internal.h"
 
 /* Libwandio IO module implementing an lzma reader */
 
@@ -57,7 +58,11 @@ DLLEXPORT io_t *lzma_open(io_t *parent) {
                 return NULL;
         io = malloc(sizeof(io_t));
         io->source = &lzma_source;
-        io->data = malloc(sizeof(struct lzma_t));
+        io->data = wandio_alloc_buffer(sizeof(struct lzma_t));
+        if (!io->data) {
+                free(io);
+                return NULL;
+        }
 
         DATA(io)->parent = parent;
 
@@ -65,7 +70,7 @@ DLLEXPORT io_t *lzma_open(io_t *parent) {
         DATA(io)->err = ERR_OK;
 
         if (lzma_auto_decoder(&DATA(io)->strm, UINT64_MAX, 0) != LZMA_OK) {
-                free(io->data);
+                wandio_free_buffer(io->data);
                 free(io);
                 fprintf(stderr, "auto decoder failed\n");
                 return NULL;
@@ -87,9 +92,13 @@ static int64_t lzma_read(io_t *io, void *buffer, int64_t len) {
 
         while (DATA(io)->err == ERR_OK && DATA(io)->strm.avail_out > 0) {
                 while (DATA(io)->strm.avail_in <= 0) {
-                        int bytes_read = wandio_read(DATA(io)->parent,
-                                                     (char *)DATA(io)->inbuff,
-                                                     sizeof(DATA(io)->inbuff));
+                        /* Decompress straight out of our parent's memory if
+                         * we can, otherwise read into inbuff */
+                        const void *in;
+                        int bytes_read =
+                            wandio_borrow(DATA(io)->parent, &in,
+                                          DATA(io)->inbuff,
+                                          sizeof(DATA(io)->inbuff));
                         if (bytes_read == 0) {
                                 /* EOF */
                                 if (DATA(io)->strm.avail_out == (uint32_t)len) {
@@ -110,7 +119,7 @@ static int64_t lzma_read(io_t *io, void *buffer, int64_t len) {
                                 /* Now return error */
                                 return -1;
                         }
-                        DATA(io)->strm.next_in = DATA(io)->inbuff;
+                        DATA(io)->strm.next_in = in;
                         DATA(io)->strm.avail_in = bytes_read;
                 }
                 /* Decompress some data into the output buffer */
@@ -134,11 +143,11 @@ static int64_t lzma_read(io_t *io, void *buffer, int64_t len) {
 static void lzma_close(io_t *io) {
         lzma_end(&DATA(io)->strm);
         wandio_destroy(DATA(io)->parent);
-        free(io->data);
+        wandio_free_buffer(io->data);
         free(io);
 }
 
 io_source_t lzma_source = {"lzma",    lzma_read, NULL, /* peek */
                            NULL,                       /* tell */
                            NULL,                       /* seek */
-                           lzma_close};
+                           lzma_close, NULL, NULL};
@@ -0,0 +1,228 @@
+/*
+ *
+ * Copyright (c) 2007-2019 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libwandio.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libwandio is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwandio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#define _GNU_SOURCE 1
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "wandio.h"
+#include "wandio_internal.h"
+
+/* Libwandio IO module implementing a reader for local files that maps the file
+ * into memory rather than reading it.
+ *
+ * The file is mapped a window at a time, so that huge files don't use up the
+ * address space. Decoders can borrow data straight out of the window, which
+ * saves copying it into their own input buffers first.
+ */
+
+#define MMAP_WINDOW (64 * 1024 * 1024)
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+struct mmap_t {
+        int fd;
+        /* Size of the file, as far as we know */
+        int64_t size;
+        /* Offset of the next byte to be handed out */
+        int64_t offset;
+        /* The currently mapped part of the file */
+        char *map;
+        int64_t map_offset;
+        int64_t map_len;
+};
+
+extern io_source_t mmap_source;
+
+#define DATA(io) ((struct mmap_t *)((io)->data))
+
+static void mmap_unmap(io_t *io) {
+        if (DATA(io)->map) {
+                munmap(DATA(io)->map, DATA(io)->map_len);
+#ifdef HAVE_POSIX_FADVISE
+                /* Pages can't be dropped while they are still mapped */
+                if (use_streaming)
+                        posix_fadvise(DATA(io)->fd, DATA(io)->map_offset,
+                                      DATA(io)->map_len, POSIX_FADV_DONTNEED);
+#endif
+                DATA(io)->map = NULL;
+                DATA(io)->map_len = 0;
+        }
+}
+
+DLLEXPORT io_t *mmap_open(const char *filename) {
+        io_t *io;
+        struct stat st;
+        int fd;
+
+        /* Only regular files can be mapped */
+        if (strcmp(filename, "-") == 0)
+                return NULL;
+
+        fd = open(filename, O_RDONLY);
+        if (fd == -1)
+                return NULL;
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+                close(fd);
+                return NULL;
+        }
+
+        io = malloc(sizeof(io_t));
+        io->source = &mmap_source;
+        io->data = calloc(1, sizeof(struct mmap_t));
+        DATA(io)->fd = fd;
+        DATA(io)->size = st.st_size;
+        return io;
+}
+
+/* Makes sure the byte at the current offset is mapped, returning the number of
+ * bytes that are available from there, 0 at the end of the file or -1 if the
+ * file couldn't be mapped */
+static int64_t mmap_window(io_t *io) {
+        int64_t offset = DATA(io)->offset;
+        int64_t start;
+        struct stat st;
+        void *map;
+
+        if (DATA(io)->map && offset >= DATA(io)->map_offset &&
+            offset < DATA(io)->map_offset + DATA(io)->map_len)
+                return DATA(io)->map_offset + DATA(io)->map_len - offset;
+
+        /* The file may still be being written, so check before giving up */
+        if (offset >= DATA(io)->size) {
+                if (fstat(DATA(io)->fd, &st) < 0)
+                        return -1;
+                DATA(io)->size = st.st_size;
+                if (offset >= DATA(io)->size)
+                        return 0;
+        }
+
+        mmap_unmap(io);
+        start = offset - offset % MMAP_WINDOW;
+        DATA(io)->map_len = MIN(MMAP_WINDOW, DATA(io)->size - start);
+        map = mmap(NULL, DATA(io)->map_len, PROT_READ, MAP_SHARED,
+                   DATA(io)->fd, start);
+        if (map == MAP_FAILED) {
+                DATA(io)->map_len = 0;
+                return -1;
+        }
+        madvise(map, DATA(io)->map_len, MADV_SEQUENTIAL);
+        DATA(io)->map = map;
+        DATA(io)->map_offset = start;
+        return DATA(io)->map_offset + DATA(io)->map_len - offset;
+}
+
+/* Returns the mapped address of the current offset */
+static const char *mmap_pos(io_t *io) {
+        return DATA(io)->map + (DATA(io)->offset - DATA(io)->map_offset);
+}
+
+static int64_t mmap_read(io_t *io, void *buffer, int64_t len) {
+        int64_t copied = 0;
+
+        while (copied < len) {
+                int64_t avail = mmap_window(io);
+
+                if (avail < 0)
+                        return copied ? copied : -1;
+                if (avail == 0)
+                        break;
+                avail = MIN(avail, len - copied);
+                memcpy((char *)buffer + copied, mmap_pos(io), avail);
+                DATA(io)->offset += avail;
+                copied += avail;
+        }
+        return copied;
+}
+
+static int64_t mmap_borrow(io_t *io, const void **buffer, void *scratch,
+                           int64_t len) {
+        int64_t avail = mmap_window(io);
+
+        (void)scratch;
+        if (avail <= 0)
+                return avail;
+        /* The window isn't unmapped until we move past it, by which time the
+         * caller has finished with what we gave them */
+        avail = MIN(avail, len);
+        *buffer = mmap_pos(io);
+        DATA(io)->offset += avail;
+        return avail;
+}
+
+static int64_t mmap_tell(io_t *io) {
+        return DATA(io)->offset;
+}
+
+static int64_t mmap_seek(io_t *io, int64_t offset, int whence) {
+        struct stat st;
+        int64_t target;
+
+        switch (whence) {
+        case SEEK_SET:
+                target = offset;
+                break;
+        case SEEK_CUR:
+                target = DATA(io)->offset + offset;
+                break;
+        case SEEK_END:
+                if (fstat(DATA(io)->fd, &st) < 0)
+                        return -1;
+                DATA(io)->size = st.st_size;
+                target = st.st_size + offset;
+                break;
+        default:
+                errno = EINVAL;
+                return -1;
+        }
+        if (target < 0) {
+                errno = EINVAL;
+                return -1;
+        }
+        DATA(io)->offset = target;
+        return target;
+}
+
+static int mmap_get_fd(io_t *io, int64_t *offset) {
+        *offset = DATA(io)->offset;
+        return DATA(io)->fd;
+}
+
+static void mmap_close(io_t *io) {
+        mmap_unmap(io);
+        close(DATA(io)->fd);
+        free(io->data);
+        free(io);
+}
+
+io_source_t mmap_source = {"mmap",     mmap_read,  NULL,
+                           mmap_tell,  mmap_seek,  mmap_close,
+                           mmap_borrow, mmap_get_fd};
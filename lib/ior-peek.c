@@ -35,6 +35,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include "wandio.h"
+#include "wandio_internal.h"
 
 /* Libwandio IO module implementing a peeking reader.
  *
@@ -284,6 +285,79 @@ static int64_t peek_peek(io_t *io, void *buffer, int64_t len) {
         return ret;
 }
 
+static int64_t peek_borrow(io_t *io, const void **buffer, void *scratch,
+                           int64_t len) {
+        int64_t ret;
+
+        if (DATA(io)->length < 0) {
+                return DATA(io)->length;
+        }
+
+        /* Hand out whatever is left from peeking first. The buffer isn't
+         * freed until the next call, so it stays valid for as long as it
+         * needs to */
+        if (DATA(io)->buffer && DATA(io)->offset < DATA(io)->length) {
+                ret = MIN(len, DATA(io)->length - DATA(io)->offset);
+                *buffer = DATA(io)->buffer + DATA(io)->offset;
+                DATA(io)->offset += ret;
+                return ret;
+        }
+        if (DATA(io)->buffer) {
+                free(DATA(io)->buffer);
+                DATA(io)->buffer = NULL;
+                DATA(io)->offset = 0;
+                DATA(io)->length = 0;
+        }
+        return wandio_borrow(DATA(io)->child, buffer, scratch, len);
+}
+
+/* Hands over whatever is left from peeking, buffer and all, and then passes
+ * the request on to the child */
+int64_t peek_lend(io_t *io, struct wandio_loan_t *loan) {
+        if (io->source != &peek_source) {
+                errno = ENOTSUP;
+                return -1;
+        }
+        if (DATA(io)->length < 0) {
+                return DATA(io)->length;
+        }
+
+        if (DATA(io)->buffer && DATA(io)->offset < DATA(io)->length) {
+                loan->data = DATA(io)->buffer + DATA(io)->offset;
+                loan->len = DATA(io)->length - DATA(io)->offset;
+                loan->owner = NULL;
+                loan->slice = -1;
+                loan->memory = DATA(io)->buffer;
+                DATA(io)->buffer = NULL;
+                DATA(io)->offset = 0;
+                DATA(io)->length = 0;
+                return loan->len;
+        }
+        if (DATA(io)->buffer) {
+                free(DATA(io)->buffer);
+                DATA(io)->buffer = NULL;
+                DATA(io)->offset = 0;
+                DATA(io)->length = 0;
+        }
+        return thread_lend(DATA(io)->child, loan);
+}
+
+static int peek_get_fd(io_t *io, int64_t *offset) {
+        int64_t unread = 0;
+        int fd = wandio_get_fd(DATA(io)->child, offset);
+
+        if (fd < 0)
+                return -1;
+        if (DATA(io)->buffer && DATA(io)->length > 0)
+                unread = DATA(io)->length - DATA(io)->offset;
+        /* Whatever we have buffered has already been taken from the file,
+         * which only matters if we can't go back for it */
+        if (*offset < 0)
+                return unread > 0 ? -1 : fd;
+        *offset -= unread;
+        return fd;
+}
+
 static int64_t peek_tell(io_t *io) {
         /* We don't actually maintain a read offset as such, so we want to
          * return the child's read offset */
@@ -305,5 +379,6 @@ static void peek_close(io_t *io) {
         free(io);
 }
 
-io_source_t peek_source = {"peek",    peek_read, peek_peek,
-                           peek_tell, peek_seek, peek_close};
+io_source_t peek_source = {"peek",      peek_read,  peek_peek,
+                           peek_tell,   peek_seek,  peek_close,
+                           peek_borrow, peek_get_fd};
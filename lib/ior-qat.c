@@ -225,4 +225,4 @@ static void qat_close(io_t *io) {
 io_source_t qat_source = {"qatr",   qat_read, NULL, /* peek */
                           NULL,                     /* tell */
                           NULL,                     /* seek */
-                          qat_close};
+                          qat_close, NULL, NULL};
@@ -0,0 +1,106 @@
+/*
+ *
+ * Copyright (c) 2007-2019 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libwandio.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libwandio is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwandio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <stdlib.h>
+#include "wandio.h"
+#include "wandio_internal.h"
+
+/* Libwandio IO module implementing a reader that only reads part of a file,
+ * e.g. one of the ranges from wandio_plan_splits(). The parent is read from
+ * wherever it is up to, and we report end of file once we have read as much
+ * as we were told to.
+ */
+
+struct range_t {
+        io_t *parent;
+        /* Amount that is still to be read */
+        int64_t remaining;
+        int64_t offset;
+};
+
+extern io_source_t range_source;
+
+#define DATA(io) ((struct range_t *)((io)->data))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+DLLEXPORT io_t *range_open(io_t *parent, int64_t length) {
+        io_t *io;
+
+        if (!parent)
+                return NULL;
+        io = malloc(sizeof(io_t));
+        io->source = &range_source;
+        io->data = malloc(sizeof(struct range_t));
+        DATA(io)->parent = parent;
+        DATA(io)->remaining = length;
+        DATA(io)->offset = 0;
+        return io;
+}
+
+static int64_t range_read(io_t *io, void *buffer, int64_t len) {
+        int64_t ret;
+
+        if (DATA(io)->remaining <= 0)
+                return 0;
+        ret = wandio_read(DATA(io)->parent, buffer,
+                          MIN(len, DATA(io)->remaining));
+        if (ret > 0) {
+                DATA(io)->remaining -= ret;
+                DATA(io)->offset += ret;
+        }
+        return ret;
+}
+
+static int64_t range_borrow(io_t *io, const void **buffer, void *scratch,
+                            int64_t len) {
+        int64_t ret;
+
+        if (DATA(io)->remaining <= 0)
+                return 0;
+        ret = wandio_borrow(DATA(io)->parent, buffer, scratch,
+                            MIN(len, DATA(io)->remaining));
+        if (ret > 0) {
+                DATA(io)->remaining -= ret;
+                DATA(io)->offset += ret;
+        }
+        return ret;
+}
+
+static int64_t range_tell(io_t *io) {
+        return DATA(io)->offset;
+}
+
+static void range_close(io_t *io) {
+        wandio_destroy(DATA(io)->parent);
+        free(io->data);
+        free(io);
+}
+
+io_source_t range_source = {"range",     range_read,  NULL, /* peek */
+                            range_tell,  NULL,              /* seek */
+                            range_close, range_borrow, NULL};
@@ -0,0 +1,239 @@
+/*
+ *
+ * Copyright (c) 2007-2019 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libwandio.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libwandio is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwandio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wandio.h"
+#include "wandio_internal.h"
+
+/* Libwandio IO module implementing a reader for files written by the sharded
+ * writer, which puts the original stream back together.
+ *
+ * Each shard is read by an ordinary reader (and so is decompressed by its own
+ * thread, if threads are enabled). We keep the header of the next write in
+ * each shard, and hand out the writes in the order they were made.
+ */
+
+extern io_source_t shard_source;
+
+struct shard_head_t {
+        /* Position in the stream of the next write in this shard */
+        uint64_t seq;
+        /* Amount of that write still to be handed out */
+        int64_t remaining;
+        /* Nothing more is coming from this shard */
+        bool eof;
+};
+
+struct shardr_t {
+        io_t **shards;
+        struct shard_head_t *heads;
+        int count;
+        /* The shard whose write we are handing out, or -1 */
+        int current;
+        /* The position in the stream of the write we want next */
+        uint64_t next_seq;
+        int64_t offset;
+};
+
+#define DATA(io) ((struct shardr_t *)((io)->data))
+
+/* Reads exactly len bytes, unless the shard ends first */
+static int64_t shard_read_full(io_t *shard, void *buffer, int64_t len) {
+        int64_t got = 0;
+        int64_t ret;
+
+        while (got < len) {
+                ret = wandio_read(shard, (char *)buffer + got, len - got);
+                if (ret < 0)
+                        return -1;
+                if (ret == 0)
+                        break;
+                got += ret;
+        }
+        return got;
+}
+
+/* Reads the header of the next write in a shard. A shard that ends part way
+ * through a header, e.g. because the writer was killed, just ends there */
+static int shard_next_header(io_t *io, int shard) {
+        struct shard_head_t *head = &DATA(io)->heads[shard];
+        unsigned char header[SHARD_HEADER_SIZE];
+        int64_t ret;
+        int i;
+
+        ret = shard_read_full(DATA(io)->shards[shard], header,
+                              SHARD_HEADER_SIZE);
+        if (ret < 0)
+                return -1;
+        if (ret < SHARD_HEADER_SIZE) {
+                head->eof = true;
+                return 0;
+        }
+        head->seq = 0;
+        head->remaining = 0;
+        for (i = 7; i >= 0; i--) {
+                head->seq = (head->seq << 8) | header[i];
+                head->remaining = (int64_t)(((uint64_t)head->remaining << 8) |
+                                            header[8 + i]);
+        }
+        /* No writer produces a length this big, so the shard is corrupt and
+         * we can't trust anything after this point in it */
+        if (head->remaining < 0) {
+                head->eof = true;
+                errno = EINVAL;
+                return -1;
+        }
+        return 0;
+}
+
+static void shard_free(io_t *io) {
+        int i;
+
+        for (i = 0; i < DATA(io)->count; i++) {
+                if (DATA(io)->shards[i])
+                        wandio_destroy(DATA(io)->shards[i]);
+        }
+        free(DATA(io)->shards);
+        free(DATA(io)->heads);
+        free(io->data);
+        free(io);
+}
+
+DLLEXPORT io_t *shard_open(const char *const *filenames, int count) {
+        char magic[SHARD_MAGIC_SIZE];
+        io_t *io;
+        int i;
+
+        if (count <= 0) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        io = malloc(sizeof(io_t));
+        io->source = &shard_source;
+        io->data = calloc(1, sizeof(struct shardr_t));
+        DATA(io)->count = count;
+        DATA(io)->current = -1;
+        DATA(io)->shards = calloc(count, sizeof(io_t *));
+        DATA(io)->heads = calloc(count, sizeof(struct shard_head_t));
+
+        for (i = 0; i < count; i++) {
+                DATA(io)->shards[i] = wandio_create(filenames[i]);
+                if (!DATA(io)->shards[i]) {
+                        shard_free(io);
+                        return NULL;
+                }
+                if (shard_read_full(DATA(io)->shards[i], magic,
+                                    SHARD_MAGIC_SIZE) != SHARD_MAGIC_SIZE ||
+                    memcmp(magic, SHARD_MAGIC, SHARD_MAGIC_SIZE) != 0) {
+                        shard_free(io);
+                        errno = EINVAL;
+                        return NULL;
+                }
+                if (shard_next_header(io, i) < 0) {
+                        shard_free(io);
+                        return NULL;
+                }
+        }
+        return io;
+}
+
+/* Finds the shard holding the next write. If it has gone missing, e.g.
+ * because a shard was cut short, we carry on with whatever comes after it */
+static int shard_pick(io_t *io) {
+        struct shard_head_t *head;
+        int best = -1;
+        int i;
+
+        for (i = 0; i < DATA(io)->count; i++) {
+                head = &DATA(io)->heads[i];
+                if (head->eof)
+                        continue;
+                if (head->seq == DATA(io)->next_seq)
+                        return i;
+                if (best < 0 || head->seq < DATA(io)->heads[best].seq)
+                        best = i;
+        }
+        return best;
+}
+
+static int64_t shard_read(io_t *io, void *buffer, int64_t len) {
+        struct shard_head_t *head;
+        int64_t copied = 0;
+        int64_t amount;
+        int64_t ret;
+
+        while (copied < len) {
+                if (DATA(io)->current < 0) {
+                        DATA(io)->current = shard_pick(io);
+                        if (DATA(io)->current < 0)
+                                break;
+                }
+                head = &DATA(io)->heads[DATA(io)->current];
+
+                if (head->remaining > 0) {
+                        amount = head->remaining;
+                        if (amount > len - copied)
+                                amount = len - copied;
+                        ret = wandio_read(DATA(io)->shards[DATA(io)->current],
+                                          (char *)buffer + copied, amount);
+                        if (ret < 0)
+                                return copied ? copied : -1;
+                        if (ret == 0) {
+                                /* The shard was cut short */
+                                head->eof = true;
+                                DATA(io)->current = -1;
+                                continue;
+                        }
+                        head->remaining -= ret;
+                        copied += ret;
+                        DATA(io)->offset += ret;
+                }
+
+                if (head->remaining == 0) {
+                        DATA(io)->next_seq = head->seq + 1;
+                        DATA(io)->current = -1;
+                        if (shard_next_header(io, head - DATA(io)->heads) < 0)
+                                return copied ? copied : -1;
+                }
+        }
+        return copied;
+}
+
+static int64_t shard_tell(io_t *io) {
+        return DATA(io)->offset;
+}
+
+static void shard_close(io_t *io) {
+        shard_free(io);
+}
+
+io_source_t shard_source = {"shard",    shard_read, NULL, /* peek */
+                            shard_tell, NULL,             /* seek */
+                            shard_close, NULL, NULL};
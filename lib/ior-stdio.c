@@ -26,6 +26,7 @@
 
 #define _GNU_SOURCE 1
 #include "config.h"
+#include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,11 +36,41 @@
 #include "wandio.h"
 #include "wandio_internal.h"
 
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+/* O_DIRECT reads must start at, and be a multiple of, this size */
+#define DIRECT_ALIGN 4096
+
 /* Libwandio IO module implementing a standard IO reader, i.e. no decompression
+ *
+ * In streaming mode, we ask the kernel to read ahead of us and to drop the
+ * parts of the file we have finished with from the page cache, so that
+ * reading a huge file doesn't push everything else out of memory.
+ *
+ * With O_DIRECT, reads that aren't aligned in memory, in size or in the file
+ * (e.g. after seeking) go through an aligned bounce buffer. A read that stops
+ * short of a block boundary has reached the end of the file, and leaves the
+ * file offset unaligned, so we don't read any further after that.
  */
 
 struct stdio_t {
         int fd;
+        bool streaming;
+        /* Offset of the next byte to be read */
+        int64_t offset;
+        /* We have asked for the file to be read ahead up to here */
+        int64_t readahead;
+        /* Everything before here has been dropped from the page cache */
+        int64_t dropped;
+        bool direct;
+        bool eof;
+        /* Aligned buffer for O_DIRECT reads that can't go straight into the
+         * caller's buffer, holding bounce_len bytes of which the first
+         * bounce_used have been handed out */
+        char *bounce;
+        int64_t bounce_used;
+        int64_t bounce_len;
+        /* Number of bytes to skip from the next block, after seeking */
+        int64_t skip;
 };
 
 extern io_source_t stdio_source;
@@ -48,44 +79,236 @@ extern io_source_t stdio_source;
 
 DLLEXPORT io_t *stdio_open(const char *filename) {
         io_t *io = malloc(sizeof(io_t));
-        io->data = malloc(sizeof(struct stdio_t));
+        struct stat st;
+        io->data = calloc(1, sizeof(struct stdio_t));
 
         if (strcmp(filename, "-") == 0)
                 DATA(io)->fd = 0; /* STDIN */
-        else
-                DATA(io)->fd =
-                    open(filename, O_RDONLY
+        else {
+                DATA(io)->fd = -1;
 #ifdef O_DIRECT
-                                       | (force_directio_read ? O_DIRECT : 0)
+                if (force_directio_read)
+                        DATA(io)->fd = open(filename, O_RDONLY | O_DIRECT);
 #endif
-                    );
+                /* Not every filesystem supports O_DIRECT (e.g. tmpfs) */
+                if (DATA(io)->fd == -1)
+                        DATA(io)->fd = open(filename, O_RDONLY);
+        }
         io->source = &stdio_source;
 
         if (DATA(io)->fd == -1) {
+                free(io->data);
                 free(io);
                 return NULL;
         }
 
+#ifdef O_DIRECT
+        if (force_directio_read &&
+            (fcntl(DATA(io)->fd, F_GETFL) & O_DIRECT) != 0) {
+                DATA(io)->bounce = wandio_alloc_buffer(WANDIO_BUFFER_SIZE);
+                if (!DATA(io)->bounce) {
+                        close(DATA(io)->fd);
+                        free(io->data);
+                        free(io);
+                        return NULL;
+                }
+                DATA(io)->direct = true;
+                DATA(io)->offset = lseek(DATA(io)->fd, 0, SEEK_CUR);
+        }
+#endif
+
+        /* Pipes have no page cache to manage, and nor does O_DIRECT */
+        if (use_streaming && !DATA(io)->direct &&
+            fstat(DATA(io)->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+                DATA(io)->streaming = true;
+                DATA(io)->offset = lseek(DATA(io)->fd, 0, SEEK_CUR);
+                DATA(io)->readahead = DATA(io)->offset;
+                DATA(io)->dropped = DATA(io)->offset;
+#ifdef HAVE_POSIX_FADVISE
+                posix_fadvise(DATA(io)->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        }
+
         return io;
 }
 
+/* Keeps the kernel reading a window ahead of the read offset, and drops
+ * anything more than a window behind it */
+static void stdio_stream(io_t *io) {
+        int64_t offset = DATA(io)->offset;
+
+        if (offset + WANDIO_STREAM_WINDOW > DATA(io)->readahead) {
+                if (DATA(io)->readahead < offset)
+                        DATA(io)->readahead = offset;
+#if defined(HAVE_READAHEAD)
+                readahead(DATA(io)->fd, DATA(io)->readahead,
+                          WANDIO_STREAM_WINDOW);
+#elif defined(HAVE_POSIX_FADVISE)
+                posix_fadvise(DATA(io)->fd, DATA(io)->readahead,
+                              WANDIO_STREAM_WINDOW, POSIX_FADV_WILLNEED);
+#endif
+                DATA(io)->readahead += WANDIO_STREAM_WINDOW;
+        }
+        if (offset - DATA(io)->dropped >= 2 * WANDIO_STREAM_WINDOW) {
+#ifdef HAVE_POSIX_FADVISE
+                posix_fadvise(DATA(io)->fd, DATA(io)->dropped,
+                              offset - WANDIO_STREAM_WINDOW - DATA(io)->dropped,
+                              POSIX_FADV_DONTNEED);
+#endif
+                DATA(io)->dropped = offset - WANDIO_STREAM_WINDOW;
+        }
+}
+
+/* Does a single O_DIRECT read, noting whether it reached the end of the
+ * file */
+static int64_t stdio_read_block(io_t *io, void *buffer, int64_t len) {
+        int64_t ret;
+
+        do {
+                ret = read(DATA(io)->fd, buffer, len);
+        } while (ret == -1 && errno == EINTR);
+        if (ret >= 0 && (ret == 0 || ret % DIRECT_ALIGN != 0))
+                DATA(io)->eof = true;
+        return ret;
+}
+
+static int64_t stdio_read_direct(io_t *io, void *buffer, int64_t len) {
+        int64_t copied = 0;
+        int64_t ret;
+
+        while (copied < len) {
+                char *dest = (char *)buffer + copied;
+                int64_t amount = len - copied;
+
+                if (DATA(io)->bounce_used < DATA(io)->bounce_len) {
+                        amount = MIN(amount, DATA(io)->bounce_len -
+                                                 DATA(io)->bounce_used);
+                        memcpy(dest, DATA(io)->bounce + DATA(io)->bounce_used,
+                               amount);
+                        DATA(io)->bounce_used += amount;
+                        DATA(io)->offset += amount;
+                        copied += amount;
+                        continue;
+                }
+                if (DATA(io)->eof || copied > 0)
+                        break;
+
+                /* Read straight into the caller's buffer if it is suitably
+                 * aligned, otherwise into the bounce buffer */
+                if ((uintptr_t)dest % DIRECT_ALIGN == 0 &&
+                    amount >= DIRECT_ALIGN &&
+                    DATA(io)->offset % DIRECT_ALIGN == 0) {
+                        ret = stdio_read_block(
+                            io, dest, amount - amount % DIRECT_ALIGN);
+                        if (ret < 0)
+                                return -1;
+                        DATA(io)->offset += ret;
+                        return ret;
+                }
+                ret = stdio_read_block(io, DATA(io)->bounce,
+                                        WANDIO_BUFFER_SIZE);
+                if (ret < 0)
+                        return -1;
+                DATA(io)->bounce_len = ret;
+                DATA(io)->bounce_used = MIN(DATA(io)->skip, ret);
+                DATA(io)->skip = 0;
+        }
+        return copied;
+}
+
 static int64_t stdio_read(io_t *io, void *buffer, int64_t len) {
-        return read(DATA(io)->fd, buffer, len);
+        int64_t ret;
+
+        if (DATA(io)->direct)
+                return stdio_read_direct(io, buffer, len);
+
+        ret = read(DATA(io)->fd, buffer, len);
+        if (ret > 0 && DATA(io)->streaming) {
+                DATA(io)->offset += ret;
+                stdio_stream(io);
+        }
+        return ret;
 }
 
 static int64_t stdio_tell(io_t *io) {
+        if (DATA(io)->direct)
+                return DATA(io)->offset;
         return lseek(DATA(io)->fd, 0, SEEK_CUR);
 }
 
+/* O_DIRECT reads have to start on a block boundary, so seek to the start of
+ * the block and skip up to the offset we were asked for */
+static int64_t stdio_seek_direct(io_t *io, int64_t offset, int whence) {
+        struct stat st;
+        int64_t target;
+
+        switch (whence) {
+        case SEEK_SET:
+                target = offset;
+                break;
+        case SEEK_CUR:
+                target = DATA(io)->offset + offset;
+                break;
+        case SEEK_END:
+                if (fstat(DATA(io)->fd, &st) < 0)
+                        return -1;
+                target = st.st_size + offset;
+                break;
+        default:
+                errno = EINVAL;
+                return -1;
+        }
+        if (target < 0) {
+                errno = EINVAL;
+                return -1;
+        }
+        if (lseek(DATA(io)->fd, target - target % DIRECT_ALIGN, SEEK_SET) < 0)
+                return -1;
+        DATA(io)->offset = target;
+        DATA(io)->skip = target % DIRECT_ALIGN;
+        DATA(io)->bounce_used = DATA(io)->bounce_len = 0;
+        DATA(io)->eof = false;
+        return target;
+}
+
 static int64_t stdio_seek(io_t *io, int64_t offset, int whence) {
-        return lseek(DATA(io)->fd, offset, whence);
+        int64_t ret;
+
+        if (DATA(io)->direct)
+                return stdio_seek_direct(io, offset, whence);
+
+        ret = lseek(DATA(io)->fd, offset, whence);
+
+        /* Start reading ahead from wherever we have ended up */
+        if (ret >= 0 && DATA(io)->streaming) {
+                DATA(io)->offset = ret;
+                DATA(io)->readahead = ret;
+                DATA(io)->dropped = MIN(DATA(io)->dropped, ret);
+        }
+        return ret;
+}
+
+static int stdio_get_fd(io_t *io, int64_t *offset) {
+        /* Anyone else reading the file would have to follow the O_DIRECT
+         * rules too */
+        if (DATA(io)->direct)
+                return -1;
+        *offset = lseek(DATA(io)->fd, 0, SEEK_CUR);
+        return DATA(io)->fd;
 }
 
 static void stdio_close(io_t *io) {
+#ifdef HAVE_POSIX_FADVISE
+        if (DATA(io)->streaming)
+                posix_fadvise(DATA(io)->fd, DATA(io)->dropped, 0,
+                              POSIX_FADV_DONTNEED);
+#endif
         close(DATA(io)->fd);
+        wandio_free_buffer(DATA(io)->bounce);
         free(io->data);
         free(io);
 }
 
-io_source_t stdio_source = {"stdio",    stdio_read, NULL,
-                            stdio_tell, stdio_seek, stdio_close};
+io_source_t stdio_source = {"stdio",     stdio_read,  NULL,
+                            stdio_tell,  stdio_seek,  stdio_close,
+                            NULL,        stdio_get_fd};
@@ -265,4 +265,4 @@ static void swift_close(io_t *io) {
 }
 
 io_source_t swift_source = {"swift",    swift_read, NULL,
-                            swift_tell, swift_seek, swift_close};
+                            swift_tell, swift_seek, swift_close, NULL, NULL};
@@ -34,6 +34,7 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 #include "wandio.h"
 #include "wandio_internal.h"
 #ifdef HAVE_SYS_PRCTL_H
@@ -48,6 +49,15 @@
  * main thread to free up some of the buffers by consuming data from them. The
  * reading thread also uses a pthread condition to indicate to the main thread
  * that there is data available in the buffers.
+ *
+ * If the worker pool is enabled, there is no reading thread. Instead a task
+ * is submitted to the pool that fills one buffer at a time, and is submitted
+ * again whenever there is another buffer free.
+ *
+ * Closing the reader doesn't wait for a buffer that is being filled, which
+ * could take a long time, e.g. over a slow network. Instead, the reading
+ * thread or task is told to give up and is left to tidy up after itself
+ * once the parent returns.
  */
 
 /* 1MB Buffer */
@@ -57,12 +67,16 @@ extern io_source_t thread_source;
 struct buffer_t {
         char *space;                        /* The buffer itself */
         int len;                            /* The size of the buffer */
-        enum { EMPTY = 0, FULL = 1 } state; /* Is the buffer in use? */
+        /* Is the buffer in use? A LENT buffer has been handed out by
+         * thread_lend() and stays untouched until it is given back */
+        enum { EMPTY = 0, FULL = 1, LENT = 2 } state;
 };
 
 struct state_t {
         /* The collection of buffers (or slices) */
         struct buffer_t *buffer;
+        /* The memory backing every slice */
+        char *space;
         /* The index of the buffer to read into next */
         int in_buffer;
         /* The read offset into the current buffer */
@@ -79,12 +93,65 @@ struct state_t {
         io_t *io;
         /* Indicates whether the main thread is concluding */
         bool closing;
+        /* A copy of the parent's file descriptor, which stays open after
+         * the reading thread closes the parent, and the parent's offset
+         * when we started */
+        int fd;
+        int64_t fd_offset;
+        /* Number of bytes handed out by thread_read() */
+        int64_t consumed;
+        /* Whether we are using the worker pool rather than a thread */
+        bool pooled;
+        /* The task that fills buffers for us, and the next buffer for it to
+         * fill */
+        struct wandio_task_t task;
+        int fill;
+        /* The task is queued or running, and may not be submitted again */
+        bool scheduled;
+        /* The task has reached the end of the file and closed the parent */
+        bool finished;
+        /* The parent is filling a buffer */
+        bool reading;
+        /* thread_close() has returned without waiting for the parent, which
+         * leaves whoever is reading to free everything */
+        bool orphaned;
 };
 
 #define DATA(x) ((struct state_t *)((x)->data))
 #define INBUFFER(x) (DATA(x)->buffer[DATA(x)->in_buffer])
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+static void thread_free(io_t *io) {
+        pthread_mutex_destroy(&DATA(io)->mutex);
+        pthread_cond_destroy(&DATA(io)->space_avail);
+        pthread_cond_destroy(&DATA(io)->data_ready);
+
+        if (DATA(io)->fd >= 0)
+                close(DATA(io)->fd);
+
+        wandio_free_buffer(DATA(io)->space);
+        free(DATA(io)->buffer);
+        free(DATA(io));
+        free(io);
+}
+
+/* Fills a buffer using the parent reader, letting it know that it can give
+ * up if we are closed in the meantime. Must be called with the mutex held,
+ * which is released while reading. Returns false if we have been closed */
+static bool thread_refill(io_t *state, struct buffer_t *slice) {
+        DATA(state)->reading = true;
+        pthread_mutex_unlock(&DATA(state)->mutex);
+
+        wandio_set_cancel(&DATA(state)->closing);
+        slice->len =
+            wandio_read(DATA(state)->io, slice->space, WANDIO_BUFFER_SIZE);
+        wandio_set_cancel(NULL);
+
+        pthread_mutex_lock(&DATA(state)->mutex);
+        DATA(state)->reading = false;
+        return !DATA(state)->closing;
+}
+
 /* The reading thread */
 static void *thread_producer(void *userdata) {
         io_t *state = (io_t *)userdata;
@@ -109,7 +176,7 @@ static void *thread_producer(void *userdata) {
         do {
                 /* If all the buffers are full, we need to wait for one to
                  * become free otherwise we have nowhere to write to! */
-                while (DATA(state)->buffer[buffer].state == FULL) {
+                while (DATA(state)->buffer[buffer].state != EMPTY) {
                         if (DATA(state)->closing)
                                 break;
                         pthread_cond_wait(&DATA(state)->space_avail,
@@ -121,14 +188,10 @@ static void *thread_producer(void *userdata) {
                 if (DATA(state)->closing) {
                         break;
                 }
-                pthread_mutex_unlock(&DATA(state)->mutex);
 
                 /* Get the parent reader to fill the buffer */
-                DATA(state)->buffer[buffer].len = wandio_read(
-                    DATA(state)->io, DATA(state)->buffer[buffer].space,
-                    WANDIO_BUFFER_SIZE);
-
-                pthread_mutex_lock(&DATA(state)->mutex);
+                if (!thread_refill(state, &DATA(state)->buffer[buffer]))
+                        break;
 
                 DATA(state)->buffer[buffer].state = FULL;
 
@@ -146,36 +209,98 @@ static void *thread_producer(void *userdata) {
         /* If we reach here, it's all over so start tidying up */
         wandio_destroy(DATA(state)->io);
 
+        if (DATA(state)->orphaned) {
+                pthread_mutex_unlock(&DATA(state)->mutex);
+                thread_free(state);
+                return NULL;
+        }
         pthread_cond_signal(&DATA(state)->data_ready);
         pthread_mutex_unlock(&DATA(state)->mutex);
 
         return NULL;
 }
 
+/* Fills a single buffer on behalf of the worker pool, then submits itself
+ * again if the next buffer is free */
+static void thread_fill(void *userdata) {
+        io_t *state = (io_t *)userdata;
+        struct buffer_t *slice;
+        bool again;
+
+        pthread_mutex_lock(&DATA(state)->mutex);
+        slice = &DATA(state)->buffer[DATA(state)->fill];
+        if (DATA(state)->closing || slice->state != EMPTY) {
+                DATA(state)->scheduled = false;
+                pthread_cond_signal(&DATA(state)->space_avail);
+                pthread_mutex_unlock(&DATA(state)->mutex);
+                return;
+        }
+
+        if (!thread_refill(state, slice)) {
+                /* thread_close() didn't wait for us, so we tidy up */
+                pthread_mutex_unlock(&DATA(state)->mutex);
+                wandio_destroy(DATA(state)->io);
+                thread_free(state);
+                return;
+        }
+        slice->state = FULL;
+        DATA(state)->fill = (DATA(state)->fill + 1) % max_buffers;
+        if (slice->len <= 0) {
+                wandio_destroy(DATA(state)->io);
+                DATA(state)->finished = true;
+        }
+        pthread_cond_signal(&DATA(state)->data_ready);
+
+        /* Once the task is no longer scheduled, thread_close() may free
+         * everything, so we mustn't touch the state after unlocking */
+        again = !DATA(state)->finished && !DATA(state)->closing &&
+                DATA(state)->buffer[DATA(state)->fill].state == EMPTY;
+        DATA(state)->scheduled = again;
+        if (!again)
+                pthread_cond_signal(&DATA(state)->space_avail);
+        pthread_mutex_unlock(&DATA(state)->mutex);
+
+        if (again)
+                wandio_pool_submit(&DATA(state)->task);
+}
+
+/* Decides whether the fill task needs submitting now that a buffer has been
+ * freed. Must be called with the mutex held, and the task submitted once
+ * the mutex has been released */
+static bool thread_kick(io_t *state) {
+        if (!DATA(state)->pooled || DATA(state)->scheduled ||
+            DATA(state)->finished || DATA(state)->closing)
+                return false;
+        DATA(state)->scheduled = true;
+        return true;
+}
+
 static void thread_close(io_t *io) {
-        unsigned int i;
         pthread_mutex_lock(&DATA(io)->mutex);
-        DATA(io)->closing = true;
+        __atomic_store_n(&DATA(io)->closing, true, __ATOMIC_RELEASE);
         pthread_cond_signal(&DATA(io)->space_avail);
+        /* Don't wait for a buffer that is being filled, as the parent may
+         * take a long time to notice that it can give up */
+        if (DATA(io)->reading) {
+                DATA(io)->orphaned = true;
+                if (DATA(io)->producer != 0)
+                        pthread_detach(DATA(io)->producer);
+                pthread_mutex_unlock(&DATA(io)->mutex);
+                return;
+        }
+        /* Otherwise wait for the fill task to finish with us */
+        while (DATA(io)->scheduled)
+                pthread_cond_wait(&DATA(io)->space_avail, &DATA(io)->mutex);
         pthread_mutex_unlock(&DATA(io)->mutex);
 
-        /* Wait for the thread to exit */
+        /* Wait for the thread to exit, which it is about to */
         if (DATA(io)->producer != 0) {
                 pthread_join(DATA(io)->producer, NULL);
         }
+        if (DATA(io)->pooled && !DATA(io)->finished)
+                wandio_destroy(DATA(io)->io);
 
-        pthread_mutex_destroy(&DATA(io)->mutex);
-        pthread_cond_destroy(&DATA(io)->space_avail);
-        pthread_cond_destroy(&DATA(io)->data_ready);
-
-        for (i = 0; i < max_buffers; i++) {
-                if (DATA(io)->buffer[i].space) {
-                        free(DATA(io)->buffer[i].space);
-                }
-        }
-        free(DATA(io)->buffer);
-        free(DATA(io));
-        free(io);
+        thread_free(io);
 }
 
 DLLEXPORT io_t *thread_open(io_t *parent) {
@@ -198,33 +323,50 @@ DLLEXPORT io_t *thread_open(io_t *parent) {
         pthread_cond_init(&DATA(state)->space_avail, NULL);
 
         DATA(state)->producer = 0;
+        DATA(state)->fd = -1;
         DATA(state)->buffer =
             (struct buffer_t *)malloc(sizeof(struct buffer_t) * max_buffers);
         memset(DATA(state)->buffer, 0, sizeof(struct buffer_t) * max_buffers);
 
+        /* Allocate the slices together, so that they can share huge pages */
+        DATA(state)->space =
+            wandio_alloc_buffer((size_t)max_buffers * WANDIO_BUFFER_SIZE);
+        if (!DATA(state)->space) {
+                thread_close(state);
+                return NULL;
+        }
         for (i = 0; i < max_buffers; i++) {
-#if _POSIX_C_SOURCE >= 200112L || _XOPEN_SOURCE >= 600
-                if (posix_memalign((void **)&(DATA(state)->buffer[i].space),
-                               4096, WANDIO_BUFFER_SIZE) != 0) {
-                        thread_close(state);
-                        return NULL;
-                }
-#else
-                DATA(state)->buffer[i].space = calloc(1, WANDIO_BUFFER_SIZE);
-#endif
+                DATA(state)->buffer[i].space =
+                    DATA(state)->space + (size_t)i * WANDIO_BUFFER_SIZE;
         }
         DATA(state)->in_buffer = 0;
         DATA(state)->offset = 0;
 
         DATA(state)->io = parent;
         DATA(state)->closing = false;
+        /* Once the reading thread starts, the parent's offset no longer
+         * tells us where the main thread is up to, so find out now */
+        DATA(state)->fd = wandio_get_fd(parent, &DATA(state)->fd_offset);
+        if (DATA(state)->fd >= 0 && DATA(state)->fd_offset >= 0)
+                DATA(state)->fd = dup(DATA(state)->fd);
+        else
+                DATA(state)->fd = -1;
+
+        if (wandio_pool_enabled()) {
+                DATA(state)->pooled = true;
+                DATA(state)->task.job = thread_fill;
+                DATA(state)->task.arg = state;
+                DATA(state)->scheduled = true;
+                wandio_pool_submit(&DATA(state)->task);
+                return state;
+        }
 
         /* Create the reading thread */
         s = pthread_sigmask(SIG_SETMASK, &set, NULL);
         if (s != 0) {
                 return NULL;
         }
-        pthread_create(&DATA(state)->producer, NULL, thread_producer, state);
+        wandio_thread_create(&DATA(state)->producer, thread_producer, state);
         sigemptyset(&set);
         s = pthread_sigmask(SIG_SETMASK, &set, NULL);
         if (s != 0) {
@@ -238,12 +380,13 @@ static int64_t thread_read(io_t *state, void *buffer, int64_t len) {
         int slice;
         int copied = 0;
         int newbuffer;
+        bool kick;
 
         while (len > 0) {
                 pthread_mutex_lock(&DATA(state)->mutex);
 
                 /* Wait for the reader thread to provide us with some data */
-                while (INBUFFER(state).state == EMPTY) {
+                while (INBUFFER(state).state != FULL) {
                         ++read_waits;
                         pthread_cond_wait(&DATA(state)->data_ready,
                                           &DATA(state)->mutex);
@@ -273,10 +416,12 @@ static int64_t thread_read(io_t *state, void *buffer, int64_t len) {
                 buffer += slice;
                 len -= slice;
                 copied += slice;
+                DATA(state)->consumed += slice;
 
                 pthread_mutex_lock(&DATA(state)->mutex);
                 DATA(state)->offset += slice;
                 newbuffer = DATA(state)->in_buffer;
+                kick = false;
 
                 /* If we've read everything from the current slice, let the
                  * read thread know that there is now more space available
@@ -284,18 +429,80 @@ static int64_t thread_read(io_t *state, void *buffer, int64_t len) {
                 if (DATA(state)->offset >= INBUFFER(state).len) {
                         INBUFFER(state).state = EMPTY;
                         pthread_cond_signal(&DATA(state)->space_avail);
+                        kick = thread_kick(state);
                         newbuffer = (newbuffer + 1) % max_buffers;
                         DATA(state)->offset = 0;
                 }
 
                 pthread_mutex_unlock(&DATA(state)->mutex);
+                if (kick)
+                        wandio_pool_submit(&DATA(state)->task);
 
                 DATA(state)->in_buffer = newbuffer;
         }
         return copied;
 }
 
+/* Hands out the rest of the next slice without copying it. The slice isn't
+ * reused until it is given back using thread_unlend(), so several slices can
+ * be out at once */
+int64_t thread_lend(io_t *state, struct wandio_loan_t *loan) {
+        int64_t len;
+
+        if (state->source != &thread_source) {
+                errno = ENOTSUP;
+                return -1;
+        }
+
+        pthread_mutex_lock(&DATA(state)->mutex);
+        while (INBUFFER(state).state != FULL) {
+                ++read_waits;
+                pthread_cond_wait(&DATA(state)->data_ready,
+                                  &DATA(state)->mutex);
+        }
+        if (INBUFFER(state).len < 1) {
+                len = INBUFFER(state).len;
+                if (len < 0)
+                        errno = EIO;
+                pthread_mutex_unlock(&DATA(state)->mutex);
+                return len;
+        }
+
+        len = INBUFFER(state).len - DATA(state)->offset;
+        loan->data = INBUFFER(state).space + DATA(state)->offset;
+        loan->len = len;
+        loan->owner = state;
+        loan->slice = DATA(state)->in_buffer;
+        loan->memory = NULL;
+        INBUFFER(state).state = LENT;
+        DATA(state)->offset = 0;
+        DATA(state)->in_buffer = (DATA(state)->in_buffer + 1) % max_buffers;
+        DATA(state)->consumed += len;
+        pthread_mutex_unlock(&DATA(state)->mutex);
+        return len;
+}
+
+void thread_unlend(struct wandio_loan_t *loan) {
+        io_t *state = loan->owner;
+        bool kick;
+
+        pthread_mutex_lock(&DATA(state)->mutex);
+        DATA(state)->buffer[loan->slice].state = EMPTY;
+        pthread_cond_signal(&DATA(state)->space_avail);
+        kick = thread_kick(state);
+        pthread_mutex_unlock(&DATA(state)->mutex);
+        if (kick)
+                wandio_pool_submit(&DATA(state)->task);
+}
+
+/* The reading thread keeps reading ahead, so the file offset is only useful
+ * to callers who read at explicit offsets */
+static int thread_get_fd(io_t *state, int64_t *offset) {
+        *offset = DATA(state)->fd_offset + DATA(state)->consumed;
+        return DATA(state)->fd;
+}
+
 io_source_t thread_source = {"thread",    thread_read, NULL, /* peek */
                              NULL,                           /* tell */
                              NULL,                           /* seek */
-                             thread_close};
+                             thread_close, NULL, thread_get_fd};
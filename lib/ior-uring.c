@@ -0,0 +1,392 @@
+/*
+ *
+ * Copyright (c) 2007-2019 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libwandio.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libwandio is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwandio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#define _GNU_SOURCE 1
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "uring-helper.h"
+#include "wandio.h"
+#include "wandio_internal.h"
+
+/* Libwandio IO module implementing a reader for local files that uses io_uring
+ * to keep several large reads queued ahead of the data we have handed out, so
+ * that the device always has work to do.
+ *
+ * Each slot holds one buffer's worth of the file. Slots are read in file order
+ * and, once we have handed out everything in a slot, it is queued again to
+ * read the next part of the file that isn't already queued.
+ */
+
+/* Reads are done in multiples of this size, so that O_DIRECT works */
+#define URING_ALIGN 4096
+#define URING_BLOCK_SIZE WANDIO_BUFFER_SIZE
+
+enum slot_state_t {
+        SLOT_IDLE,
+        SLOT_INFLIGHT,
+        SLOT_READY,
+};
+
+struct uring_slot_t {
+        enum slot_state_t state;
+        char *buffer;
+        /* File offset of the start of the buffer */
+        int64_t offset;
+        /* Number of bytes read into the buffer so far */
+        int64_t filled;
+        /* Number of bytes that have been handed out, or are to be skipped */
+        int64_t used;
+        /* The end of the file falls within this buffer */
+        bool eof;
+        /* errno from a failed read */
+        int error;
+};
+
+struct uringr_t {
+        int fd;
+        struct uring ring;
+        struct uring_slot_t *slots;
+        char *buffers;
+        int depth;
+        /* Slot holding the next data to be handed out */
+        int head;
+        /* Offset of the next read to be queued */
+        int64_t next_offset;
+        /* Offset of the next byte to be handed out */
+        int64_t offset;
+        /* A read has reached the end of the file */
+        bool eof;
+        int inflight;
+        bool direct;
+        bool fixed_buffers;
+        bool fixed_file;
+};
+
+extern io_source_t uring_source;
+
+#define DATA(io) ((struct uringr_t *)((io)->data))
+
+static void uring_free(io_t *io) {
+        if (DATA(io)->ring.fd >= 0)
+                uring_exit(&DATA(io)->ring);
+        if (DATA(io)->fd >= 0)
+                close(DATA(io)->fd);
+        wandio_free_buffer(DATA(io)->buffers);
+        free(DATA(io)->slots);
+        free(io->data);
+        free(io);
+}
+
+DLLEXPORT io_t *uring_open(const char *filename) {
+        io_t *io;
+        struct stat st;
+        struct iovec *iov;
+        int i;
+
+        /* Only regular files can be read at arbitrary offsets */
+        if (strcmp(filename, "-") == 0)
+                return NULL;
+
+        io = malloc(sizeof(io_t));
+        io->source = &uring_source;
+        io->data = calloc(1, sizeof(struct uringr_t));
+        DATA(io)->ring.fd = -1;
+        DATA(io)->depth = uring_depth;
+#ifdef O_DIRECT
+        DATA(io)->direct = force_directio_read;
+#endif
+
+        DATA(io)->fd = open(filename, O_RDONLY
+#ifdef O_DIRECT
+                                          | (force_directio_read ? O_DIRECT : 0)
+#endif
+        );
+        if (DATA(io)->fd == -1 || fstat(DATA(io)->fd, &st) < 0 ||
+            !S_ISREG(st.st_mode)) {
+                uring_free(io);
+                return NULL;
+        }
+
+        if (uring_init(&DATA(io)->ring, DATA(io)->depth) < 0) {
+                DATA(io)->ring.fd = -1;
+                uring_free(io);
+                return NULL;
+        }
+
+        DATA(io)->buffers = wandio_alloc_buffer((size_t)DATA(io)->depth *
+                                                URING_BLOCK_SIZE);
+        if (!DATA(io)->buffers) {
+                uring_free(io);
+                return NULL;
+        }
+        DATA(io)->slots = calloc(DATA(io)->depth, sizeof(struct uring_slot_t));
+        iov = calloc(DATA(io)->depth, sizeof(struct iovec));
+        for (i = 0; i < DATA(io)->depth; i++) {
+                DATA(io)->slots[i].buffer =
+                    DATA(io)->buffers + (size_t)i * URING_BLOCK_SIZE;
+                iov[i].iov_base = DATA(io)->slots[i].buffer;
+                iov[i].iov_len = URING_BLOCK_SIZE;
+        }
+
+        /* These are only optimisations, so carry on if we can't have them */
+        DATA(io)->fixed_buffers =
+            uring_register_buffers(&DATA(io)->ring, iov, DATA(io)->depth) == 0;
+        DATA(io)->fixed_file =
+            uring_register_file(&DATA(io)->ring, DATA(io)->fd) == 0;
+        free(iov);
+
+        return io;
+}
+
+/* Queues a read for whatever part of the slot has not been filled yet */
+static int uring_queue(io_t *io, int index) {
+        struct uring_slot_t *slot = &DATA(io)->slots[index];
+        struct io_uring_sqe *sqe = uring_get_sqe(&DATA(io)->ring);
+
+        if (!sqe) {
+                errno = EBUSY;
+                return -1;
+        }
+
+        sqe->opcode =
+            DATA(io)->fixed_buffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        if (DATA(io)->fixed_file) {
+                sqe->fd = 0;
+                sqe->flags = IOSQE_FIXED_FILE;
+        } else {
+                sqe->fd = DATA(io)->fd;
+        }
+        sqe->off = slot->offset + slot->filled;
+        sqe->addr = (uint64_t)(uintptr_t)(slot->buffer + slot->filled);
+        sqe->len = URING_BLOCK_SIZE - slot->filled;
+        sqe->buf_index = index;
+        sqe->user_data = index;
+
+        slot->state = SLOT_INFLIGHT;
+        DATA(io)->inflight++;
+        return 0;
+}
+
+/* Starts reading the next part of the file into an idle slot */
+static int uring_queue_next(io_t *io, int index) {
+        struct uring_slot_t *slot = &DATA(io)->slots[index];
+
+        slot->offset = DATA(io)->next_offset;
+        slot->filled = 0;
+        slot->used = 0;
+        slot->eof = false;
+        slot->error = 0;
+        DATA(io)->next_offset += URING_BLOCK_SIZE;
+        return uring_queue(io, index);
+}
+
+/* Waits for a read to complete and updates its slot */
+static int uring_reap(io_t *io) {
+        struct io_uring_cqe cqe;
+        struct uring_slot_t *slot;
+
+        if (uring_wait(&DATA(io)->ring, &cqe) < 0)
+                return -1;
+
+        slot = &DATA(io)->slots[cqe.user_data];
+        DATA(io)->inflight--;
+        slot->state = SLOT_READY;
+
+        if (cqe.res == -EINTR || cqe.res == -EAGAIN)
+                return uring_queue(io, cqe.user_data);
+        if (cqe.res < 0) {
+                slot->error = -cqe.res;
+                return 0;
+        }
+        if (cqe.res == 0) {
+                slot->eof = true;
+                DATA(io)->eof = true;
+                return 0;
+        }
+        slot->filled += cqe.res;
+        if (slot->filled == URING_BLOCK_SIZE)
+                return 0;
+        /* A short read from O_DIRECT is the end of the file, and trying to
+         * read the rest would be unaligned */
+        if (DATA(io)->direct) {
+                slot->eof = true;
+                DATA(io)->eof = true;
+                return 0;
+        }
+        /* Otherwise it is either the end of the file, in which case the next
+         * read will tell us so, or needs finishing off */
+        return uring_queue(io, cqe.user_data);
+}
+
+/* Waits for every outstanding read, e.g. before the buffers are reused */
+static int uring_drain(io_t *io) {
+        while (DATA(io)->inflight > 0) {
+                if (uring_reap(io) < 0)
+                        return -1;
+        }
+        return 0;
+}
+
+static int64_t uring_read(io_t *io, void *buffer, int64_t len) {
+        int64_t copied = 0;
+        int i;
+
+        while (copied < len) {
+                struct uring_slot_t *slot = &DATA(io)->slots[DATA(io)->head];
+                int64_t avail;
+
+                if (slot->state == SLOT_IDLE) {
+                        /* Nothing queued yet (or since a seek), so fill the
+                         * whole queue */
+                        for (i = 0; i < DATA(io)->depth; i++) {
+                                int index =
+                                    (DATA(io)->head + i) % DATA(io)->depth;
+                                if (uring_queue_next(io, index) < 0)
+                                        return copied ? copied : -1;
+                        }
+                        if (uring_submit(&DATA(io)->ring) < 0)
+                                return copied ? copied : -1;
+                }
+
+                /* Don't hold on to data we already have just to wait for
+                 * more */
+                while (slot->state == SLOT_INFLIGHT) {
+                        if (copied > 0) {
+                                uring_submit(&DATA(io)->ring);
+                                return copied;
+                        }
+                        if (uring_reap(io) < 0)
+                                return -1;
+                }
+
+                if (slot->error) {
+                        if (copied > 0)
+                                return copied;
+                        errno = slot->error;
+                        return -1;
+                }
+
+                avail = slot->filled - slot->used;
+                if (avail <= 0 && slot->eof)
+                        break;
+                if (avail > len - copied)
+                        avail = len - copied;
+                if (avail > 0) {
+                        memcpy((char *)buffer + copied,
+                               slot->buffer + slot->used, avail);
+                        slot->used += avail;
+                        copied += avail;
+                        DATA(io)->offset += avail;
+                }
+
+                if (slot->used >= slot->filled && !slot->eof) {
+                        /* Finished with this slot, so reuse it to read further
+                         * ahead unless we already know where the file ends */
+                        if (DATA(io)->eof) {
+                                slot->state = SLOT_READY;
+                                slot->filled = slot->used = 0;
+                                slot->eof = true;
+                        } else if (uring_queue_next(io, DATA(io)->head) < 0) {
+                                return copied ? copied : -1;
+                        }
+                        DATA(io)->head = (DATA(io)->head + 1) % DATA(io)->depth;
+                }
+        }
+        uring_submit(&DATA(io)->ring);
+        return copied;
+}
+
+static int64_t uring_tell(io_t *io) {
+        return DATA(io)->offset;
+}
+
+static int64_t uring_seek(io_t *io, int64_t offset, int whence) {
+        struct stat st;
+        int64_t target;
+        int i;
+
+        switch (whence) {
+        case SEEK_SET:
+                target = offset;
+                break;
+        case SEEK_CUR:
+                target = DATA(io)->offset + offset;
+                break;
+        case SEEK_END:
+                if (fstat(DATA(io)->fd, &st) < 0)
+                        return -1;
+                target = st.st_size + offset;
+                break;
+        default:
+                errno = EINVAL;
+                return -1;
+        }
+        if (target < 0) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        if (uring_drain(io) < 0)
+                return -1;
+        for (i = 0; i < DATA(io)->depth; i++)
+                DATA(io)->slots[i].state = SLOT_IDLE;
+        DATA(io)->head = 0;
+        DATA(io)->eof = false;
+        DATA(io)->offset = target;
+        /* Keep reads aligned, and skip the start of the first one */
+        DATA(io)->next_offset = target - target % URING_ALIGN;
+        if (uring_queue_next(io, 0) < 0)
+                return -1;
+        DATA(io)->slots[0].used = target % URING_ALIGN;
+        for (i = 1; i < DATA(io)->depth; i++) {
+                if (uring_queue_next(io, i) < 0)
+                        return -1;
+        }
+        if (uring_submit(&DATA(io)->ring) < 0)
+                return -1;
+        return target;
+}
+
+/* Our reads all give an explicit offset, so the descriptor can be shared */
+static int uring_get_fd(io_t *io, int64_t *offset) {
+        *offset = DATA(io)->offset;
+        return DATA(io)->fd;
+}
+
+static void uring_close(io_t *io) {
+        uring_drain(io);
+        uring_free(io);
+}
+
+io_source_t uring_source = {"uring",    uring_read,  NULL,
+                            uring_tell, uring_seek,  uring_close,
+                            NULL,       uring_get_fd};
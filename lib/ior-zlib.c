@@ -33,6 +33,7 @@
 #include <sys/types.h>
 #include <zlib.h>
 #include "wandio.h"
+#include "wandio_internal.h"
 
 /* Libwandio IO module implementing a zlib reader */
 
@@ -59,7 +60,11 @@ DLLEXPORT io_t *zlib_open(io_t *parent) {
                 return NULL;
         io = malloc(sizeof(io_t));
         io->source = &zlib_source;
-        io->data = malloc(sizeof(struct zlib_t));
+        io->data = wandio_alloc_buffer(sizeof(struct zlib_t));
+        if (!io->data) {
+                free(io);
+                return NULL;
+        }
 
         DATA(io)->parent = parent;
 
@@ -91,9 +96,13 @@ static int64_t zlib_read(io_t *io, void *buffer, int64_t len) {
 
         while (DATA(io)->err == ERR_OK && DATA(io)->strm.avail_out > 0) {
                 while (DATA(io)->strm.avail_in <= 0) {
-                        int bytes_read = wandio_read(DATA(io)->parent,
-                                                     (char *)DATA(io)->inbuff,
-                                                     sizeof(DATA(io)->inbuff));
+                        /* Decompress straight out of our parent's memory if
+                         * we can, otherwise read into inbuff */
+                        const void *in;
+                        int bytes_read =
+                            wandio_borrow(DATA(io)->parent, &in,
+                                          DATA(io)->inbuff,
+                                          sizeof(DATA(io)->inbuff));
                         if (bytes_read == 0) {
                                 /* If we get EOF immediately after a
                                  * Z_STREAM_END, then we assume we've reached
@@ -130,7 +139,7 @@ static int64_t zlib_read(io_t *io, void *buffer, int64_t len) {
                                 /* Now return error */
                                 return -1;
                         }
-                        DATA(io)->strm.next_in = DATA(io)->inbuff;
+                        DATA(io)->strm.next_in = (Bytef *)in;
                         DATA(io)->strm.avail_in = bytes_read;
                         DATA(io)->sincelastend += bytes_read;
                 }
@@ -164,11 +173,11 @@ static int64_t zlib_read(io_t *io, void *buffer, int64_t len) {
 static void zlib_close(io_t *io) {
         inflateEnd(&DATA(io)->strm);
         wandio_destroy(DATA(io)->parent);
-        free(io->data);
+        wandio_free_buffer(io->data);
         free(io);
 }
 
 io_source_t zlib_source = {"zlib",    zlib_read, NULL, /* peek */
                            NULL,                       /* tell */
                            NULL,                       /* seek */
-                           zlib_close};
+                           zlib_close, NULL, NULL};
@@ -36,8 +36,10 @@
 #include <lz4frame.h>
 #endif
 #include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include "wandio_internal.h"
 
 enum err_t { ERR_OK = 1, ERR_EOF = 0, ERR_ERROR = -1 };
 
@@ -48,6 +50,8 @@ struct zstd_lz4_t {
         ZSTD_DStream *stream;
         ZSTD_inBuffer input_buffer;
         ZSTD_outBuffer output_buffer;
+        ZSTD_DDict *ddict;
+        unsigned int dict_id;
 #endif
 #if HAVE_LIBLZ4F
         LZ4F_decompressionContext_t dcCtxt;
@@ -55,6 +59,9 @@ struct zstd_lz4_t {
         enum err_t err;
         enum decoder_t dec;
         io_t *parent;
+        /* The input being decoded, which is either inbuf or memory borrowed
+         * from our parent */
+        const unsigned char *in;
         int inbuf_index;
         int inbuf_len;
         unsigned char inbuf[1024 * 1024];
@@ -62,6 +69,11 @@ struct zstd_lz4_t {
 };
 
 #define DATA(io) ((struct zstd_lz4_t *)((io)->data))
+/* Enough input to be sure of having a complete zstd or lz4 frame header */
+#define FRAME_HEADER_MAX 32
+/* liblz4 before 1.7.3 can't cope with the input moving mid-frame, which
+ * happens when we decode straight out of our parent's memory */
+#define ZERO_COPY (!HAVE_LIBLZ4F || HAVE_LIBLZ4_MOVABLE)
 extern io_source_t zstd_lz4_source;
 
 DLLEXPORT io_t *zstd_lz4_open(io_t *parent) {
@@ -71,18 +83,30 @@ DLLEXPORT io_t *zstd_lz4_open(io_t *parent) {
         }
         io = malloc(sizeof(io_t));
         io->source = &zstd_lz4_source;
-        io->data = malloc(sizeof(struct zstd_lz4_t));
+        io->data = wandio_alloc_buffer(sizeof(struct zstd_lz4_t));
+        if (!io->data) {
+                free(io);
+                return NULL;
+        }
         memset(io->data, 0, sizeof(struct zstd_lz4_t));
         DATA(io)->parent = parent;
+        DATA(io)->in = DATA(io)->inbuf;
 #if HAVE_LIBZSTD
         DATA(io)->stream = ZSTD_createDStream();
         ZSTD_initDStream(DATA(io)->stream);
+        /* Files written with a large window (e.g. zstd --long) can't be
+         * decoded using the default window size limit */
+        ZSTD_DCtx_setParameter(
+            DATA(io)->stream, ZSTD_d_windowLogMax,
+            ZSTD_dParam_getBounds(ZSTD_d_windowLogMax).upperBound);
         DATA(io)->input_buffer.size = 0;
         DATA(io)->input_buffer.src = NULL;
         DATA(io)->input_buffer.pos = 0;
         DATA(io)->output_buffer.size = 0;
         DATA(io)->output_buffer.dst = NULL;
         DATA(io)->output_buffer.pos = 0;
+        DATA(io)->ddict = NULL;
+        DATA(io)->dict_id = 0;
 #endif
 #if HAVE_LIBLZ4F
         LZ4F_errorCode_t result =
@@ -90,7 +114,7 @@ DLLEXPORT io_t *zstd_lz4_open(io_t *parent) {
         if (LZ4F_isError(result)) {
                 fprintf(stderr, "lz4f read open failed %s\n",
                         LZ4F_getErrorName(result));
-                free(DATA(io));
+                wandio_free_buffer(io->data);
                 free(io);
                 return NULL;
         }
@@ -103,6 +127,54 @@ DLLEXPORT io_t *zstd_lz4_open(io_t *parent) {
         return io;
 }
 
+#if HAVE_LIBZSTD
+/* Makes sure the decompression stream is using the dictionary that the zstd
+ * frame at the start of 'buf' was compressed with. Dictionaries are loaded
+ * from the zstddictdir directory, and the last one is kept around because
+ * consecutive frames will almost always share the same dictionary.
+ */
+static int zstd_use_frame_dict(io_t *io, const void *buf, size_t len) {
+        unsigned int dict_id = ZSTD_getDictID_fromFrame(buf, len);
+        char path[PATH_MAX];
+        void *dict;
+        int64_t dict_len;
+
+        if (dict_id == DATA(io)->dict_id)
+                return 0;
+
+        ZSTD_DCtx_reset(DATA(io)->stream, ZSTD_reset_session_only);
+        ZSTD_DCtx_refDDict(DATA(io)->stream, NULL);
+        ZSTD_freeDDict(DATA(io)->ddict);
+        DATA(io)->ddict = NULL;
+        DATA(io)->dict_id = 0;
+
+        if (dict_id == 0)
+                return 0;
+
+        if (!zstd_dict_dir) {
+                fprintf(stderr, "zstd frame requires dictionary %u but no "
+                                "zstddictdir has been configured\n",
+                        dict_id);
+                return -1;
+        }
+        snprintf(path, sizeof(path), "%s/%u.dict", zstd_dict_dir, dict_id);
+        dict = wandio_load_file(path, &dict_len);
+        if (!dict) {
+                fprintf(stderr, "Unable to load zstd dictionary %s\n", path);
+                return -1;
+        }
+        DATA(io)->ddict = ZSTD_createDDict(dict, dict_len);
+        free(dict);
+        if (!DATA(io)->ddict) {
+                fprintf(stderr, "Invalid zstd dictionary %s\n", path);
+                return -1;
+        }
+        ZSTD_DCtx_refDDict(DATA(io)->stream, DATA(io)->ddict);
+        DATA(io)->dict_id = dict_id;
+        return 0;
+}
+#endif
+
 static int64_t zstd_lz4_read(io_t *io, void *buffer, int64_t len) {
         if (DATA(io)->err == ERR_EOF) {
                 return 0; /* EOF */
@@ -115,7 +187,52 @@ static int64_t zstd_lz4_read(io_t *io, void *buffer, int64_t len) {
         int outbuf_index = 0;
         while (true) {
                 int data_size = DATA(io)->inbuf_len - DATA(io)->inbuf_index;
+#if ZERO_COPY
+                if (data_size == 0) {
+                        /* Decode straight out of our parent's memory if we
+                         * can, otherwise read into inbuf */
+                        const void *in;
+                        int bytes_read = wandio_borrow(DATA(io)->parent, &in,
+                                                       DATA(io)->inbuf,
+                                                       sizeof(DATA(io)->inbuf));
+                        if (bytes_read < 0) {
+                                /* Errno should already be set */
+                                DATA(io)->err = ERR_ERROR;
+                                return -1; /*  ERROR */
+                        }
+                        if (bytes_read == 0 && DATA(io)->dec == DEC_UNDEF) {
+                                DATA(io)->err = ERR_EOF;
+                                return outbuf_index; /* EOF here too*/
+                        }
+                        if (bytes_read == 0) {
+                                /* The decoder may still be holding on to
+                                 * the end of an unfinished frame */
+                                DATA(io)->eof = true;
+                        } else {
+                                DATA(io)->in = in;
+                                DATA(io)->inbuf_index = 0;
+                                DATA(io)->inbuf_len = bytes_read;
+                                data_size = bytes_read;
+                        }
+                } else if (DATA(io)->in != DATA(io)->inbuf &&
+                           DATA(io)->dec == DEC_UNDEF &&
+                           data_size < FRAME_HEADER_MAX) {
+                        /* The next frame header may be split between this
+                         * piece of borrowed memory and the next, so gather
+                         * it up in inbuf */
+                        memmove(DATA(io)->inbuf,
+                                DATA(io)->in + DATA(io)->inbuf_index,
+                                data_size);
+                        DATA(io)->in = DATA(io)->inbuf;
+                        DATA(io)->inbuf_index = 0;
+                        DATA(io)->inbuf_len = data_size;
+                }
+                /* Borrowed memory is decoded until it runs out */
+                if (DATA(io)->in == DATA(io)->inbuf &&
+                    data_size < 256 * 1024) {
+#else
                 if (data_size < 256 * 1024) {
+#endif
                         if (data_size == 0) {
                                 DATA(io)->inbuf_index = 0;
                                 DATA(io)->inbuf_len = 0;
@@ -160,8 +277,15 @@ static int64_t zstd_lz4_read(io_t *io, void *buffer, int64_t len) {
                                 if ((bytes_read == 0) &&
                                     (DATA(io)->inbuf_len ==
                                      DATA(io)->inbuf_index)) {
-                                        DATA(io)->err = ERR_EOF;
-                                        return outbuf_index; /* EOF here too*/
+                                        if (DATA(io)->dec == DEC_UNDEF) {
+                                                DATA(io)->err = ERR_EOF;
+                                                return outbuf_index;
+                                        }
+                                        /* A frame that was flushed but not
+                                         * finished ends here, but the
+                                         * decoder may still be holding on
+                                         * to some of its data */
+                                        DATA(io)->eof = true;
                                 }
                                 DATA(io)->inbuf_len += bytes_read;
                                 if (bytes_read == 0 ||
@@ -180,9 +304,8 @@ static int64_t zstd_lz4_read(io_t *io, void *buffer, int64_t len) {
                                         errno = EIO;
                                         return -1;
                                 }
-                                unsigned char *buf =
-                                    (unsigned char *)(DATA(io)->inbuf +
-                                                      DATA(io)->inbuf_index);
+                                const unsigned char *buf =
+                                    DATA(io)->in + DATA(io)->inbuf_index;
                                 if (((buf[0] & 0xf0) == 0x50) &&
                                     (buf[1] == 0x2a) && (buf[2] == 0x4d) &&
                                     (buf[3] == 0x18)) {
@@ -193,6 +316,15 @@ static int64_t zstd_lz4_read(io_t *io, void *buffer, int64_t len) {
                                            (buf[2] == 0x2f) &&
                                            (buf[3] == 0xfd)) {
                                         DATA(io)->dec = DEC_ZSTD;
+                                        if (zstd_use_frame_dict(
+                                                io, buf,
+                                                DATA(io)->inbuf_len -
+                                                    DATA(io)->inbuf_index) <
+                                            0) {
+                                                DATA(io)->err = ERR_ERROR;
+                                                errno = EIO;
+                                                return -1;
+                                        }
 #endif
 #if HAVE_LIBLZ4F
                                 } else if ((buf[0] == 0x04) &&
@@ -210,6 +342,7 @@ static int64_t zstd_lz4_read(io_t *io, void *buffer, int64_t len) {
                                 }
                         }
                         int inbuf_index_save = DATA(io)->inbuf_index;
+                        int outbuf_index_save = outbuf_index;
                         if (DATA(io)->dec == DEC_UNDEF) {
                         /* This noop "if" is needed for macros to work properly
                          */
@@ -218,7 +351,7 @@ static int64_t zstd_lz4_read(io_t *io, void *buffer, int64_t len) {
 #if HAVE_LIBZSTD
                         } else if (DATA(io)->dec == DEC_ZSTD ||
                                    DATA(io)->dec == DEC_SKIP_FRAME) {
-                                DATA(io)->input_buffer.src = DATA(io)->inbuf;
+                                DATA(io)->input_buffer.src = DATA(io)->in;
                                 DATA(io)->input_buffer.pos =
                                     DATA(io)->inbuf_index;
                                 DATA(io)->input_buffer.size =
@@ -254,7 +387,7 @@ static int64_t zstd_lz4_read(io_t *io, void *buffer, int64_t len) {
                                 LZ4F_errorCode_t result = LZ4F_decompress(
                                     DATA(io)->dcCtxt, buffer + outbuf_index,
                                     &dst_ptr,
-                                    DATA(io)->inbuf + DATA(io)->inbuf_index,
+                                    DATA(io)->in + DATA(io)->inbuf_index,
                                     &src_ptr, NULL);
                                 if (LZ4F_isError(result)) {
                                         fprintf(stderr,
@@ -272,6 +405,13 @@ static int64_t zstd_lz4_read(io_t *io, void *buffer, int64_t len) {
                                 }
 #endif
                         }
+                        if (DATA(io)->eof &&
+                            DATA(io)->inbuf_index == inbuf_index_save &&
+                            outbuf_index == outbuf_index_save) {
+                                /* Everything there was has come out */
+                                DATA(io)->err = ERR_EOF;
+                                return outbuf_index;
+                        }
                         if (DATA(io)->inbuf_index == inbuf_index_save &&
                             outbuf_index == 0) {
                                 fprintf(stderr, "zstd - lz4 decoder has made "
@@ -288,6 +428,16 @@ static int64_t zstd_lz4_read(io_t *io, void *buffer, int64_t len) {
                         if (DATA(io)->inbuf_index >= DATA(io)->inbuf_len) {
                                 break;
                         }
+#if ZERO_COPY
+                        /* Go back for more before looking at a frame header
+                         * that may run off the end of borrowed memory */
+                        if (DATA(io)->dec == DEC_UNDEF &&
+                            DATA(io)->in != DATA(io)->inbuf &&
+                            DATA(io)->inbuf_len - DATA(io)->inbuf_index <
+                                FRAME_HEADER_MAX) {
+                                break;
+                        }
+#endif
                 }
         }
 }
@@ -295,16 +445,17 @@ static int64_t zstd_lz4_read(io_t *io, void *buffer, int64_t len) {
 static void zstd_lz4_close(io_t *io) {
 #if HAVE_LIBZSTD
         ZSTD_freeDStream(DATA(io)->stream);
+        ZSTD_freeDDict(DATA(io)->ddict);
 #endif
 #if HAVE_LIBLZ4F
         LZ4F_freeDecompressionContext(DATA(io)->dcCtxt);
 #endif
         wandio_destroy(DATA(io)->parent);
-        free(io->data);
+        wandio_free_buffer(io->data);
         free(io);
 }
 
 io_source_t zstd_lz4_source = {"zstd_lz4",    zstd_lz4_read, NULL, /* peek */
                                NULL,                               /* tell */
                                NULL,                               /* seek */
-                               zstd_lz4_close};
+                               zstd_lz4_close, NULL, NULL};
@@ -32,6 +32,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include "wandio.h"
+#include "wandio_internal.h"
 
 /* Libwandio IO module implement a bzip writer */
 
@@ -56,7 +57,11 @@ DLLEXPORT iow_t *bz_wopen(iow_t *child, int compress_level) {
                 return NULL;
         iow = malloc(sizeof(iow_t));
         iow->source = &bz_wsource;
-        iow->data = malloc(sizeof(struct bzw_t));
+        iow->data = wandio_alloc_buffer(sizeof(struct bzw_t));
+        if (!iow->data) {
+                free(iow);
+                return NULL;
+        }
 
         DATA(iow)->child = child;
 
@@ -69,9 +74,16 @@ DLLEXPORT iow_t *bz_wopen(iow_t *child, int compress_level) {
         DATA(iow)->strm.opaque = NULL;
         DATA(iow)->err = ERR_OK;
 
-        BZ2_bzCompressInit(&DATA(iow)->strm, compress_level, /* Block size */
-                           0,                                /* Verbosity */
-                           30);                              /* Work factor */
+        if (BZ2_bzCompressInit(&DATA(iow)->strm,
+                               compress_level, /* Block size */
+                               0,              /* Verbosity */
+                               30) != BZ_OK) { /* Work factor */
+                fprintf(stderr, "Invalid bzip2 compression level %d\n",
+                        compress_level);
+                wandio_free_buffer(iow->data);
+                free(iow);
+                return NULL;
+        }
 
         return iow;
 }
@@ -140,8 +152,9 @@ static void bz_wclose(iow_t *iow) {
         wandio_wwrite(DATA(iow)->child, DATA(iow)->outbuff,
                       sizeof(DATA(iow)->outbuff) - DATA(iow)->strm.avail_out);
         wandio_wdestroy(DATA(iow)->child);
-        free(iow->data);
+        wandio_free_buffer(iow->data);
         free(iow);
 }
 
-iow_source_t bz_wsource = {"bzw", bz_wwrite, bz_wflush, bz_wclose};
+iow_source_t bz_wsource = {"bzw", bz_wwrite, bz_wflush, bz_wclose,
+                           NULL, NULL};
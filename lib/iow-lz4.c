@@ -30,12 +30,14 @@
 #include "config.h"
 #include <assert.h>
 #include <errno.h>
+#include <inttypes.h>
 #if HAVE_LIBLZ4F
 #include <lz4frame.h>
 #endif
 #include <stdlib.h>
 #include <string.h>
 #include "wandio.h"
+#include "wandio_internal.h"
 
 enum err_t { ERR_OK = 1, ERR_EOF = 0, ERR_ERROR = -1 };
 
@@ -46,37 +48,114 @@ struct lz4w_t {
         LZ4F_compressionContext_t cctx;
         LZ4F_preferences_t prefs;
 #endif
-        char outbuf[1024 * 1024 * 2];
+        char *outbuf;
+        size_t outbuf_len;
         int outbuf_size_max;
         int outbuf_index;
+        /* Level to use for the next frame and the range it can be adapted
+         * within */
+        int next_level;
+        int min_level;
+        int max_level;
+        /* Whether to store incompressible data, if we currently are, and
+         * how much incompressible data there has been in a row */
+        bool store_incompressible;
+        bool storing;
+        int64_t store_run;
 };
 
 #define DATA(iow) ((struct lz4w_t *)((iow)->data))
+#define LZ4_STORE_LEVEL (-65537)
 extern iow_source_t lz4_wsource;
 
 DLLEXPORT iow_t *lz4_wopen(iow_t *child, int compress_level) {
+        return lz4_wopen_opts(child, compress_level, NULL);
+}
+
+DLLEXPORT iow_t *lz4_wopen_opts(iow_t *child, int compress_level,
+                                const struct wandio_wopt *opts) {
         iow_t *iow;
+        int64_t block_size =
+            wandio_wopt_get(opts, WANDIO_WOPT_LZ4_BLOCK_SIZE, 0);
+        int min_level = wandio_wopt_get(opts, WANDIO_WOPT_ADAPT_MIN_LEVEL,
+                                        compress_level);
+        bool store = wandio_wopt_get(opts, WANDIO_WOPT_STORE_INCOMPRESSIBLE, 1);
         if (!child) {
                 return NULL;
         }
+        if (min_level > compress_level) {
+                fprintf(stderr, "lz4 adaptive level must be at most %d\n",
+                        compress_level);
+                return NULL;
+        }
         iow = malloc(sizeof(iow_t));
-        /* flush rely on sufficiently large output buffer and not making loops
-         */
-        assert(sizeof(DATA(iow)->outbuf) >= 1024 * 1024);
         iow->source = &lz4_wsource;
-        iow->data = malloc(sizeof(struct lz4w_t));
-        memset(DATA(iow), 0, sizeof(struct lz4w_t));
+        iow->data = calloc(1, sizeof(struct lz4w_t));
+        if (!iow->data) {
+                free(iow);
+                return NULL;
+        }
         DATA(iow)->child = child;
         DATA(iow)->err = ERR_OK;
-        DATA(iow)->outbuf_size_max = sizeof(DATA(iow)->outbuf) / 2;
+        DATA(iow)->outbuf_len = 1024 * 1024 * 2;
+        DATA(iow)->outbuf_size_max = 1024 * 1024;
         DATA(iow)->outbuf_index = 0;
+        DATA(iow)->next_level = compress_level;
+        DATA(iow)->min_level = min_level;
+        DATA(iow)->max_level = compress_level;
+        DATA(iow)->store_incompressible = store;
+        DATA(iow)->storing = false;
+        DATA(iow)->store_run = 0;
 
 #if HAVE_LIBLZ4F
         memset(&(DATA(iow)->prefs), 0, sizeof(LZ4F_preferences_t));
+        /* Levels of 3 and above use the lz4hc compressor */
         DATA(iow)->prefs.compressionLevel = compress_level;
+        switch (block_size) {
+        case 0:
+                break;
+        case 64 * 1024:
+                DATA(iow)->prefs.frameInfo.blockSizeID = LZ4F_max64KB;
+                break;
+        case 256 * 1024:
+                DATA(iow)->prefs.frameInfo.blockSizeID = LZ4F_max256KB;
+                break;
+        case 1024 * 1024:
+                DATA(iow)->prefs.frameInfo.blockSizeID = LZ4F_max1MB;
+                break;
+        case 4 * 1024 * 1024:
+                DATA(iow)->prefs.frameInfo.blockSizeID = LZ4F_max4MB;
+                break;
+        default:
+                fprintf(stderr, "Invalid lz4 block size %" PRId64 "\n",
+                        block_size);
+                free(iow->data);
+                free(iow);
+                return NULL;
+        }
+        /* Large blocks are buffered in their entirety, so the output buffer
+         * has to be able to hold at least one of them. Keep room for two so
+         * flush doesn't need to loop. */
+        size_t bound = LZ4F_compressBound(DATA(iow)->outbuf_size_max,
+                                          &(DATA(iow)->prefs));
+        if (bound * 2 > DATA(iow)->outbuf_len) {
+                DATA(iow)->outbuf_len = bound * 2;
+        }
+#else
+        (void)block_size;
+#endif
+        DATA(iow)->outbuf = wandio_alloc_buffer(DATA(iow)->outbuf_len);
+        if (!DATA(iow)->outbuf) {
+                free(iow->data);
+                free(iow);
+                return NULL;
+        }
+
+#if HAVE_LIBLZ4F
         LZ4F_errorCode_t result =
             LZ4F_createCompressionContext(&DATA(iow)->cctx, LZ4F_VERSION);
         if (LZ4F_isError(result)) {
+                wandio_free_buffer(DATA(iow)->outbuf);
                 free(iow->data);
                 free(iow);
                 fprintf(stderr, "lz4 write open failed %s\n",
@@ -86,9 +165,10 @@ DLLEXPORT iow_t *lz4_wopen(iow_t *child, int compress_level) {
 
         result =
             LZ4F_compressBegin(DATA(iow)->cctx, DATA(iow)->outbuf,
-                               sizeof(DATA(iow)->outbuf), &(DATA(iow)->prefs));
+                               DATA(iow)->outbuf_len, &(DATA(iow)->prefs));
         if (LZ4F_isError(result)) {
                 LZ4F_freeCompressionContext(DATA(iow)->cctx);
+                wandio_free_buffer(DATA(iow)->outbuf);
                 free(iow->data);
                 free(iow);
                 fprintf(stderr, "lz4 write open failed %s\n",
@@ -100,6 +180,49 @@ DLLEXPORT iow_t *lz4_wopen(iow_t *child, int compress_level) {
         return iow;
 }
 
+#if HAVE_LIBLZ4F
+/* The level is fixed for the whole of an lz4 frame, so changing it means
+ * ending the current frame and starting another. Readers handle concatenated
+ * frames just fine.
+ */
+static int lz4_wnew_frame(iow_t *iow, int level) {
+        size_t result;
+
+        if (DATA(iow)->outbuf_index > 0) {
+                if (wandio_wwrite(DATA(iow)->child, DATA(iow)->outbuf,
+                                  DATA(iow)->outbuf_index) <= 0) {
+                        DATA(iow)->err = ERR_ERROR;
+                        return -1;
+                }
+                DATA(iow)->outbuf_index = 0;
+        }
+
+        result = LZ4F_compressEnd(DATA(iow)->cctx, DATA(iow)->outbuf,
+                                  DATA(iow)->outbuf_len, NULL);
+        if (LZ4F_isError(result)) {
+                fprintf(stderr, "lz4 compress error %s\n",
+                        LZ4F_getErrorName(result));
+                DATA(iow)->err = ERR_ERROR;
+                return -1;
+        }
+        DATA(iow)->outbuf_index = result;
+
+        DATA(iow)->prefs.compressionLevel = level;
+        result = LZ4F_compressBegin(
+            DATA(iow)->cctx, DATA(iow)->outbuf + DATA(iow)->outbuf_index,
+            DATA(iow)->outbuf_len - DATA(iow)->outbuf_index,
+            &(DATA(iow)->prefs));
+        if (LZ4F_isError(result)) {
+                fprintf(stderr, "lz4 compress error %s\n",
+                        LZ4F_getErrorName(result));
+                DATA(iow)->err = ERR_ERROR;
+                return -1;
+        }
+        DATA(iow)->outbuf_index += result;
+        return 0;
+}
+#endif
+
 static int64_t lz4_wwrite(iow_t *iow, const char *buffer, int64_t len) {
         if (DATA(iow)->err == ERR_EOF) {
                 return 0; /* EOF */
@@ -111,6 +234,23 @@ static int64_t lz4_wwrite(iow_t *iow, const char *buffer, int64_t len) {
         if (len <= 0) {
                 return 0;
         }
+#if HAVE_LIBLZ4F
+        /* Changing level means starting a new frame, so only start
+         * storing once there has been plenty of incompressible data */
+        if (DATA(iow)->store_incompressible)
+                DATA(iow)->storing =
+                    wandio_store_steady(DATA(iow)->storing,
+                                        &DATA(iow)->store_run, buffer, len);
+        /* Negative levels are lz4's acceleration factor. At the maximum lz4
+         * skips through incompressible data and stores the blocks as they
+         * are */
+        int level =
+            DATA(iow)->storing ? LZ4_STORE_LEVEL : DATA(iow)->next_level;
+        if (level != DATA(iow)->prefs.compressionLevel &&
+            lz4_wnew_frame(iow, level) < 0) {
+                return -1;
+        }
+#endif
         /* Lz4 does not have a streaming comrpession */
         /* We need to handle arbitrarily large input buffer, by limiting to 1MB
          * pieces */
@@ -131,7 +271,7 @@ static int64_t lz4_wwrite(iow_t *iow, const char *buffer, int64_t len) {
                     LZ4F_compressBound(inbuf_len, &(DATA(iow)->prefs));
 #endif
                 if ((size_t)upper_bound >
-                    sizeof(DATA(iow)->outbuf) - DATA(iow)->outbuf_index) {
+                    DATA(iow)->outbuf_len - DATA(iow)->outbuf_index) {
                         int bytes_written =
                             wandio_wwrite(DATA(iow)->child, DATA(iow)->outbuf,
                                           DATA(iow)->outbuf_index);
@@ -143,7 +283,7 @@ static int64_t lz4_wwrite(iow_t *iow, const char *buffer, int64_t len) {
                         DATA(iow)->outbuf_index = 0;
                 }
 
-                if (upper_bound > (int64_t)sizeof(DATA(iow)->outbuf)) {
+                if (upper_bound > DATA(iow)->outbuf_len) {
                         fprintf(stderr, "invalid upper bound calculated by lz4 library: %zu\n", upper_bound);
                         errno = EINVAL;
                         return -1;
@@ -153,7 +293,7 @@ static int64_t lz4_wwrite(iow_t *iow, const char *buffer, int64_t len) {
                 result = LZ4F_compressUpdate(
                     DATA(iow)->cctx,
                     DATA(iow)->outbuf + DATA(iow)->outbuf_index,
-                    sizeof(DATA(iow)->outbuf) - DATA(iow)->outbuf_index,
+                    DATA(iow)->outbuf_len - DATA(iow)->outbuf_index,
                     buffer + inbuf_index, inbuf_len, NULL);
                 if (LZ4F_isError(result)) {
                         fprintf(stderr, "lz4 compress error %ld %s\n", result,
@@ -183,7 +323,7 @@ static int lz4_wflush(iow_t *iow) {
         DATA(iow)->outbuf_index = 0;
 #if HAVE_LIBLZ4F
         result = LZ4F_flush(DATA(iow)->cctx, DATA(iow)->outbuf,
-                            sizeof(DATA(iow)->outbuf), NULL);
+                            DATA(iow)->outbuf_len, NULL);
         if (LZ4F_isError(result)) {
                 fprintf(stderr, "lz4 compress flush error %ld %s\n", result,
                         LZ4F_getErrorName(result));
@@ -211,13 +351,23 @@ static int lz4_wflush(iow_t *iow) {
         return 0;
 }
 
+/* Steps the level down when we are falling behind and back up towards the
+ * level we were opened with when we are keeping up */
+static void lz4_wadapt(iow_t *iow, bool faster) {
+        int level = DATA(iow)->next_level + (faster ? -1 : 1);
+
+        if (level < DATA(iow)->min_level || level > DATA(iow)->max_level)
+                return;
+        DATA(iow)->next_level = level;
+}
+
 static void lz4_wclose(iow_t *iow) {
         lz4_wflush(iow);
 
 #if HAVE_LIBLZ4F
         size_t result = 0;
         result = LZ4F_compressEnd(DATA(iow)->cctx, DATA(iow)->outbuf,
-                                  sizeof(DATA(iow)->outbuf), NULL);
+                                  DATA(iow)->outbuf_len, NULL);
         if (LZ4F_isError(result)) {
                 fprintf(stderr, "lz4 compress close error %ld %s\n", result,
                         LZ4F_getErrorName(result));
@@ -234,8 +384,10 @@ static void lz4_wclose(iow_t *iow) {
 #if HAVE_LIBLZ4F
         LZ4F_freeCompressionContext(DATA(iow)->cctx);
 #endif
+        wandio_free_buffer(DATA(iow)->outbuf);
         free(iow->data);
         free(iow);
 }
 
-iow_source_t lz4_wsource = {"lz4w", lz4_wwrite, lz4_wflush, lz4_wclose};
+iow_source_t lz4_wsource = {"lz4w", lz4_wwrite, lz4_wflush,
+                            lz4_wclose, lz4_wadapt, NULL};
@@ -33,6 +33,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include "wandio.h"
+#include "wandio_internal.h"
 
 /* Libwandio IO module implementing an lzma writer */
 
@@ -44,6 +45,10 @@ struct lzmaw_t {
         iow_t *child;
         enum err_t err;
         int inoffset;
+        /* Start a new xz block after this much input, 0 for never */
+        int64_t block_size;
+        /* The amount of input in the current block */
+        int64_t block_used;
 };
 
 extern iow_source_t lzma_wsource;
@@ -52,12 +57,24 @@ extern iow_source_t lzma_wsource;
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
 DLLEXPORT iow_t *lzma_wopen(iow_t *child, int compress_level) {
+        return lzma_wopen_opts(child, compress_level, NULL);
+}
+
+DLLEXPORT iow_t *lzma_wopen_opts(iow_t *child, int compress_level,
+                                 const struct wandio_wopt *opts) {
         iow_t *iow;
+        uint32_t preset = compress_level;
         if (!child)
                 return NULL;
+        if (wandio_wopt_get(opts, WANDIO_WOPT_LZMA_EXTREME, 0))
+                preset |= LZMA_PRESET_EXTREME;
         iow = malloc(sizeof(iow_t));
         iow->source = &lzma_wsource;
-        iow->data = malloc(sizeof(struct lzmaw_t));
+        iow->data = wandio_alloc_buffer(sizeof(struct lzmaw_t));
+        if (!iow->data) {
+                free(iow);
+                return NULL;
+        }
 
         DATA(iow)->child = child;
 
@@ -65,10 +82,15 @@ DLLEXPORT iow_t *lzma_wopen(iow_t *child, int compress_level) {
         DATA(iow)->strm.next_out = DATA(iow)->outbuff;
         DATA(iow)->strm.avail_out = sizeof(DATA(iow)->outbuff);
         DATA(iow)->err = ERR_OK;
-
-        if (lzma_easy_encoder(&DATA(iow)->strm, compress_level,
-                              LZMA_CHECK_CRC64) != LZMA_OK) {
-                free(iow->data);
+        DATA(iow)->block_size =
+            wandio_wopt_get(opts, WANDIO_WOPT_LZMA_BLOCK_SIZE, 0);
+        DATA(iow)->block_used = 0;
+
+        if (lzma_easy_encoder(&DATA(iow)->strm, preset, LZMA_CHECK_CRC64) !=
+            LZMA_OK) {
+                fprintf(stderr, "Invalid lzma compression level %d\n",
+                        compress_level);
+                wandio_free_buffer(iow->data);
                 free(iow);
                 return NULL;
         }
@@ -76,7 +98,7 @@ DLLEXPORT iow_t *lzma_wopen(iow_t *child, int compress_level) {
         return iow;
 }
 
-static int64_t lzma_wwrite(iow_t *iow, const char *buffer, int64_t len) {
+static int64_t lzma_wcompress(iow_t *iow, const char *buffer, int64_t len) {
         if (DATA(iow)->err == ERR_EOF) {
                 return 0; /* EOF */
         }
@@ -119,6 +141,65 @@ static int64_t lzma_wwrite(iow_t *iow, const char *buffer, int64_t len) {
         return len - DATA(iow)->strm.avail_in;
 }
 
+/* Finishes the current xz block, so that the next one can be decompressed
+ * independently of everything written before it */
+static int lzma_wend_block(iow_t *iow) {
+        lzma_ret res;
+        do {
+                res = lzma_code(&DATA(iow)->strm, LZMA_FULL_FLUSH);
+                if (res != LZMA_OK && res != LZMA_STREAM_END) {
+                        DATA(iow)->err = ERR_ERROR;
+                        return -1;
+                }
+                if (DATA(iow)->strm.avail_out < sizeof(DATA(iow)->outbuff)) {
+                        if (wandio_wwrite(DATA(iow)->child,
+                                          (char *)DATA(iow)->outbuff,
+                                          sizeof(DATA(iow)->outbuff) -
+                                              DATA(iow)->strm.avail_out) <=
+                            0) {
+                                DATA(iow)->err = ERR_ERROR;
+                                return -1;
+                        }
+                        DATA(iow)->strm.next_out = DATA(iow)->outbuff;
+                        DATA(iow)->strm.avail_out = sizeof(DATA(iow)->outbuff);
+                }
+        } while (res != LZMA_STREAM_END);
+        DATA(iow)->block_used = 0;
+        return 0;
+}
+
+static int64_t lzma_wwrite(iow_t *iow, const char *buffer, int64_t len) {
+        int64_t done = 0;
+
+        if (DATA(iow)->block_size <= 0) {
+                return lzma_wcompress(iow, buffer, len);
+        }
+
+        /* Compress the input in pieces that stop at each block boundary */
+        while (done < len) {
+                int64_t chunk = len - done;
+                int64_t ret;
+
+                if (chunk > DATA(iow)->block_size - DATA(iow)->block_used) {
+                        chunk = DATA(iow)->block_size - DATA(iow)->block_used;
+                }
+                ret = lzma_wcompress(iow, buffer + done, chunk);
+                if (ret < 0) {
+                        return done > 0 ? done : ret;
+                }
+                done += ret;
+                DATA(iow)->block_used += ret;
+                if (ret < chunk) {
+                        break;
+                }
+                if (DATA(iow)->block_used >= DATA(iow)->block_size &&
+                    lzma_wend_block(iow) < 0) {
+                        break;
+                }
+        }
+        return done;
+}
+
 static int lzma_wflush(iow_t *iow) {
         /* TODO implement this */
         (void)iow;  // silence compiler warning
@@ -149,8 +230,9 @@ static void lzma_wclose(iow_t *iow) {
                       sizeof(DATA(iow)->outbuff) - DATA(iow)->strm.avail_out);
         lzma_end(&DATA(iow)->strm);
         wandio_wdestroy(DATA(iow)->child);
-        free(iow->data);
+        wandio_free_buffer(iow->data);
         free(iow);
 }
 
-iow_source_t lzma_wsource = {"xz", lzma_wwrite, lzma_wflush, lzma_wclose};
+iow_source_t lzma_wsource = {"xz", lzma_wwrite, lzma_wflush,
+                             lzma_wclose, NULL, NULL};
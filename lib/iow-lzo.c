@@ -113,14 +113,28 @@ struct lzothread_t {
         int num;
         struct buffer_t inbuf;
         struct buffer_t outbuf;
+        /* With the worker pool: the task that compresses this block, whether
+         * it is queued or running, and whether someone is compressing the
+         * block right now */
+        struct wandio_task_t task;
+        bool busy;
+        bool claimed;
+        /* Set if the writer was closed while the task was still queued, in
+         * which case the tasks that are left free the blocks between them,
+         * counting down refs */
+        int *refs;
 };
 
 struct lzow_t {
         iow_t *child;
         enum err_t err;
+        bool pooled;
         int threads;
         int next_thread;
         struct lzothread_t *thread;
+        /* With the worker pool: how many references there are to thread,
+         * which may outlive the writer */
+        int *refs;
 };
 
 extern iow_source_t lzo_wsource;
@@ -265,6 +279,69 @@ static void *lzo_compress_thread(void *data) {
         return NULL;
 }
 
+/* Compresses a block that is waiting to be compressed. Must be called with
+ * the mutex held, which is released while compressing */
+static void lzo_compress_block(struct lzothread_t *me) {
+        int err;
+
+        me->claimed = true;
+        pthread_mutex_unlock(&me->mutex);
+        err = lzo_wwrite_block(me->inbuf.buffer, me->inbuf.offset,
+                               &me->outbuf);
+        pthread_mutex_lock(&me->mutex);
+        if (err < 0)
+                me->outbuf.offset = 0;
+        me->claimed = false;
+        me->state = FULL;
+        pthread_cond_signal(&me->out_ready);
+}
+
+/* When using the worker pool, this job takes the place of the thread */
+static void lzo_compress_job(void *data) {
+        struct lzothread_t *me = (struct lzothread_t *)data;
+        int *refs;
+
+        pthread_mutex_lock(&me->mutex);
+        while (me->state == WAITING && !me->claimed)
+                lzo_compress_block(me);
+        me->busy = false;
+        refs = me->refs;
+        pthread_cond_signal(&me->out_ready);
+        pthread_mutex_unlock(&me->mutex);
+
+        /* The writer has gone, and we may be the last to need the blocks */
+        if (refs && __atomic_sub_fetch(refs, 1, __ATOMIC_ACQ_REL) == 0) {
+                wandio_free_buffer(me - me->num);
+                free(refs);
+        }
+}
+
+/* Waits for a block to be compressed. With the worker pool, compress it here
+ * if no worker has got to it yet, so that a worker writing out a file never
+ * waits for another. Must be called with the mutex held */
+static void lzo_wait_block(iow_t *iow, struct lzothread_t *me) {
+        while (me->state == WAITING) {
+                if (DATA(iow)->pooled && !me->claimed)
+                        lzo_compress_block(me);
+                else
+                        pthread_cond_wait(&me->out_ready, &me->mutex);
+        }
+}
+
+/* Hands a block over to be compressed. Must be called with the mutex held,
+ * and releases it */
+static void lzo_start_block(iow_t *iow, struct lzothread_t *me) {
+        bool submit = DATA(iow)->pooled && !me->busy;
+
+        me->state = WAITING;
+        pthread_cond_signal(&me->in_ready);
+        if (submit)
+                me->busy = true;
+        pthread_mutex_unlock(&me->mutex);
+        if (submit)
+                wandio_pool_submit(&me->task);
+}
+
 DLLEXPORT iow_t *lzo_wopen(iow_t *child, int compress_level) {
         const int opt_filter = 0;
         int flags;
@@ -341,11 +418,26 @@ DLLEXPORT iow_t *lzo_wopen(iow_t *child, int compress_level) {
         wandio_wwrite(DATA(iow)->child, buffer.buffer, buffer.offset);
 
         /* Set up the thread pool -- one thread per core */
+        DATA(iow)->pooled = wandio_pool_enabled();
+        DATA(iow)->thread = NULL;
+        DATA(iow)->refs = NULL;
         if (use_threads > 0) {
                 DATA(iow)->threads =
                     min((uint32_t)sysconf(_SC_NPROCESSORS_ONLN), use_threads);
-                DATA(iow)->thread =
-                    malloc(sizeof(struct lzothread_t) * DATA(iow)->threads);
+                DATA(iow)->thread = wandio_alloc_buffer(
+                    sizeof(struct lzothread_t) * DATA(iow)->threads);
+        }
+        if (DATA(iow)->thread && DATA(iow)->pooled) {
+                DATA(iow)->refs = malloc(sizeof(int));
+                if (!DATA(iow)->refs) {
+                        wandio_free_buffer(DATA(iow)->thread);
+                        DATA(iow)->thread = NULL;
+                } else {
+                        *DATA(iow)->refs = 1;
+                }
+        }
+        /* Without the threads we can still compress it ourselves */
+        if (use_threads > 0 && DATA(iow)->thread) {
                 DATA(iow)->next_thread = 0;
                 for (i = 0; i < DATA(iow)->threads; ++i) {
                         pthread_cond_init(&DATA(iow)->thread[i].in_ready, NULL);
@@ -356,10 +448,17 @@ DLLEXPORT iow_t *lzo_wopen(iow_t *child, int compress_level) {
                         DATA(iow)->thread[i].num = i;
                         DATA(iow)->thread[i].state = EMPTY;
                         DATA(iow)->thread[i].inbuf.offset = 0;
-
-                        pthread_create(&DATA(iow)->thread[i].thread, NULL,
-                                       lzo_compress_thread,
-                                       (void *)&DATA(iow)->thread[i]);
+                        DATA(iow)->thread[i].busy = false;
+                        DATA(iow)->thread[i].claimed = false;
+                        DATA(iow)->thread[i].refs = NULL;
+                        DATA(iow)->thread[i].task.job = lzo_compress_job;
+                        DATA(iow)->thread[i].task.arg = &DATA(iow)->thread[i];
+
+                        if (DATA(iow)->pooled)
+                                continue;
+                        wandio_thread_create(&DATA(iow)->thread[i].thread,
+                                             lzo_compress_thread,
+                                             (void *)&DATA(iow)->thread[i]);
                 }
         } else {
                 DATA(iow)->threads = 0;
@@ -407,11 +506,7 @@ static int64_t lzo_wwrite(iow_t *iow, const char *buffer, int64_t len) {
                         pthread_mutex_lock(&get_next_thread(iow)->mutex);
                         /* If this thread is still compressing, wait for it to
                          * finish */
-                        while (get_next_thread(iow)->state == WAITING) {
-                                pthread_cond_wait(
-                                    &get_next_thread(iow)->out_ready,
-                                    &get_next_thread(iow)->mutex);
-                        }
+                        lzo_wait_block(iow, get_next_thread(iow));
 
                         /* Flush any data out thats there */
                         if (get_next_thread(iow)->state == FULL) {
@@ -457,12 +552,7 @@ static int64_t lzo_wwrite(iow_t *iow, const char *buffer, int64_t len) {
                             get_next_thread(iow)->inbuf.offset >=
                                 MAX_BLOCK_SIZE) {
                                 assert(get_next_thread(iow)->state == EMPTY);
-                                get_next_thread(iow)->state = WAITING;
-                                pthread_cond_signal(
-                                    &get_next_thread(iow)->in_ready);
-
-                                pthread_mutex_unlock(
-                                    &get_next_thread(iow)->mutex);
+                                lzo_start_block(iow, get_next_thread(iow));
 
                                 DATA(iow)->next_thread =
                                     (DATA(iow)->next_thread + 1) %
@@ -479,7 +569,8 @@ static int64_t lzo_wwrite(iow_t *iow, const char *buffer, int64_t len) {
         return len;
 }
 
-static void shutdown_thread(iow_t *iow, struct lzothread_t *thread) {
+static void shutdown_thread(iow_t *iow, struct lzothread_t *thread,
+                            int *refs) {
         pthread_mutex_lock(&thread->mutex);
 
         /* If this buffer is empty it shouldn't have any data in it, we should
@@ -488,9 +579,7 @@ static void shutdown_thread(iow_t *iow, struct lzothread_t *thread) {
         /* thread->state == EMPTY implies thread->inbuf.offset == 0 */
         assert(!(thread->state == EMPTY) || thread->inbuf.offset == 0);
 
-        while (thread->state == WAITING) {
-                pthread_cond_wait(&thread->out_ready, &thread->mutex);
-        }
+        lzo_wait_block(iow, thread);
         if (thread->state == FULL) {
                 wandio_wwrite(DATA(iow)->child, thread->outbuf.buffer,
                               thread->outbuf.offset);
@@ -499,6 +588,17 @@ static void shutdown_thread(iow_t *iow, struct lzothread_t *thread) {
         }
         /* Now the thread should be empty, so ask it to shut down */
         assert(thread->state == EMPTY && thread->inbuf.offset == 0);
+        if (DATA(iow)->pooled) {
+                /* There is no thread, but the job may still be queued. We
+                 * may be running on the only worker that could run it, so
+                 * leave it to free the blocks rather than waiting for it */
+                if (thread->busy) {
+                        thread->refs = refs;
+                        __atomic_add_fetch(refs, 1, __ATOMIC_ACQ_REL);
+                }
+                pthread_mutex_unlock(&thread->mutex);
+                return;
+        }
         thread->closing = true;
         pthread_cond_signal(&thread->in_ready);
         pthread_mutex_unlock(&thread->mutex);
@@ -514,27 +614,27 @@ static int lzo_wflush(iow_t *iow) {
 
 static void lzo_wclose(iow_t *iow) {
         const uint32_t zero = 0;
+        int *refs = DATA(iow)->refs;
         int i;
 
         /* Flush the last buffer */
         if (DATA(iow)->thread != NULL) {
                 pthread_mutex_lock(&get_next_thread(iow)->mutex);
                 if (get_next_thread(iow)->state == EMPTY &&
-                    get_next_thread(iow)->inbuf.offset != 0) {
-                        get_next_thread(iow)->state = WAITING;
-                        pthread_cond_signal(&get_next_thread(iow)->in_ready);
-                }
-                pthread_mutex_unlock(&get_next_thread(iow)->mutex);
+                    get_next_thread(iow)->inbuf.offset != 0)
+                        lzo_start_block(iow, get_next_thread(iow));
+                else
+                        pthread_mutex_unlock(&get_next_thread(iow)->mutex);
 
                 DATA(iow)->next_thread =
                     (DATA(iow)->next_thread + 1) % DATA(iow)->threads;
 
                 /* Right, now we have to shutdown all our threads -- in order */
                 for (i = DATA(iow)->next_thread; i < DATA(iow)->threads; ++i) {
-                        shutdown_thread(iow, &DATA(iow)->thread[i]);
+                        shutdown_thread(iow, &DATA(iow)->thread[i], refs);
                 }
                 for (i = 0; i < DATA(iow)->next_thread; ++i) {
-                        shutdown_thread(iow, &DATA(iow)->thread[i]);
+                        shutdown_thread(iow, &DATA(iow)->thread[i], refs);
                 }
         }
 
@@ -543,9 +643,13 @@ static void lzo_wclose(iow_t *iow) {
 
         /* And clean everything up */
         wandio_wdestroy(DATA(iow)->child);
-        free(DATA(iow)->thread);
+        if (!refs || __atomic_sub_fetch(refs, 1, __ATOMIC_ACQ_REL) == 0) {
+                wandio_free_buffer(DATA(iow)->thread);
+                free(refs);
+        }
         free(iow->data);
         free(iow);
 }
 
-iow_source_t lzo_wsource = {"lzo", lzo_wwrite, lzo_wflush, lzo_wclose};
+iow_source_t lzo_wsource = {"lzo", lzo_wwrite, lzo_wflush,
+                            lzo_wclose, NULL, NULL};
@@ -0,0 +1,620 @@
+/*
+ *
+ * Copyright (c) 2007-2019 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libwandio.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libwandio is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwandio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wandio.h"
+#include "wandio_internal.h"
+#ifdef HAVE_SYS_PRCTL_H
+#include <sys/prctl.h>
+#endif
+
+/* Libwandio IO module implementing a writer that several threads can write
+ * to at once, e.g. one per capture queue, without funnelling everything
+ * through a single thread first.
+ *
+ * Each thread writes through a producer handle of its own, which copies the
+ * data into slices that belong to that producer alone, so writing doesn't
+ * take any locks. Only when a slice is full is it handed over to a merging
+ * thread, which feeds the slices to the compressor and file. Each write is
+ * kept together in the output, i.e. writes from different producers are
+ * interleaved, but never mixed up.
+ *
+ * In ordered mode, each write is instead tagged with a sequence number and
+ * the merging thread writes them out in that order, whichever producer
+ * they came from. The write that is due next may be sitting in a slice that
+ * its producer hasn't filled yet, and that producer may not write again
+ * until the others have made progress, so the merging thread can also write
+ * out the writes in a slice that is still being filled. The producer counts
+ * each write into the slice once it has been copied, and only wakes the
+ * merging thread if it is idle and the write is the one it is waiting for.
+ */
+
+/* Number of slices each producer has */
+#define MULTI_SLICES 4
+/* Number of writes that a slice can hold in ordered mode */
+#define MULTI_RECORDS 1024
+
+extern iow_source_t multi_wsource;
+extern iow_source_t producer_wsource;
+
+/* A single write in ordered mode, or part of one if it didn't fit */
+struct multi_record_t {
+        uint64_t seq;
+        int64_t len;
+        /* The rest of the write is at the start of the next slice */
+        bool partial;
+};
+
+struct multi_slice_t {
+        char *buffer;
+        int64_t len;
+        /* Amount that has been written out by the merging thread */
+        int64_t used;
+        /* Interleaved mode: the last write continues in the next slice */
+        bool split;
+        /* Ordered mode: the writes in the slice, and how many of them have
+         * been written out. nrecords is updated atomically, as the merging
+         * thread may read it while the slice is still being filled */
+        struct multi_record_t *records;
+        int nrecords;
+        int done;
+        /* Slices are written out in the order they are handed over */
+        uint64_t ticket;
+        struct multi_slice_t *next;
+};
+
+struct multi_producer_t {
+        iow_t *multi;
+        char *buffers;
+        struct multi_slice_t slices[MULTI_SLICES];
+        /* The slice being filled, which only the producer uses */
+        struct multi_slice_t *staging;
+        /* Everything below is protected by the writer's mutex. Slices that
+         * are waiting to be written, oldest first, and slices that are
+         * free to be filled */
+        struct multi_slice_t *queue;
+        struct multi_slice_t *queue_tail;
+        struct multi_slice_t *free;
+        /* The producer's handle has been destroyed */
+        bool detached;
+        struct multi_producer_t *next;
+};
+
+struct multiw_t {
+        /* The writer for the file, which only the merging thread uses */
+        iow_t *child;
+        bool ordered;
+        pthread_t thread;
+        pthread_mutex_t mutex;
+        pthread_cond_t data_ready;
+        pthread_cond_t space_avail;
+        struct multi_producer_t *producers;
+        uint64_t ticket;
+        /* Ordered mode: the sequence number to write next, and whether the
+         * merging thread is waiting for it. Producers read both without
+         * holding the mutex */
+        uint64_t next_seq;
+        bool idle;
+        /* Interleaved mode: a producer whose write has been split across
+         * slices, which we have to finish before moving on */
+        struct multi_producer_t *current;
+        bool flush;
+        bool closing;
+        /* errno from a failed write, which is reported to every producer */
+        int error;
+};
+
+#define DATA(iow) ((struct multiw_t *)((iow)->data))
+#define PRODUCER(iow) ((struct multi_producer_t *)((iow)->data))
+
+static void multi_free_producer(struct multi_producer_t *p) {
+        int i;
+
+        for (i = 0; i < MULTI_SLICES; i++)
+                free(p->slices[i].records);
+        wandio_free_buffer(p->buffers);
+        free(p);
+}
+
+/* Works out what to write next. Returns the slice and sets *len to the
+ * amount to write from it and, in ordered mode, *count to the number of
+ * writes that covers, or returns NULL if nothing can be written yet. Must be
+ * called with the mutex held */
+static struct multi_slice_t *multi_pick(iow_t *iow,
+                                        struct multi_producer_t **from,
+                                        int64_t *len, int *count) {
+        struct multi_producer_t *p, *best = NULL;
+        struct multi_slice_t *slice;
+        struct multi_record_t *rec;
+        uint64_t seq;
+        int nrecords = 0;
+        int i;
+
+        if (!DATA(iow)->ordered) {
+                best = DATA(iow)->current;
+                for (p = DATA(iow)->producers; p && !DATA(iow)->current;
+                     p = p->next) {
+                        if (p->queue && (!best || p->queue->ticket <
+                                                      best->queue->ticket))
+                                best = p;
+                }
+                if (!best || !best->queue)
+                        return NULL;
+                *from = best;
+                *len = best->queue->len - best->queue->used;
+                return best->queue;
+        }
+
+        /* A producer's writes are in order, so anything it hasn't handed
+         * over yet only matters once the rest has been written out */
+        for (p = DATA(iow)->producers; p; p = p->next) {
+                slice = p->queue ? p->queue : p->staging;
+                if (!slice)
+                        continue;
+                nrecords = __atomic_load_n(&slice->nrecords, __ATOMIC_SEQ_CST);
+                if (slice->done < nrecords &&
+                    slice->records[slice->done].seq == DATA(iow)->next_seq)
+                        break;
+        }
+        if (!p)
+                return NULL;
+
+        /* Consecutive writes from the same slice are next to each other, so
+         * can be written out together */
+        seq = slice->records[slice->done].seq;
+        *len = 0;
+        *count = 0;
+        for (i = slice->done; i < nrecords; i++) {
+                rec = &slice->records[i];
+                if (rec->seq != seq)
+                        break;
+                *len += rec->len;
+                (*count)++;
+                if (rec->partial)
+                        break;
+                seq++;
+        }
+        *from = p;
+        return slice;
+}
+
+/* Moves on past data that has been written out, and gives the slice back to
+ * its producer once it is empty, unless the producer is still filling it.
+ * Must be called with the mutex held */
+static void multi_consume(iow_t *iow, struct multi_producer_t *p,
+                          struct multi_slice_t *slice, int64_t len,
+                          int count) {
+        struct multi_producer_t **prev;
+        struct multi_record_t *rec;
+
+        slice->used += len;
+        if (DATA(iow)->ordered) {
+                while (count-- > 0) {
+                        rec = &slice->records[slice->done++];
+                        if (!rec->partial)
+                                __atomic_store_n(&DATA(iow)->next_seq,
+                                                 rec->seq + 1,
+                                                 __ATOMIC_SEQ_CST);
+                }
+                if (slice == p->staging || slice->done < slice->nrecords)
+                        return;
+        } else {
+                DATA(iow)->current = slice->split ? p : NULL;
+                if (slice->used < slice->len)
+                        return;
+        }
+
+        p->queue = slice->next;
+        if (!p->queue)
+                p->queue_tail = NULL;
+        slice->next = p->free;
+        p->free = slice;
+        pthread_cond_broadcast(&DATA(iow)->space_avail);
+
+        if (p->detached && !p->queue) {
+                for (prev = &DATA(iow)->producers; *prev != p;
+                     prev = &(*prev)->next)
+                        ;
+                *prev = p->next;
+                multi_free_producer(p);
+        }
+}
+
+/* Once we are closing and nothing else is coming, any gaps in the sequence
+ * numbers will never be filled, so skip over them. Returns false if there is
+ * nothing left to write at all. Must be called with the mutex held */
+static bool multi_skip_gap(iow_t *iow) {
+        struct multi_producer_t *p;
+        bool found = false;
+        uint64_t seq, lowest = 0;
+
+        for (p = DATA(iow)->producers; p; p = p->next) {
+                if (!p->queue)
+                        continue;
+                seq = p->queue->records[p->queue->done].seq;
+                if (!found || seq < lowest)
+                        lowest = seq;
+                found = true;
+        }
+        if (found)
+                __atomic_store_n(&DATA(iow)->next_seq, lowest,
+                                 __ATOMIC_SEQ_CST);
+        return found;
+}
+
+/* The merging thread, which writes out everything the producers hand over */
+static void *multi_thread(void *userdata) {
+        iow_t *iow = (iow_t *)userdata;
+        struct multi_producer_t *p = NULL;
+        struct multi_slice_t *slice;
+        int64_t len = 0;
+        int count = 0;
+        bool failed;
+
+#ifdef PR_SET_NAME
+        prctl(PR_SET_NAME, "wandio [multi]", 0, 0, 0);
+#endif
+
+        pthread_mutex_lock(&DATA(iow)->mutex);
+        while (true) {
+                slice = multi_pick(iow, &p, &len, &count);
+                if (slice) {
+                        /* The slice can't change until we hand it back */
+                        failed = DATA(iow)->error != 0;
+                        pthread_mutex_unlock(&DATA(iow)->mutex);
+                        /* After an error, the data is just thrown away */
+                        if (!failed && len > 0)
+                                failed = wandio_wwrite(
+                                             DATA(iow)->child,
+                                             slice->buffer + slice->used,
+                                             len) != len;
+                        pthread_mutex_lock(&DATA(iow)->mutex);
+                        if (failed && !DATA(iow)->error)
+                                DATA(iow)->error = errno ? errno : EIO;
+                        multi_consume(iow, p, slice, len, count);
+                        continue;
+                }
+                if (DATA(iow)->flush) {
+                        DATA(iow)->flush = false;
+                        pthread_mutex_unlock(&DATA(iow)->mutex);
+                        failed = wandio_wflush(DATA(iow)->child) < 0;
+                        pthread_mutex_lock(&DATA(iow)->mutex);
+                        if (failed && !DATA(iow)->error)
+                                DATA(iow)->error = errno ? errno : EIO;
+                        continue;
+                }
+                if (DATA(iow)->closing) {
+                        if (DATA(iow)->ordered && multi_skip_gap(iow))
+                                continue;
+                        break;
+                }
+                /* Producers only wake us for a write we are waiting for
+                 * once they can see that we are idle, so have one more look
+                 * after saying so */
+                if (DATA(iow)->ordered && !DATA(iow)->idle) {
+                        __atomic_store_n(&DATA(iow)->idle, true,
+                                         __ATOMIC_SEQ_CST);
+                        continue;
+                }
+                pthread_cond_wait(&DATA(iow)->data_ready, &DATA(iow)->mutex);
+                __atomic_store_n(&DATA(iow)->idle, false, __ATOMIC_SEQ_CST);
+        }
+        pthread_mutex_unlock(&DATA(iow)->mutex);
+        return NULL;
+}
+
+DLLEXPORT iow_t *multi_wopen(const char *filename, int compress_type,
+                             int compression_level, int flags,
+                             const struct wandio_wopt *opts, bool ordered) {
+        iow_t *iow;
+
+        iow = malloc(sizeof(iow_t));
+        iow->source = &multi_wsource;
+        iow->data = calloc(1, sizeof(struct multiw_t));
+        DATA(iow)->ordered = ordered;
+        pthread_mutex_init(&DATA(iow)->mutex, NULL);
+        pthread_cond_init(&DATA(iow)->data_ready, NULL);
+        pthread_cond_init(&DATA(iow)->space_avail, NULL);
+
+        /* The merging thread already takes the writing off the producers'
+         * hands, so there is no need for a threaded writer as well */
+        DATA(iow)->child = wandio_wcreate_unthreaded(
+            filename, compress_type, compression_level, flags, opts);
+        if (!DATA(iow)->child ||
+            wandio_thread_create(&DATA(iow)->thread, multi_thread, iow) !=
+                0) {
+                if (DATA(iow)->child)
+                        wandio_wdestroy(DATA(iow)->child);
+                pthread_mutex_destroy(&DATA(iow)->mutex);
+                pthread_cond_destroy(&DATA(iow)->data_ready);
+                pthread_cond_destroy(&DATA(iow)->space_avail);
+                free(iow->data);
+                free(iow);
+                return NULL;
+        }
+        return iow;
+}
+
+iow_t *multi_wproducer(iow_t *multi) {
+        struct multi_producer_t *p;
+        iow_t *iow;
+        int i;
+
+        if (multi->source != &multi_wsource) {
+                errno = ENOTSUP;
+                return NULL;
+        }
+
+        p = calloc(1, sizeof(struct multi_producer_t));
+        p->multi = multi;
+        p->buffers =
+            wandio_alloc_buffer((size_t)MULTI_SLICES * WANDIO_BUFFER_SIZE);
+        if (!p->buffers) {
+                free(p);
+                return NULL;
+        }
+        for (i = 0; i < MULTI_SLICES; i++) {
+                p->slices[i].buffer =
+                    p->buffers + (size_t)i * WANDIO_BUFFER_SIZE;
+                if (DATA(multi)->ordered)
+                        p->slices[i].records = malloc(
+                            MULTI_RECORDS * sizeof(struct multi_record_t));
+                if (i > 0)
+                        p->slices[i].next = &p->slices[i - 1];
+        }
+        p->staging = &p->slices[MULTI_SLICES - 1];
+        p->staging->next = NULL;
+        p->free = &p->slices[MULTI_SLICES - 2];
+
+        iow = malloc(sizeof(iow_t));
+        iow->source = &producer_wsource;
+        iow->data = p;
+
+        pthread_mutex_lock(&DATA(multi)->mutex);
+        p->next = DATA(multi)->producers;
+        DATA(multi)->producers = p;
+        pthread_mutex_unlock(&DATA(multi)->mutex);
+        return iow;
+}
+
+/* Hands the slice being filled over to the merging thread and, unless we are
+ * finished, waits for an empty one to fill next */
+static int producer_publish(struct multi_producer_t *p, bool last) {
+        iow_t *multi = p->multi;
+        struct multi_slice_t *slice = p->staging;
+
+        pthread_mutex_lock(&DATA(multi)->mutex);
+        if (slice->nrecords > 0 && slice->done == slice->nrecords) {
+                /* The merging thread has already written out everything in
+                 * it, so we can just start filling it again */
+                slice->len = 0;
+                slice->used = 0;
+                slice->nrecords = 0;
+                slice->done = 0;
+                if (last)
+                        p->staging = NULL;
+        } else if (slice->len > 0 || slice->nrecords > 0) {
+                slice->ticket = DATA(multi)->ticket++;
+                slice->next = NULL;
+                if (p->queue_tail)
+                        p->queue_tail->next = slice;
+                else
+                        p->queue = slice;
+                p->queue_tail = slice;
+                pthread_cond_signal(&DATA(multi)->data_ready);
+
+                p->staging = NULL;
+                while (!last && !p->free)
+                        pthread_cond_wait(&DATA(multi)->space_avail,
+                                          &DATA(multi)->mutex);
+                if (!last) {
+                        p->staging = p->free;
+                        p->free = p->staging->next;
+                        p->staging->len = 0;
+                        p->staging->used = 0;
+                        p->staging->nrecords = 0;
+                        p->staging->done = 0;
+                        p->staging->split = false;
+                }
+        }
+        if (DATA(multi)->error) {
+                errno = DATA(multi)->error;
+                pthread_mutex_unlock(&DATA(multi)->mutex);
+                return -1;
+        }
+        pthread_mutex_unlock(&DATA(multi)->mutex);
+        return 0;
+}
+
+/* Copies data into the slice being filled, handing slices over as they fill
+ * up. A write is only split across slices if it won't fit in one by itself.
+ * seq is only used in ordered mode */
+static int64_t producer_append(iow_t *iow, uint64_t seq, const char *buffer,
+                               int64_t len) {
+        struct multi_producer_t *p = PRODUCER(iow);
+        iow_t *multi = p->multi;
+        bool ordered = DATA(multi)->ordered;
+        struct multi_record_t *rec;
+        int64_t done = 0;
+        int64_t amount;
+
+        if ((p->staging->len > 0 &&
+             WANDIO_BUFFER_SIZE - p->staging->len < len) ||
+            (ordered && p->staging->nrecords == MULTI_RECORDS)) {
+                if (producer_publish(p, false) < 0)
+                        return -1;
+        }
+
+        /* Even an empty write uses up a sequence number */
+        do {
+                amount = WANDIO_BUFFER_SIZE - p->staging->len;
+                if (amount > len - done)
+                        amount = len - done;
+                memcpy(p->staging->buffer + p->staging->len, buffer + done,
+                       amount);
+                p->staging->len += amount;
+                if (ordered) {
+                        rec = &p->staging->records[p->staging->nrecords];
+                        rec->seq = seq;
+                        rec->len = amount;
+                        rec->partial = done + amount < len;
+                        /* The merging thread may take it from here on */
+                        __atomic_store_n(&p->staging->nrecords,
+                                         p->staging->nrecords + 1,
+                                         __ATOMIC_SEQ_CST);
+                }
+                done += amount;
+                if (done < len) {
+                        p->staging->split = true;
+                        if (producer_publish(p, false) < 0)
+                                return -1;
+                }
+        } while (done < len);
+
+        /* The merging thread may be waiting for this very write */
+        if (ordered && __atomic_load_n(&DATA(multi)->idle, __ATOMIC_SEQ_CST) &&
+            __atomic_load_n(&DATA(multi)->next_seq, __ATOMIC_SEQ_CST) == seq) {
+                pthread_mutex_lock(&DATA(multi)->mutex);
+                pthread_cond_signal(&DATA(multi)->data_ready);
+                pthread_mutex_unlock(&DATA(multi)->mutex);
+        }
+        return len;
+}
+
+int64_t multi_wwrite_seq(iow_t *iow, uint64_t seq, const void *buffer,
+                         int64_t len) {
+        if (iow->source != &producer_wsource) {
+                errno = ENOTSUP;
+                return -1;
+        }
+        if (!DATA(PRODUCER(iow)->multi)->ordered) {
+                errno = EINVAL;
+                return -1;
+        }
+        return producer_append(iow, seq, buffer, len);
+}
+
+static int64_t producer_wwrite(iow_t *iow, const char *buffer, int64_t len) {
+        /* Ordered mode needs a sequence number for every write */
+        if (DATA(PRODUCER(iow)->multi)->ordered) {
+                errno = EINVAL;
+                return -1;
+        }
+        return producer_append(iow, 0, buffer, len);
+}
+
+static int multi_request_flush(iow_t *multi) {
+        int ret = 0;
+
+        pthread_mutex_lock(&DATA(multi)->mutex);
+        DATA(multi)->flush = true;
+        pthread_cond_signal(&DATA(multi)->data_ready);
+        if (DATA(multi)->error) {
+                errno = DATA(multi)->error;
+                ret = -1;
+        }
+        pthread_mutex_unlock(&DATA(multi)->mutex);
+        return ret;
+}
+
+/* Hands over whatever this producer has written so far. As with the threaded
+ * writer, this doesn't wait for it to be written out */
+static int producer_wflush(iow_t *iow) {
+        if (producer_publish(PRODUCER(iow), false) < 0)
+                return -1;
+        return multi_request_flush(PRODUCER(iow)->multi);
+}
+
+static void producer_wclose(iow_t *iow) {
+        struct multi_producer_t *p = PRODUCER(iow);
+        iow_t *multi = p->multi;
+        struct multi_producer_t **prev;
+
+        producer_publish(p, true);
+
+        /* Anything we handed over still has to be written, so the merging
+         * thread frees the producer once it has finished with it */
+        pthread_mutex_lock(&DATA(multi)->mutex);
+        if (p->queue) {
+                p->detached = true;
+        } else {
+                for (prev = &DATA(multi)->producers; *prev != p;
+                     prev = &(*prev)->next)
+                        ;
+                *prev = p->next;
+                multi_free_producer(p);
+        }
+        pthread_mutex_unlock(&DATA(multi)->mutex);
+        free(iow);
+}
+
+/* Writes have to go through a producer */
+static int64_t multi_wwrite(iow_t *iow, const char *buffer, int64_t len) {
+        (void)iow;
+        (void)buffer;
+        (void)len;
+        errno = EINVAL;
+        return -1;
+}
+
+static int multi_wflush(iow_t *iow) {
+        return multi_request_flush(iow);
+}
+
+static void multi_wclose(iow_t *iow) {
+        struct multi_producer_t *p;
+
+        pthread_mutex_lock(&DATA(iow)->mutex);
+        DATA(iow)->closing = true;
+        pthread_cond_signal(&DATA(iow)->data_ready);
+        pthread_mutex_unlock(&DATA(iow)->mutex);
+        pthread_join(DATA(iow)->thread, NULL);
+
+        /* Every producer should have been destroyed by now, so these have
+         * all been detached */
+        while ((p = DATA(iow)->producers)) {
+                DATA(iow)->producers = p->next;
+                multi_free_producer(p);
+        }
+        wandio_wdestroy(DATA(iow)->child);
+        pthread_mutex_destroy(&DATA(iow)->mutex);
+        pthread_cond_destroy(&DATA(iow)->data_ready);
+        pthread_cond_destroy(&DATA(iow)->space_avail);
+        free(iow->data);
+        free(iow);
+}
+
+iow_source_t multi_wsource = {"multiw",     multi_wwrite, multi_wflush,
+                              multi_wclose, NULL,         NULL};
+
+iow_source_t producer_wsource = {"producerw",     producer_wwrite,
+                                 producer_wflush, producer_wclose,
+                                 NULL,            NULL};
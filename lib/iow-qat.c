@@ -218,4 +218,5 @@ static void qat_wclose(iow_t *iow) {
         free(iow);
 }
 
-iow_source_t qat_wsource = {"qatw", qat_wwrite, qat_wflush, qat_wclose};
+iow_source_t qat_wsource = {"qatw", qat_wwrite, qat_wflush,
+                            qat_wclose, NULL, NULL};
@@ -0,0 +1,283 @@
+/*
+ *
+ * Copyright (c) 2007-2019 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libwandio.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libwandio is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwandio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "wandio.h"
+#include "wandio_internal.h"
+#ifdef HAVE_SYS_PRCTL_H
+#include <sys/prctl.h>
+#endif
+
+/* Libwandio IO module implementing a writer that moves from one file to the
+ * next, e.g. to split a long capture into a file per hour.
+ *
+ * Opening a file and finishing one off (which means compressing and writing
+ * out everything that is still buffered) can both take a while, so neither
+ * is done by the caller. The next file is opened by a background thread as
+ * soon as the caller names it, and when the caller says to rotate, the old
+ * file is handed to the same thread to close. All the caller has to do is
+ * swap one writer for the other, so it only has to wait if the next file
+ * hasn't finished opening yet.
+ */
+
+extern iow_source_t rotate_wsource;
+
+/* A file that has been rotated out and is waiting to be closed */
+struct retired_t {
+        iow_t *iow;
+        struct retired_t *next;
+};
+
+struct rotatew_t {
+        /* How to create each file */
+        int compress_type;
+        int compression_level;
+        int flags;
+        struct wandio_wopt *opts;
+        /* The file being written, which only the caller uses */
+        iow_t *current;
+        /* Everything below is shared with the background thread */
+        pthread_t thread;
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        /* The name of the next file, which is being opened if opening is
+         * set and is ready to use if next is set */
+        char *next_name;
+        bool opening;
+        iow_t *next;
+        /* The next file could not be opened */
+        bool failed;
+        /* Files waiting to be closed, oldest first */
+        struct retired_t *retired;
+        struct retired_t *retired_tail;
+        /* The thread should exit once it has nothing left to do */
+        bool closing;
+};
+
+#define DATA(iow) ((struct rotatew_t *)((iow)->data))
+
+/* The background thread, which opens and closes files for the caller */
+static void *rotate_thread(void *userdata) {
+        iow_t *iow = (iow_t *)userdata;
+        struct retired_t *old;
+        iow_t *next;
+
+#ifdef PR_SET_NAME
+        prctl(PR_SET_NAME, "wandio [rotate]", 0, 0, 0);
+#endif
+
+        pthread_mutex_lock(&DATA(iow)->mutex);
+        while (true) {
+                /* The caller may be waiting for the next file, so that
+                 * comes first */
+                if (DATA(iow)->opening) {
+                        pthread_mutex_unlock(&DATA(iow)->mutex);
+                        next = wandio_wcreate_opts(
+                            DATA(iow)->next_name, DATA(iow)->compress_type,
+                            DATA(iow)->compression_level, DATA(iow)->flags,
+                            DATA(iow)->opts);
+                        pthread_mutex_lock(&DATA(iow)->mutex);
+                        DATA(iow)->next = next;
+                        DATA(iow)->failed = next == NULL;
+                        DATA(iow)->opening = false;
+                        pthread_cond_broadcast(&DATA(iow)->cond);
+                        continue;
+                }
+                if (DATA(iow)->retired) {
+                        old = DATA(iow)->retired;
+                        DATA(iow)->retired = old->next;
+                        if (!DATA(iow)->retired)
+                                DATA(iow)->retired_tail = NULL;
+                        pthread_mutex_unlock(&DATA(iow)->mutex);
+                        wandio_wdestroy(old->iow);
+                        free(old);
+                        pthread_mutex_lock(&DATA(iow)->mutex);
+                        continue;
+                }
+                if (DATA(iow)->closing)
+                        break;
+                pthread_cond_wait(&DATA(iow)->cond, &DATA(iow)->mutex);
+        }
+        pthread_mutex_unlock(&DATA(iow)->mutex);
+        return NULL;
+}
+
+/* Queues a file to be closed by the background thread. Must be called with
+ * the mutex held */
+static int rotate_retire(iow_t *iow, iow_t *old) {
+        struct retired_t *entry = malloc(sizeof(struct retired_t));
+
+        if (!entry)
+                return -1;
+        entry->iow = old;
+        entry->next = NULL;
+        if (DATA(iow)->retired_tail)
+                DATA(iow)->retired_tail->next = entry;
+        else
+                DATA(iow)->retired = entry;
+        DATA(iow)->retired_tail = entry;
+        pthread_cond_signal(&DATA(iow)->cond);
+        return 0;
+}
+
+static void rotate_free(iow_t *iow) {
+        pthread_mutex_destroy(&DATA(iow)->mutex);
+        pthread_cond_destroy(&DATA(iow)->cond);
+        free(DATA(iow)->opts);
+        free(DATA(iow)->next_name);
+        free(iow->data);
+        free(iow);
+}
+
+DLLEXPORT iow_t *rotate_wopen(const char *filename, int compress_type,
+                              int compression_level, int flags,
+                              const struct wandio_wopt *opts) {
+        iow_t *iow;
+        int count = 0;
+
+        iow = malloc(sizeof(iow_t));
+        iow->source = &rotate_wsource;
+        iow->data = calloc(1, sizeof(struct rotatew_t));
+        DATA(iow)->compress_type = compress_type;
+        DATA(iow)->compression_level = compression_level;
+        DATA(iow)->flags = flags;
+        pthread_mutex_init(&DATA(iow)->mutex, NULL);
+        pthread_cond_init(&DATA(iow)->cond, NULL);
+
+        /* Every file is created with the same options, so keep a copy */
+        if (opts) {
+                while (opts[count].option != WANDIO_WOPT_END)
+                        count++;
+                DATA(iow)->opts =
+                    malloc((count + 1) * sizeof(struct wandio_wopt));
+                memcpy(DATA(iow)->opts, opts,
+                       (count + 1) * sizeof(struct wandio_wopt));
+        }
+
+        DATA(iow)->current = wandio_wcreate_opts(
+            filename, compress_type, compression_level, flags, opts);
+        if (!DATA(iow)->current) {
+                rotate_free(iow);
+                return NULL;
+        }
+
+        if (wandio_thread_create(&DATA(iow)->thread, rotate_thread, iow) !=
+            0) {
+                wandio_wdestroy(DATA(iow)->current);
+                rotate_free(iow);
+                return NULL;
+        }
+        return iow;
+}
+
+int rotate_wprepare(iow_t *iow, const char *filename) {
+        if (iow->source != &rotate_wsource) {
+                errno = ENOTSUP;
+                return -1;
+        }
+
+        pthread_mutex_lock(&DATA(iow)->mutex);
+        /* Only one file can be waiting in the wings at a time */
+        if (DATA(iow)->opening || DATA(iow)->next) {
+                pthread_mutex_unlock(&DATA(iow)->mutex);
+                errno = EBUSY;
+                return -1;
+        }
+        free(DATA(iow)->next_name);
+        DATA(iow)->next_name = strdup(filename);
+        DATA(iow)->failed = false;
+        DATA(iow)->opening = true;
+        pthread_cond_signal(&DATA(iow)->cond);
+        pthread_mutex_unlock(&DATA(iow)->mutex);
+        return 0;
+}
+
+int rotate_wrotate(iow_t *iow) {
+        if (iow->source != &rotate_wsource) {
+                errno = ENOTSUP;
+                return -1;
+        }
+
+        pthread_mutex_lock(&DATA(iow)->mutex);
+        while (DATA(iow)->opening)
+                pthread_cond_wait(&DATA(iow)->cond, &DATA(iow)->mutex);
+        if (!DATA(iow)->next) {
+                /* Either there was nothing to rotate to, or it couldn't be
+                 * opened, in which case we carry on with the current file */
+                errno = DATA(iow)->failed ? EIO : EINVAL;
+                DATA(iow)->failed = false;
+                pthread_mutex_unlock(&DATA(iow)->mutex);
+                return -1;
+        }
+        if (rotate_retire(iow, DATA(iow)->current) < 0) {
+                pthread_mutex_unlock(&DATA(iow)->mutex);
+                return -1;
+        }
+        DATA(iow)->current = DATA(iow)->next;
+        DATA(iow)->next = NULL;
+        pthread_mutex_unlock(&DATA(iow)->mutex);
+        return 0;
+}
+
+static int64_t rotate_wwrite(iow_t *iow, const char *buffer, int64_t len) {
+        return wandio_wwrite(DATA(iow)->current, buffer, len);
+}
+
+static int rotate_wflush(iow_t *iow) {
+        return wandio_wflush(DATA(iow)->current);
+}
+
+static void rotate_wclose(iow_t *iow) {
+        pthread_mutex_lock(&DATA(iow)->mutex);
+        /* The last file is closed alongside any others that are still
+         * being finished off, and we wait for all of them */
+        if (rotate_retire(iow, DATA(iow)->current) < 0) {
+                pthread_mutex_unlock(&DATA(iow)->mutex);
+                wandio_wdestroy(DATA(iow)->current);
+                pthread_mutex_lock(&DATA(iow)->mutex);
+        }
+        DATA(iow)->closing = true;
+        pthread_cond_signal(&DATA(iow)->cond);
+        pthread_mutex_unlock(&DATA(iow)->mutex);
+        pthread_join(DATA(iow)->thread, NULL);
+
+        /* A file that was opened but never rotated to has nothing in it
+         * that anyone asked for */
+        if (DATA(iow)->next) {
+                wandio_wdestroy(DATA(iow)->next);
+                unlink(DATA(iow)->next_name);
+        }
+        rotate_free(iow);
+}
+
+iow_source_t rotate_wsource = {"rotatew",     rotate_wwrite, rotate_wflush,
+                               rotate_wclose, NULL,          NULL};
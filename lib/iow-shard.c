@@ -0,0 +1,154 @@
+/*
+ *
+ * Copyright (c) 2007-2019 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libwandio.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libwandio is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwandio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wandio.h"
+#include "wandio_internal.h"
+
+/* Libwandio IO module implementing a writer that spreads one stream across
+ * several files, e.g. one per disk, so that each file only has to keep up
+ * with part of the data.
+ *
+ * Each write goes to one of the files in turn, or to the file picked by a
+ * key that the caller gives. Each file is an ordinary compressed file with
+ * its own writer (and so its own thread, if threads are enabled), but every
+ * write is stored with its position in the stream, so that the sharded
+ * reader can put the stream back together.
+ */
+
+extern iow_source_t shard_wsource;
+
+struct shardw_t {
+        iow_t **shards;
+        int count;
+        /* The shard that the next write goes to if no key is given */
+        int next;
+        /* The position of the next write in the stream */
+        uint64_t seq;
+};
+
+#define DATA(iow) ((struct shardw_t *)((iow)->data))
+
+static void shard_wfree(iow_t *iow) {
+        int i;
+
+        for (i = 0; i < DATA(iow)->count; i++) {
+                if (DATA(iow)->shards[i])
+                        wandio_wdestroy(DATA(iow)->shards[i]);
+        }
+        free(DATA(iow)->shards);
+        free(iow->data);
+        free(iow);
+}
+
+DLLEXPORT iow_t *shard_wopen(const char *const *filenames, int count,
+                             int compress_type, int compression_level,
+                             int flags, const struct wandio_wopt *opts) {
+        iow_t *iow;
+        int i;
+
+        if (count <= 0) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        iow = malloc(sizeof(iow_t));
+        iow->source = &shard_wsource;
+        iow->data = calloc(1, sizeof(struct shardw_t));
+        DATA(iow)->count = count;
+        DATA(iow)->shards = calloc(count, sizeof(iow_t *));
+
+        for (i = 0; i < count; i++) {
+                DATA(iow)->shards[i] = wandio_wcreate_opts(
+                    filenames[i], compress_type, compression_level, flags,
+                    opts);
+                if (!DATA(iow)->shards[i] ||
+                    wandio_wwrite(DATA(iow)->shards[i], SHARD_MAGIC,
+                                  SHARD_MAGIC_SIZE) != SHARD_MAGIC_SIZE) {
+                        shard_wfree(iow);
+                        return NULL;
+                }
+        }
+        return iow;
+}
+
+/* Writes a buffer to one of the shards, along with its position */
+static int64_t shard_wput(iow_t *iow, int shard, const void *buffer,
+                          int64_t len) {
+        unsigned char header[SHARD_HEADER_SIZE];
+        uint64_t seq = DATA(iow)->seq;
+        int i;
+
+        for (i = 0; i < 8; i++) {
+                header[i] = (unsigned char)(seq >> (8 * i));
+                header[8 + i] = (unsigned char)((uint64_t)len >> (8 * i));
+        }
+        if (wandio_wwrite(DATA(iow)->shards[shard], header,
+                          SHARD_HEADER_SIZE) != SHARD_HEADER_SIZE)
+                return -1;
+        if (len > 0 &&
+            wandio_wwrite(DATA(iow)->shards[shard], buffer, len) != len)
+                return -1;
+        DATA(iow)->seq++;
+        return len;
+}
+
+int64_t shard_wwrite_key(iow_t *iow, uint64_t key, const void *buffer,
+                         int64_t len) {
+        if (iow->source != &shard_wsource) {
+                errno = ENOTSUP;
+                return -1;
+        }
+        return shard_wput(iow, key % DATA(iow)->count, buffer, len);
+}
+
+static int64_t shard_wwrite(iow_t *iow, const char *buffer, int64_t len) {
+        int shard = DATA(iow)->next;
+
+        DATA(iow)->next = (shard + 1) % DATA(iow)->count;
+        return shard_wput(iow, shard, buffer, len);
+}
+
+static int shard_wflush(iow_t *iow) {
+        int ret = 0;
+        int i;
+
+        for (i = 0; i < DATA(iow)->count; i++) {
+                if (wandio_wflush(DATA(iow)->shards[i]) < 0)
+                        ret = -1;
+        }
+        return ret;
+}
+
+static void shard_wclose(iow_t *iow) {
+        shard_wfree(iow);
+}
+
+iow_source_t shard_wsource = {"shardw",     shard_wwrite, shard_wflush,
+                              shard_wclose, NULL,         NULL};
@@ -27,6 +27,7 @@
 #define _GNU_SOURCE 1
 #include "config.h"
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
@@ -38,6 +39,20 @@
 #include "wandio_internal.h"
 
 /* Libwandio IO module implementing a standard IO writer, i.e. no decompression
+ *
+ * In streaming mode, we start writeback as soon as a window of data has been
+ * written and drop the window before it from the page cache once it has made
+ * it to disk, so writing a huge file doesn't build up a backlog of dirty
+ * pages or push everything else out of memory.
+ *
+ * With O_DIRECT, data is gathered into an aligned staging buffer and written
+ * out a whole buffer at a time. Flushing writes a final partial block padded
+ * out to the block size and truncates the file back to the real length,
+ * keeping the partial block staged so that it is rewritten in full next
+ * time. That way O_DIRECT stays on for the life of the file.
+ *
+ * If the writeback or datasync options are set, a background thread keeps
+ * the amount of dirty data behind regular files in check as well.
  */
 
 enum { MIN_WRITE_SIZE = 4096 };
@@ -46,13 +61,29 @@ struct stdiow_t {
         char buffer[MIN_WRITE_SIZE];
         int offset;
         int fd;
+        bool streaming;
+        /* Number of bytes written to the file */
+        int64_t written;
+        /* Writeback has been started for everything before here */
+        int64_t synced;
+        /* Everything before here has been dropped from the page cache */
+        int64_t dropped;
+        bool direct;
+        /* Aligned buffer holding staged bytes for O_DIRECT, which belong at
+         * file offset direct_offset */
+        char *staging;
+        int64_t staged;
+        int64_t direct_offset;
+        struct wandio_writeback_t *writeback;
+        /* Space has been allocated for the file up to here, or -1 */
+        int64_t allocated;
 };
 
 extern iow_source_t stdio_wsource;
 
 #define DATA(iow) ((struct stdiow_t *)((iow)->data))
 
-static int safe_open(const char *filename, int flags) {
+int wandio_safe_open(const char *filename, int flags) {
         int fd = -1;
         uid_t userid = 0;
         gid_t groupid = 0;
@@ -96,27 +127,119 @@ static int safe_open(const char *filename, int flags) {
         return fd;
 }
 
+int64_t wandio_prealloc(int fd, int64_t allocated, int64_t end) {
+#ifdef HAVE_FALLOCATE
+        int64_t chunk = (int64_t)prealloc_mb * 1024 * 1024;
+
+        while (allocated >= 0 && allocated < end) {
+                if (fallocate(fd, FALLOC_FL_KEEP_SIZE, allocated, chunk) < 0)
+                        return -1;
+                allocated += chunk;
+        }
+        return allocated;
+#else
+        (void)fd;
+        (void)allocated;
+        (void)end;
+        return -1;
+#endif
+}
+
+void wandio_prealloc_trim(int fd, int64_t allocated) {
+        struct stat st;
+
+        /* Truncating a file to its own length frees the blocks past the
+         * end */
+        if (allocated > 0 && fstat(fd, &st) == 0 && st.st_size < allocated)
+                ftruncate(fd, st.st_size);
+}
+
 DLLEXPORT iow_t *stdio_wopen(const char *filename, int flags) {
         iow_t *iow = malloc(sizeof(iow_t));
+        struct stat st;
+        int fl;
         iow->source = &stdio_wsource;
-        iow->data = malloc(sizeof(struct stdiow_t));
+        iow->data = calloc(1, sizeof(struct stdiow_t));
 
         if (strcmp(filename, "-") == 0)
                 DATA(iow)->fd = 1; /* STDOUT */
         else {
-                DATA(iow)->fd = safe_open(filename, flags);
+                DATA(iow)->fd = wandio_safe_open(filename, flags);
         }
 
         if (DATA(iow)->fd == -1) {
+                free(iow->data);
                 free(iow);
                 return NULL;
         }
 
-        DATA(iow)->offset = 0;
+#ifdef O_DIRECT
+        /* Appending would stop us from rewriting the last block */
+        fl = fcntl(DATA(iow)->fd, F_GETFL);
+        if (fl != -1 && (fl & O_DIRECT) != 0) {
+                if ((fl & O_APPEND) == 0)
+                        DATA(iow)->staging =
+                            wandio_alloc_buffer(WANDIO_BUFFER_SIZE);
+                if (DATA(iow)->staging) {
+                        DATA(iow)->direct = true;
+                        DATA(iow)->direct_offset =
+                            lseek(DATA(iow)->fd, 0, SEEK_CUR);
+                } else {
+                        fcntl(DATA(iow)->fd, F_SETFL, fl & ~O_DIRECT);
+                }
+        }
+#endif
+
+        /* Pipes have no page cache to manage, and nor does O_DIRECT */
+        DATA(iow)->allocated = -1;
+        if (fstat(DATA(iow)->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+                DATA(iow)->streaming = use_streaming && !DATA(iow)->direct;
+                if (prealloc_mb > 0)
+                        DATA(iow)->allocated = st.st_size;
+                DATA(iow)->writeback = wandio_writeback_start(DATA(iow)->fd);
+        }
 
         return iow;
 }
 
+/* Drops everything that has been written from the page cache, once it is
+ * safely on disk */
+static void stdio_wdrop(iow_t *iow, int64_t end) {
+        if (end <= DATA(iow)->dropped)
+                return;
+#ifdef HAVE_SYNC_FILE_RANGE
+        sync_file_range(DATA(iow)->fd, DATA(iow)->dropped,
+                        end - DATA(iow)->dropped,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                            SYNC_FILE_RANGE_WAIT_AFTER);
+#else
+        fdatasync(DATA(iow)->fd);
+#endif
+#ifdef HAVE_POSIX_FADVISE
+        posix_fadvise(DATA(iow)->fd, DATA(iow)->dropped,
+                      end - DATA(iow)->dropped, POSIX_FADV_DONTNEED);
+#endif
+        DATA(iow)->dropped = end;
+}
+
+/* Starts writeback of each window as soon as it is complete, then waits for
+ * the previous one to finish and drops it. That keeps at most two windows of
+ * the file in the page cache, and the disk busy in the meantime */
+static void stdio_wstream(iow_t *iow, int64_t amount) {
+        DATA(iow)->written += amount;
+        wandio_writeback_note(DATA(iow)->writeback, DATA(iow)->written);
+        if (!DATA(iow)->streaming ||
+            DATA(iow)->written - DATA(iow)->synced < WANDIO_STREAM_WINDOW)
+                return;
+#ifdef HAVE_SYNC_FILE_RANGE
+        sync_file_range(DATA(iow)->fd, DATA(iow)->synced,
+                        DATA(iow)->written - DATA(iow)->synced,
+                        SYNC_FILE_RANGE_WRITE);
+#endif
+        stdio_wdrop(iow, DATA(iow)->synced);
+        DATA(iow)->synced = DATA(iow)->written;
+}
+
 #define min(a, b) ((a) < (b) ? (a) : (b))
 #define max(a, b) ((a) > (b) ? (a) : (b))
 /* Round A Down to the nearest multiple of B */
@@ -129,8 +252,90 @@ DLLEXPORT iow_t *stdio_wopen(const char *filename, int flags) {
  * Since most writes are likely to be larger than MIN_WRITE_SIZE optimise for
  * that case.
  */
+/* Writes len bytes of staged data, which must be a multiple of
+ * MIN_WRITE_SIZE, at the staged offset */
+static int stdio_wdirect(iow_t *iow, int64_t len) {
+        int64_t done = 0;
+
+        DATA(iow)->allocated =
+            wandio_prealloc(DATA(iow)->fd, DATA(iow)->allocated,
+                            DATA(iow)->direct_offset + len);
+        while (done < len) {
+                int64_t ret =
+                    pwrite(DATA(iow)->fd, DATA(iow)->staging + done, len - done,
+                           DATA(iow)->direct_offset + done);
+                if (ret == -1 && errno == EINTR)
+                        continue;
+                if (ret <= 0)
+                        return -1;
+                done += ret;
+        }
+        return 0;
+}
+
+static int64_t stdio_wwrite_direct(iow_t *iow, const char *buffer,
+                                   int64_t len) {
+        int64_t done = 0;
+
+        while (done < len) {
+                int64_t amount =
+                    min(len - done, WANDIO_BUFFER_SIZE - DATA(iow)->staged);
+
+                memcpy(DATA(iow)->staging + DATA(iow)->staged, buffer + done,
+                       amount);
+                DATA(iow)->staged += amount;
+                done += amount;
+                if (DATA(iow)->staged == WANDIO_BUFFER_SIZE) {
+                        if (stdio_wdirect(iow, WANDIO_BUFFER_SIZE) < 0)
+                                return -1;
+                        DATA(iow)->direct_offset += WANDIO_BUFFER_SIZE;
+                        DATA(iow)->staged = 0;
+                        wandio_writeback_note(DATA(iow)->writeback,
+                                              DATA(iow)->direct_offset);
+                }
+        }
+        return len;
+}
+
+/* Writes out everything that has been staged. The final partial block is
+ * padded out to the block size, which is then cut off the end of the file
+ * again, and is kept so it can be completed by later writes */
+static int stdio_wflush_direct(iow_t *iow) {
+        int64_t whole = rounddown(DATA(iow)->staged, MIN_WRITE_SIZE);
+        int64_t tail = DATA(iow)->staged - whole;
+        int64_t padded = tail ? whole + MIN_WRITE_SIZE : whole;
+        int64_t end = DATA(iow)->direct_offset + DATA(iow)->staged;
+
+        if (padded == 0)
+                return 0;
+        memset(DATA(iow)->staging + DATA(iow)->staged, 0,
+               padded - DATA(iow)->staged);
+        if (stdio_wdirect(iow, padded) < 0)
+                return -1;
+        wandio_writeback_note(DATA(iow)->writeback, end);
+        if (tail) {
+                if (ftruncate(DATA(iow)->fd, end) < 0)
+                        return -1;
+                /* That also freed the space set aside past the end, so set
+                 * it aside again rather than growing a write at a time */
+                if (DATA(iow)->allocated > end)
+                        DATA(iow)->allocated =
+                            wandio_prealloc(DATA(iow)->fd, end,
+                                            DATA(iow)->allocated);
+        }
+
+        memmove(DATA(iow)->staging, DATA(iow)->staging + whole, tail);
+        DATA(iow)->direct_offset += whole;
+        DATA(iow)->staged = tail;
+        return 0;
+}
+
 static int64_t stdio_wwrite(iow_t *iow, const char *buffer, int64_t len) {
         int towrite = len;
+
+        if (DATA(iow)->direct)
+                return stdio_wwrite_direct(iow, buffer, len);
+
         /* Round down size to the nearest multiple of MIN_WRITE_SIZE */
 
         assert(towrite >= 0);
@@ -161,9 +366,13 @@ static int64_t stdio_wwrite(iow_t *iow, const char *buffer, int64_t len) {
                         ++count;
                 }
                 assert(amount == 0);
+                DATA(iow)->allocated =
+                    wandio_prealloc(DATA(iow)->fd, DATA(iow)->allocated,
+                                    DATA(iow)->written + total);
                 err = writev(DATA(iow)->fd, iov, count);
                 if (err == -1)
                         return -1;
+                stdio_wstream(iow, err);
 
                 /* Drop off "err" bytes from the beginning of the buffers */
                 amount = min(DATA(iow)->offset,
@@ -200,6 +409,9 @@ static int64_t stdio_wwrite(iow_t *iow, const char *buffer, int64_t len) {
 static int stdio_wflush(iow_t *iow) {
 
         int err;
+
+        if (DATA(iow)->direct)
+                return stdio_wflush_direct(iow);
         /* Now, there might be some non multiple of the direct filesize left
          * over, if so turn off O_DIRECT and write the final chunk.
          */
@@ -212,16 +424,33 @@ static int stdio_wflush(iow_t *iow) {
         }
 #endif
         err = write(DATA(iow)->fd, DATA(iow)->buffer, DATA(iow)->offset);
+        if (err > 0)
+                stdio_wstream(iow, err);
         DATA(iow)->offset = 0;
         return err;
 }
 
+static int stdio_wget_fd(iow_t *iow) {
+        /* Writing straight to the file would make a mess of our staged
+         * partial block */
+        if (DATA(iow)->direct)
+                return -1;
+        if (DATA(iow)->offset > 0 && stdio_wflush(iow) < 0)
+                return -1;
+        return DATA(iow)->fd;
+}
+
 static void stdio_wclose(iow_t *iow) {
         stdio_wflush(iow);
+        if (DATA(iow)->streaming)
+                stdio_wdrop(iow, DATA(iow)->written);
+        wandio_prealloc_trim(DATA(iow)->fd, DATA(iow)->allocated);
+        wandio_writeback_stop(DATA(iow)->writeback);
         close(DATA(iow)->fd);
+        wandio_free_buffer(DATA(iow)->staging);
         free(iow->data);
         free(iow);
 }
 
-iow_source_t stdio_wsource = {"stdiow", stdio_wwrite, stdio_wflush,
-                              stdio_wclose};
+iow_source_t stdio_wsource = {"stdiow",     stdio_wwrite, stdio_wflush,
+                              stdio_wclose, NULL,         stdio_wget_fd};
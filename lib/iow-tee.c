@@ -0,0 +1,309 @@
+/*
+ *
+ * Copyright (c) 2007-2019 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libwandio.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libwandio is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwandio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wandio.h"
+#include "wandio_internal.h"
+#ifdef HAVE_SYS_PRCTL_H
+#include <sys/prctl.h>
+#endif
+
+/* Libwandio IO module implementing a writer that sends the same data to
+ * several files, e.g. a fast lz4 copy for live tools alongside a zstd copy
+ * for the archive.
+ *
+ * The caller's data is copied once, into a ring of slices shared by every
+ * branch. Each branch has its own thread that feeds the slices, in order,
+ * to its own compressor and file, so the branches compress in parallel
+ * rather than one after the other. A slice is only reused once every branch
+ * has finished with it, so the slowest branch sets the pace.
+ */
+
+/* Number of slices in the ring */
+#define TEE_SLICES 8
+
+extern iow_source_t tee_wsource;
+
+enum tee_kind_t {
+        TEE_DATA,
+        TEE_FLUSH,
+        TEE_END,
+};
+
+struct tee_slice_t {
+        char *buffer;
+        int64_t len;
+        enum tee_kind_t kind;
+        /* Number of branches that haven't finished with the slice yet */
+        int refs;
+};
+
+struct tee_branch_t {
+        iow_t *tee;
+        /* The branch's own writer, which only its thread uses */
+        iow_t *iow;
+        pthread_t thread;
+        /* Number of the next slice for this branch to write */
+        uint64_t next;
+};
+
+struct teew_t {
+        struct tee_branch_t *branches;
+        int count;
+        struct tee_slice_t slices[TEE_SLICES];
+        char *buffers;
+        pthread_mutex_t mutex;
+        pthread_cond_t data_ready;
+        pthread_cond_t space_avail;
+        /* Number of the slice being filled by the caller */
+        uint64_t head;
+        /* errno from the first branch that failed, which is reported by the
+         * next call */
+        int error;
+};
+
+#define DATA(iow) ((struct teew_t *)((iow)->data))
+#define SLICE(iow, seq) (DATA(iow)->slices[(seq) % TEE_SLICES])
+
+/* The thread for a single branch, which writes each slice to the branch's
+ * writer as it is published */
+static void *tee_thread(void *userdata) {
+        struct tee_branch_t *branch = (struct tee_branch_t *)userdata;
+        iow_t *iow = branch->tee;
+        struct tee_slice_t *slice;
+        enum tee_kind_t kind;
+        bool failed = false;
+        int ret;
+
+#ifdef PR_SET_NAME
+        prctl(PR_SET_NAME, "wandio [tee]", 0, 0, 0);
+#endif
+
+        do {
+                pthread_mutex_lock(&DATA(iow)->mutex);
+                while (branch->next == DATA(iow)->head)
+                        pthread_cond_wait(&DATA(iow)->data_ready,
+                                          &DATA(iow)->mutex);
+                pthread_mutex_unlock(&DATA(iow)->mutex);
+
+                /* The slice can't change until we drop our reference */
+                slice = &SLICE(iow, branch->next);
+                kind = slice->kind;
+                ret = 0;
+                if (failed) {
+                        /* Keep consuming slices so the other branches can
+                         * carry on */
+                } else if (kind == TEE_DATA) {
+                        if (wandio_wwrite(branch->iow, slice->buffer,
+                                          slice->len) != slice->len)
+                                ret = -1;
+                } else if (kind == TEE_FLUSH) {
+                        ret = wandio_wflush(branch->iow);
+                }
+
+                pthread_mutex_lock(&DATA(iow)->mutex);
+                if (ret < 0) {
+                        failed = true;
+                        if (!DATA(iow)->error)
+                                DATA(iow)->error = errno ? errno : EIO;
+                }
+                branch->next++;
+                if (--slice->refs == 0)
+                        pthread_cond_signal(&DATA(iow)->space_avail);
+                pthread_mutex_unlock(&DATA(iow)->mutex);
+        } while (kind != TEE_END);
+
+        return NULL;
+}
+
+static void tee_free(iow_t *iow) {
+        int i;
+
+        for (i = 0; i < DATA(iow)->count; i++) {
+                if (DATA(iow)->branches[i].iow)
+                        wandio_wdestroy(DATA(iow)->branches[i].iow);
+        }
+        pthread_mutex_destroy(&DATA(iow)->mutex);
+        pthread_cond_destroy(&DATA(iow)->data_ready);
+        pthread_cond_destroy(&DATA(iow)->space_avail);
+        wandio_free_buffer(DATA(iow)->buffers);
+        free(DATA(iow)->branches);
+        free(iow->data);
+        free(iow);
+}
+
+/* Hands the current slice to every branch and waits until the next one is
+ * free to be filled. Must be called with the mutex held */
+static void tee_publish(iow_t *iow, enum tee_kind_t kind) {
+        SLICE(iow, DATA(iow)->head).kind = kind;
+        SLICE(iow, DATA(iow)->head).refs = DATA(iow)->count;
+        DATA(iow)->head++;
+        pthread_cond_broadcast(&DATA(iow)->data_ready);
+
+        while (SLICE(iow, DATA(iow)->head).refs > 0)
+                pthread_cond_wait(&DATA(iow)->space_avail, &DATA(iow)->mutex);
+        SLICE(iow, DATA(iow)->head).len = 0;
+}
+
+/* Stops the branch threads, once they have written everything they have
+ * been given. Must be called with the mutex held */
+static void tee_stop(iow_t *iow, int started) {
+        int i;
+
+        /* Nothing else will be published, so we don't need to wait for the
+         * slice after this one */
+        SLICE(iow, DATA(iow)->head).kind = TEE_END;
+        SLICE(iow, DATA(iow)->head).refs = started;
+        DATA(iow)->head++;
+        pthread_cond_broadcast(&DATA(iow)->data_ready);
+        pthread_mutex_unlock(&DATA(iow)->mutex);
+
+        for (i = 0; i < started; i++)
+                pthread_join(DATA(iow)->branches[i].thread, NULL);
+        pthread_mutex_lock(&DATA(iow)->mutex);
+}
+
+DLLEXPORT iow_t *tee_wopen(const struct wandio_branch *branches, int count) {
+        iow_t *iow;
+        int i;
+
+        if (count <= 0) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        iow = malloc(sizeof(iow_t));
+        iow->source = &tee_wsource;
+        iow->data = calloc(1, sizeof(struct teew_t));
+        DATA(iow)->count = count;
+        DATA(iow)->branches = calloc(count, sizeof(struct tee_branch_t));
+        pthread_mutex_init(&DATA(iow)->mutex, NULL);
+        pthread_cond_init(&DATA(iow)->data_ready, NULL);
+        pthread_cond_init(&DATA(iow)->space_avail, NULL);
+
+        DATA(iow)->buffers =
+            wandio_alloc_buffer((size_t)TEE_SLICES * WANDIO_BUFFER_SIZE);
+        if (!DATA(iow)->buffers) {
+                tee_free(iow);
+                return NULL;
+        }
+        for (i = 0; i < TEE_SLICES; i++) {
+                DATA(iow)->slices[i].buffer =
+                    DATA(iow)->buffers + (size_t)i * WANDIO_BUFFER_SIZE;
+        }
+
+        /* Each branch already has a thread of its own, so there is no need
+         * for a threaded writer on top of it */
+        for (i = 0; i < count; i++) {
+                DATA(iow)->branches[i].tee = iow;
+                DATA(iow)->branches[i].iow = wandio_wcreate_unthreaded(
+                    branches[i].filename, branches[i].compression_type,
+                    branches[i].compression_level, branches[i].flags,
+                    branches[i].opts);
+                if (!DATA(iow)->branches[i].iow) {
+                        tee_free(iow);
+                        return NULL;
+                }
+        }
+
+        for (i = 0; i < count; i++) {
+                if (wandio_thread_create(&DATA(iow)->branches[i].thread,
+                                         tee_thread,
+                                         &DATA(iow)->branches[i]) != 0) {
+                        pthread_mutex_lock(&DATA(iow)->mutex);
+                        tee_stop(iow, i);
+                        pthread_mutex_unlock(&DATA(iow)->mutex);
+                        tee_free(iow);
+                        return NULL;
+                }
+        }
+        return iow;
+}
+
+static int64_t tee_wwrite(iow_t *iow, const char *buffer, int64_t len) {
+        struct tee_slice_t *slice;
+        int64_t done = 0;
+        int64_t amount;
+
+        pthread_mutex_lock(&DATA(iow)->mutex);
+        while (done < len) {
+                if (DATA(iow)->error) {
+                        errno = DATA(iow)->error;
+                        pthread_mutex_unlock(&DATA(iow)->mutex);
+                        return -1;
+                }
+
+                /* The slice being filled belongs to us alone, so copy into
+                 * it without holding the lock */
+                pthread_mutex_unlock(&DATA(iow)->mutex);
+                slice = &SLICE(iow, DATA(iow)->head);
+                amount = WANDIO_BUFFER_SIZE - slice->len;
+                if (amount > len - done)
+                        amount = len - done;
+                memcpy(slice->buffer + slice->len, buffer + done, amount);
+                slice->len += amount;
+                done += amount;
+                pthread_mutex_lock(&DATA(iow)->mutex);
+
+                if (slice->len == WANDIO_BUFFER_SIZE)
+                        tee_publish(iow, TEE_DATA);
+        }
+        pthread_mutex_unlock(&DATA(iow)->mutex);
+        return len;
+}
+
+/* Like the threaded writer, this doesn't wait for the branches to finish
+ * flushing, but any error they hit is reported by a later call */
+static int tee_wflush(iow_t *iow) {
+        pthread_mutex_lock(&DATA(iow)->mutex);
+        if (DATA(iow)->error) {
+                errno = DATA(iow)->error;
+                pthread_mutex_unlock(&DATA(iow)->mutex);
+                return -1;
+        }
+        if (SLICE(iow, DATA(iow)->head).len > 0)
+                tee_publish(iow, TEE_DATA);
+        tee_publish(iow, TEE_FLUSH);
+        pthread_mutex_unlock(&DATA(iow)->mutex);
+        return 0;
+}
+
+static void tee_wclose(iow_t *iow) {
+        pthread_mutex_lock(&DATA(iow)->mutex);
+        if (SLICE(iow, DATA(iow)->head).len > 0)
+                tee_publish(iow, TEE_DATA);
+        tee_stop(iow, DATA(iow)->count);
+        pthread_mutex_unlock(&DATA(iow)->mutex);
+        tee_free(iow);
+}
+
+iow_source_t tee_wsource = {"teew",     tee_wwrite, tee_wflush,
+                            tee_wclose, NULL,       NULL};
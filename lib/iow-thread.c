@@ -25,6 +25,7 @@
  */
 
 #include "config.h"
+#include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
 #include <stdbool.h>
@@ -47,6 +48,16 @@
  * communicate between the two threads, e.g. when there are buffers available
  * for the main thread to copy data into or when there is data available for
  * the write thread to write.
+ *
+ * If the worker pool is enabled, there is no writing thread. Instead a task
+ * is submitted to the pool that writes out one buffer at a time, and is
+ * submitted again for as long as there are full buffers.
+ *
+ * If the flushms option is set, a buffer that has had data waiting in it for
+ * that long is written out and flushed without waiting for it to fill up,
+ * so that slow streams still reach the disk (or whoever is reading the
+ * output) promptly. The writing thread keeps an eye on the time while it
+ * waits for data, and pooled writers have a delayed task to do so instead.
  */
 
 #define BUFFERS 5
@@ -55,7 +66,7 @@ extern iow_source_t thread_wsource;
 
 /* This structure defines a single buffer or "slice" */
 struct buffer_t {
-        char buffer[WANDIO_BUFFER_SIZE];    /* The buffer itself */
+        char *buffer;                       /* The buffer itself */
         int len;                            /* The size of the buffer */
         enum { EMPTY = 0, FULL = 1 } state; /* Is the buffer in use? */
         bool flush;
@@ -64,6 +75,8 @@ struct buffer_t {
 struct state_t {
         /* The collection of buffers (or slices) */
         struct buffer_t buffer[BUFFERS];
+        /* The memory backing every slice */
+        char *space;
         /* The write offset into the current buffer */
         int64_t offset;
         /* The writing thread */
@@ -80,17 +93,276 @@ struct state_t {
         int out_buffer;
         /* Indicates whether the main thread is concluding */
         bool closing;
+        /* Number of times the main thread has had to wait for a buffer */
+        uint64_t waits;
+        /* Number of buffers written in a row without any others waiting */
+        int idle;
+        /* Whether we are using the worker pool rather than a thread */
+        bool pooled;
+        /* The task that writes out buffers for us, and the next buffer for
+         * it to write */
+        struct wandio_task_t task;
+        int drain;
+        uint64_t last_waits;
+        /* The task is queued or running, and may not be submitted again */
+        bool scheduled;
+        /* The task has written everything and closed the child */
+        bool finished;
+        /* Return rather than wait when every buffer is full */
+        bool nonblock;
+        /* Number of bytes waiting to be written out by the child */
+        int64_t queued;
+        /* Watermarks on the number of queued bytes, whether we have gone
+         * above the high one since last being at the low one, and who to
+         * tell when that changes */
+        int64_t low_mark;
+        int64_t high_mark;
+        bool above;
+        wandio_watermark_cb_t *mark_cb;
+        void *mark_data;
+        /* When data was first copied into the buffer being filled */
+        struct timespec pending_since;
+        /* The main thread is copying into the buffer being filled, so it
+         * can't be written out until it has finished */
+        bool copying;
+        /* The buffer being filled has waited too long, and the main thread
+         * is to send it on its way once it has finished copying */
+        bool expired;
+        /* The delayed task that checks on the buffer being filled, and
+         * whether it is pending or running */
+        struct wandio_task_t timer;
+        bool timer_armed;
 };
 
 #define DATA(x) ((struct state_t *)((x)->data))
 #define OUTBUFFER(x) (DATA(x)->buffer[DATA(x)->out_buffer])
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+/* Tells the child writer whether it is keeping up with the main thread. If
+ * the main thread had to wait for a buffer, or is about to, the child is
+ * falling behind. Once the child has emptied every buffer several times in a
+ * row it has capacity to spare. Must be called with the mutex held.
+ */
+static void adapt_child(iow_t *state, uint64_t *last_waits) {
+        int i, backlog = 0;
+
+        if (!DATA(state)->iow->source->adapt)
+                return;
+
+        for (i = 0; i < BUFFERS; i++) {
+                if (DATA(state)->buffer[i].state == FULL)
+                        backlog++;
+        }
+
+        if (DATA(state)->waits != *last_waits || backlog >= BUFFERS - 1) {
+                *last_waits = DATA(state)->waits;
+                DATA(state)->idle = 0;
+                DATA(state)->iow->source->adapt(DATA(state)->iow, true);
+        } else if (backlog == 0 && ++DATA(state)->idle >= BUFFERS) {
+                DATA(state)->idle = 0;
+                DATA(state)->iow->source->adapt(DATA(state)->iow, false);
+        }
+}
+
+/* Calls the watermark call-back if the amount of queued data has crossed
+ * one of the watermarks. Must be called with the mutex held, which is
+ * released while the call-back runs */
+static void thread_wmarks(iow_t *state) {
+        wandio_watermark_cb_t *cb = DATA(state)->mark_cb;
+        void *data = DATA(state)->mark_data;
+        bool above = DATA(state)->above;
+
+        if (!cb)
+                return;
+        if (!above && DATA(state)->queued >= DATA(state)->high_mark)
+                above = true;
+        else if (above && DATA(state)->queued <= DATA(state)->low_mark)
+                above = false;
+        else
+                return;
+
+        DATA(state)->above = above;
+        pthread_mutex_unlock(&DATA(state)->mutex);
+        cb(state, above, data);
+        pthread_mutex_lock(&DATA(state)->mutex);
+}
+
+/* Writes out a buffer using the child writer. Must be called with the mutex
+ * held, which is released while writing. Returns false if this was the end
+ * of the file */
+static bool thread_empty(iow_t *state, int buffer, uint64_t *last_waits) {
+        bool running;
+
+        pthread_mutex_unlock(&DATA(state)->mutex);
+        if (DATA(state)->buffer[buffer].len > 0) {
+                wandio_wwrite(DATA(state)->iow,
+                              DATA(state)->buffer[buffer].buffer,
+                              DATA(state)->buffer[buffer].len);
+        }
+        if (DATA(state)->buffer[buffer].flush) {
+                wandio_wflush(DATA(state)->iow);
+        }
+        pthread_mutex_lock(&DATA(state)->mutex);
+
+        /* If we've not reached the end of the file keep going. An empty
+         * buffer is only the end if it isn't a flush request */
+        running = (DATA(state)->buffer[buffer].len > 0 ||
+                   DATA(state)->buffer[buffer].flush);
+        DATA(state)->queued -= DATA(state)->buffer[buffer].len;
+        DATA(state)->buffer[buffer].len = 0;
+        DATA(state)->buffer[buffer].state = EMPTY;
+        DATA(state)->buffer[buffer].flush = false;
+
+        /* Signal that we've freed up another buffer for the main thread to
+         * copy data into */
+        pthread_cond_signal(&DATA(state)->space_avail);
+
+        if (running) {
+                adapt_child(state, last_waits);
+                thread_wmarks(state);
+        }
+        return running;
+}
+
+/* Writes out a single buffer on behalf of the worker pool, then submits
+ * itself again if the next buffer is full too */
+static void thread_drain(void *userdata) {
+        iow_t *state = (iow_t *)userdata;
+        bool again;
+
+        pthread_mutex_lock(&DATA(state)->mutex);
+        /* When closing, the buffer being filled is written out whether it
+         * is full or not, as is an empty one that marks the end */
+        if (DATA(state)->buffer[DATA(state)->drain].state == FULL ||
+            DATA(state)->closing) {
+                if (!thread_empty(state, DATA(state)->drain,
+                                  &DATA(state)->last_waits)) {
+                        wandio_wdestroy(DATA(state)->iow);
+                        DATA(state)->finished = true;
+                }
+                DATA(state)->drain = (DATA(state)->drain + 1) % BUFFERS;
+        }
+
+        /* Once the task is no longer scheduled, thread_wclose() may free
+         * everything, so we mustn't touch the state after unlocking */
+        again = !DATA(state)->finished &&
+                (DATA(state)->closing ||
+                 DATA(state)->buffer[DATA(state)->drain].state == FULL);
+        DATA(state)->scheduled = again;
+        if (!again)
+                pthread_cond_signal(&DATA(state)->space_avail);
+        pthread_mutex_unlock(&DATA(state)->mutex);
+
+        if (again)
+                wandio_pool_submit(&DATA(state)->task);
+}
+
+/* Lets the writing thread or task know that there is something for it to
+ * do. Must be called with the mutex held, which is released while the task
+ * is submitted */
+static void thread_wake(iow_t *state) {
+        pthread_cond_signal(&DATA(state)->data_ready);
+        if (!DATA(state)->pooled || DATA(state)->scheduled ||
+            DATA(state)->finished)
+                return;
+        DATA(state)->scheduled = true;
+        pthread_mutex_unlock(&DATA(state)->mutex);
+        wandio_pool_submit(&DATA(state)->task);
+        pthread_mutex_lock(&DATA(state)->mutex);
+}
+
+/* Hands the buffer being filled to the writing thread or task and moves on
+ * to the next one. Must be called with the mutex held, which may be released
+ * while the task is submitted */
+static void thread_wsend(iow_t *state, bool flush) {
+        OUTBUFFER(state).state = FULL;
+        OUTBUFFER(state).flush = flush;
+        DATA(state)->offset = 0;
+        DATA(state)->out_buffer = (DATA(state)->out_buffer + 1) % BUFFERS;
+        thread_wake(state);
+}
+
+/* Works out when data that was copied into the buffer being filled at
+ * pending_since has to be written out by */
+static void thread_wdue(iow_t *state, struct timespec *deadline) {
+        *deadline = DATA(state)->pending_since;
+        deadline->tv_sec += flush_ms / 1000;
+        deadline->tv_nsec += (long)(flush_ms % 1000) * 1000000;
+        if (deadline->tv_nsec >= 1000000000) {
+                deadline->tv_sec++;
+                deadline->tv_nsec -= 1000000000;
+        }
+}
+
+/* Works out when the buffer being filled has to be written out by. Returns
+ * false if there is no such deadline. Must be called with the mutex held */
+static bool thread_wdeadline(iow_t *state, struct timespec *deadline) {
+        if (!flush_ms || DATA(state)->offset == 0 || DATA(state)->expired)
+                return false;
+        thread_wdue(state, deadline);
+        return true;
+}
+
+/* Writes out and flushes the buffer being filled if it has waited for too
+ * long. Must be called with the mutex held, which may be released */
+static void thread_wexpire(iow_t *state) {
+        struct timespec deadline, now;
+
+        if (!thread_wdeadline(state, &deadline))
+                return;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec < deadline.tv_sec ||
+            (now.tv_sec == deadline.tv_sec && now.tv_nsec < deadline.tv_nsec))
+                return;
+        if (DATA(state)->copying)
+                DATA(state)->expired = true;
+        else
+                thread_wsend(state, true);
+}
+
+/* Makes sure that something is going to check on the buffer being filled
+ * once its deadline has passed. Must be called with the mutex held */
+static void thread_warm(iow_t *state) {
+        struct timespec deadline;
+
+        if (!DATA(state)->pooled) {
+                /* The writing thread works out how long to wait for */
+                pthread_cond_signal(&DATA(state)->data_ready);
+                return;
+        }
+        if (DATA(state)->timer_armed)
+                return;
+        thread_wdue(state, &deadline);
+        /* Without a pool of our own, the main thread checks instead */
+        DATA(state)->timer_armed =
+            wandio_pool_submit_at(&DATA(state)->timer, &deadline) == 0;
+}
+
+/* Checks on the buffer being filled on behalf of a pooled writer */
+static void thread_wtimer(void *userdata) {
+        iow_t *state = (iow_t *)userdata;
+        struct timespec deadline;
+
+        pthread_mutex_lock(&DATA(state)->mutex);
+        if (!DATA(state)->closing)
+                thread_wexpire(state);
+        /* Once the timer is disarmed, thread_wclose() may free everything,
+         * so we mustn't touch the state after unlocking */
+        DATA(state)->timer_armed = false;
+        if (!DATA(state)->closing && thread_wdeadline(state, &deadline))
+                thread_warm(state);
+        if (!DATA(state)->timer_armed)
+                pthread_cond_signal(&DATA(state)->space_avail);
+        pthread_mutex_unlock(&DATA(state)->mutex);
+}
+
 /* The writing thread */
 static void *thread_consumer(void *userdata) {
         int buffer = 0;
         bool running = true;
         iow_t *state = (iow_t *)userdata;
+        uint64_t last_waits = 0;
+        struct timespec deadline;
 
 #ifdef PR_SET_NAME
         char namebuf[17];
@@ -113,30 +385,16 @@ static void *thread_consumer(void *userdata) {
                         /* Unless, of course, the program is over! */
                         if (DATA(state)->closing)
                                 break;
-                        pthread_cond_wait(&DATA(state)->data_ready,
-                                          &DATA(state)->mutex);
-                }
-                /* Empty the buffer using the child writer */
-                pthread_mutex_unlock(&DATA(state)->mutex);
-                if (DATA(state)->buffer[buffer].len > 0) {
-                        wandio_wwrite(DATA(state)->iow,
-                                      DATA(state)->buffer[buffer].buffer,
-                                      DATA(state)->buffer[buffer].len);
-                }
-                if (DATA(state)->buffer[buffer].flush) {
-                        wandio_wflush(DATA(state)->iow);
+                        if (!thread_wdeadline(state, &deadline))
+                                pthread_cond_wait(&DATA(state)->data_ready,
+                                                  &DATA(state)->mutex);
+                        else if (pthread_cond_timedwait(
+                                     &DATA(state)->data_ready,
+                                     &DATA(state)->mutex,
+                                     &deadline) == ETIMEDOUT)
+                                thread_wexpire(state);
                 }
-                pthread_mutex_lock(&DATA(state)->mutex);
-
-                /* If we've not reached the end of the file keep going */
-                running = (DATA(state)->buffer[buffer].len > 0);
-                DATA(state)->buffer[buffer].len = 0;
-                DATA(state)->buffer[buffer].state = EMPTY;
-                DATA(state)->buffer[buffer].flush = false;
-
-                /* Signal that we've freed up another buffer for the main
-                 * thread to copy data into */
-                pthread_cond_signal(&DATA(state)->space_avail);
+                running = thread_empty(state, buffer, &last_waits);
 
                 /* Move on to the next buffer */
                 buffer = (buffer + 1) % BUFFERS;
@@ -152,6 +410,8 @@ static void *thread_consumer(void *userdata) {
 
 DLLEXPORT iow_t *thread_wopen(iow_t *child) {
         iow_t *state;
+        pthread_condattr_t attr;
+        int i;
 
         if (!child) {
                 return NULL;
@@ -161,17 +421,44 @@ DLLEXPORT iow_t *thread_wopen(iow_t *child) {
         state->data = calloc(1, sizeof(struct state_t));
         state->source = &thread_wsource;
 
+        /* Allocate the slices together, so that they can share huge pages */
+        DATA(state)->space =
+            wandio_alloc_buffer((size_t)BUFFERS * WANDIO_BUFFER_SIZE);
+        if (!DATA(state)->space) {
+                free(state->data);
+                free(state);
+                return NULL;
+        }
+        for (i = 0; i < BUFFERS; i++) {
+                DATA(state)->buffer[i].buffer =
+                    DATA(state)->space + (size_t)i * WANDIO_BUFFER_SIZE;
+        }
+
         DATA(state)->out_buffer = 0;
         DATA(state)->offset = 0;
         pthread_mutex_init(&DATA(state)->mutex, NULL);
-        pthread_cond_init(&DATA(state)->data_ready, NULL);
+        /* The writing thread waits for data with a deadline, which shouldn't
+         * move if somebody changes the clock */
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&DATA(state)->data_ready, &attr);
+        pthread_condattr_destroy(&attr);
         pthread_cond_init(&DATA(state)->space_avail, NULL);
 
         DATA(state)->iow = child;
         DATA(state)->closing = false;
 
+        if (wandio_pool_enabled()) {
+                DATA(state)->pooled = true;
+                DATA(state)->task.job = thread_drain;
+                DATA(state)->task.arg = state;
+                DATA(state)->timer.job = thread_wtimer;
+                DATA(state)->timer.arg = state;
+                return state;
+        }
+
         /* Start the writer thread */
-        pthread_create(&DATA(state)->consumer, NULL, thread_consumer, state);
+        wandio_thread_create(&DATA(state)->consumer, thread_consumer, state);
 
         return state;
 }
@@ -179,49 +466,65 @@ DLLEXPORT iow_t *thread_wopen(iow_t *child) {
 static int64_t thread_wwrite(iow_t *state, const char *buffer, int64_t len) {
         int slice;
         int copied = 0;
-        int newbuffer;
 
         pthread_mutex_lock(&DATA(state)->mutex);
+        /* Pooled writers that couldn't have a timer check here instead */
+        if (DATA(state)->pooled && !DATA(state)->timer_armed)
+                thread_wexpire(state);
         while (len > 0) {
 
-                /* Wait for there to be space available for us to write into */
+                /* Wait for there to be space available for us to write into,
+                 * unless we have been told not to */
                 while (OUTBUFFER(state).state == FULL) {
+                        if (DATA(state)->nonblock) {
+                                pthread_mutex_unlock(&DATA(state)->mutex);
+                                if (copied > 0)
+                                        return copied;
+                                errno = EAGAIN;
+                                return -1;
+                        }
                         write_waits++;
+                        DATA(state)->waits++;
                         pthread_cond_wait(&DATA(state)->space_avail,
                                           &DATA(state)->mutex);
                 }
 
                 /* Copy out of our main buffer into the next available slice */
-                slice = min((int64_t)sizeof(OUTBUFFER(state).buffer) -
-                                DATA(state)->offset,
+                slice = min((int64_t)WANDIO_BUFFER_SIZE - DATA(state)->offset,
                             len);
+                if (DATA(state)->offset == 0 && flush_ms) {
+                        clock_gettime(CLOCK_MONOTONIC,
+                                      &DATA(state)->pending_since);
+                        thread_warm(state);
+                }
 
+                DATA(state)->copying = true;
                 pthread_mutex_unlock(&DATA(state)->mutex);
                 memcpy(OUTBUFFER(state).buffer + DATA(state)->offset, buffer,
                        slice);
                 pthread_mutex_lock(&DATA(state)->mutex);
+                DATA(state)->copying = false;
 
                 DATA(state)->offset += slice;
                 OUTBUFFER(state).len += slice;
+                DATA(state)->queued += slice;
 
                 buffer += slice;
                 len -= slice;
                 copied += slice;
-                newbuffer = DATA(state)->out_buffer;
-
-                /* If we've filled a buffer, move on to the next one and
-                 * signal to the write thread that there is something for it
-                 * to do */
-                if (DATA(state)->offset >=
-                    (int64_t)sizeof(OUTBUFFER(state).buffer)) {
-                        OUTBUFFER(state).state = FULL;
-                        OUTBUFFER(state).flush = false;
-                        pthread_cond_signal(&DATA(state)->data_ready);
-                        DATA(state)->offset = 0;
-                        newbuffer = (newbuffer + 1) % BUFFERS;
+
+                /* If we've filled a buffer, or it has waited too long while
+                 * we were copying, move on to the next one and signal to the
+                 * write thread that there is something for it to do */
+                if (DATA(state)->offset >= (int64_t)WANDIO_BUFFER_SIZE ||
+                    DATA(state)->expired) {
+                        bool flush = DATA(state)->expired;
+
+                        DATA(state)->expired = false;
+                        thread_wsend(state, flush);
                 }
 
-                DATA(state)->out_buffer = newbuffer;
+                thread_wmarks(state);
         }
 
         pthread_mutex_unlock(&DATA(state)->mutex);
@@ -231,33 +534,114 @@ static int64_t thread_wwrite(iow_t *state, const char *buffer, int64_t len) {
 static int thread_wflush(iow_t *iow) {
         int64_t flushed = 0;
         pthread_mutex_lock(&DATA(iow)->mutex);
-        if (DATA(iow)->offset > 0) {
-                flushed = DATA(iow)->offset;
-                OUTBUFFER(iow).state = FULL;
-                OUTBUFFER(iow).flush = true;
-                pthread_cond_signal(&DATA(iow)->data_ready);
-                DATA(iow)->offset = 0;
-                DATA(iow)->out_buffer = (DATA(iow)->out_buffer + 1) % BUFFERS;
+
+        /* Even if there is no buffered data, the writing thread still has to
+         * pass the flush on to the child, so queue up an empty buffer */
+        while (OUTBUFFER(iow).state == FULL) {
+                if (DATA(iow)->nonblock) {
+                        pthread_mutex_unlock(&DATA(iow)->mutex);
+                        errno = EAGAIN;
+                        return -1;
+                }
+                write_waits++;
+                pthread_cond_wait(&DATA(iow)->space_avail, &DATA(iow)->mutex);
         }
+        flushed = DATA(iow)->offset;
+        thread_wsend(iow, true);
 
         pthread_mutex_unlock(&DATA(iow)->mutex);
         return (int)flushed;
 }
 
+static int thread_wget_fd(iow_t *iow) {
+        int i;
+        bool busy = true;
+
+        if (!DATA(iow)->iow->source->get_fd)
+                return -1;
+
+        /* Wait for the writing thread to write out everything we have */
+        thread_wflush(iow);
+        pthread_mutex_lock(&DATA(iow)->mutex);
+        while (busy) {
+                busy = false;
+                for (i = 0; i < BUFFERS; i++) {
+                        if (DATA(iow)->buffer[i].state == FULL)
+                                busy = true;
+                }
+                if (busy)
+                        pthread_cond_wait(&DATA(iow)->space_avail,
+                                          &DATA(iow)->mutex);
+        }
+        pthread_mutex_unlock(&DATA(iow)->mutex);
+
+        /* The writing thread is idle until we give it more data */
+        return wandio_wget_fd(DATA(iow)->iow);
+}
+
+int thread_wset_nonblocking(iow_t *iow, bool nonblock) {
+        if (iow->source != &thread_wsource) {
+                errno = ENOTSUP;
+                return -1;
+        }
+        pthread_mutex_lock(&DATA(iow)->mutex);
+        DATA(iow)->nonblock = nonblock;
+        pthread_mutex_unlock(&DATA(iow)->mutex);
+        return 0;
+}
+
+int64_t thread_wqueued(iow_t *iow) {
+        int64_t queued;
+
+        if (iow->source != &thread_wsource)
+                return 0;
+        pthread_mutex_lock(&DATA(iow)->mutex);
+        queued = DATA(iow)->queued;
+        pthread_mutex_unlock(&DATA(iow)->mutex);
+        return queued;
+}
+
+int thread_wset_watermarks(iow_t *iow, int64_t low, int64_t high,
+                           wandio_watermark_cb_t *cb, void *data) {
+        if (iow->source != &thread_wsource) {
+                errno = ENOTSUP;
+                return -1;
+        }
+        pthread_mutex_lock(&DATA(iow)->mutex);
+        DATA(iow)->low_mark = low;
+        DATA(iow)->high_mark = high;
+        DATA(iow)->mark_cb = cb;
+        DATA(iow)->mark_data = data;
+        DATA(iow)->above = false;
+        thread_wmarks(iow);
+        pthread_mutex_unlock(&DATA(iow)->mutex);
+        return 0;
+}
+
 static void thread_wclose(iow_t *iow) {
         pthread_mutex_lock(&DATA(iow)->mutex);
         DATA(iow)->closing = true;
-        pthread_cond_signal(&DATA(iow)->data_ready);
+        if (DATA(iow)->timer_armed && wandio_pool_cancel(&DATA(iow)->timer))
+                DATA(iow)->timer_armed = false;
+        thread_wake(iow);
+        /* Wait for the writing task to write everything out, and for the
+         * timer to notice that we are closing */
+        while (DATA(iow)->pooled &&
+               (DATA(iow)->scheduled || !DATA(iow)->finished ||
+                DATA(iow)->timer_armed))
+                pthread_cond_wait(&DATA(iow)->space_avail, &DATA(iow)->mutex);
         pthread_mutex_unlock(&DATA(iow)->mutex);
-        pthread_join(DATA(iow)->consumer, NULL);
+        if (!DATA(iow)->pooled)
+                pthread_join(DATA(iow)->consumer, NULL);
 
         pthread_mutex_destroy(&DATA(iow)->mutex);
         pthread_cond_destroy(&DATA(iow)->data_ready);
         pthread_cond_destroy(&DATA(iow)->space_avail);
 
+        wandio_free_buffer(DATA(iow)->space);
         free(iow->data);
         free(iow);
 }
 
-iow_source_t thread_wsource = {"threadw", thread_wwrite, thread_wflush,
-                               thread_wclose};
+iow_source_t thread_wsource = {"threadw",     thread_wwrite, thread_wflush,
+                               thread_wclose, NULL,          thread_wget_fd};
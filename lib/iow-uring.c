@@ -0,0 +1,349 @@
+/*
+ *
+ * Copyright (c) 2007-2019 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libwandio.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libwandio is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwandio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#define _GNU_SOURCE 1
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "uring-helper.h"
+#include "wandio.h"
+#include "wandio_internal.h"
+
+/* Libwandio IO module implementing a writer for local files that uses io_uring
+ * to write data behind the caller's back.
+ *
+ * Data is copied into a slot until the slot is full, at which point a write
+ * is queued for it and we move on to the next slot. We only have to wait for
+ * the kernel when every slot has a write in flight.
+ */
+
+#define URING_ALIGN 4096
+#define URING_BLOCK_SIZE WANDIO_BUFFER_SIZE
+/* user_data for fdatasync requests, which don't belong to any slot */
+#define URING_SYNC_TAG ((uint64_t)-1)
+
+struct uringw_slot_t {
+        char *buffer;
+        /* File offset that the buffer is written to */
+        int64_t offset;
+        /* Number of bytes in the buffer */
+        int64_t len;
+        /* Number of bytes the kernel has written so far */
+        int64_t written;
+        bool inflight;
+};
+
+struct uringw_t {
+        int fd;
+        struct uring ring;
+        struct uringw_slot_t *slots;
+        char *buffers;
+        int depth;
+        /* Slot that is being filled */
+        int current;
+        /* File offset for the next slot to be written */
+        int64_t offset;
+        /* Number of requests (including syncs) the kernel hasn't finished */
+        int inflight;
+        /* errno from a failed write, which is reported by the next call */
+        int error;
+        /* Queue an fdatasync after every sync_every bytes, if non-zero */
+        int64_t sync_every;
+        int64_t unsynced;
+        /* Number of bytes the kernel has finished writing */
+        int64_t completed;
+        bool fixed_buffers;
+        bool fixed_file;
+        struct wandio_writeback_t *writeback;
+        /* Space has been allocated for the file up to here, or -1 */
+        int64_t allocated;
+};
+
+extern iow_source_t uring_wsource;
+
+#define DATA(iow) ((struct uringw_t *)((iow)->data))
+
+static void uring_wfree(iow_t *iow) {
+        if (DATA(iow)->ring.fd >= 0)
+                uring_exit(&DATA(iow)->ring);
+        wandio_writeback_stop(DATA(iow)->writeback);
+        if (DATA(iow)->fd >= 0)
+                close(DATA(iow)->fd);
+        wandio_free_buffer(DATA(iow)->buffers);
+        free(DATA(iow)->slots);
+        free(iow->data);
+        free(iow);
+}
+
+DLLEXPORT iow_t *uring_wopen(const char *filename, int flags) {
+        iow_t *iow;
+        struct iovec *iov;
+        int i;
+
+        /* We write at explicit offsets, so we need a regular file */
+        if (strcmp(filename, "-") == 0)
+                return NULL;
+
+        iow = malloc(sizeof(iow_t));
+        iow->source = &uring_wsource;
+        iow->data = calloc(1, sizeof(struct uringw_t));
+        DATA(iow)->fd = -1;
+        DATA(iow)->depth = uring_depth;
+        DATA(iow)->sync_every = (int64_t)uring_sync_mb * 1024 * 1024;
+        DATA(iow)->allocated = prealloc_mb > 0 ? 0 : -1;
+
+        /* Make sure io_uring works before we go creating any files. Leave
+         * room for a sync request alongside every write */
+        if (uring_init(&DATA(iow)->ring, DATA(iow)->depth * 2) < 0) {
+                DATA(iow)->ring.fd = -1;
+                uring_wfree(iow);
+                return NULL;
+        }
+
+        DATA(iow)->fd = wandio_safe_open(filename, flags);
+        if (DATA(iow)->fd == -1) {
+                uring_wfree(iow);
+                return NULL;
+        }
+
+        DATA(iow)->buffers = wandio_alloc_buffer((size_t)DATA(iow)->depth *
+                                                URING_BLOCK_SIZE);
+        if (!DATA(iow)->buffers) {
+                uring_wfree(iow);
+                return NULL;
+        }
+        DATA(iow)->slots =
+            calloc(DATA(iow)->depth, sizeof(struct uringw_slot_t));
+        iov = calloc(DATA(iow)->depth, sizeof(struct iovec));
+        for (i = 0; i < DATA(iow)->depth; i++) {
+                DATA(iow)->slots[i].buffer =
+                    DATA(iow)->buffers + (size_t)i * URING_BLOCK_SIZE;
+                iov[i].iov_base = DATA(iow)->slots[i].buffer;
+                iov[i].iov_len = URING_BLOCK_SIZE;
+        }
+
+        /* These are only optimisations, so carry on if we can't have them */
+        DATA(iow)->fixed_buffers = uring_register_buffers(
+                                       &DATA(iow)->ring, iov,
+                                       DATA(iow)->depth) == 0;
+        DATA(iow)->fixed_file =
+            uring_register_file(&DATA(iow)->ring, DATA(iow)->fd) == 0;
+        free(iov);
+        DATA(iow)->writeback = wandio_writeback_start(DATA(iow)->fd);
+
+        return iow;
+}
+
+static void uring_wset_fd(iow_t *iow, struct io_uring_sqe *sqe) {
+        if (DATA(iow)->fixed_file) {
+                sqe->fd = 0;
+                sqe->flags |= IOSQE_FIXED_FILE;
+        } else {
+                sqe->fd = DATA(iow)->fd;
+        }
+}
+
+/* Queues a write for whatever part of the slot hasn't been written yet */
+static int uring_wqueue(iow_t *iow, int index) {
+        struct uringw_slot_t *slot = &DATA(iow)->slots[index];
+        struct io_uring_sqe *sqe = uring_get_sqe(&DATA(iow)->ring);
+
+        if (!sqe) {
+                errno = EBUSY;
+                return -1;
+        }
+        sqe->opcode =
+            DATA(iow)->fixed_buffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        uring_wset_fd(iow, sqe);
+        sqe->off = slot->offset + slot->written;
+        sqe->addr = (uint64_t)(uintptr_t)(slot->buffer + slot->written);
+        sqe->len = slot->len - slot->written;
+        sqe->buf_index = index;
+        sqe->user_data = index;
+
+        slot->inflight = true;
+        DATA(iow)->inflight++;
+        return 0;
+}
+
+/* Queues an fdatasync. IOSQE_IO_DRAIN holds it back until every write queued
+ * before it has finished, so it covers all of the data written so far, and
+ * holds back later writes until it has finished.
+ */
+static int uring_wqueue_sync(iow_t *iow) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&DATA(iow)->ring);
+
+        if (!sqe) {
+                errno = EBUSY;
+                return -1;
+        }
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->flags = IOSQE_IO_DRAIN;
+        uring_wset_fd(iow, sqe);
+        sqe->user_data = URING_SYNC_TAG;
+
+        DATA(iow)->inflight++;
+        DATA(iow)->unsynced = 0;
+        return 0;
+}
+
+/* Handles a single completion. If wait is false and nothing has completed,
+ * returns 0 straight away */
+static int uring_wreap(iow_t *iow, bool wait) {
+        struct io_uring_cqe cqe;
+        struct uringw_slot_t *slot;
+        int ret;
+
+        ret = wait ? uring_wait(&DATA(iow)->ring, &cqe)
+                   : uring_peek(&DATA(iow)->ring, &cqe);
+        if (ret <= 0)
+                return ret;
+
+        DATA(iow)->inflight--;
+        if (cqe.user_data == URING_SYNC_TAG) {
+                if (cqe.res < 0)
+                        DATA(iow)->error = -cqe.res;
+                return 1;
+        }
+
+        slot = &DATA(iow)->slots[cqe.user_data];
+        slot->inflight = false;
+        if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+                if (uring_wqueue(iow, cqe.user_data) < 0)
+                        return -1;
+                return 1;
+        }
+        if (cqe.res <= 0) {
+                DATA(iow)->error = cqe.res < 0 ? -cqe.res : EIO;
+                slot->len = slot->written = 0;
+                return 1;
+        }
+        slot->written += cqe.res;
+        DATA(iow)->completed += cqe.res;
+        wandio_writeback_note(DATA(iow)->writeback, DATA(iow)->completed);
+        if (slot->written < slot->len) {
+                if (uring_wqueue(iow, cqe.user_data) < 0)
+                        return -1;
+                return 1;
+        }
+        slot->len = slot->written = 0;
+        return 1;
+}
+
+/* Queues the current slot to be written and moves on to the next one */
+static int uring_wsend(iow_t *iow) {
+        struct uringw_slot_t *slot = &DATA(iow)->slots[DATA(iow)->current];
+
+        slot->offset = DATA(iow)->offset;
+        slot->written = 0;
+        DATA(iow)->offset += slot->len;
+        DATA(iow)->unsynced += slot->len;
+        DATA(iow)->allocated = wandio_prealloc(
+            DATA(iow)->fd, DATA(iow)->allocated, DATA(iow)->offset);
+        if (uring_wqueue(iow, DATA(iow)->current) < 0)
+                return -1;
+        if (DATA(iow)->sync_every &&
+            DATA(iow)->unsynced >= DATA(iow)->sync_every &&
+            uring_wqueue_sync(iow) < 0)
+                return -1;
+        DATA(iow)->current = (DATA(iow)->current + 1) % DATA(iow)->depth;
+        return uring_submit(&DATA(iow)->ring);
+}
+
+static int64_t uring_wwrite(iow_t *iow, const char *buffer, int64_t len) {
+        int64_t done = 0;
+
+        /* Pick up anything that has finished, so errors are noticed early */
+        while (uring_wreap(iow, false) > 0)
+                ;
+
+        while (done < len) {
+                struct uringw_slot_t *slot =
+                    &DATA(iow)->slots[DATA(iow)->current];
+                int64_t amount;
+
+                while (slot->inflight) {
+                        if (uring_wreap(iow, true) < 0)
+                                return -1;
+                }
+                if (DATA(iow)->error) {
+                        errno = DATA(iow)->error;
+                        return -1;
+                }
+
+                amount = URING_BLOCK_SIZE - slot->len;
+                if (amount > len - done)
+                        amount = len - done;
+                memcpy(slot->buffer + slot->len, buffer + done, amount);
+                slot->len += amount;
+                done += amount;
+
+                if (slot->len == URING_BLOCK_SIZE && uring_wsend(iow) < 0)
+                        return -1;
+        }
+        return len;
+}
+
+/* Writes out everything we have been given and waits for the kernel to
+ * finish with it */
+static int uring_wflush(iow_t *iow) {
+        struct uringw_slot_t *slot = &DATA(iow)->slots[DATA(iow)->current];
+
+        if (slot->len > 0) {
+#ifdef O_DIRECT
+                /* As with the stdio writer, a partial block means we can't
+                 * keep using O_DIRECT */
+                int fl = fcntl(DATA(iow)->fd, F_GETFL);
+                if (fl != -1 && (fl & O_DIRECT) != 0 &&
+                    slot->len % URING_ALIGN != 0)
+                        fcntl(DATA(iow)->fd, F_SETFL, fl & ~O_DIRECT);
+#endif
+                if (uring_wsend(iow) < 0)
+                        return -1;
+        }
+        while (DATA(iow)->inflight > 0) {
+                if (uring_wreap(iow, true) < 0)
+                        return -1;
+        }
+        if (DATA(iow)->error) {
+                errno = DATA(iow)->error;
+                return -1;
+        }
+        return 0;
+}
+
+static void uring_wclose(iow_t *iow) {
+        uring_wflush(iow);
+        wandio_prealloc_trim(DATA(iow)->fd, DATA(iow)->allocated);
+        uring_wfree(iow);
+}
+
+iow_source_t uring_wsource = {"uringw", uring_wwrite, uring_wflush,
+                              uring_wclose, NULL, NULL};
@@ -33,6 +33,7 @@
 #include <sys/types.h>
 #include <zlib.h>
 #include "wandio.h"
+#include "wandio_internal.h"
 
 /* Libwandio IO module implementing a zlib writer */
 
@@ -44,6 +45,15 @@ struct zlibw_t {
         iow_t *child;
         enum err_t err;
         int inoffset;
+        int strategy;
+        /* Current level and the range it can be adapted within */
+        int level;
+        int next_level;
+        int min_level;
+        int max_level;
+        /* Whether to store incompressible data, and if we currently are */
+        bool store_incompressible;
+        bool storing;
 };
 
 extern iow_source_t zlib_wsource;
@@ -52,12 +62,35 @@ extern iow_source_t zlib_wsource;
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
 DLLEXPORT iow_t *zlib_wopen(iow_t *child, int compress_level) {
+        return zlib_wopen_opts(child, compress_level, NULL);
+}
+
+DLLEXPORT iow_t *zlib_wopen_opts(iow_t *child, int compress_level,
+                                 const struct wandio_wopt *opts) {
         iow_t *iow;
+        /* Use maximum (fastest) amount of memory usage by default */
+        int mem_level = wandio_wopt_get(opts, WANDIO_WOPT_ZLIB_MEM_LEVEL, 9);
+        int strategy = wandio_wopt_get(opts, WANDIO_WOPT_ZLIB_STRATEGY,
+                                       Z_DEFAULT_STRATEGY);
+        int min_level = wandio_wopt_get(opts, WANDIO_WOPT_ADAPT_MIN_LEVEL,
+                                        compress_level);
+        bool store = wandio_wopt_get(opts, WANDIO_WOPT_STORE_INCOMPRESSIBLE, 1);
         if (!child)
                 return NULL;
+        if (min_level > compress_level ||
+            (min_level < 1 && min_level != compress_level)) {
+                fprintf(stderr,
+                        "zlib adaptive level must be between 1 and %d\n",
+                        compress_level);
+                return NULL;
+        }
         iow = malloc(sizeof(iow_t));
         iow->source = &zlib_wsource;
-        iow->data = malloc(sizeof(struct zlibw_t));
+        iow->data = wandio_alloc_buffer(sizeof(struct zlibw_t));
+        if (!iow->data) {
+                free(iow);
+                return NULL;
+        }
 
         DATA(iow)->child = child;
 
@@ -69,17 +102,60 @@ DLLEXPORT iow_t *zlib_wopen(iow_t *child, int compress_level) {
         DATA(iow)->strm.zfree = Z_NULL;
         DATA(iow)->strm.opaque = NULL;
         DATA(iow)->err = ERR_OK;
+        DATA(iow)->strategy = strategy;
+        DATA(iow)->level = compress_level;
+        DATA(iow)->next_level = compress_level;
+        DATA(iow)->min_level = min_level;
+        DATA(iow)->max_level = compress_level;
+        DATA(iow)->store_incompressible = store;
+        DATA(iow)->storing = false;
 
-        deflateInit2(&DATA(iow)->strm, compress_level, /* Level */
-                     Z_DEFLATED,                       /* Method */
-                     15 | 16, /* 15 bits of windowsize, 16 == use gzip header */
-                     9,       /* Use maximum (fastest) amount of memory usage */
-                     Z_DEFAULT_STRATEGY);
+        if (deflateInit2(&DATA(iow)->strm, compress_level, /* Level */
+                         Z_DEFLATED,                       /* Method */
+                         15 | 16, /* 15 bits of windowsize, 16 == use gzip
+                                     header */
+                         mem_level, strategy) != Z_OK) {
+                fprintf(stderr,
+                        "Invalid zlib compression level (%d), memory level "
+                        "(%d) or strategy (%d)\n",
+                        compress_level, mem_level, strategy);
+                wandio_free_buffer(iow->data);
+                free(iow);
+                return NULL;
+        }
 
         return iow;
 }
 
+/* Switches compression level. zlib ends the current deflate block before
+ * changing level, so make sure there is plenty of room for it.
+ */
+static int zlib_wset_level(iow_t *iow, int level) {
+        int avail = sizeof(DATA(iow)->outbuff) - DATA(iow)->strm.avail_out;
+
+        if (avail > 0) {
+                if (wandio_wwrite(DATA(iow)->child, (char *)DATA(iow)->outbuff,
+                                  avail) <= 0) {
+                        DATA(iow)->err = ERR_ERROR;
+                        return -1;
+                }
+                DATA(iow)->strm.next_out = DATA(iow)->outbuff;
+                DATA(iow)->strm.avail_out = sizeof(DATA(iow)->outbuff);
+        }
+
+        if (deflateParams(&DATA(iow)->strm, level, DATA(iow)->strategy) !=
+            Z_OK) {
+                fprintf(stderr, "Unable to change zlib compression level\n");
+                DATA(iow)->err = ERR_ERROR;
+                return -1;
+        }
+        DATA(iow)->level = level;
+        return 0;
+}
+
 static int64_t zlib_wwrite(iow_t *iow, const char *buffer, int64_t len) {
+        int level;
+
         if (DATA(iow)->err == ERR_EOF) {
                 return 0; /* EOF */
         }
@@ -87,6 +163,14 @@ static int64_t zlib_wwrite(iow_t *iow, const char *buffer, int64_t len) {
                 return -1; /* ERROR! */
         }
 
+        if (DATA(iow)->store_incompressible && len >= WANDIO_SAMPLE_MIN)
+                DATA(iow)->storing = wandio_incompressible(buffer, len);
+        /* Level 0 writes stored deflate blocks */
+        level = DATA(iow)->storing ? 0 : DATA(iow)->next_level;
+        if (level != DATA(iow)->level && zlib_wset_level(iow, level) < 0) {
+                return -1;
+        }
+
         DATA(iow)->strm.next_in =
             (Bytef *)buffer; /* This casts away const, but it's really const
                               * anyway
@@ -153,6 +237,16 @@ static int zlib_wflush(iow_t *iow) {
         return res;
 }
 
+/* Steps the level down when we are falling behind and back up towards the
+ * level we were opened with when we are keeping up */
+static void zlib_wadapt(iow_t *iow, bool faster) {
+        int level = DATA(iow)->next_level + (faster ? -1 : 1);
+
+        if (level < DATA(iow)->min_level || level > DATA(iow)->max_level)
+                return;
+        DATA(iow)->next_level = level;
+}
+
 static void zlib_wclose(iow_t *iow) {
         int res;
 
@@ -178,8 +272,9 @@ static void zlib_wclose(iow_t *iow) {
         wandio_wwrite(DATA(iow)->child, (char *)DATA(iow)->outbuff,
                       sizeof(DATA(iow)->outbuff) - DATA(iow)->strm.avail_out);
         wandio_wdestroy(DATA(iow)->child);
-        free(iow->data);
+        wandio_free_buffer(iow->data);
         free(iow);
 }
 
-iow_source_t zlib_wsource = {"zlibw", zlib_wwrite, zlib_wflush, zlib_wclose};
+iow_source_t zlib_wsource = {"zlibw", zlib_wwrite, zlib_wflush,
+                             zlib_wclose, zlib_wadapt, NULL};
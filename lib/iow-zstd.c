@@ -29,8 +29,11 @@
 
 #include "config.h"
 #include <stdlib.h>
+#include <string.h>
+#include <zdict.h>
 #include <zstd.h>
 #include "wandio.h"
+#include "wandio_internal.h"
 
 enum err_t { ERR_OK = 1, ERR_EOF = 0, ERR_ERROR = -1 };
 
@@ -40,6 +43,16 @@ struct zstdw_t {
         ZSTD_CStream *stream;
         ZSTD_outBuffer output_buffer;
         ZSTD_inBuffer input_buffer;
+        /* Current level and the range it can be adapted within */
+        int level;
+        int next_level;
+        int min_level;
+        int max_level;
+        /* Whether to store incompressible data, if we currently are, and
+         * how much incompressible data there has been in a row */
+        bool store_incompressible;
+        bool storing;
+        int64_t store_run;
         char outbuff[WANDIO_BUFFER_SIZE];
 };
 
@@ -47,20 +60,232 @@ struct zstdw_t {
 extern iow_source_t zstd_wsource;
 
 DLLEXPORT iow_t *zstd_wopen(iow_t *child, int compress_level) {
+        return zstd_wopen_opts(child, compress_level, NULL);
+}
+
+/* Applies a single compression parameter, reporting any error */
+static int zstd_wset(iow_t *iow, ZSTD_cParameter param, int value,
+                     const char *name) {
+        size_t result = ZSTD_CCtx_setParameter(DATA(iow)->stream, param, value);
+        if (ZSTD_isError(result)) {
+                fprintf(stderr, "Unable to set zstd %s to %d: %s\n", name,
+                        value, ZSTD_getErrorName(result));
+                return -1;
+        }
+        return 0;
+}
+
+DLLEXPORT iow_t *zstd_wopen_opts(iow_t *child, int compress_level,
+                                 const struct wandio_wopt *opts) {
         iow_t *iow;
+        int window_log = wandio_wopt_get(opts, WANDIO_WOPT_ZSTD_WINDOW_LOG, 0);
+        int long_log = wandio_wopt_get(opts, WANDIO_WOPT_ZSTD_LONG, 0);
+        int min_level = wandio_wopt_get(opts, WANDIO_WOPT_ADAPT_MIN_LEVEL,
+                                        compress_level);
+        bool store = wandio_wopt_get(opts, WANDIO_WOPT_STORE_INCOMPRESSIBLE, 1);
+
         if (!child)
                 return NULL;
+        /* zstd silently clamps levels that are out of range, which would
+         * hide mistakes from the user */
+        if (compress_level < ZSTD_minCLevel() ||
+            compress_level > ZSTD_maxCLevel()) {
+                fprintf(stderr,
+                        "zstd compression level must be between %d and %d\n",
+                        ZSTD_minCLevel(), ZSTD_maxCLevel());
+                return NULL;
+        }
+        if (min_level < ZSTD_minCLevel() || min_level > compress_level) {
+                fprintf(stderr,
+                        "zstd adaptive level must be between %d and %d\n",
+                        ZSTD_minCLevel(), compress_level);
+                return NULL;
+        }
         iow = malloc(sizeof(iow_t));
         iow->source = &zstd_wsource;
-        iow->data = malloc(sizeof(struct zstdw_t));
+        iow->data = wandio_alloc_buffer(sizeof(struct zstdw_t));
+        if (!iow->data) {
+                free(iow);
+                return NULL;
+        }
         DATA(iow)->child = child;
         DATA(iow)->err = ERR_OK;
         DATA(iow)->stream = ZSTD_createCStream();
-        ZSTD_initCStream(DATA(iow)->stream, compress_level);
+        DATA(iow)->level = compress_level;
+        DATA(iow)->next_level = compress_level;
+        DATA(iow)->min_level = min_level;
+        DATA(iow)->max_level = compress_level;
+        DATA(iow)->store_incompressible = store;
+        DATA(iow)->storing = false;
+        DATA(iow)->store_run = 0;
+
+        if (zstd_wset(iow, ZSTD_c_compressionLevel, compress_level, "level") <
+            0)
+                goto fail;
+        if (long_log) {
+                /* Like zstd --long, this also sets the window size unless
+                 * it has been given explicitly */
+                if (zstd_wset(iow, ZSTD_c_enableLongDistanceMatching, 1,
+                              "long distance matching") < 0)
+                        goto fail;
+                if (!window_log)
+                        window_log = long_log;
+        }
+        if (window_log &&
+            zstd_wset(iow, ZSTD_c_windowLog, window_log, "window log") < 0)
+                goto fail;
+        return iow;
+
+fail:
+        ZSTD_freeCStream(DATA(iow)->stream);
+        wandio_free_buffer(iow->data);
+        free(iow);
+        return NULL;
+}
+
+int zstd_wload_dict(iow_t *iow, const void *dict, int64_t dict_len) {
+        size_t result;
+
+        result = ZSTD_CCtx_loadDictionary(DATA(iow)->stream, dict, dict_len);
+        if (ZSTD_isError(result)) {
+                fprintf(stderr, "Unable to load zstd dictionary: %s\n",
+                        ZSTD_getErrorName(result));
+                return -1;
+        }
+        return 0;
+}
+
+/* Compresses using a dictionary, which can be either one trained by zstd (in
+ * which case its ID is written into every frame header) or raw content. The
+ * dictionary is copied, so the caller may free it as soon as we return.
+ */
+DLLEXPORT iow_t *zstd_wopen_dict(iow_t *child, int compress_level,
+                                 const void *dict, int64_t dict_len) {
+        iow_t *iow = zstd_wopen(child, compress_level);
+
+        if (!iow)
+                return NULL;
+
+        if (zstd_wload_dict(iow, dict, dict_len) < 0) {
+                ZSTD_freeCStream(DATA(iow)->stream);
+                wandio_free_buffer(iow->data);
+                free(iow);
+                return NULL;
+        }
         return iow;
 }
 
+int64_t zstd_train_dict(char *const *filenames, int count, void *dict,
+                        int64_t capacity, unsigned int *dict_id) {
+        size_t *sizes = calloc(count, sizeof(size_t));
+        char *samples = NULL;
+        int64_t total = 0, alloced = 0;
+        size_t result;
+        int i;
+
+        if (!sizes) {
+                fprintf(stderr, "Unable to allocate zstd sample sizes\n");
+                return -1;
+        }
+
+        for (i = 0; i < count; i++) {
+                io_t *io = wandio_create(filenames[i]);
+                int64_t len;
+
+                if (!io) {
+                        fprintf(stderr, "Unable to open sample file %s\n",
+                                filenames[i]);
+                        continue;
+                }
+                do {
+                        if (alloced - total < WANDIO_BUFFER_SIZE) {
+                                char *grown = realloc(
+                                    samples, alloced + WANDIO_BUFFER_SIZE * 16);
+
+                                if (!grown) {
+                                        fprintf(stderr, "Unable to allocate "
+                                                        "zstd samples\n");
+                                        wandio_destroy(io);
+                                        goto fail;
+                                }
+                                samples = grown;
+                                alloced += WANDIO_BUFFER_SIZE * 16;
+                        }
+                        len = wandio_read(io, samples + total,
+                                          alloced - total);
+                        if (len > 0) {
+                                total += len;
+                                sizes[i] += len;
+                        }
+                } while (len > 0);
+                wandio_destroy(io);
+                if (len < 0) {
+                        fprintf(stderr, "Unable to read sample file %s\n",
+                                filenames[i]);
+                        goto fail;
+                }
+        }
+
+        result = ZDICT_trainFromBuffer(dict, capacity, samples, sizes, count);
+        free(samples);
+        free(sizes);
+        if (ZDICT_isError(result)) {
+                fprintf(stderr, "Unable to train zstd dictionary: %s\n",
+                        ZDICT_getErrorName(result));
+                return -1;
+        }
+        if (dict_id)
+                *dict_id = ZDICT_getDictID(dict, result);
+        return result;
+
+fail:
+        free(samples);
+        free(sizes);
+        return -1;
+}
+
+/* Writes out all of the compressed data buffered by zstd, ending either the
+ * current block or the whole frame depending on mode. Returns the number of
+ * bytes written to the child.
+ */
+static int zstd_wdrain(iow_t *iow, ZSTD_EndDirective mode) {
+        ZSTD_inBuffer empty = {NULL, 0, 0};
+        size_t remaining;
+        int flushed = 0;
+        int res;
+
+        do {
+                DATA(iow)->output_buffer.dst = DATA(iow)->outbuff;
+                DATA(iow)->output_buffer.pos = 0;
+                DATA(iow)->output_buffer.size = sizeof(DATA(iow)->outbuff);
+
+                remaining = ZSTD_compressStream2(DATA(iow)->stream,
+                                                 &DATA(iow)->output_buffer,
+                                                 &empty, mode);
+                if (ZSTD_isError(remaining)) {
+                        fprintf(stderr,
+                                "ZSTD error while flushing output: %s\n",
+                                ZSTD_getErrorName(remaining));
+                        DATA(iow)->err = ERR_ERROR;
+                        return -1;
+                }
+                if (DATA(iow)->output_buffer.pos > 0) {
+                        res = wandio_wwrite(DATA(iow)->child,
+                                            DATA(iow)->outbuff,
+                                            DATA(iow)->output_buffer.pos);
+                        if (res <= 0) {
+                                DATA(iow)->err = ERR_ERROR;
+                                return -1;
+                        }
+                        flushed += res;
+                }
+        } while (remaining != 0);
+        return flushed;
+}
+
 static int64_t zstd_wwrite(iow_t *iow, const char *buffer, int64_t len) {
+        int level;
+
         if (DATA(iow)->err == ERR_EOF) {
                 return 0; /* EOF */
         }
@@ -72,6 +297,29 @@ static int64_t zstd_wwrite(iow_t *iow, const char *buffer, int64_t len) {
                 return 0;
         }
 
+        /* Changing level means starting a new frame, so only start
+         * storing once there has been plenty of incompressible data */
+        if (DATA(iow)->store_incompressible)
+                DATA(iow)->storing =
+                    wandio_store_steady(DATA(iow)->storing,
+                                        &DATA(iow)->store_run, buffer, len);
+        /* At the fastest level zstd gives up on incompressible data almost
+         * immediately and writes it out as raw blocks */
+        level = DATA(iow)->storing ? ZSTD_minCLevel() : DATA(iow)->next_level;
+
+        /* Without worker threads zstd only picks up a new level at the start
+         * of a frame, so end the current one before switching */
+        if (level != DATA(iow)->level) {
+                if (zstd_wdrain(iow, ZSTD_e_end) < 0)
+                        return -1;
+                DATA(iow)->level = level;
+                if (zstd_wset(iow, ZSTD_c_compressionLevel, DATA(iow)->level,
+                              "level") < 0) {
+                        DATA(iow)->err = ERR_ERROR;
+                        return -1;
+                }
+        }
+
         DATA(iow)->input_buffer.src = buffer;
         DATA(iow)->input_buffer.size = len;
         DATA(iow)->input_buffer.pos = 0;
@@ -90,6 +338,11 @@ static int64_t zstd_wwrite(iow_t *iow, const char *buffer, int64_t len) {
                         DATA(iow)->err = ERR_ERROR;
                         return -1;
                 }
+                /* zstd buffers small amounts of input internally, so there
+                 * may not be any output yet */
+                if (DATA(iow)->output_buffer.pos == 0) {
+                        continue;
+                }
                 int bytes_written =
                     wandio_wwrite(DATA(iow)->child, DATA(iow)->outbuff,
                                   DATA(iow)->output_buffer.pos);
@@ -101,10 +354,43 @@ static int64_t zstd_wwrite(iow_t *iow, const char *buffer, int64_t len) {
         return DATA(iow)->input_buffer.pos;
 }
 
+/* Compresses everything we have been given so far and writes it out. By
+ * default this ends the current block, which is enough for a streaming reader
+ * to decode all of the data written so far. If the zstdflushframe option is
+ * set, the whole frame is ended instead so that tools which only decode
+ * complete frames can also see the data.
+ */
 static int zstd_wflush(iow_t *iow) {
-        /* TODO implement this */
-        (void)(iow);
-        return 0;
+        int flushed;
+        int res;
+
+        if (DATA(iow)->err == ERR_ERROR) {
+                return -1;
+        }
+
+        flushed =
+            zstd_wdrain(iow, zstd_flush_frame ? ZSTD_e_end : ZSTD_e_flush);
+        if (flushed < 0)
+                return -1;
+
+        if ((res = wandio_wflush(DATA(iow)->child)) < 0) {
+                DATA(iow)->err = ERR_ERROR;
+                return res;
+        }
+        return flushed;
+}
+
+/* Steps the level down when we are falling behind and back up towards the
+ * level we were opened with when we are keeping up. Level 0 means the
+ * default level to zstd, so it is skipped. */
+static void zstd_wadapt(iow_t *iow, bool faster) {
+        int level = DATA(iow)->next_level + (faster ? -1 : 1);
+
+        if (level == 0)
+                level += faster ? -1 : 1;
+        if (level < DATA(iow)->min_level || level > DATA(iow)->max_level)
+                return;
+        DATA(iow)->next_level = level;
 }
 
 static void zstd_wclose(iow_t *iow) {
@@ -112,7 +398,9 @@ static void zstd_wclose(iow_t *iow) {
         /* I'm not sure if this loop is exactly the right thing to do,
            but it is what happens in zstd's zstd/programs/fileio.c. */
         while (result != 0) {
+                DATA(iow)->output_buffer.dst = DATA(iow)->outbuff;
                 DATA(iow)->output_buffer.pos = 0;
+                DATA(iow)->output_buffer.size = sizeof(DATA(iow)->outbuff);
                 result = ZSTD_endStream(DATA(iow)->stream,
                                         &DATA(iow)->output_buffer);
 
@@ -126,8 +414,9 @@ static void zstd_wclose(iow_t *iow) {
         }
         wandio_wdestroy(DATA(iow)->child);
         ZSTD_freeCStream(DATA(iow)->stream);
-        free(iow->data);
+        wandio_free_buffer(iow->data);
         free(iow);
 }
 
-iow_source_t zstd_wsource = {"zstdw", zstd_wwrite, zstd_wflush, zstd_wclose};
+iow_source_t zstd_wsource = {"zstdw", zstd_wwrite, zstd_wflush,
+                             zstd_wclose, zstd_wadapt, NULL};
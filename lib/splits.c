@@ -0,0 +1,476 @@
+/*
+ *
+ * Copyright (c) 2007-2019 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libwandio.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libwandio is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwandio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "wandio.h"
+#include "wandio_internal.h"
+#if HAVE_LIBZ
+#include <zlib.h>
+#endif
+#if HAVE_LIBBZ2
+#include <bzlib.h>
+#endif
+#if HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+#if HAVE_LIBLZ4F
+#include <lz4frame.h>
+#endif
+
+/* Works out where a file can be cut into ranges that can each be read by a
+ * reader of their own, for wandio_plan_splits().
+ *
+ * A compressed file can only be cut where a decompressor could start afresh,
+ * i.e. at the start of a zstd or lz4 frame, a gzip member (which includes
+ * every BGZF block) or a bzip2 stream. We walk through the file, noting
+ * where each of these starts and how much data comes before it once it is
+ * decompressed, and then pick the starts closest to where each range should
+ * begin.
+ *
+ * Frames and BGZF blocks give their sizes in their headers, so these files
+ * can be walked without decompressing them, unless a frame leaves its
+ * decompressed size out. The end of any other gzip member or bzip2 stream
+ * can only be found by decompressing it.
+ *
+ * The xz reader stops at the end of the first stream and there is no lzo
+ * reader, so these (and any other formats) are left in one piece.
+ */
+
+/* A place where the file can be cut */
+struct split_point_t {
+        int64_t offset;
+        int64_t uncompressed_offset;
+};
+
+struct split_plan_t {
+        const unsigned char *map;
+        int64_t size;
+        struct split_point_t *points;
+        int count;
+        int allocated;
+        /* Somewhere to decompress into when we only want to know how much
+         * data there is */
+        char *scratch;
+};
+
+static uint32_t split_le32(const unsigned char *p) {
+        return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+               ((uint32_t)p[3] << 24);
+}
+
+static int split_add(struct split_plan_t *plan, int64_t offset,
+                     int64_t uncompressed_offset) {
+        struct split_point_t *points;
+
+        if (plan->count == plan->allocated) {
+                plan->allocated = plan->allocated ? plan->allocated * 2 : 64;
+                points = realloc(plan->points,
+                                 plan->allocated *
+                                     sizeof(struct split_point_t));
+                if (!points)
+                        return -1;
+                plan->points = points;
+        }
+        plan->points[plan->count].offset = offset;
+        plan->points[plan->count].uncompressed_offset = uncompressed_offset;
+        plan->count++;
+        return 0;
+}
+
+#if HAVE_LIBZSTD
+/* Finds the length of the zstd frame at pos, and the amount of data in it,
+ * decompressing it if the frame doesn't say */
+static int64_t split_zstd_frame(struct split_plan_t *plan, int64_t pos,
+                                int64_t *content) {
+        ZSTD_DStream *stream;
+        ZSTD_inBuffer in;
+        ZSTD_outBuffer out;
+        unsigned long long size;
+        size_t len, ret;
+
+        len = ZSTD_findFrameCompressedSize(plan->map + pos, plan->size - pos);
+        if (ZSTD_isError(len))
+                return -1;
+        size = ZSTD_getFrameContentSize(plan->map + pos, len);
+        if (size != ZSTD_CONTENTSIZE_UNKNOWN &&
+            size != ZSTD_CONTENTSIZE_ERROR) {
+                *content = (int64_t)size;
+                return len;
+        }
+
+        stream = ZSTD_createDStream();
+        ZSTD_initDStream(stream);
+        in.src = plan->map + pos;
+        in.size = len;
+        in.pos = 0;
+        *content = 0;
+        do {
+                out.dst = plan->scratch;
+                out.size = WANDIO_BUFFER_SIZE;
+                out.pos = 0;
+                ret = ZSTD_decompressStream(stream, &out, &in);
+                *content += out.pos;
+        } while (!ZSTD_isError(ret) && ret != 0 &&
+                 (in.pos < in.size || out.pos == out.size));
+        ZSTD_freeDStream(stream);
+        return ZSTD_isError(ret) ? -1 : (int64_t)len;
+}
+#endif
+
+#if HAVE_LIBLZ4F
+/* Decompresses an lz4 frame to find out how much data is in it */
+static int64_t split_lz4_content(struct split_plan_t *plan, int64_t pos,
+                                 int64_t len) {
+        LZ4F_decompressionContext_t ctx;
+        const unsigned char *in = plan->map + pos;
+        size_t in_len, out_len, ret;
+        int64_t content = 0;
+
+        if (LZ4F_isError(LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION)))
+                return -1;
+        do {
+                in_len = len - (in - (plan->map + pos));
+                out_len = WANDIO_BUFFER_SIZE;
+                ret = LZ4F_decompress(ctx, plan->scratch, &out_len, in,
+                                      &in_len, NULL);
+                in += in_len;
+                content += out_len;
+        } while (!LZ4F_isError(ret) && ret != 0 &&
+                 (in_len > 0 || out_len > 0));
+        LZ4F_freeDecompressionContext(ctx);
+        return LZ4F_isError(ret) ? -1 : content;
+}
+#endif
+
+/* Finds the length of the lz4 frame at pos by walking its blocks, and the
+ * amount of data in it */
+static int64_t split_lz4_frame(struct split_plan_t *plan, int64_t pos,
+                               int64_t *content) {
+        const unsigned char *p = plan->map + pos;
+        int64_t avail = plan->size - pos;
+        int64_t len, block;
+        unsigned char flags;
+        int i;
+
+        if (avail < 7)
+                return -1;
+        flags = p[4];
+        /* Magic, flags, block descriptor, content size, dictionary ID and
+         * header checksum */
+        len = 4 + 2 + ((flags & 0x08) ? 8 : 0) + ((flags & 0x01) ? 4 : 0) + 1;
+        *content = -1;
+        if ((flags & 0x08) && avail >= 14) {
+                *content = 0;
+                for (i = 7; i >= 0; i--)
+                        *content = (*content << 8) | p[6 + i];
+        }
+
+        while (true) {
+                if (len + 4 > avail)
+                        return -1;
+                block = split_le32(p + len) & 0x7fffffff;
+                len += 4;
+                if (block == 0)
+                        break;
+                len += block + ((flags & 0x10) ? 4 : 0);
+        }
+        if (flags & 0x04)
+                len += 4;
+        if (len > avail)
+                return -1;
+
+        if (*content < 0) {
+#if HAVE_LIBLZ4F
+                *content = split_lz4_content(plan, pos, len);
+#endif
+                if (*content < 0)
+                        return -1;
+        }
+        return len;
+}
+
+/* Walks a file made up of zstd and lz4 frames, which may be mixed with
+ * skippable frames */
+static int split_frames(struct split_plan_t *plan) {
+        int64_t pos = 0, uncompressed = 0;
+        int64_t len, content;
+        uint32_t magic;
+
+        while (pos + 8 <= plan->size) {
+                magic = split_le32(plan->map + pos);
+                len = -1;
+                content = 0;
+                if ((magic & 0xfffffff0) == 0x184d2a50) {
+                        len = 8 + (int64_t)split_le32(plan->map + pos + 4);
+                } else if (magic == 0x184d2204) {
+                        len = split_lz4_frame(plan, pos, &content);
+                }
+#if HAVE_LIBZSTD
+                else if (magic == 0xfd2fb528) {
+                        len = split_zstd_frame(plan, pos, &content);
+                }
+#endif
+                /* Anything we don't understand stays with the frame before
+                 * it */
+                if (len <= 0 || pos + len > plan->size)
+                        break;
+                if (split_add(plan, pos, uncompressed) < 0)
+                        return -1;
+                pos += len;
+                uncompressed += content;
+        }
+        return 0;
+}
+
+#if HAVE_LIBZ
+/* Walks a file made up of gzip members. BGZF blocks give their size in the
+ * header and their decompressed size in the trailer, but any other member
+ * has to be decompressed to find its end */
+static int split_gzip(struct split_plan_t *plan) {
+        const unsigned char *p;
+        int64_t pos = 0, uncompressed = 0;
+        int64_t len, content;
+        z_stream strm;
+        int ret;
+
+        while (pos + 18 <= plan->size) {
+                p = plan->map + pos;
+                if (p[0] != 0x1f || p[1] != 0x8b)
+                        break;
+                if ((p[3] & 0x04) && p[12] == 'B' && p[13] == 'C' &&
+                    p[14] == 2 && p[15] == 0) {
+                        len = (int64_t)(p[16] | (p[17] << 8)) + 1;
+                        if (pos + len > plan->size)
+                                break;
+                        content = split_le32(p + len - 4);
+                } else {
+                        memset(&strm, 0, sizeof(strm));
+                        if (inflateInit2(&strm, 15 | 16) != Z_OK)
+                                return -1;
+                        strm.next_in = (Bytef *)p;
+                        do {
+                                strm.avail_in = (plan->size - pos) -
+                                                strm.total_in;
+                                if (strm.avail_in > 1 << 30)
+                                        strm.avail_in = 1 << 30;
+                                strm.next_out = (Bytef *)plan->scratch;
+                                strm.avail_out = WANDIO_BUFFER_SIZE;
+                                ret = inflate(&strm, Z_NO_FLUSH);
+                        } while (ret == Z_OK);
+                        len = strm.total_in;
+                        content = strm.total_out;
+                        inflateEnd(&strm);
+                        if (ret != Z_STREAM_END)
+                                break;
+                }
+                if (split_add(plan, pos, uncompressed) < 0)
+                        return -1;
+                pos += len;
+                uncompressed += content;
+        }
+        return 0;
+}
+#endif
+
+#if HAVE_LIBBZ2
+/* Walks a file made up of several bzip2 streams, e.g. from pbzip2. Blocks
+ * within a stream don't start on a byte boundary, so we can only cut the file
+ * between streams, and have to decompress each stream to find its end */
+static int split_bzip2(struct split_plan_t *plan) {
+        const unsigned char *p;
+        int64_t pos = 0, uncompressed = 0;
+        int64_t len, content;
+        bz_stream strm;
+        int64_t avail;
+        int ret;
+
+        while (pos + 4 <= plan->size) {
+                p = plan->map + pos;
+                if (p[0] != 'B' || p[1] != 'Z' || p[2] != 'h')
+                        break;
+                memset(&strm, 0, sizeof(strm));
+                if (BZ2_bzDecompressInit(&strm, 0, 0) != BZ_OK)
+                        return -1;
+                strm.next_in = (char *)p;
+                len = 0;
+                content = 0;
+                do {
+                        avail = (plan->size - pos) - len;
+                        strm.avail_in = avail > 1 << 30 ? 1 << 30 : avail;
+                        strm.next_out = plan->scratch;
+                        strm.avail_out = WANDIO_BUFFER_SIZE;
+                        ret = BZ2_bzDecompress(&strm);
+                        len = ((int64_t)strm.total_in_hi32 << 32) |
+                              strm.total_in_lo32;
+                        content = ((int64_t)strm.total_out_hi32 << 32) |
+                                  strm.total_out_lo32;
+                } while (ret == BZ_OK);
+                BZ2_bzDecompressEnd(&strm);
+                if (ret != BZ_STREAM_END)
+                        break;
+                if (split_add(plan, pos, uncompressed) < 0)
+                        return -1;
+                pos += len;
+                uncompressed += content;
+        }
+        return 0;
+}
+#endif
+
+/* Works out what sort of file we have, and how it can be cut up */
+static int split_walk(struct split_plan_t *plan, int *type) {
+        const unsigned char *p = plan->map;
+
+        *type = WANDIO_COMPRESS_NONE;
+        if (plan->size < 6)
+                return 0;
+        if (p[0] == 0x1f && p[1] == 0x8b && p[2] == 0x08) {
+                *type = WANDIO_COMPRESS_ZLIB;
+#if HAVE_LIBZ
+                return split_gzip(plan);
+#endif
+        } else if (p[0] == 'B' && p[1] == 'Z' && p[2] == 'h') {
+                *type = WANDIO_COMPRESS_BZ2;
+#if HAVE_LIBBZ2
+                return split_bzip2(plan);
+#endif
+        } else if (split_le32(p) == 0xfd2fb528 ||
+                   split_le32(p) == 0x184d2204 ||
+                   (split_le32(p) & 0xfffffff0) == 0x184d2a50) {
+                *type = p[0] == 0x04 ? WANDIO_COMPRESS_LZ4
+                                     : WANDIO_COMPRESS_ZSTD;
+                return split_frames(plan);
+        } else if (p[0] == 0xfd && memcmp(p + 1, "7zXZ", 4) == 0) {
+                /* Can't be cut, but isn't uncompressed either */
+                *type = WANDIO_COMPRESS_LZMA;
+        } else if (p[0] == 0x1f && p[1] == 0x9d) {
+                /* compress(1), which is read by the zlib reader */
+                *type = WANDIO_COMPRESS_ZLIB;
+        }
+        return 0;
+}
+
+DLLEXPORT int wandio_plan_splits(const char *filename, int n,
+                                 struct wandio_split *splits) {
+        struct split_plan_t plan;
+        struct stat st;
+        int64_t target, end;
+        int type = WANDIO_COMPRESS_NONE;
+        int fd, count, i, next;
+
+        if (n <= 0) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        fd = open(filename, O_RDONLY);
+        if (fd < 0)
+                return -1;
+        if (fstat(fd, &st) < 0) {
+                close(fd);
+                return -1;
+        }
+
+        memset(&plan, 0, sizeof(plan));
+        plan.size = st.st_size;
+        if (plan.size > 0) {
+                plan.map = mmap(NULL, plan.size, PROT_READ, MAP_PRIVATE, fd,
+                                0);
+                if (plan.map == MAP_FAILED) {
+                        close(fd);
+                        return -1;
+                }
+                madvise((void *)plan.map, plan.size, MADV_SEQUENTIAL);
+        }
+        close(fd);
+        plan.scratch = malloc(WANDIO_BUFFER_SIZE);
+        if (!plan.scratch || split_walk(&plan, &type) < 0) {
+                if (plan.size > 0)
+                        munmap((void *)plan.map, plan.size);
+                free(plan.scratch);
+                free(plan.points);
+                return -1;
+        }
+        if (plan.size > 0)
+                munmap((void *)plan.map, plan.size);
+        free(plan.scratch);
+
+        /* An uncompressed file can be cut anywhere */
+        if (type == WANDIO_COMPRESS_NONE) {
+                count = 0;
+                for (i = 0; i < n; i++) {
+                        target = plan.size / n * i;
+                        if (i > 0 && target == splits[count - 1].offset)
+                                continue;
+                        splits[count].offset = target;
+                        splits[count].uncompressed_offset = target;
+                        splits[count].compression_type = type;
+                        count++;
+                }
+        } else {
+                /* Otherwise each range starts at whichever place we can cut
+                 * after the last range is nearest to where it ought to, and
+                 * anything we couldn't make sense of is left in the last
+                 * range */
+                if (plan.count == 0 && split_add(&plan, 0, 0) < 0) {
+                        free(plan.points);
+                        return -1;
+                }
+                count = 0;
+                next = 0;
+                for (i = 0; i < n && next < plan.count; i++) {
+                        target = plan.size / n * i;
+                        while (next + 1 < plan.count &&
+                               plan.points[next + 1].offset <= target)
+                                next++;
+                        if (next + 1 < plan.count &&
+                            plan.points[next].offset < target &&
+                            plan.points[next + 1].offset - target <
+                                target - plan.points[next].offset)
+                                next++;
+                        splits[count].offset = plan.points[next].offset;
+                        splits[count].uncompressed_offset =
+                            plan.points[next].uncompressed_offset;
+                        splits[count].compression_type = type;
+                        count++;
+                        next++;
+                }
+        }
+        free(plan.points);
+
+        for (i = 0; i < count; i++) {
+                end = i + 1 < count ? splits[i + 1].offset : plan.size;
+                splits[i].length = end - splits[i].offset;
+        }
+        return count;
+}
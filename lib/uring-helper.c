@@ -0,0 +1,190 @@
+/*
+ *
+ * Copyright (c) 2007-2019 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libwandio.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libwandio is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwandio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include "uring-helper.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* The ring indices are shared with the kernel, so reads of the indices it
+ * updates need acquire semantics and our updates need release semantics */
+#define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int uring_enter(struct uring *ring, unsigned int to_submit,
+                       unsigned int min_complete, unsigned int flags) {
+        return syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete,
+                       flags, NULL, 0);
+}
+
+int uring_init(struct uring *ring, unsigned int entries) {
+        struct io_uring_params params;
+
+        memset(ring, 0, sizeof(struct uring));
+        memset(&params, 0, sizeof(params));
+        ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (ring->fd < 0)
+                return -1;
+
+        ring->sq_len = params.sq_off.array + params.sq_entries *
+                                                 sizeof(unsigned int);
+        ring->cq_len = params.cq_off.cqes +
+                       params.cq_entries * sizeof(struct io_uring_cqe);
+        ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+        ring->entries = params.sq_entries;
+
+        ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_SQ_RING);
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+        ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+        if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED ||
+            ring->sqes == MAP_FAILED) {
+                int err = errno;
+
+                uring_exit(ring);
+                errno = err;
+                return -1;
+        }
+
+        ring->sq_head = (unsigned int *)((char *)ring->sq_ptr +
+                                         params.sq_off.head);
+        ring->sq_tail = (unsigned int *)((char *)ring->sq_ptr +
+                                         params.sq_off.tail);
+        ring->sq_mask = (unsigned int *)((char *)ring->sq_ptr +
+                                         params.sq_off.ring_mask);
+        ring->sq_array = (unsigned int *)((char *)ring->sq_ptr +
+                                          params.sq_off.array);
+        ring->cq_head = (unsigned int *)((char *)ring->cq_ptr +
+                                         params.cq_off.head);
+        ring->cq_tail = (unsigned int *)((char *)ring->cq_ptr +
+                                         params.cq_off.tail);
+        ring->cq_mask = (unsigned int *)((char *)ring->cq_ptr +
+                                         params.cq_off.ring_mask);
+        ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr +
+                                             params.cq_off.cqes);
+        ring->sqe_tail = *ring->sq_tail;
+        return 0;
+}
+
+void uring_exit(struct uring *ring) {
+        if (ring->sqes && ring->sqes != MAP_FAILED)
+                munmap(ring->sqes, ring->sqes_len);
+        if (ring->cq_ptr && ring->cq_ptr != MAP_FAILED)
+                munmap(ring->cq_ptr, ring->cq_len);
+        if (ring->sq_ptr && ring->sq_ptr != MAP_FAILED)
+                munmap(ring->sq_ptr, ring->sq_len);
+        if (ring->fd >= 0)
+                close(ring->fd);
+        ring->fd = -1;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+        unsigned int tail = ring->sqe_tail;
+        unsigned int index;
+        struct io_uring_sqe *sqe;
+
+        if (tail - load_acquire(ring->sq_head) >= ring->entries)
+                return NULL;
+
+        index = tail & *ring->sq_mask;
+        sqe = &ring->sqes[index];
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        ring->sq_array[index] = index;
+        ring->sqe_tail = tail + 1;
+        return sqe;
+}
+
+/* Makes the entries that have been filled in since we last did this visible
+ * to the kernel. Only we move the tail, so it can be read without a barrier,
+ * but the release makes sure that the entries are written before it moves */
+static void uring_flush(struct uring *ring) {
+        unsigned int tail = *ring->sq_tail;
+
+        if (ring->sqe_tail == tail)
+                return;
+        ring->pending += ring->sqe_tail - tail;
+        store_release(ring->sq_tail, ring->sqe_tail);
+}
+
+int uring_submit(struct uring *ring) {
+        int ret;
+
+        uring_flush(ring);
+        while (ring->pending > 0) {
+                ret = uring_enter(ring, ring->pending, 0, 0);
+                if (ret < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+                ring->pending -= ret;
+        }
+        return 0;
+}
+
+int uring_peek(struct uring *ring, struct io_uring_cqe *cqe) {
+        unsigned int head = *ring->cq_head;
+
+        if (head == load_acquire(ring->cq_tail))
+                return 0;
+        *cqe = ring->cqes[head & *ring->cq_mask];
+        store_release(ring->cq_head, head + 1);
+        return 1;
+}
+
+int uring_wait(struct uring *ring, struct io_uring_cqe *cqe) {
+        int ret;
+
+        uring_flush(ring);
+        while ((ret = uring_peek(ring, cqe)) == 0) {
+                ret = uring_enter(ring, ring->pending, 1,
+                                  IORING_ENTER_GETEVENTS);
+                if (ret < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+                ring->pending -= ret;
+        }
+        return ret;
+}
+
+int uring_register_buffers(struct uring *ring, const struct iovec *iov,
+                           unsigned int count) {
+        return syscall(__NR_io_uring_register, ring->fd,
+                       IORING_REGISTER_BUFFERS, iov, count);
+}
+
+int uring_register_file(struct uring *ring, int fd) {
+        return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES,
+                       &fd, 1);
+}
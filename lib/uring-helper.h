@@ -0,0 +1,95 @@
+/*
+ *
+ * Copyright (c) 2007-2019 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libwandio.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libwandio is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwandio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#ifndef URING_HELPER_H
+#define URING_HELPER_H 1 /**< Guard Define */
+
+/* Helper for the modules that read and write files using io_uring. This is a
+ * bare minimum wrapper around the kernel interface, so that we don't need to
+ * depend on liburing.
+ *
+ * Like liburing, entries handed out by uring_get_sqe() only become visible to
+ * the kernel when they are submitted, so callers can fill them in first. The
+ * ring is never set up with IORING_SETUP_SQPOLL, so the kernel doesn't look
+ * at the queue until we enter it anyway.
+ */
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+struct uring {
+        int fd;
+        /* Submission queue, shared with the kernel */
+        unsigned int *sq_head;
+        unsigned int *sq_tail;
+        unsigned int *sq_mask;
+        unsigned int *sq_array;
+        struct io_uring_sqe *sqes;
+        /* Completion queue, shared with the kernel */
+        unsigned int *cq_head;
+        unsigned int *cq_tail;
+        unsigned int *cq_mask;
+        struct io_uring_cqe *cqes;
+        /* Tail of the entries handed out by uring_get_sqe(), which the
+         * kernel's tail is moved up to when they are submitted */
+        unsigned int sqe_tail;
+        /* Number of entries queued but not yet handed to the kernel */
+        unsigned int pending;
+        unsigned int entries;
+
+        void *sq_ptr;
+        size_t sq_len;
+        void *cq_ptr;
+        size_t cq_len;
+        size_t sqes_len;
+};
+
+/* Returns 0 on success, or -1 (with errno set) if io_uring is unavailable */
+int uring_init(struct uring *ring, unsigned int entries);
+void uring_exit(struct uring *ring);
+
+/* Returns a cleared submission entry, or NULL if the queue is full. The
+ * entry is queued by the next uring_submit() or uring_wait() */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+/* Hands any queued entries to the kernel without waiting */
+int uring_submit(struct uring *ring);
+
+/* Copies the next completion into cqe. uring_wait submits any queued entries
+ * and blocks until a completion is available, uring_peek returns 0 straight
+ * away if there is none. Both return 1 on success and -1 on error. */
+int uring_wait(struct uring *ring, struct io_uring_cqe *cqe);
+int uring_peek(struct uring *ring, struct io_uring_cqe *cqe);
+
+/* Registering buffers and files saves the kernel from mapping them on every
+ * request. These may fail (e.g. due to RLIMIT_MEMLOCK), in which case callers
+ * should just carry on without. */
+int uring_register_buffers(struct uring *ring, const struct iovec *iov,
+                           unsigned int count);
+int uring_register_file(struct uring *ring, int fd);
+
+#endif
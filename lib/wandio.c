@@ -30,11 +30,18 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "wandio_internal.h"
+#if HAVE_LIBNUMA
+#include <numa.h>
+#endif
 
 /* This file contains the implementation of the libwandio IO API, which format
  * modules should use to open, read from, write to, seek and close trace files.
@@ -56,6 +63,25 @@ int use_autodetect = 1;
 unsigned int use_threads = -1;
 unsigned int max_buffers = 50;
 int loghttpservererrors = 1;
+char *zstd_dict_file = NULL;
+char *zstd_dict_dir = NULL;
+int zstd_flush_frame = 0;
+int use_mmap = 0;
+int use_uring_read = 0;
+unsigned int uring_depth = 8;
+int use_uring_write = 0;
+unsigned int uring_sync_mb = 0;
+int use_streaming = 0;
+int use_hugepages = 0;
+unsigned int pool_threads = 0;
+unsigned int writeback_mb = 0;
+unsigned int datasync_secs = 0;
+unsigned int prealloc_mb = 0;
+unsigned int flush_ms = 0;
+/* The CPUs that worker threads run on, and the NUMA node they belong to */
+static int use_worker_cpus = 0;
+static cpu_set_t worker_cpus;
+static int worker_node = -1;
 
 uint64_t read_waits = 0;
 uint64_t write_waits = 0;
@@ -83,29 +109,120 @@ static const char *ctype_name(int compress_type) {
  *		   are uncompressed
  * nothreads -- Don't use threads
  * threads=n -- Use a maximum of 'n' threads for thread farms
+ * zstddict=file -- compress zstd output using the dictionary in 'file'
+ * zstddictdir=dir -- look up the dictionaries needed to read zstd input in
+ *                    'dir', where each is named <dictionary id>.dict
+ * zstdflushframe -- end the current zstd frame whenever the output is flushed
+ * mmap -- read local files by mapping them into memory
+ * uringread -- read local files using io_uring, if it is available
+ * uringwrite -- write local files using io_uring, if it is available
+ * uringdepth=n -- keep up to 'n' io_uring requests in flight per file
+ * uringsync=n -- have io_uring fdatasync written files after every 'n' MB
+ * writeback=n -- start writing local output files back to disk after every
+ *                'n' MB, from a background thread
+ * datasync=t -- fdatasync local output files every 't' seconds, from a
+ *               background thread
+ * prealloc=n -- allocate space for local output files 'n' MB at a time,
+ *               ahead of the data, and give back what is left at the end
+ * flushms=t -- have threaded writers flush data that has been waiting for
+ *              longer than 't' milliseconds
+ * streaming -- read ahead of and drop behind local files as they are read
+ *              and written, to keep them from filling the page cache
+ * hugepages -- back large buffers with huge pages and fault them in up front
+ * pool=n -- share 'n' worker threads between every reader and writer, rather
+ *           than starting threads for each of them
+ * cpus=list -- run worker threads on the CPUs in 'list', e.g. 0-3:8, and
+ *              place their buffers on the NUMA node of the first of them
  */
+/* Parses a list of CPUs or ranges of CPUs, separated by colons because the
+ * options themselves are separated by commas */
+static void parse_cpus(const char *list) {
+        const char *p = list;
+        char *end;
+        long first, last, cpu, lowest = -1;
+
+        CPU_ZERO(&worker_cpus);
+        while (*p != '\0') {
+                first = last = strtol(p, &end, 10);
+                if (end != p && *end == '-') {
+                        p = end + 1;
+                        last = strtol(p, &end, 10);
+                }
+                if (end == p || (*end != ':' && *end != '\0') || first < 0 ||
+                    last < first) {
+                        fprintf(stderr, "Bad libwandio CPU list '%s'\n", list);
+                        use_worker_cpus = 0;
+                        return;
+                }
+                for (cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+                        CPU_SET(cpu, &worker_cpus);
+                if (lowest < 0 || first < lowest)
+                        lowest = first;
+                p = *end == ':' ? end + 1 : end;
+        }
+        use_worker_cpus = CPU_COUNT(&worker_cpus) > 0;
+        worker_node = -1;
+#if HAVE_LIBNUMA
+        if (use_worker_cpus && numa_available() >= 0)
+                worker_node = numa_node_of_cpu(lowest);
+#endif
+}
+
 static void do_option(const char *option) {
         if (*option == '\0')
                 ;
         else if (strcmp(option, "stats") == 0)
                 keep_stats = 1;
-        /*
-        else if (strcmp(option,"directwrite") == 0)
+        else if (strcmp(option, "directwrite") == 0)
                 force_directio_write = 1;
-        else if (strcmp(option,"directread") == 0)
-                force_directio_read  = 1;
-        */
+        else if (strcmp(option, "directread") == 0)
+                force_directio_read = 1;
         else if (strcmp(option, "nothreads") == 0)
                 use_threads = 0;
         else if (strcmp(option, "nologhttpservererrors") == 0)
                 loghttpservererrors = 0;
         else if (strcmp(option, "noautodetect") == 0)
                 use_autodetect = 0;
+        else if (strcmp(option, "zstdflushframe") == 0)
+                zstd_flush_frame = 1;
+        else if (strcmp(option, "streaming") == 0)
+                use_streaming = 1;
+        else if (strcmp(option, "mmap") == 0)
+                use_mmap = 1;
+        else if (strcmp(option, "hugepages") == 0)
+                use_hugepages = 1;
+        else if (strcmp(option, "uringread") == 0)
+                use_uring_read = 1;
+        else if (strcmp(option, "uringwrite") == 0)
+                use_uring_write = 1;
+        else if (strncmp(option, "uringsync=", 10) == 0)
+                uring_sync_mb = atoi(option + 10);
+        else if (strncmp(option, "uringdepth=", 11) == 0 &&
+                 atoi(option + 11) > 0)
+                uring_depth = atoi(option + 11);
+        else if (strncmp(option, "writeback=", 10) == 0)
+                writeback_mb = atoi(option + 10);
+        else if (strncmp(option, "datasync=", 9) == 0)
+                datasync_secs = atoi(option + 9);
+        else if (strncmp(option, "prealloc=", 9) == 0)
+                prealloc_mb = atoi(option + 9);
+        else if (strncmp(option, "flushms=", 8) == 0)
+                flush_ms = atoi(option + 8);
+        else if (strncmp(option, "pool=", 5) == 0)
+                pool_threads = atoi(option + 5);
+        else if (strncmp(option, "cpus=", 5) == 0)
+                parse_cpus(option + 5);
         else if (strncmp(option, "threads=", 8) == 0)
                 use_threads = atoi(option + 8);
         else if (strncmp(option, "buffers=", 8) == 0)
                 max_buffers = atoi(option + 8);
-        else {
+        else if (strncmp(option, "zstddict=", 9) == 0) {
+                free(zstd_dict_file);
+                zstd_dict_file = strdup(option + 9);
+        } else if (strncmp(option, "zstddictdir=", 12) == 0) {
+                free(zstd_dict_dir);
+                zstd_dict_dir = strdup(option + 12);
+        } else {
                 fprintf(stderr, "Unknown libwandio debug option '%s'\n",
                         option);
         }
@@ -143,14 +260,15 @@ static void parse_env(void) {
 #define DEBUG_PIPELINE(x)
 #endif
 
+static io_t *create_io_pipeline(io_t *base, const char *filename,
+                                int autodetect, int mapped);
+
 static io_t *create_io_reader(const char *filename, int autodetect) {
-        io_t *io, *base;
-        /* Use a peeking reader to look at the start of the trace file and
-         * determine what type of compression may have been used to write
-         * the file */
+        io_t *base;
 
         /* should we use http or swift to read this file? */
         int stdfile = 1;
+        int mapped = 0;
         const char *p, *q;
         p = strstr(filename, "://");
         if (p && *p) {
@@ -162,8 +280,24 @@ static io_t *create_io_reader(const char *filename, int autodetect) {
                         stdfile = 0;
         }
         if (stdfile) {
-                DEBUG_PIPELINE("stdio");
-                base = stdio_open(filename);
+                base = NULL;
+                /* Fall back to stdio if the file can't be mapped */
+                if (use_mmap) {
+                        DEBUG_PIPELINE("mmap");
+                        base = mmap_open(filename);
+                        mapped = base != NULL;
+                }
+#if HAVE_IO_URING
+                /* Fall back to stdio if io_uring is unavailable */
+                if (!base && use_uring_read) {
+                        DEBUG_PIPELINE("uring");
+                        base = uring_open(filename);
+                }
+#endif
+                if (!base) {
+                        DEBUG_PIPELINE("stdio");
+                        base = stdio_open(filename);
+                }
         } else {
 #if HAVE_HTTP
                 /* is this a swift file? */
@@ -184,10 +318,23 @@ static io_t *create_io_reader(const char *filename, int autodetect) {
 #endif
         }
 
-        DEBUG_PIPELINE("peek");
-        base = peek_open(base);
+        return create_io_pipeline(base, filename, autodetect, mapped);
+}
+
+/* Puts the decompressor (if any), threaded reader and peeking reader on top
+ * of a reader for the raw file */
+static io_t *create_io_pipeline(io_t *base, const char *filename,
+                                int autodetect, int mapped) {
+        io_t *io;
+        bool compressed = false;
         unsigned char buffer[1024];
         int len;
+
+        /* Use a peeking reader to look at the start of the trace file and
+         * determine what type of compression may have been used to write
+         * the file */
+        DEBUG_PIPELINE("peek");
+        base = peek_open(base);
         if (!base)
                 return NULL;
         len = wandio_peek(base, buffer, sizeof(buffer));
@@ -208,6 +355,7 @@ static io_t *create_io_reader(const char *filename, int autodetect) {
                         if (io == NULL) {
                                 DEBUG_PIPELINE("zlib");
                                 io = zlib_open(base);
+                                compressed = true;
                         }
 #endif
                         if (io == NULL) {
@@ -225,6 +373,7 @@ static io_t *create_io_reader(const char *filename, int autodetect) {
 #if HAVE_LIBZ
                         DEBUG_PIPELINE("zlib");
                         io = zlib_open(base);
+                        compressed = true;
 #else
                         fprintf(stderr,
                                 "File %s is compress(1) compressed but "
@@ -241,6 +390,7 @@ static io_t *create_io_reader(const char *filename, int autodetect) {
 #if HAVE_LIBBZ2
                         DEBUG_PIPELINE("bzip");
                         io = bz_open(base);
+                        compressed = true;
 #else
                         fprintf(stderr,
                                 "File %s is bzip compressed but libwandio has "
@@ -255,6 +405,7 @@ static io_t *create_io_reader(const char *filename, int autodetect) {
 #if HAVE_LIBLZMA
                         DEBUG_PIPELINE("lzma");
                         io = lzma_open(base);
+                        compressed = true;
 #else
                         fprintf(stderr,
                                 "File %s is lzma compressed but libwandio has "
@@ -269,6 +420,7 @@ static io_t *create_io_reader(const char *filename, int autodetect) {
 #if HAVE_LIBZSTD
                         DEBUG_PIPELINE("zstd");
                         io = zstd_lz4_open(base);
+                        compressed = true;
 #else
                         fprintf(stderr,
                                 "File %s is zstd compress but libwandio has "
@@ -283,6 +435,7 @@ static io_t *create_io_reader(const char *filename, int autodetect) {
 #if HAVE_LIBLZ4F
                         DEBUG_PIPELINE("lz4");
                         io = zstd_lz4_open(base);
+                        compressed = true;
 #else
                         fprintf(stderr,
                                 "File %s is lz4 compress but libwandio has not "
@@ -299,6 +452,7 @@ static io_t *create_io_reader(const char *filename, int autodetect) {
 #if HAVE_LIBLZ4F || HAVE_LIBZSTD
                         DEBUG_PIPELINE("lz4 or zstd");
                         io = zstd_lz4_open(base);
+                        compressed = true;
 #else
                         fprintf(stderr,
                                 "File %s is lz4 or zstd compress but libwandio "
@@ -309,13 +463,21 @@ static io_t *create_io_reader(const char *filename, int autodetect) {
 #endif
                 }
         }
+        /* Don't hand out compressed data if we couldn't set up a decoder for
+         * it, e.g. because we ran out of memory */
+        if (io == NULL && compressed) {
+                wandio_destroy(base);
+                return NULL;
+        }
         /* Now open a threaded, peekable reader using the appropriate module
          * to read the data */
         if (io == NULL) {
                 io = base;
         }
 
-        if (use_threads) {
+        /* A thread would only add a copy when reading straight out of a
+         * mapped file, as the kernel is already reading ahead for us */
+        if (use_threads && !(io == base && mapped)) {
                 DEBUG_PIPELINE("thread");
                 io = thread_open(io);
         }
@@ -348,6 +510,26 @@ DLLEXPORT io_t *wandio_create_uncompressed(const char *filename) {
         return create_io_reader(filename, 0);
 }
 
+DLLEXPORT io_t *wandio_create_split(const char *filename,
+                                   const struct wandio_split *split) {
+        io_t *base;
+
+        parse_env();
+        base = stdio_open(filename);
+        if (!base)
+                return NULL;
+        if (wandio_seek(base, split->offset, SEEK_SET) != split->offset) {
+                wandio_destroy(base);
+                return NULL;
+        }
+        /* Part of an uncompressed file could start with anything, so don't
+         * try to work out what it is */
+        return create_io_pipeline(range_open(base, split->length), filename,
+                                  split->compression_type !=
+                                      WANDIO_COMPRESS_NONE,
+                                  0);
+}
+
 DLLEXPORT int64_t wandio_tell(io_t *io) {
         if (!io->source->tell) {
                 errno = -ENOSYS;
@@ -374,6 +556,35 @@ DLLEXPORT int64_t wandio_read(io_t *io, void *buffer, int64_t len) {
         return ret;
 }
 
+int64_t wandio_borrow(io_t *io, const void **buffer, void *scratch,
+                      int64_t len) {
+        if (io->source->borrow)
+                return io->source->borrow(io, buffer, scratch, len);
+        *buffer = scratch;
+        return wandio_read(io, scratch, len);
+}
+
+int64_t wandio_lend(io_t *io, struct wandio_loan_t *loan) {
+        int64_t ret = peek_lend(io, loan);
+
+        if (ret < 0 && errno == ENOTSUP)
+                ret = thread_lend(io, loan);
+        return ret;
+}
+
+void wandio_unlend(struct wandio_loan_t *loan) {
+        if (loan->owner)
+                thread_unlend(loan);
+        else
+                free(loan->memory);
+}
+
+DLLEXPORT int wandio_get_fd(io_t *io, int64_t *offset) {
+        if (!io->source->get_fd)
+                return -1;
+        return io->source->get_fd(io, offset);
+}
+
 DLLEXPORT int64_t wandio_peek(io_t *io, void *buffer, int64_t len) {
         int64_t ret;
         assert(io->source->peek); /* If this fails, it means you're calling
@@ -402,13 +613,86 @@ DLLEXPORT void wandio_destroy(io_t *io) {
 
 DLLEXPORT iow_t *wandio_wcreate(const char *filename, int compress_type,
                                 int compression_level, int flags) {
+        assert(compression_level >= 0 && compression_level <= 9);
+        return wandio_wcreate_opts(filename, compress_type, compression_level,
+                                   flags, NULL);
+}
+
+int64_t wandio_wopt_get(const struct wandio_wopt *opts, int option,
+                        int64_t def) {
+        if (!opts)
+                return def;
+        for (; opts->option != WANDIO_WOPT_END; opts++) {
+                if (opts->option == option)
+                        return opts->value;
+        }
+        return def;
+}
+
+/* Only a small sample of the buffer is examined: a few evenly spaced runs of
+ * bytes, which is enough to catch compressed or encrypted data without
+ * costing anything noticeable next to the compressor itself.
+ */
+#define SAMPLE_RUNS 16
+#define SAMPLE_RUN_LEN 256
+
+bool wandio_incompressible(const void *buffer, int64_t len) {
+        const uint8_t *bytes = buffer;
+        uint32_t counts[256];
+        uint64_t n = SAMPLE_RUNS * SAMPLE_RUN_LEN;
+        uint64_t sum = 0;
+        int64_t stride = len / SAMPLE_RUNS;
+        int i, j;
+
+        if (stride < SAMPLE_RUN_LEN)
+                return false;
+
+        memset(counts, 0, sizeof(counts));
+        for (i = 0; i < SAMPLE_RUNS; i++) {
+                for (j = 0; j < SAMPLE_RUN_LEN; j++)
+                        counts[bytes[i * stride + j]]++;
+        }
+
+        /* sum / n^2 is the chance that two sampled bytes are the same,
+         * which is 1/256 if every byte value is equally likely. Anything
+         * within 20% of that (more than ~7.7 bits of entropy per byte) is
+         * not going to compress. */
+        for (i = 0; i < 256; i++)
+                sum += (uint64_t)counts[i] * counts[i];
+        return sum * 256 * 5 < n * n * 6;
+}
+
+/* Storing data that would have compressed costs far more than compressing
+ * data that won't, so we go back to compressing straight away */
+bool wandio_store_steady(bool storing, int64_t *run, const void *buffer,
+                         int64_t len) {
+        if (len < WANDIO_SAMPLE_MIN)
+                return storing;
+        if (!wandio_incompressible(buffer, len)) {
+                *run = 0;
+                return false;
+        }
+        if (storing)
+                return true;
+        *run += len;
+        return *run >= WANDIO_STORE_SWITCH;
+}
+
+iow_t *wandio_wcreate_unthreaded(const char *filename, int compress_type,
+                                 int compression_level, int flags,
+                                 const struct wandio_wopt *opts) {
         iow_t *iow, *base;
-        parse_env();
 
-        assert(compression_level >= 0 && compression_level <= 9);
         assert(compress_type != WANDIO_COMPRESS_MASK);
 
-        base = stdio_wopen(filename, flags);
+        base = NULL;
+#if HAVE_IO_URING
+        /* Fall back to stdio if io_uring is unavailable */
+        if (use_uring_write)
+                base = uring_wopen(filename, flags);
+#endif
+        if (!base)
+                base = stdio_wopen(filename, flags);
         if (!base)
                 return NULL;
         iow = base;
@@ -423,7 +707,8 @@ DLLEXPORT iow_t *wandio_wcreate(const char *filename, int compress_type,
 #endif
 #if HAVE_LIBZ
                         if (iow == NULL || iow == base) {
-                                iow = zlib_wopen(base, compression_level);
+                                iow = zlib_wopen_opts(base, compression_level,
+                                                      opts);
                         }
 #endif
                 }
@@ -439,20 +724,51 @@ DLLEXPORT iow_t *wandio_wcreate(const char *filename, int compress_type,
 #endif
 #if HAVE_LIBLZMA
                 if (compress_type == WANDIO_COMPRESS_LZMA) {
-                        iow = lzma_wopen(base, compression_level);
+                        iow = lzma_wopen_opts(base, compression_level, opts);
                 }
 #endif
 #if HAVE_LIBZSTD
                 if (compress_type == WANDIO_COMPRESS_ZSTD) {
-                        iow = zstd_wopen(base, compression_level);
+                        if (zstd_dict_file) {
+                                int64_t dict_len;
+                                void *dict =
+                                    wandio_load_file(zstd_dict_file, &dict_len);
+                                if (!dict) {
+                                        fprintf(stderr,
+                                                "Unable to load zstd "
+                                                "dictionary %s\n",
+                                                zstd_dict_file);
+                                        wandio_wdestroy(base);
+                                        return NULL;
+                                }
+                                iow = zstd_wopen_opts(base, compression_level,
+                                                      opts);
+                                if (iow &&
+                                    zstd_wload_dict(iow, dict, dict_len) < 0) {
+                                        /* Closing the zstd writer will also
+                                         * close base */
+                                        wandio_wdestroy(iow);
+                                        free(dict);
+                                        return NULL;
+                                }
+                                free(dict);
+                        } else {
+                                iow = zstd_wopen_opts(base, compression_level,
+                                                      opts);
+                        }
                 }
 #endif
 #if HAVE_LIBLZ4F
                 if (compress_type == WANDIO_COMPRESS_LZ4) {
-                        iow = lz4_wopen(base, compression_level);
+                        iow = lz4_wopen_opts(base, compression_level, opts);
                 }
 #endif
         }
+        if (!iow) {
+                /* The compression method rejected the level or options */
+                wandio_wdestroy(base);
+                return NULL;
+        }
         if (compress_type != WANDIO_COMPRESS_NONE && iow == base) {
                 fprintf(stderr,
                         "warning: %s compression requested but libwandio has "
@@ -460,6 +776,17 @@ DLLEXPORT iow_t *wandio_wcreate(const char *filename, int compress_type,
                         "falling back to stdio\n",
                         ctype_name(compress_type));
         }
+        return iow;
+}
+
+DLLEXPORT iow_t *wandio_wcreate_opts(const char *filename, int compress_type,
+                                     int compression_level, int flags,
+                                     const struct wandio_wopt *opts) {
+        iow_t *iow;
+        parse_env();
+
+        iow = wandio_wcreate_unthreaded(filename, compress_type,
+                                        compression_level, flags, opts);
 
         /* Open a threaded writer */
         if (iow && use_threads) {
@@ -469,6 +796,68 @@ DLLEXPORT iow_t *wandio_wcreate(const char *filename, int compress_type,
         }
 }
 
+DLLEXPORT io_t *wandio_create_sharded(const char *const *filenames,
+                                      int count) {
+        parse_env();
+        return peek_open(shard_open(filenames, count));
+}
+
+DLLEXPORT iow_t *wandio_wcreate_rotating(const char *filename,
+                                         int compress_type,
+                                         int compression_level, int flags,
+                                         const struct wandio_wopt *opts) {
+        parse_env();
+        return rotate_wopen(filename, compress_type, compression_level, flags,
+                            opts);
+}
+
+DLLEXPORT int wandio_wprepare(iow_t *iow, const char *filename) {
+        return rotate_wprepare(iow, filename);
+}
+
+DLLEXPORT int wandio_wrotate(iow_t *iow) {
+        return rotate_wrotate(iow);
+}
+
+DLLEXPORT iow_t *wandio_wcreate_tee(const struct wandio_branch *branches,
+                                    int count) {
+        parse_env();
+        return tee_wopen(branches, count);
+}
+
+DLLEXPORT iow_t *wandio_wcreate_multi(const char *filename,
+                                      int compress_type,
+                                      int compression_level, int flags,
+                                      const struct wandio_wopt *opts,
+                                      bool ordered) {
+        parse_env();
+        return multi_wopen(filename, compress_type, compression_level, flags,
+                           opts, ordered);
+}
+
+DLLEXPORT iow_t *wandio_wproducer(iow_t *iow) {
+        return multi_wproducer(iow);
+}
+
+DLLEXPORT int64_t wandio_wwrite_seq(iow_t *iow, uint64_t seq,
+                                    const void *buffer, int64_t len) {
+        return multi_wwrite_seq(iow, seq, buffer, len);
+}
+
+DLLEXPORT iow_t *wandio_wcreate_sharded(const char *const *filenames,
+                                        int count, int compress_type,
+                                        int compression_level, int flags,
+                                        const struct wandio_wopt *opts) {
+        parse_env();
+        return shard_wopen(filenames, count, compress_type, compression_level,
+                           flags, opts);
+}
+
+DLLEXPORT int64_t wandio_wwrite_key(iow_t *iow, uint64_t key,
+                                    const void *buffer, int64_t len) {
+        return shard_wwrite_key(iow, key, buffer, len);
+}
+
 DLLEXPORT int64_t wandio_wwrite(iow_t *iow, const void *buffer, int64_t len) {
 #if WRITE_TRACE
         fprintf(stderr, "wwrite(%s): %d bytes\n", iow->source->name, (int)len);
@@ -485,6 +874,29 @@ DLLEXPORT int wandio_wflush(iow_t *iow) {
         return -1;
 }
 
+DLLEXPORT int wandio_wset_nonblocking(iow_t *iow, int nonblock) {
+        return thread_wset_nonblocking(iow, nonblock != 0);
+}
+
+DLLEXPORT int64_t wandio_wqueued(iow_t *iow) {
+        return thread_wqueued(iow);
+}
+
+DLLEXPORT int wandio_wset_watermarks(iow_t *iow, int64_t low, int64_t high,
+                                     wandio_watermark_cb_t *cb, void *data) {
+        if (low < 0 || high <= low) {
+                errno = EINVAL;
+                return -1;
+        }
+        return thread_wset_watermarks(iow, low, high, cb, data);
+}
+
+DLLEXPORT int wandio_wget_fd(iow_t *iow) {
+        if (!iow->source->get_fd)
+                return -1;
+        return iow->source->get_fd(iow);
+}
+
 DLLEXPORT void wandio_wdestroy(iow_t *iow) {
         iow->source->close(iow);
         if (keep_stats)
@@ -493,6 +905,246 @@ DLLEXPORT void wandio_wdestroy(iow_t *iow) {
                         write_waits);
 }
 
+struct async_close_t {
+        struct wandio_task_t task;
+        iow_t *iow;
+        wandio_closed_cb_t *cb;
+        void *data;
+};
+
+static void async_close(void *userdata) {
+        struct async_close_t *job = (struct async_close_t *)userdata;
+
+        wandio_wdestroy(job->iow);
+        if (job->cb)
+                job->cb(job->data);
+        free(job);
+}
+
+DLLEXPORT void wandio_wdestroy_async(iow_t *iow, wandio_closed_cb_t *cb,
+                                     void *data) {
+        struct async_close_t *job = malloc(sizeof(struct async_close_t));
+
+        if (job) {
+                job->task.job = async_close;
+                job->task.arg = job;
+                job->iow = iow;
+                job->cb = cb;
+                job->data = data;
+                /* Closing waits for the writer's own jobs to finish */
+                if (wandio_pool_submit_blocking(&job->task) == 0)
+                        return;
+        }
+        /* The best we can do is close it ourselves */
+        free(job);
+        wandio_wdestroy(iow);
+        if (cb)
+                cb(data);
+}
+
+void *wandio_load_file(const char *filename, int64_t *len) {
+        struct stat st;
+        char *buf;
+        int64_t got = 0;
+        int fd = open(filename, O_RDONLY);
+
+        if (fd == -1)
+                return NULL;
+        if (fstat(fd, &st) == -1 || st.st_size <= 0) {
+                close(fd);
+                return NULL;
+        }
+        buf = malloc(st.st_size);
+        if (!buf) {
+                close(fd);
+                return NULL;
+        }
+        while (got < st.st_size) {
+                ssize_t ret = read(fd, buf + got, st.st_size - got);
+                if (ret <= 0) {
+                        free(buf);
+                        close(fd);
+                        return NULL;
+                }
+                got += ret;
+        }
+        close(fd);
+        *len = got;
+        return buf;
+}
+
+#define SMALL_PAGE_SIZE 4096
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+/* Anything smaller than this isn't worth a mapping of its own, and comes from
+ * posix_memalign() whatever options are set */
+#define MAPPED_MIN (256 * 1024)
+
+/* The buffers that were mapped rather than allocated, so that
+ * wandio_free_buffer() knows how much to unmap. Keeping these apart from the
+ * buffers means that a buffer starts right at the start of its mapping, and
+ * so is huge page aligned. There are only ever a handful of these, at most a
+ * few per reader or writer.
+ */
+struct mapped_buffer_t {
+        void *start;
+        size_t len;
+        struct mapped_buffer_t *next;
+};
+
+static struct mapped_buffer_t *mapped_buffers = NULL;
+static pthread_mutex_t mapped_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void *alloc_mapped(size_t len) {
+        char *ptr = MAP_FAILED, *aligned;
+        size_t off;
+
+        /* Pages from the hugetlb pool are the best we can do, but only exist
+         * if the administrator has reserved some */
+        if (use_hugepages)
+                ptr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (ptr != MAP_FAILED) {
+                aligned = ptr;
+        } else if (use_hugepages) {
+                /* Otherwise ask for transparent huge pages, which need the
+                 * mapping to be aligned to a huge page. Trim off whatever we
+                 * don't need */
+                ptr = mmap(NULL, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (ptr == MAP_FAILED)
+                        return NULL;
+                aligned = (char *)(((uintptr_t)ptr + HUGE_PAGE_SIZE - 1) &
+                                   ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+                if (aligned > ptr)
+                        munmap(ptr, aligned - ptr);
+                munmap(aligned + len, HUGE_PAGE_SIZE - (aligned - ptr));
+                madvise(aligned, len, MADV_HUGEPAGE);
+        } else {
+                aligned = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (aligned == MAP_FAILED)
+                        return NULL;
+        }
+
+#if HAVE_LIBNUMA
+        /* Nothing has been faulted in yet, so every page will come from the
+         * node that the worker threads are running on */
+        if (worker_node >= 0)
+                numa_tonode_memory(aligned, len, worker_node);
+#endif
+
+        /* Fault everything in now rather than in the middle of a copy */
+        if (use_hugepages) {
+                for (off = 0; off < len; off += SMALL_PAGE_SIZE)
+                        aligned[off] = 0;
+        }
+        return aligned;
+}
+
+void *wandio_alloc_buffer(size_t size) {
+        struct mapped_buffer_t *mapped;
+        size_t len = size;
+        void *start;
+
+        if ((!use_hugepages && worker_node < 0) || size < MAPPED_MIN) {
+                if (posix_memalign(&start, SMALL_PAGE_SIZE, size) != 0)
+                        return NULL;
+                return start;
+        }
+
+        if (use_hugepages)
+                len = (len + HUGE_PAGE_SIZE - 1) &
+                      ~(size_t)(HUGE_PAGE_SIZE - 1);
+        mapped = malloc(sizeof(struct mapped_buffer_t));
+        if (!mapped)
+                return NULL;
+        start = alloc_mapped(len);
+        if (!start) {
+                free(mapped);
+                return NULL;
+        }
+        mapped->start = start;
+        mapped->len = len;
+        pthread_mutex_lock(&mapped_mutex);
+        mapped->next = mapped_buffers;
+        mapped_buffers = mapped;
+        pthread_mutex_unlock(&mapped_mutex);
+        return start;
+}
+
+/* Set while a reading thread is filling a buffer, and points at the flag
+ * that tells it to give up */
+static __thread const bool *cancel_flag = NULL;
+
+void wandio_set_cancel(const bool *flag) {
+        cancel_flag = flag;
+}
+
+bool wandio_cancellable(void) {
+        return cancel_flag != NULL;
+}
+
+bool wandio_read_cancelled(void) {
+        return cancel_flag && __atomic_load_n(cancel_flag, __ATOMIC_ACQUIRE);
+}
+
+int wandio_thread_create(pthread_t *thread, void *(*start)(void *),
+                         void *arg) {
+        pthread_attr_t attr;
+        int ret;
+
+        if (!use_worker_cpus)
+                return pthread_create(thread, NULL, start, arg);
+
+        pthread_attr_init(&attr);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &worker_cpus);
+        ret = pthread_create(thread, &attr, start, arg);
+        pthread_attr_destroy(&attr);
+        return ret;
+}
+
+void wandio_free_buffer(void *buffer) {
+        struct mapped_buffer_t **prev, *mapped = NULL;
+
+        if (!buffer)
+                return;
+        pthread_mutex_lock(&mapped_mutex);
+        for (prev = &mapped_buffers; *prev; prev = &(*prev)->next) {
+                if ((*prev)->start == buffer) {
+                        mapped = *prev;
+                        *prev = mapped->next;
+                        break;
+                }
+        }
+        pthread_mutex_unlock(&mapped_mutex);
+
+        if (!mapped) {
+                free(buffer);
+                return;
+        }
+        munmap(mapped->start, mapped->len);
+        free(mapped);
+}
+
+DLLEXPORT int64_t wandio_zstd_train_dict(char *const *filenames, int count,
+                                         void *dict, int64_t capacity,
+                                         unsigned int *dict_id) {
+#if HAVE_LIBZSTD
+        parse_env();
+        return zstd_train_dict(filenames, count, dict, capacity, dict_id);
+#else
+        (void)filenames;
+        (void)count;
+        (void)dict;
+        (void)capacity;
+        (void)dict_id;
+        fprintf(stderr, "libwandio has not been built with zstd support, "
+                        "unable to train a dictionary\n");
+        errno = ENOSYS;
+        return -1;
+#endif
+}
+
 /** Alistair's API extensions from "wandio_util" */
 
 DLLEXPORT int64_t wandio_generic_fgets(void *file, void *buffer, int64_t len,
@@ -134,6 +134,34 @@ typedef struct {
          * @param io		The IO reader to close
          */
         void (*close)(io_t *io);
+
+        /** Reads from the IO source without copying, if the data is already
+         *  in memory somewhere (e.g. a memory mapped file). This is optional
+         *  and may be NULL.
+         *
+         * @param io		The IO reader
+         * @param buffer	Set to point at the data that was read, which
+         * 			remains valid until the next call on this reader
+         * @param scratch	A buffer that the data may be read into instead,
+         * 			if it can't be handed out directly
+         * @param len		The most data to return, and the amount of
+         * 			space available in scratch
+         * @return The amount of bytes read, 0 if end of file is reached, -1
+         * if an error occurs
+         */
+        int64_t (*borrow)(io_t *io, const void **buffer, void *scratch,
+                          int64_t len);
+
+        /** Returns the file descriptor that the IO source reads from, if it
+         *  is reading a local file without decompressing it. This is
+         *  optional and may be NULL.
+         *
+         * @param io		The IO reader
+         * @param offset	Set to the file offset of the next byte that
+         * 			would be read, or -1 if the descriptor can't seek
+         * @return The file descriptor, or -1 if there isn't one
+         */
+        int (*get_fd)(io_t *io, int64_t *offset);
 } io_source_t;
 
 /** Structure defining a libwandio IO writer module */
@@ -161,6 +189,26 @@ typedef struct {
          * @param iow		The IO writer to close
          */
         void (*close)(iow_t *iow);
+
+        /** Tells an IO writer whether it is keeping up with the data being
+         *  written to it, so that it can trade compression ratio for speed.
+         *  This is optional and may be NULL.
+         *
+         * @param iow		The IO writer that should adapt
+         * @param faster	True if the writer is falling behind and should
+         * 			compress faster, false if it has time to spare
+         * 			and may compress harder
+         */
+        void (*adapt)(iow_t *iow, bool faster);
+
+        /** Writes out any buffered output and returns the file descriptor
+         *  that the IO writer writes to, if it is writing a local file
+         *  without compressing it. This is optional and may be NULL.
+         *
+         * @param iow		The IO writer
+         * @return The file descriptor, or -1 if there isn't one
+         */
+        int (*get_fd)(iow_t *iow);
 } iow_source_t;
 
 /** A libwandio IO reader */
@@ -199,6 +247,67 @@ enum {
         WANDIO_COMPRESS_MASK = 7
 };
 
+/** Codec specific tuning options for IO writers.
+ *
+ * Options are passed as an array of struct wandio_wopt, terminated by an
+ * entry with the option WANDIO_WOPT_END. Options that do not apply to the
+ * chosen compression method are ignored.
+ */
+enum wandio_wopt_t {
+        /** Marks the end of an option array */
+        WANDIO_WOPT_END = 0,
+        /** zstd: log2 of the maximum back-reference distance (10 - 31) */
+        WANDIO_WOPT_ZSTD_WINDOW_LOG = 1,
+        /** zstd: enable long distance matching using a window of
+         *  2^value bytes, the same as zstd --long=value */
+        WANDIO_WOPT_ZSTD_LONG = 2,
+        /** zlib: memory used for the internal compression state (1 - 9) */
+        WANDIO_WOPT_ZLIB_MEM_LEVEL = 3,
+        /** zlib: compression strategy, using the zlib values: 0 = default,
+         *  1 = filtered, 2 = huffman only, 3 = rle, 4 = fixed */
+        WANDIO_WOPT_ZLIB_STRATEGY = 4,
+        /** lz4: maximum block size in bytes, one of 65536, 262144, 1048576
+         *  or 4194304 */
+        WANDIO_WOPT_LZ4_BLOCK_SIZE = 5,
+        /** lzma: if non-zero, use the slower "extreme" variant of the
+         *  compression level preset */
+        WANDIO_WOPT_LZMA_EXTREME = 6,
+        /** lzma: start a new xz block after this many bytes of input */
+        WANDIO_WOPT_LZMA_BLOCK_SIZE = 7,
+        /** zstd, zlib, lz4: adapt the compression level to keep up with the
+         *  data being written, going no lower than this level. The level
+         *  passed when opening the writer is the highest level used. Only
+         *  has an effect when writing using a separate thread. */
+        WANDIO_WOPT_ADAPT_MIN_LEVEL = 8,
+        /** zstd, zlib, lz4: store data that looks incompressible (e.g.
+         *  data that is already compressed or encrypted) instead of
+         *  compressing it. On by default, set to 0 to disable. */
+        WANDIO_WOPT_STORE_INCOMPRESSIBLE = 9,
+};
+
+/** A single codec tuning option and its value */
+struct wandio_wopt {
+        /** The option being set, from enum wandio_wopt_t */
+        int option;
+        /** The value for the option */
+        int64_t value;
+};
+
+/** One of the files written by a writer created using wandio_wcreate_tee() */
+struct wandio_branch {
+        /** The name of the file to write */
+        const char *filename;
+        /** Compression type */
+        int compression_type;
+        /** The compression level to use when writing */
+        int compression_level;
+        /** Flags to apply when opening the file */
+        int flags;
+        /** An array of tuning options terminated by WANDIO_WOPT_END, or
+         *  NULL */
+        const struct wandio_wopt *opts;
+};
+
 /** @name IO open functions
  *
  * These functions deal with creating and initialising a new IO reader or
@@ -215,19 +324,44 @@ io_t *zstd_lz4_open(io_t *parent);
 io_t *peek_open(io_t *parent);
 io_t *qat_open(io_t *parent);
 io_t *stdio_open(const char *filename);
+io_t *uring_open(const char *filename);
+io_t *mmap_open(const char *filename);
 io_t *http_open(const char *filename);
 io_t *http_open_hdrs(const char *filename, char **hdrs, int hdrs_cnt);
 io_t *swift_open(const char *filename);
+io_t *shard_open(const char *const *filenames, int count);
+io_t *range_open(io_t *parent, int64_t length);
 
 iow_t *zlib_wopen(iow_t *child, int compress_level);
+iow_t *zlib_wopen_opts(iow_t *child, int compress_level,
+                       const struct wandio_wopt *opts);
 iow_t *bz_wopen(iow_t *child, int compress_level);
 iow_t *lzo_wopen(iow_t *child, int compress_level);
 iow_t *lzma_wopen(iow_t *child, int compress_level);
+iow_t *lzma_wopen_opts(iow_t *child, int compress_level,
+                       const struct wandio_wopt *opts);
 iow_t *zstd_wopen(iow_t *child, int compress_level);
+iow_t *zstd_wopen_opts(iow_t *child, int compress_level,
+                       const struct wandio_wopt *opts);
+iow_t *zstd_wopen_dict(iow_t *child, int compress_level, const void *dict,
+                       int64_t dict_len);
 iow_t *qat_wopen(iow_t *child, int compress_level);
 iow_t *lz4_wopen(iow_t *child, int compress_level);
+iow_t *lz4_wopen_opts(iow_t *child, int compress_level,
+                      const struct wandio_wopt *opts);
 iow_t *thread_wopen(iow_t *child);
 iow_t *stdio_wopen(const char *filename, int fileflags);
+iow_t *uring_wopen(const char *filename, int fileflags);
+iow_t *rotate_wopen(const char *filename, int compress_type,
+                    int compression_level, int flags,
+                    const struct wandio_wopt *opts);
+iow_t *tee_wopen(const struct wandio_branch *branches, int count);
+iow_t *multi_wopen(const char *filename, int compress_type,
+                   int compression_level, int flags,
+                   const struct wandio_wopt *opts, bool ordered);
+iow_t *shard_wopen(const char *const *filenames, int count, int compress_type,
+                   int compression_level, int flags,
+                   const struct wandio_wopt *opts);
 
 /* @} */
 
@@ -279,6 +413,65 @@ io_t *wandio_create(const char *filename);
  */
 io_t *wandio_create_uncompressed(const char *filename);
 
+/** Creates a new libwandio IO reader for a set of files written by a writer
+ * from wandio_wcreate_sharded(), which gives back the data that was
+ * written, in the order it was written.
+ *
+ * @param filenames	The names of the files, in any order
+ * @param count		The number of files
+ * @return A pointer to a new libwandio IO reader, or NULL if an error occurs,
+ * with errno set to EINVAL if any of the files wasn't written by a sharded
+ * writer
+ *
+ * If a file ends early, e.g. because the writer was killed, the data that
+ * was written to it after that point is skipped.
+ */
+io_t *wandio_create_sharded(const char *const *filenames, int count);
+
+/** A part of a file that can be read by itself, from wandio_plan_splits() */
+struct wandio_split {
+        /** The offset of the start of the range in the file */
+        int64_t offset;
+        /** The length of the range in the file */
+        int64_t length;
+        /** The offset in the decompressed data that the range starts at */
+        int64_t uncompressed_offset;
+        /** The compression type of the file */
+        int compression_type;
+};
+
+/** Divides a local file into ranges that can each be read by a reader of
+ * their own, e.g. on a different core or machine, using
+ * wandio_create_split().
+ *
+ * Compressed files can only be divided where decompression can start
+ * afresh: at zstd and lz4 frames, gzip members (including BGZF blocks) and
+ * bzip2 streams. Working these out means reading through the whole file,
+ * and decompressing any gzip member, bzip2 stream or frame that doesn't
+ * give its size up front. Files that are a single member, stream or frame,
+ * and xz and lzo files, are left in one piece.
+ *
+ * @param filename	The name of the file to divide
+ * @param n		The number of ranges wanted
+ * @param splits	An array of n entries, which is filled in with the
+ * 			ranges, in order
+ * @return The number of ranges, which may be fewer than n if the file can't
+ * be divided that finely, or -1 if an error occurs
+ */
+int wandio_plan_splits(const char *filename, int n,
+                       struct wandio_split *splits);
+
+/** Creates a new libwandio IO reader for one of the ranges of a file from
+ * wandio_plan_splits(), which returns the decompressed data for just that
+ * range.
+ *
+ * @param filename	The name of the file
+ * @param split		The range to read
+ * @return A pointer to a new libwandio IO reader, or NULL if an error occurs
+ */
+io_t *wandio_create_split(const char *filename,
+                          const struct wandio_split *split);
+
 /** Returns the current offset of the read pointer for a libwandio IO reader.
  *
  * @param io		The IO reader to get the read offset for
@@ -319,6 +512,25 @@ int64_t wandio_read(io_t *io, void *buffer, int64_t len);
  */
 int64_t wandio_peek(io_t *io, void *buffer, int64_t len);
 
+/** Returns the file descriptor underneath a libwandio IO reader, so that
+ * the caller can copy the rest of the file without going through libwandio
+ * (e.g. using copy_file_range(2) or splice(2)). This is only possible if the
+ * reader is reading a local file that isn't compressed.
+ *
+ * The descriptor still belongs to the reader and may be shared with a
+ * reading thread, so callers should read from it using explicit offsets
+ * (starting from offset) rather than the file position. The reader should
+ * not be used again once the caller has read from the descriptor, other
+ * than to destroy it.
+ *
+ * @param io		The IO reader
+ * @param offset	Set to the file offset of the next byte the reader
+ * 			would have returned, or -1 if the descriptor can't
+ * 			seek (e.g. a pipe) and must be read from directly
+ * @return The file descriptor, or -1 if there isn't a suitable one
+ */
+int wandio_get_fd(io_t *io, int64_t *offset);
+
 /** Destroys a libwandio IO reader, closing the file and freeing the reader
  * structure.
  *
@@ -338,6 +550,235 @@ void wandio_destroy(io_t *io);
 iow_t *wandio_wcreate(const char *filename, int compression_type,
                       int compression_level, int flags);
 
+/** Creates a new libwandio IO writer using codec specific tuning options.
+ *
+ * @param filename		The name of the file to open
+ * @param compression_type	Compression type
+ * @param compression_level	The compression level to use when writing
+ * @param flags			Flags to apply when opening the file, e.g.
+ * 				O_CREAT. See fcntl.h for more flags.
+ * @param opts			An array of tuning options terminated by
+ * 				WANDIO_WOPT_END, or NULL
+ * @return A pointer to the new libwandio IO writer, or NULL if an error occurs
+ *
+ * Unlike wandio_wcreate, the compression level is not limited to 0 - 9, but
+ * may be any level supported by the compression method, e.g. -7 to 22 for
+ * zstd or 1 to 12 for lz4. A level of 0 still means no compression.
+ */
+iow_t *wandio_wcreate_opts(const char *filename, int compression_type,
+                           int compression_level, int flags,
+                           const struct wandio_wopt *opts);
+
+/** Creates a new libwandio IO writer that can move on to a new file without
+ * waiting for the old one to be finished off, e.g. to start a new capture
+ * file every hour.
+ *
+ * The name of the next file is given in advance using wandio_wprepare(), so
+ * that it can be opened in the background. wandio_wrotate() then switches
+ * to it, at whatever point in the data the caller chooses, and the old file
+ * is closed in the background as well. Every file is created with the same
+ * compression settings and options.
+ *
+ * @param filename		The name of the first file to open
+ * @param compression_type	Compression type
+ * @param compression_level	The compression level to use when writing
+ * @param flags			Flags to apply when opening each file
+ * @param opts			An array of tuning options terminated by
+ * 				WANDIO_WOPT_END, or NULL
+ * @return A pointer to the new libwandio IO writer, or NULL if an error occurs
+ */
+iow_t *wandio_wcreate_rotating(const char *filename, int compression_type,
+                               int compression_level, int flags,
+                               const struct wandio_wopt *opts);
+
+/** Starts opening the file that a rotating writer will move on to next.
+ *
+ * @param iow		A writer created by wandio_wcreate_rotating()
+ * @param filename	The name of the next file
+ * @return 0 if successful, or -1 with errno set to EBUSY if another file
+ * has already been prepared, or ENOTSUP if the writer doesn't rotate
+ */
+int wandio_wprepare(iow_t *iow, const char *filename);
+
+/** Moves a rotating writer on to the file given to wandio_wprepare(), so
+ * that everything written from now on goes into the new file. The old file
+ * is finished off and closed in the background. This only waits if the new
+ * file hasn't finished being opened yet.
+ *
+ * @param iow		A writer created by wandio_wcreate_rotating()
+ * @return 0 if successful, or -1 with errno set to EINVAL if no file has
+ * been prepared, EIO if it could not be opened (in which case the writer
+ * carries on with the current file), or ENOTSUP if the writer doesn't
+ * rotate
+ */
+int wandio_wrotate(iow_t *iow);
+
+/** Creates a new libwandio IO writer that writes the same data to several
+ * files, each with its own compression settings, e.g. a quick lz4 copy and
+ * a smaller zstd copy of the same capture.
+ *
+ * Data written is copied once and shared between the files, and each file
+ * is compressed and written by a thread of its own, so a slow branch only
+ * holds the others up once it falls a few buffers behind.
+ *
+ * @param branches	The files to write, and how to write each one
+ * @param count		The number of entries in branches
+ * @return A pointer to the new libwandio IO writer, or NULL if any of the
+ * files could not be opened
+ */
+iow_t *wandio_wcreate_tee(const struct wandio_branch *branches, int count);
+
+/** Creates a new libwandio IO writer that several threads can write to at
+ * the same time, each through a producer handle of its own from
+ * wandio_wproducer().
+ *
+ * Each producer copies what it is given into buffers of its own, without
+ * taking any locks, and full buffers are merged into the file by a
+ * separate thread. Every write is kept in one piece in the file. Unless
+ * ordered is set, writes from different producers appear in roughly the
+ * order they were made. If ordered is set, every write must be made using
+ * wandio_wwrite_seq() instead, and they appear in order of their sequence
+ * numbers.
+ *
+ * Every producer must be destroyed, using wandio_wdestroy(), before the
+ * writer itself is. The writer itself cannot be written to.
+ *
+ * @param filename		The name of the file to open
+ * @param compression_type	Compression type
+ * @param compression_level	The compression level to use when writing
+ * @param flags			Flags to apply when opening the file
+ * @param opts			An array of tuning options terminated by
+ * 				WANDIO_WOPT_END, or NULL
+ * @param ordered		Whether writes are ordered by sequence number
+ * @return A pointer to the new libwandio IO writer, or NULL if an error occurs
+ */
+iow_t *wandio_wcreate_multi(const char *filename, int compression_type,
+                            int compression_level, int flags,
+                            const struct wandio_wopt *opts, bool ordered);
+
+/** Creates a producer handle for a writer created by wandio_wcreate_multi(),
+ * which a single thread can then write to using wandio_wwrite() (or
+ * wandio_wwrite_seq() in ordered mode). wandio_wflush() on a producer hands
+ * over everything it has been given so far and then flushes the file.
+ *
+ * @param iow		A writer created by wandio_wcreate_multi()
+ * @return A new producer handle, or NULL with errno set to ENOTSUP if the
+ * writer doesn't support producers
+ */
+iow_t *wandio_wproducer(iow_t *iow);
+
+/** Writes a buffer through a producer of an ordered writer from
+ * wandio_wcreate_multi(). Sequence numbers start at 0 and each must be used
+ * exactly once, by any producer, but each producer has to use its sequence
+ * numbers in increasing order. A write is not written out until everything
+ * before it in the sequence has been, although if a number is never used,
+ * the rest are written out anyway when the writer is closed.
+ *
+ * @param iow		A producer from wandio_wproducer()
+ * @param seq		The sequence number for this write
+ * @param buffer	The buffer to write out
+ * @param len		The amount of writable data in the buffer
+ * @return The amount of data written, or -1 if an error occurs, with errno
+ * set to ENOTSUP if iow isn't a producer, or EINVAL if its writer isn't
+ * ordered
+ */
+int64_t wandio_wwrite_seq(iow_t *iow, uint64_t seq, const void *buffer,
+                          int64_t len);
+
+/** Creates a new libwandio IO writer that spreads the data written to it
+ * across several files, e.g. on different disks, each with its own writer.
+ * Each write goes to the next file in turn, unless wandio_wwrite_key() is
+ * used to choose one. Each write is stored with a small header, so the
+ * files can only be read back using wandio_create_sharded().
+ *
+ * @param filenames		The names of the files to write
+ * @param count			The number of files
+ * @param compression_type	Compression type
+ * @param compression_level	The compression level to use when writing
+ * @param flags			Flags to apply when opening each file
+ * @param opts			An array of tuning options terminated by
+ * 				WANDIO_WOPT_END, or NULL
+ * @return A pointer to the new libwandio IO writer, or NULL if any of the
+ * files could not be opened
+ */
+iow_t *wandio_wcreate_sharded(const char *const *filenames, int count,
+                              int compression_type, int compression_level,
+                              int flags, const struct wandio_wopt *opts);
+
+/** Writes a buffer using a writer from wandio_wcreate_sharded(), into the
+ * file picked by a key, e.g. a hash of a flow, so that everything with the
+ * same key ends up in the same file.
+ *
+ * @param iow		A writer created by wandio_wcreate_sharded()
+ * @param key		The key, which picks file number key % count
+ * @param buffer	The buffer to write out
+ * @param len		The amount of writable data in the buffer
+ * @return The amount of data written, or -1 if an error occurs, with errno
+ * set to ENOTSUP if the writer isn't sharded
+ */
+int64_t wandio_wwrite_key(iow_t *iow, uint64_t key, const void *buffer,
+                          int64_t len);
+
+/** A part of a stream handed to a worker by wandio_dispatch() */
+struct wandio_chunk {
+        /** The position of the chunk in the stream, starting from 0 */
+        uint64_t seq;
+        /** The offset of the start of the chunk in the stream */
+        int64_t offset;
+        /** The data, which is only valid until the callback returns */
+        const void *data;
+        /** The amount of data in the chunk */
+        int64_t len;
+};
+
+/** Processes a chunk of a stream, on one of the workers started by
+ * wandio_dispatch(). Chunks are processed in parallel, so may finish in any
+ * order.
+ *
+ * @param chunk		The chunk to process
+ * @param data		The data pointer given to wandio_dispatch()
+ * @return 0 to carry on, or anything else to stop
+ */
+typedef int(wandio_chunk_cb_t)(const struct wandio_chunk *chunk, void *data);
+
+/** Finds the end of the last whole record in a buffer, so that
+ * wandio_dispatch() can keep records from being split between chunks.
+ *
+ * @param buffer	Data that starts at the beginning of a record
+ * @param len		The amount of data in the buffer
+ * @param data		The data pointer given to wandio_dispatch()
+ * @return The length of the whole records at the start of the buffer, or 0
+ * if not even the first record is complete
+ */
+typedef int64_t(wandio_boundary_cb_t)(const void *buffer, int64_t len,
+                                      void *data);
+
+/** Reads the rest of a stream, splits it into chunks and hands them to a set
+ * of worker threads, for callers whose processing can't keep up with a
+ * single thread. This returns once every chunk has been processed.
+ *
+ * If the reader is threaded, which it is by default, each chunk points
+ * straight into one of the threaded reader's buffers, which isn't reused
+ * until the chunk has been processed. As a result, only as many chunks as
+ * the reader has buffers (see the buffers option) can be processed at once.
+ *
+ * If boundary is given, chunks are only cut at the ends of records, so no
+ * record is split between two chunks. Records that cross from one of the
+ * reader's buffers into the next are copied into a chunk of their own.
+ *
+ * @param io		The IO reader, which must not be used by anything
+ * 			else until this returns
+ * @param workers	The number of worker threads to start
+ * @param cb		Called by the workers for each chunk
+ * @param boundary	Finds the ends of records, or NULL if chunks can be
+ * 			cut anywhere
+ * @param data		Passed to both callbacks
+ * @return The number of chunks processed, or -1 if an error occurs, with
+ * errno set to ECANCELED if a callback asked to stop
+ */
+int64_t wandio_dispatch(io_t *io, int workers, wandio_chunk_cb_t *cb,
+                        wandio_boundary_cb_t *boundary, void *data);
+
 /** Writes the contents of a buffer using a libwandio IO writer.
  *
  * @param iow		The IO writer to write the data with
@@ -356,6 +797,72 @@ int64_t wandio_wwrite(iow_t *iow, const void *buffer, int64_t len);
  */
 int wandio_wflush(iow_t *iow);
 
+/** Puts a libwandio IO writer into non-blocking mode, or takes it out again.
+ *
+ * In non-blocking mode, wandio_wwrite() and wandio_wflush() never wait for
+ * the writing thread to catch up. If there isn't room for everything,
+ * wandio_wwrite() buffers as much as it can and returns the amount buffered,
+ * or returns -1 with errno set to EAGAIN if there was no room at all.
+ * wandio_wflush() also fails with EAGAIN if it can't be queued. Only writers
+ * using a separate thread (i.e. not using the nothreads option) can do this.
+ *
+ * @param iow		The IO writer
+ * @param nonblock	Non-zero to enable non-blocking mode, zero to disable it
+ * @return 0 if successful, or -1 with errno set to ENOTSUP if the writer
+ * doesn't support non-blocking mode
+ */
+int wandio_wset_nonblocking(iow_t *iow, int nonblock);
+
+/** Returns the amount of data that has been written to a libwandio IO writer
+ * but is still waiting for the writing thread.
+ *
+ * @param iow		The IO writer
+ * @return The number of bytes waiting to be written, which is always 0 for
+ * writers that don't use a separate thread
+ */
+int64_t wandio_wqueued(iow_t *iow);
+
+/**
+ * Watermark call-back function pointer, called with above set to 1 when
+ * the amount of queued data reaches the high watermark and with above set
+ * to 0 when it falls back to the low watermark
+ */
+typedef void(wandio_watermark_cb_t)(iow_t *iow, int above, void *data);
+
+/** Asks to be told when the amount of data waiting for a libwandio IO
+ * writer's thread crosses a pair of watermarks, e.g. so that the caller can
+ * start shedding load before wandio_wwrite() has to block or fail.
+ *
+ * The call-back is called from whichever thread causes the watermark to be
+ * crossed, which may be the thread calling wandio_wwrite() or the writing
+ * thread, and must not write to or destroy the writer itself. The queue
+ * holds at most 5 * WANDIO_BUFFER_SIZE bytes.
+ *
+ * @param iow		The IO writer
+ * @param low		The low watermark, in bytes
+ * @param high		The high watermark, in bytes, which must be above low
+ * @param cb		The call-back, or NULL to stop calling it
+ * @param data		Passed to every call of the call-back
+ * @return 0 if successful, or -1 with errno set to ENOTSUP if the writer
+ * doesn't use a separate thread or EINVAL if the watermarks are invalid
+ */
+int wandio_wset_watermarks(iow_t *iow, int64_t low, int64_t high,
+                           wandio_watermark_cb_t *cb, void *data);
+
+/** Writes out everything that has been written to a libwandio IO writer and
+ * returns the file descriptor underneath it, so that the caller can write
+ * to it directly (e.g. using copy_file_range(2) or splice(2)). This is only
+ * possible if the writer isn't compressing its output.
+ *
+ * Data written to the descriptor should be written at the current file
+ * position, which is where the writer will carry on from if it is used
+ * again.
+ *
+ * @param iow		The IO writer
+ * @return The file descriptor, or -1 if there isn't a suitable one
+ */
+int wandio_wget_fd(iow_t *iow);
+
 /** Destroys a libwandio IO writer, closing the file and freeing the writer
  * structure.
  *
@@ -363,6 +870,29 @@ int wandio_wflush(iow_t *iow);
  */
 void wandio_wdestroy(iow_t *iow);
 
+/**
+ * Completion call-back function pointer, called once a writer passed to
+ * wandio_wdestroy_async() has been closed
+ */
+typedef void(wandio_closed_cb_t)(void *data);
+
+/** Destroys a libwandio IO writer in the background, so that the caller
+ * doesn't have to wait for buffered data to be compressed and written out.
+ *
+ * The call-back is called from one of the worker pool's threads once the
+ * file has been closed, e.g. to write to an eventfd or pipe that the
+ * application polls. If no worker can be started, or the application has
+ * provided its own executor, the writer is destroyed and the call-back
+ * called before this returns. The writer must not be used again after
+ * calling this.
+ *
+ * @param iow		The IO writer to destroy
+ * @param cb		The call-back, or NULL if the caller doesn't need to
+ * 			know when the file has been closed
+ * @param data		Passed to the call-back
+ */
+void wandio_wdestroy_async(iow_t *iow, wandio_closed_cb_t *cb, void *data);
+
 /**
  * Generic read call-back function pointer
  */
@@ -396,6 +926,51 @@ int64_t wandio_fgets(io_t *file, void *buffer, int64_t len, int chomp);
  */
 int wandio_detect_compression_type(const char *filename);
 
+/** Trains a zstd dictionary from a set of sample files
+ *
+ * @param filenames     The sample files to train the dictionary from. These
+ *                      are opened using wandio_create, so may be compressed.
+ * @param count         The number of sample files
+ * @param dict          The buffer to write the dictionary into
+ * @param capacity      The size of the dictionary buffer, which is also the
+ *                      maximum size of the dictionary
+ * @param dict_id       If not NULL, set to the ID of the new dictionary
+ * @return The size of the dictionary, or -1 if an error occurs
+ *
+ * Dictionaries help most when compressing many small, similar files. Files
+ * written with a dictionary record its ID, so a reader can find the
+ * dictionary again using the zstddictdir option.
+ */
+int64_t wandio_zstd_train_dict(char *const *filenames, int count, void *dict,
+                               int64_t capacity, unsigned int *dict_id);
+
+/**
+ * A piece of background work, such as reading ahead into a buffer or
+ * compressing a block, which must be run by calling it with its argument
+ */
+typedef void(wandio_job_t)(void *arg);
+
+/**
+ * Executor call-back function pointer, which must arrange for job(arg) to be
+ * called soon on some thread other than the one that submitted it
+ */
+typedef void(wandio_executor_t)(wandio_job_t *job, void *arg, void *data);
+
+/** Hands libwandio's background work to an executor provided by the
+ *  application, rather than having libwandio start threads of its own.
+ *
+ * @param executor      The function that jobs are submitted to, or NULL to
+ *                      go back to libwandio's own threads
+ * @param data          Passed to every call of the executor
+ *
+ * Jobs never wait for other jobs, so any number of them can share a small
+ * pool of threads. Each reader or writer only has one job outstanding at a
+ * time, and each job moves at most one buffer, so a FIFO executor shares
+ * its threads fairly between files. The executor must only be changed when
+ * no files are open.
+ */
+void wandio_set_executor(wandio_executor_t *executor, void *data);
+
 /** Print a string to a wandio file using a vprintf-style API
  *
  * @param file          The file to write to
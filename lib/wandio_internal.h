@@ -28,8 +28,11 @@
 #define WANDIO_INTERNAL_H 1 /**< Guard Define */
 #include "config.h"
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <sys/types.h>
+#include <time.h>
+#include "wandio.h"
 
 /** @name libwandioio options
  * @{ */
@@ -40,6 +43,359 @@ extern uint64_t read_waits;
 extern unsigned int use_threads;
 extern unsigned int max_buffers;
 extern int loghttpservererrors;
+extern char *zstd_dict_file;
+extern char *zstd_dict_dir;
+extern int zstd_flush_frame;
+extern int use_mmap;
+extern int use_uring_read;
+extern unsigned int uring_depth;
+extern int use_uring_write;
+extern unsigned int uring_sync_mb;
+extern int use_streaming;
+extern int use_hugepages;
+extern unsigned int pool_threads;
+extern unsigned int writeback_mb;
+extern unsigned int datasync_secs;
+extern unsigned int prealloc_mb;
+extern unsigned int flush_ms;
 /* @} */
 
+/** Reads the entire contents of a local file into a newly allocated buffer.
+ *
+ * @param filename	The name of the file to read
+ * @param len		Set to the number of bytes read from the file
+ * @return A pointer to the file contents, which must be freed by the caller,
+ * or NULL if an error occurs
+ */
+void *wandio_load_file(const char *filename, int64_t *len);
+
+/** Reads from an IO reader, avoiding a copy if the reader can hand out
+ * data that is already in memory.
+ *
+ * @param io		The IO reader
+ * @param buffer	Set to point at the data that was read, which is either
+ * 			scratch or memory belonging to the reader that remains
+ * 			valid until the next call on io
+ * @param scratch	A buffer to read into if the reader can't avoid a copy
+ * @param len		The size of scratch
+ * @return The amount of bytes read, 0 if end of file is reached, -1 if an
+ * error occurs
+ */
+int64_t wandio_borrow(io_t *io, const void **buffer, void *scratch,
+                      int64_t len);
+
+/** Data handed out by wandio_lend(), which stays valid until it is given
+ * back, however many other loans are made in the meantime */
+struct wandio_loan_t {
+        const char *data;
+        int64_t len;
+        /* The threaded reader that the data belongs to, and which of its
+         * slices it is in */
+        io_t *owner;
+        int slice;
+        /* Or memory that has been handed over, and is freed when the loan is
+         * given back */
+        void *memory;
+};
+
+/** Hands out the next part of a stream without copying it, which only works
+ * for the threaded reader (with or without a peeking reader on top).
+ *
+ * @param io		The IO reader
+ * @param loan		Set to describe the data, which must be given back
+ * 			using wandio_unlend()
+ * @return The amount of bytes handed out, 0 if end of file is reached, -1 if
+ * an error occurs, with errno set to ENOTSUP if the reader can't lend
+ */
+int64_t wandio_lend(io_t *io, struct wandio_loan_t *loan);
+
+/** Gives back data handed out by wandio_lend(). This may be called from any
+ * thread, but the reader must not have been destroyed yet.
+ *
+ * @param loan		The loan to give back
+ */
+void wandio_unlend(struct wandio_loan_t *loan);
+
+/** Creates a file for writing, honouring the directwrite option, and makes
+ * sure it is owned by the original user if we are running under sudo.
+ *
+ * @param filename	The name of the file to create
+ * @param flags		Extra flags to pass to open()
+ * @return A file descriptor, or -1 if the file could not be created
+ */
+int wandio_safe_open(const char *filename, int flags);
+
+/** Creates a writer for a file, with compression if requested, but without
+ *  the threaded writer on top, e.g. for a module that runs the writer on a
+ *  thread of its own.
+ *
+ * @param filename		The name of the file to open
+ * @param compress_type		Compression type
+ * @param compression_level	The compression level to use when writing
+ * @param flags			Flags to apply when opening the file
+ * @param opts			An array of tuning options terminated by
+ * 				WANDIO_WOPT_END, or NULL
+ * @return The new writer, or NULL if an error occurs
+ */
+iow_t *wandio_wcreate_unthreaded(const char *filename, int compress_type,
+                                 int compression_level, int flags,
+                                 const struct wandio_wopt *opts);
+
+/** Makes sure that space has been allocated for a file up to a given offset,
+ *  allocating prealloc_mb MB at a time without changing the size of the
+ *  file. Allocating large extents ahead of the data keeps files that are
+ *  being written at the same time from fragmenting each other.
+ *
+ * @param fd		The descriptor of the file being written
+ * @param allocated	How far space has been allocated so far, or -1 if
+ * 			preallocation is off or isn't supported by the file
+ * @param end		The offset that is about to be written up to
+ * @return How far space has been allocated now, or -1 if preallocation is
+ * off or isn't supported by the file
+ */
+int64_t wandio_prealloc(int fd, int64_t allocated, int64_t end);
+
+/** Gives back any space that was allocated beyond the end of a file by
+ *  wandio_prealloc(), once it has been completely written.
+ *
+ * @param fd		The descriptor of the file being written
+ * @param allocated	The last value returned by wandio_prealloc()
+ */
+void wandio_prealloc_trim(int fd, int64_t allocated);
+
+/** Looks up the value of a codec tuning option.
+ *
+ * @param opts		An array of options terminated by WANDIO_WOPT_END, or
+ * 			NULL
+ * @param option	The option to look for
+ * @param def		The value to return if the option is not present
+ * @return The value of the option, or def if it has not been set
+ */
+int64_t wandio_wopt_get(const struct wandio_wopt *opts, int option,
+                        int64_t def);
+
+/** Allocates a large, page aligned buffer. If the hugepages option is set,
+ *  the buffer is huge page aligned, backed by huge pages where possible and
+ *  faulted in before it is returned. If the cpus option is set, it is placed
+ *  on the same NUMA node as the worker threads. Buffers smaller than a few
+ *  hundred KB are just page aligned, whatever options are set, so small
+ *  structures should use malloc() instead. The contents are not initialised.
+ *
+ * @param size		The size of the buffer
+ * @return A pointer to the buffer, which must be freed using
+ * wandio_free_buffer(), or NULL if it could not be allocated
+ */
+void *wandio_alloc_buffer(size_t size);
+
+/** Frees a buffer allocated using wandio_alloc_buffer().
+ *
+ * @param buffer	The buffer to free, which may be NULL
+ */
+void wandio_free_buffer(void *buffer);
+
+/** Starts a worker thread, e.g. to read ahead or to compress data. If the
+ *  cpus option is set, the thread only runs on the CPUs it lists.
+ *
+ * @param thread	Set to the ID of the new thread
+ * @param start		The function that the thread runs
+ * @param arg		The argument passed to start
+ * @return 0 if successful, otherwise an error number
+ */
+int wandio_thread_create(pthread_t *thread, void *(*start)(void *),
+                         void *arg);
+
+/** Lets readers called on this thread know when to give up, e.g. because
+ *  the threaded reader they are filling a buffer for is being closed.
+ *
+ * @param flag		A flag that is set once reading should stop, or NULL
+ * 			once this thread is done reading
+ */
+void wandio_set_cancel(const bool *flag);
+
+/** Tells a reader whether it might be asked to give up part way through a
+ *  read, in which case it should check wandio_read_cancelled() at least
+ *  every 100ms or so while it waits, e.g. for the network.
+ *
+ * @return true if a cancel flag has been set for this thread
+ */
+bool wandio_cancellable(void);
+
+/** Tells a reader whether to give up on the read in progress, because
+ *  nobody wants the data any more.
+ *
+ * @return true if reading should stop as soon as possible
+ */
+bool wandio_read_cancelled(void);
+
+/** A job waiting for the worker pool. Modules embed one of these in their
+ *  state, so that submitting work never has to allocate memory. A task must
+ *  not be submitted again until its job has started running. */
+struct wandio_task_t {
+        wandio_job_t *job;
+        void *arg;
+        /* When a delayed task is due to run */
+        struct timespec when;
+        /* Whether the job may wait for other jobs to finish */
+        bool blocking;
+        struct wandio_task_t *next;
+};
+
+/** Tells the threaded modules whether to submit their work to the shared
+ *  pool (or the application's executor) instead of starting threads of
+ *  their own.
+ *
+ * @return true if the pool option or an executor has been set
+ */
+bool wandio_pool_enabled(void);
+
+/** Queues a task to be run by the shared pool, or hands it to the
+ *  application's executor if there is one. The job may run before this
+ *  returns, so it must not be called with any locks held that the job
+ *  needs.
+ *
+ * @param task		The task to run
+ */
+void wandio_pool_submit(struct wandio_task_t *task);
+
+/** Queues a task to be run by the shared pool once a given time has been
+ *  reached. Unlike wandio_pool_submit(), the job never runs before this
+ *  returns, so it may be called with locks held.
+ *
+ * @param task		The task to run
+ * @param when		When to run it, according to CLOCK_MONOTONIC
+ * @return 0 if successful, or -1 if there are no pool threads to run it,
+ * e.g. because the application has provided its own executor
+ */
+int wandio_pool_submit_at(struct wandio_task_t *task,
+                          const struct timespec *when);
+
+/** Queues a task whose job may wait for other jobs to finish, e.g. for a
+ *  writer's buffers to be written out. The pool starts an extra worker for
+ *  it, so it can't hold up the ordinary jobs. The job never runs before
+ *  this returns.
+ *
+ * @param task		The task to run
+ * @return 0 if successful, or -1 if no worker could be started for it or
+ * the application has provided its own executor
+ */
+int wandio_pool_submit_blocking(struct wandio_task_t *task);
+
+/** Stops a task submitted by wandio_pool_submit_at() from running, if it
+ *  hasn't been queued to run yet.
+ *
+ * @param task		The task to cancel
+ * @return true if the task was cancelled, or false if it has already been
+ * queued, in which case it is going to run
+ */
+bool wandio_pool_cancel(struct wandio_task_t *task);
+
+/** Keeps track of the dirty data behind a local file being written */
+struct wandio_writeback_t;
+
+/** Hands a local file over to the background writeback thread, which starts
+ *  writing it back after every writeback_mb MB and runs fdatasync on it every
+ *  datasync_secs seconds.
+ *
+ * @param fd		The descriptor of the file being written
+ * @return The writeback state for the file, or NULL if neither option is set
+ * or the thread could not be started
+ */
+struct wandio_writeback_t *wandio_writeback_start(int fd);
+
+/** Tells the background writeback thread how much of the file has been
+ *  written so far. This is cheap enough to call after every write.
+ *
+ * @param wb		The writeback state for the file, which may be NULL
+ * @param written	The number of bytes written to the file
+ */
+void wandio_writeback_note(struct wandio_writeback_t *wb, int64_t written);
+
+/** Stops background writeback for a file, waiting for anything that is in
+ *  progress. This must be done before the descriptor is closed.
+ *
+ * @param wb		The writeback state for the file, which may be NULL
+ */
+void wandio_writeback_stop(struct wandio_writeback_t *wb);
+
+/** In streaming mode, local files are read ahead and dropped from the page
+ *  cache in chunks of this size */
+#define WANDIO_STREAM_WINDOW (8 * 1024 * 1024)
+
+/** Writes smaller than this are too short for wandio_incompressible() to
+ *  judge, so compressors should carry on as they were */
+#define WANDIO_SAMPLE_MIN (64 * 1024)
+
+/** Estimates whether compressing a buffer would be a waste of time, e.g.
+ *  because it holds data that is already compressed or encrypted.
+ *
+ * @param buffer	The data that is about to be compressed
+ * @param len		The length of the data, which should be at least
+ * 			WANDIO_SAMPLE_MIN bytes
+ * @return true if the data looks random enough that it should be stored
+ * rather than compressed
+ */
+bool wandio_incompressible(const void *buffer, int64_t len);
+
+/** How much incompressible data there has to be in a row before
+ *  wandio_store_steady() switches to storing */
+#define WANDIO_STORE_SWITCH (4 * 1024 * 1024)
+
+/** Decides whether to store a buffer, for writers that have to end a frame
+ *  to change level. Unlike wandio_incompressible(), this only starts storing
+ *  once the data has looked incompressible for WANDIO_STORE_SWITCH bytes in
+ *  a row, so that mixed data doesn't end up as lots of tiny frames.
+ *
+ * @param storing	Whether the writer is storing at the moment
+ * @param run		How much incompressible data there has been in a
+ * 			row, which is kept up to date by this function
+ * @param buffer	The data that is about to be written
+ * @param len		The length of the data
+ * @return true if the data should be stored rather than compressed
+ */
+bool wandio_store_steady(bool storing, int64_t *run, const void *buffer,
+                         int64_t len);
+
+/* These are used by wandio_lend() and wandio_unlend(), and fail with ENOTSUP
+ * if given a reader they don't apply to */
+int64_t thread_lend(io_t *io, struct wandio_loan_t *loan);
+void thread_unlend(struct wandio_loan_t *loan);
+int64_t peek_lend(io_t *io, struct wandio_loan_t *loan);
+
+/* These only apply to the threaded writer, and fail with ENOTSUP (or return
+ * 0 from thread_wqueued) if given any other writer */
+int thread_wset_nonblocking(iow_t *iow, bool nonblock);
+int64_t thread_wqueued(iow_t *iow);
+int thread_wset_watermarks(iow_t *iow, int64_t low, int64_t high,
+                           wandio_watermark_cb_t *cb, void *data);
+
+/* These only apply to the rotating writer, and fail with ENOTSUP if given
+ * any other writer */
+int rotate_wprepare(iow_t *iow, const char *filename);
+int rotate_wrotate(iow_t *iow);
+
+/* These only apply to the multi-producer writer, and its producers, and fail
+ * with ENOTSUP if given any other writer */
+iow_t *multi_wproducer(iow_t *multi);
+int64_t multi_wwrite_seq(iow_t *iow, uint64_t seq, const void *buffer,
+                         int64_t len);
+
+/* This only applies to the sharded writer, and fails with ENOTSUP if given
+ * any other writer */
+int64_t shard_wwrite_key(iow_t *iow, uint64_t key, const void *buffer,
+                         int64_t len);
+
+/* Each file written by the sharded writer starts with SHARD_MAGIC, and then
+ * each write is stored as a header of SHARD_HEADER_SIZE bytes, holding the
+ * write's position in the stream and its length as little-endian 64 bit
+ * numbers, followed by the data itself */
+#define SHARD_MAGIC "WANDSHRD"
+#define SHARD_MAGIC_SIZE 8
+#define SHARD_HEADER_SIZE 16
+
+#if HAVE_LIBZSTD
+int zstd_wload_dict(iow_t *iow, const void *dict, int64_t dict_len);
+int64_t zstd_train_dict(char *const *filenames, int count, void *dict,
+                        int64_t capacity, unsigned int *dict_id);
+#endif
+
 #endif
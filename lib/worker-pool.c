@@ -0,0 +1,265 @@
+/*
+ *
+ * Copyright (c) 2007-2019 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libwandio.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libwandio is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwandio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include "config.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "wandio.h"
+#include "wandio_internal.h"
+#ifdef HAVE_SYS_PRCTL_H
+#include <sys/prctl.h>
+#endif
+
+/* A pool of worker threads shared by every threaded reader and writer.
+ *
+ * Rather than each file having a thread of its own, the threaded modules
+ * submit a task whenever they have work to do, e.g. an empty buffer to read
+ * into. Each task moves a single buffer before it is queued again, and the
+ * queue is first in, first out, so busy files take turns. Tasks never wait
+ * for each other, which means that a handful of threads can look after any
+ * number of files without deadlocking.
+ *
+ * Tasks can also be delayed until a given time, e.g. to flush data that has
+ * been waiting too long. They sit in a list ordered by time, and whichever
+ * worker is idle when the first of them is due moves it onto the queue.
+ *
+ * The application can also provide its own executor, in which case tasks
+ * are handed straight to it and the pool is never started. Delayed tasks
+ * aren't supported then, as we have no threads of our own to wait with.
+ *
+ * A few jobs, such as closing a file in the background, have to wait for
+ * other jobs to finish. Each of these gets a worker of its own on top of
+ * the pool_threads that the ordinary jobs share, so they can never tie up
+ * the workers that the jobs they are waiting for need.
+ */
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_ready;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static struct wandio_task_t *queue_head = NULL;
+static struct wandio_task_t *queue_tail = NULL;
+/* Delayed tasks, soonest first */
+static struct wandio_task_t *timers = NULL;
+static unsigned int pool_started = 0;
+/* Blocking jobs that are queued or running */
+static unsigned int pool_blocking = 0;
+
+static wandio_executor_t *executor = NULL;
+static void *executor_data = NULL;
+
+static void pool_init(void) {
+        pthread_condattr_t attr;
+
+        /* Delayed tasks shouldn't move if somebody changes the clock */
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&pool_ready, &attr);
+        pthread_condattr_destroy(&attr);
+}
+
+static bool pool_due(const struct timespec *when) {
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec > when->tv_sec ||
+               (now.tv_sec == when->tv_sec && now.tv_nsec >= when->tv_nsec);
+}
+
+/* Adds a task to the end of the queue. Must be called with the pool mutex
+ * held */
+static void pool_enqueue(struct wandio_task_t *task) {
+        task->next = NULL;
+        if (queue_tail)
+                queue_tail->next = task;
+        else
+                queue_head = task;
+        queue_tail = task;
+}
+
+static void *pool_worker(void *userdata) {
+        struct wandio_task_t *task;
+        bool blocking;
+
+        (void)userdata;
+#ifdef PR_SET_NAME
+        prctl(PR_SET_NAME, "wandio [pool]", 0, 0, 0);
+#endif
+
+        pthread_mutex_lock(&pool_mutex);
+        while (true) {
+                while (!queue_head) {
+                        if (!timers) {
+                                pthread_cond_wait(&pool_ready, &pool_mutex);
+                        } else if (pool_due(&timers->when)) {
+                                task = timers;
+                                timers = task->next;
+                                pool_enqueue(task);
+                        } else {
+                                pthread_cond_timedwait(&pool_ready,
+                                                       &pool_mutex,
+                                                       &timers->when);
+                        }
+                }
+                task = queue_head;
+                queue_head = task->next;
+                if (!queue_head)
+                        queue_tail = NULL;
+                pthread_mutex_unlock(&pool_mutex);
+
+                /* Once the job has started, the task may be submitted again
+                 * or even freed, so don't touch it afterwards */
+                blocking = task->blocking;
+                task->job(task->arg);
+
+                pthread_mutex_lock(&pool_mutex);
+                if (blocking)
+                        pool_blocking--;
+        }
+        return NULL;
+}
+
+/* Starts any workers that we haven't got yet. Must be called with the pool
+ * mutex held */
+static void pool_start(void) {
+        sigset_t set, old;
+        pthread_t thread;
+
+        /* Signals are for the application's threads, not ours */
+        sigfillset(&set);
+        pthread_sigmask(SIG_SETMASK, &set, &old);
+        while (pool_started < pool_threads + pool_blocking) {
+                if (wandio_thread_create(&thread, pool_worker, NULL) != 0)
+                        break;
+                pthread_detach(thread);
+                pool_started++;
+        }
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+bool wandio_pool_enabled(void) {
+        return executor != NULL || pool_threads > 0;
+}
+
+void wandio_pool_submit(struct wandio_task_t *task) {
+        if (executor) {
+                executor(task->job, task->arg, executor_data);
+                return;
+        }
+
+        task->blocking = false;
+        pthread_once(&pool_once, pool_init);
+        pthread_mutex_lock(&pool_mutex);
+        pool_enqueue(task);
+        if (pool_started < pool_threads + pool_blocking)
+                pool_start();
+        if (pool_started == 0) {
+                /* Without any workers, the best we can do is run it now */
+                queue_head = queue_tail = NULL;
+                pthread_mutex_unlock(&pool_mutex);
+                task->job(task->arg);
+                return;
+        }
+        pthread_cond_signal(&pool_ready);
+        pthread_mutex_unlock(&pool_mutex);
+}
+
+int wandio_pool_submit_at(struct wandio_task_t *task,
+                          const struct timespec *when) {
+        struct wandio_task_t **prev;
+
+        if (executor)
+                return -1;
+
+        pthread_once(&pool_once, pool_init);
+        pthread_mutex_lock(&pool_mutex);
+        if (pool_started < pool_threads + pool_blocking)
+                pool_start();
+        if (pool_started == 0) {
+                pthread_mutex_unlock(&pool_mutex);
+                return -1;
+        }
+        task->blocking = false;
+        task->when = *when;
+        for (prev = &timers; *prev; prev = &(*prev)->next) {
+                if (when->tv_sec < (*prev)->when.tv_sec ||
+                    (when->tv_sec == (*prev)->when.tv_sec &&
+                     when->tv_nsec < (*prev)->when.tv_nsec))
+                        break;
+        }
+        task->next = *prev;
+        *prev = task;
+        /* An idle worker may need to wait for less time than it was */
+        pthread_cond_signal(&pool_ready);
+        pthread_mutex_unlock(&pool_mutex);
+        return 0;
+}
+
+int wandio_pool_submit_blocking(struct wandio_task_t *task) {
+        /* The application's executor expects jobs not to wait */
+        if (executor)
+                return -1;
+
+        pthread_once(&pool_once, pool_init);
+        pthread_mutex_lock(&pool_mutex);
+        pool_blocking++;
+        pool_start();
+        if (pool_started < pool_threads + pool_blocking) {
+                pool_blocking--;
+                pthread_mutex_unlock(&pool_mutex);
+                return -1;
+        }
+        task->blocking = true;
+        pool_enqueue(task);
+        pthread_cond_signal(&pool_ready);
+        pthread_mutex_unlock(&pool_mutex);
+        return 0;
+}
+
+bool wandio_pool_cancel(struct wandio_task_t *task) {
+        struct wandio_task_t **prev;
+        bool found = false;
+
+        pthread_mutex_lock(&pool_mutex);
+        for (prev = &timers; *prev; prev = &(*prev)->next) {
+                if (*prev == task) {
+                        *prev = task->next;
+                        found = true;
+                        break;
+                }
+        }
+        pthread_mutex_unlock(&pool_mutex);
+        return found;
+}
+
+DLLEXPORT void wandio_set_executor(wandio_executor_t *new_executor,
+                                   void *data) {
+        executor = new_executor;
+        executor_data = data;
+}
@@ -0,0 +1,269 @@
+/*
+ *
+ * Copyright (c) 2007-2019 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libwandio.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libwandio is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwandio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#define _GNU_SOURCE 1
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "wandio.h"
+#include "wandio_internal.h"
+#ifdef HAVE_SYS_PRCTL_H
+#include <sys/prctl.h>
+#endif
+
+/* A single background thread that keeps the amount of dirty data behind
+ * every local file being written within bounds.
+ *
+ * Writers tell us how far they have got, which costs them nothing more than
+ * a store unless a whole window has built up. We then start writeback for
+ * each window of writeback_mb MB with sync_file_range(), so the kernel never
+ * has a large backlog to flush in one go, and fdatasync each file that has
+ * changed every datasync_secs seconds, so that no more than that much data
+ * can be lost. Both can take a while, so neither is done on the thread that
+ * is writing or compressing the data.
+ */
+
+struct wandio_writeback_t {
+        int fd;
+        /* Number of bytes that have been written to the file, which is
+         * updated by the writer without taking the lock */
+        int64_t written;
+        /* Writer's copy of where it last woke us up */
+        int64_t kicked;
+        /* Writeback has been started for everything before here */
+        int64_t started;
+        /* Everything before here was written when we last ran fdatasync */
+        int64_t datasynced;
+        struct timespec datasync_at;
+        /* Nothing has been written since the last fdatasync, so the writer
+         * has to wake us up when something is */
+        bool clean;
+        /* We are in the middle of a system call on fd */
+        bool busy;
+        struct wandio_writeback_t *next;
+};
+
+static pthread_mutex_t wb_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wb_ready;
+static pthread_cond_t wb_idle;
+static struct wandio_writeback_t *wb_files = NULL;
+static bool wb_started = false;
+
+/* written and clean are shared with the writer. Each side stores one and
+ * then loads the other, so at least one of us sees what the other did */
+#define load(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define store(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+
+static int64_t writeback_window(void) {
+        return (int64_t)writeback_mb * 1024 * 1024;
+}
+
+static void writeback_deadline(struct wandio_writeback_t *wb,
+                               struct timespec *when) {
+        *when = wb->datasync_at;
+        when->tv_sec += datasync_secs;
+}
+
+static bool writeback_due(const struct timespec *when,
+                          const struct timespec *now) {
+        return now->tv_sec > when->tv_sec ||
+               (now->tv_sec == when->tv_sec && now->tv_nsec >= when->tv_nsec);
+}
+
+/* Finds a file that needs something doing to it and does it, with the lock
+ * dropped. Returns false if there was nothing to do, in which case deadline
+ * is set to when there will be, if ever */
+static bool writeback_one(struct timespec *deadline, bool *waiting) {
+        struct wandio_writeback_t *wb;
+        struct timespec now, when;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        *waiting = false;
+        for (wb = wb_files; wb; wb = wb->next) {
+                int64_t written = load(&wb->written);
+
+                if (writeback_mb && written - wb->started >=
+                                        writeback_window()) {
+                        int64_t start = wb->started;
+
+                        wb->busy = true;
+                        wb->started = written;
+                        pthread_mutex_unlock(&wb_mutex);
+#ifdef HAVE_SYNC_FILE_RANGE
+                        sync_file_range(wb->fd, start, written - start,
+                                        SYNC_FILE_RANGE_WRITE);
+#else
+                        (void)start;
+                        fdatasync(wb->fd);
+#endif
+                        pthread_mutex_lock(&wb_mutex);
+                        wb->busy = false;
+                        pthread_cond_broadcast(&wb_idle);
+                        return true;
+                }
+                if (!datasync_secs || written == wb->datasynced)
+                        continue;
+                writeback_deadline(wb, &when);
+                if (writeback_due(&when, &now)) {
+                        wb->busy = true;
+                        pthread_mutex_unlock(&wb_mutex);
+                        fdatasync(wb->fd);
+                        pthread_mutex_lock(&wb_mutex);
+                        wb->busy = false;
+                        wb->datasynced = written;
+                        clock_gettime(CLOCK_MONOTONIC, &wb->datasync_at);
+                        store(&wb->clean, true);
+                        if (load(&wb->written) != written)
+                                store(&wb->clean, false);
+                        pthread_cond_broadcast(&wb_idle);
+                        return true;
+                }
+                if (!*waiting || !writeback_due(&when, deadline)) {
+                        *deadline = when;
+                        *waiting = true;
+                }
+        }
+        return false;
+}
+
+static void *writeback_thread(void *userdata) {
+        struct timespec deadline;
+        bool waiting;
+
+        (void)userdata;
+#ifdef PR_SET_NAME
+        prctl(PR_SET_NAME, "wandio [sync]", 0, 0, 0);
+#endif
+
+        pthread_mutex_lock(&wb_mutex);
+        while (true) {
+                if (writeback_one(&deadline, &waiting))
+                        continue;
+                if (waiting)
+                        pthread_cond_timedwait(&wb_ready, &wb_mutex,
+                                               &deadline);
+                else
+                        pthread_cond_wait(&wb_ready, &wb_mutex);
+        }
+        return NULL;
+}
+
+/* Starts the background thread, if it isn't already running. Must be called
+ * with the lock held */
+static bool writeback_init(void) {
+        pthread_condattr_t attr;
+        sigset_t set, old;
+        pthread_t thread;
+
+        if (wb_started)
+                return true;
+
+        /* Deadlines shouldn't move if somebody changes the clock */
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&wb_ready, &attr);
+        pthread_cond_init(&wb_idle, NULL);
+        pthread_condattr_destroy(&attr);
+
+        /* Signals are for the application's threads, not ours */
+        sigfillset(&set);
+        pthread_sigmask(SIG_SETMASK, &set, &old);
+        if (wandio_thread_create(&thread, writeback_thread, NULL) == 0) {
+                pthread_detach(thread);
+                wb_started = true;
+        } else {
+                pthread_cond_destroy(&wb_ready);
+                pthread_cond_destroy(&wb_idle);
+        }
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        return wb_started;
+}
+
+struct wandio_writeback_t *wandio_writeback_start(int fd) {
+        struct wandio_writeback_t *wb;
+
+        if (!writeback_mb && !datasync_secs)
+                return NULL;
+
+        wb = calloc(1, sizeof(struct wandio_writeback_t));
+        if (!wb)
+                return NULL;
+        wb->fd = fd;
+        wb->clean = true;
+        clock_gettime(CLOCK_MONOTONIC, &wb->datasync_at);
+
+        pthread_mutex_lock(&wb_mutex);
+        if (!writeback_init()) {
+                pthread_mutex_unlock(&wb_mutex);
+                free(wb);
+                return NULL;
+        }
+        wb->next = wb_files;
+        wb_files = wb;
+        pthread_mutex_unlock(&wb_mutex);
+        return wb;
+}
+
+void wandio_writeback_note(struct wandio_writeback_t *wb, int64_t written) {
+        if (!wb)
+                return;
+        store(&wb->written, written);
+        /* A file that has only just become dirty needs a deadline, and a
+         * full window needs writing back */
+        if ((datasync_secs && load(&wb->clean)) ||
+            (writeback_mb && written - wb->kicked >= writeback_window())) {
+                store(&wb->clean, false);
+                wb->kicked = written;
+                pthread_mutex_lock(&wb_mutex);
+                pthread_cond_signal(&wb_ready);
+                pthread_mutex_unlock(&wb_mutex);
+        }
+}
+
+void wandio_writeback_stop(struct wandio_writeback_t *wb) {
+        struct wandio_writeback_t **prev;
+
+        if (!wb)
+                return;
+
+        pthread_mutex_lock(&wb_mutex);
+        while (wb->busy)
+                pthread_cond_wait(&wb_idle, &wb_mutex);
+        for (prev = &wb_files; *prev; prev = &(*prev)->next) {
+                if (*prev == wb) {
+                        *prev = wb->next;
+                        break;
+                }
+        }
+        pthread_mutex_unlock(&wb_mutex);
+        free(wb);
+}
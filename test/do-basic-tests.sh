@@ -32,11 +32,13 @@ reading $1 test file"
 }
 
 do_write_test() {
+        INPUT=${3:-files/big.txt}
+        BASE=${4:-/tmp/wandiobase.md5}
 
         if [ $1 = "text" ]; then
-                wandiocat -o /tmp/wandiowrite.out files/big.txt
+                wandiocat -o /tmp/wandiowrite.out $INPUT
         else
-                wandiocat -z 1 -Z $1 -o /tmp/wandiowrite.out files/big.txt
+                wandiocat -z 1 -Z $1 $2 -o /tmp/wandiowrite.out $INPUT
         fi
 
 
@@ -73,7 +75,7 @@ writing $1 test file"
 
         if [ $1 != "lzo" ]; then
                 wandiocat /tmp/wandiowrite.out | md5sum | cut -d " " -f 1 > /tmp/wandiotest.md5
-                diff -q /tmp/wandiotest.md5 /tmp/wandiobase.md5 > /dev/null
+                diff -q /tmp/wandiotest.md5 $BASE > /dev/null
 
                 if [ $? -ne 0 ]; then
                         FAIL="$FAIL
@@ -84,7 +86,7 @@ writing $1 test file"
         fi
 
 
-        diff -q /tmp/wandiotest2.md5 /tmp/wandiobase.md5 > /dev/null
+        diff -q /tmp/wandiotest2.md5 $BASE > /dev/null
         if [ $? -ne 0 ]; then
                 FAIL="$FAIL
 writing $1 test file"
@@ -95,6 +97,94 @@ writing $1 test file"
         fi
 }
 
+do_zstd_dict_test() {
+
+        rm -rf /tmp/wandiodict && mkdir -p /tmp/wandiodict/samples
+        split -b 4096 files/big.txt /tmp/wandiodict/samples/
+        wandiocat -T -o /tmp/wandiodict /tmp/wandiodict/samples/* 2> /dev/null
+        DICT=`ls /tmp/wandiodict/*.dict 2> /dev/null | head -1`
+
+        if [ -z "$DICT" ]; then
+                FAIL="$FAIL
+writing zstd file with dictionary"
+                echo "   fail (training)"
+                return
+        fi
+
+        LIBTRACEIO="zstddict=$DICT" wandiocat -z 1 -Z zstd \
+                -o /tmp/wandiowrite.out files/big.txt
+        LIBTRACEIO="zstddictdir=/tmp/wandiodict" wandiocat \
+                /tmp/wandiowrite.out | md5sum | cut -d " " -f 1 > \
+                /tmp/wandiotest.md5
+        zstd -q -d -c -D $DICT /tmp/wandiowrite.out | md5sum | \
+                cut -d " " -f 1 > /tmp/wandiotest2.md5
+
+        if diff -q /tmp/wandiotest.md5 /tmp/wandiobase.md5 > /dev/null && \
+                diff -q /tmp/wandiotest2.md5 /tmp/wandiobase.md5 > /dev/null; then
+                OK=$[ OK + 1 ]
+                echo "   pass"
+        else
+                FAIL="$FAIL
+writing zstd file with dictionary"
+                echo "   fail"
+        fi
+}
+
+# Runs one of the tests in wandiotest, or anything else that exits with 0 if
+# it passed
+do_api_test() {
+        DESC=$1
+        shift
+
+        if "$@"; then
+                OK=$[ OK + 1 ]
+                echo "   pass"
+        else
+                FAIL="$FAIL
+$DESC"
+                echo "   fail"
+        fi
+}
+
+# Builds a file out of 8 separately compressed pieces of big.txt using the
+# tool given, then checks that it can be divided into 5, or all 8, ranges
+# which each decompress by themselves
+do_split_test() {
+        rm -f /tmp/wandiosplit.out /tmp/wandiopart.*
+        split -n 8 files/big.txt /tmp/wandiopart.
+        for part in /tmp/wandiopart.*; do
+                $1 -c $part >> /tmp/wandiosplit.out || return 1
+        done
+        ./wandiotest splits /tmp/wandiosplit.out 5 5 &&
+                ./wandiotest splits /tmp/wandiosplit.out 8 8
+}
+
+# Runs one of the writing tests in wandiotest with lzo, which libwandio can't
+# read back, and checks each of the files it writes with lzop instead
+do_lzo_api_test() {
+        rm -f /tmp/wandiowrite.out*
+        ./wandiotest $1 files/big.txt /tmp/wandiowrite.out lzo $2 || return 1
+        for out in /tmp/wandiowrite.out*; do
+                lzop -q -d -c $out | md5sum | cut -d " " -f 1 \
+                        > /tmp/wandiotest2.md5
+                diff -q /tmp/wandiotest2.md5 /tmp/wandiobase.md5 \
+                        > /dev/null || return 1
+        done
+}
+
+# Checks that everything written to a zstd file before a flush can be
+# decompressed by the zstd tool, which needs the frame to have been ended
+do_flush_frame_test() {
+        ./wandiotest flush files/big.txt /tmp/wandiowrite.out zstd \
+                /tmp/wandioflush.out || return 1
+        HALF=$[ `wc -c < files/big.txt` / 2 ]
+        head -c $HALF files/big.txt | md5sum | cut -d " " -f 1 > \
+                /tmp/wandiotest.md5
+        zstd -q -d -c /tmp/wandioflush.out | md5sum | cut -d " " -f 1 > \
+                /tmp/wandiotest2.md5
+        diff -q /tmp/wandiotest.md5 /tmp/wandiotest2.md5 > /dev/null
+}
+
 REQBINARIES=( gzip bzip2 xz lz4 zstd lzop )
 
 for bin in ${REQBINARIES[*]}; do
@@ -103,6 +193,16 @@ done
 
 cat files/big.txt | md5sum | cut -d " " -f 1 > /tmp/wandiobase.md5
 
+# Text with already compressed data in the middle of it, with enough of the
+# compressed data for the writers to switch to storing it
+cat files/big.txt files/big.txt.xz files/big.txt.bz2 files/big.txt.zst \
+        files/big.txt > /tmp/wandiomixed.txt
+cat /tmp/wandiomixed.txt | md5sum | cut -d " " -f 1 > /tmp/wandiomixed.md5
+
+# Uncompressed and compressed inputs concatenated together
+cat files/big.txt files/big.txt files/big.txt | md5sum | cut -d " " -f 1 > \
+        /tmp/wandiotriple.md5
+
 echo -n \* Reading text...
 do_read_test text files/big.txt
 
@@ -124,6 +224,42 @@ do_read_test lz4 files/big.txt.lz4
 echo -n \* Reading zstd...
 do_read_test zstd files/big.txt.zst
 
+echo -n \* Reading text with io_uring...
+LIBTRACEIO=uringread,uringdepth=2 do_read_test text files/big.txt
+
+echo -n \* Reading zstd with io_uring...
+LIBTRACEIO=uringread do_read_test zstd files/big.txt.zst
+
+echo -n \* Reading text with mmap...
+LIBTRACEIO=mmap do_read_test text files/big.txt
+
+echo -n \* Reading gzip with mmap...
+LIBTRACEIO=mmap do_read_test gzip files/big.txt.gz
+
+echo -n \* Reading multi-stream bzip2 with mmap...
+LIBTRACEIO=mmap do_read_test bzip2 files/big.multistream.txt.bz2
+
+echo -n \* Reading lz4 with mmap...
+LIBTRACEIO=mmap do_read_test lz4 files/big.txt.lz4
+
+echo -n \* Reading zstd with mmap...
+LIBTRACEIO=mmap do_read_test zstd files/big.txt.zst
+
+echo -n \* Reading gzip with streaming...
+LIBTRACEIO=streaming do_read_test gzip files/big.txt.gz
+
+echo -n \* Reading text with direct IO...
+LIBTRACEIO=directread do_read_test text files/big.txt
+
+echo -n \* Reading gzip with direct IO...
+LIBTRACEIO=directread do_read_test gzip files/big.txt.gz
+
+echo -n \* Reading zstd with huge pages...
+LIBTRACEIO=hugepages do_read_test zstd files/big.txt.zst
+
+echo -n \* Reading bzip2 with pinned threads...
+LIBTRACEIO=cpus=0 do_read_test bzip2 files/big.txt.bz2
+
 echo -n \* Writing text...
 do_write_test text
 
@@ -145,6 +281,149 @@ do_write_test zstd
 echo -n \* Writing lzo...
 do_write_test lzo
 
+echo -n \* Writing pooled lzo...
+LIBTRACEIO=pool=1 do_write_test lzo
+
+echo -n \* Writing gzip with io_uring...
+LIBTRACEIO=uringwrite,uringdepth=2,uringsync=1 do_write_test gzip
+
+echo -n \* Writing zstd with streaming...
+LIBTRACEIO=streaming do_write_test zstd
+
+echo -n \* Writing text from mixed inputs...
+do_write_test text "" "files/big.txt files/big.txt.gz files/big.txt" \
+        /tmp/wandiotriple.md5
+
+echo -n \* Writing text with direct IO...
+LIBTRACEIO=directwrite do_write_test text
+
+echo -n \* Writing gzip with direct IO...
+LIBTRACEIO=directread,directwrite do_write_test gzip
+
+echo -n \* Writing lz4 with huge pages...
+LIBTRACEIO=hugepages,uringwrite do_write_test lz4
+
+echo -n \* Writing gzip with a shared worker pool...
+LIBTRACEIO=pool=1 do_write_test gzip
+
+echo -n \* Writing gzip with background writeback...
+LIBTRACEIO=writeback=1,datasync=1 do_write_test gzip
+
+echo -n \* Writing text with preallocation...
+LIBTRACEIO=prealloc=4 do_write_test text
+
+echo -n \* Flushing direct writes with preallocation...
+LIBTRACEIO=prealloc=8,directwrite do_api_test \
+        "flushing direct writes with preallocation" \
+        ./wandiotest prealloc files/big.txt /tmp/wandiowrite.out 8
+
+echo -n \* Writing gzip with a flush deadline...
+LIBTRACEIO=flushms=1 do_write_test gzip
+
+echo -n \* Writing zstd with tuning options...
+do_write_test zstd "-z -3 -O zstd-long=24"
+
+echo -n \* Writing gzip with tuning options...
+do_write_test gzip "-O zlib-mem-level=4 -O zlib-strategy=1"
+
+echo -n \* Writing lz4 with tuning options...
+do_write_test lz4 "-z 9 -O lz4-block-size=4194304"
+
+echo -n \* Writing lzma with tuning options...
+do_write_test lzma "-O lzma-extreme=1 -O lzma-block-size=1000000"
+
+echo -n \* Writing zstd with adaptive level...
+do_write_test zstd "-z 19 -O adapt-min-level=1"
+
+echo -n \* Writing gzip with adaptive level...
+do_write_test gzip "-z 9 -O adapt-min-level=1"
+
+echo -n \* Writing zstd with incompressible data...
+do_write_test zstd "" /tmp/wandiomixed.txt /tmp/wandiomixed.md5
+
+echo -n \* Writing gzip with incompressible data...
+do_write_test gzip "" /tmp/wandiomixed.txt /tmp/wandiomixed.md5
+
+echo -n \* Writing lz4 with incompressible data...
+do_write_test lz4 "" /tmp/wandiomixed.txt /tmp/wandiomixed.md5
+
+echo -n \* Writing zstd with dictionary...
+do_zstd_dict_test
+
+echo -n \* Flushing zstd...
+do_api_test "flushing zstd" ./wandiotest flush files/big.txt \
+        /tmp/wandiowrite.out zstd /tmp/wandioflush.out
+
+echo -n \* Flushing zstd without threads...
+LIBTRACEIO=nothreads do_api_test "flushing zstd without threads" \
+        ./wandiotest flush files/big.txt /tmp/wandiowrite.out zstd \
+        /tmp/wandioflush.out
+
+echo -n \* Flushing zstd frames...
+LIBTRACEIO=zstdflushframe do_api_test "flushing zstd frames" \
+        do_flush_frame_test
+
+echo -n \* Writing lzma without blocking...
+do_api_test "writing lzma without blocking" \
+        ./wandiotest nonblock files/big.txt /tmp/wandiowrite.out lzma
+
+echo -n \* Writing pooled lzma without blocking...
+LIBTRACEIO=pool=1 do_api_test "writing pooled lzma without blocking" \
+        ./wandiotest nonblock files/big.txt /tmp/wandiowrite.out lzma
+
+echo -n \* Rotating gzip files...
+do_api_test "rotating gzip files" \
+        ./wandiotest rotate files/big.txt /tmp/wandiowrite.out gzip
+
+echo -n \* Writing several files at once...
+do_api_test "writing several files at once" \
+        ./wandiotest tee files/big.txt /tmp/wandiowrite.out gzip zstd lz4 none
+
+echo -n \* Writing in sequence from several threads...
+do_api_test "writing in sequence from several threads" \
+        ./wandiotest ordered files/big.txt /tmp/wandiowrite.out zstd 4
+
+echo -n \* Writing and merging shards...
+do_api_test "writing and merging shards" \
+        ./wandiotest shard files/big.txt /tmp/wandiowrite.out zstd 3
+
+echo -n \* Dispatching lines to workers...
+do_api_test "dispatching lines to workers" \
+        ./wandiotest dispatch files/big.txt.gz 4 lines
+
+echo -n \* Dispatching chunks to workers without threads...
+LIBTRACEIO=nothreads do_api_test "dispatching chunks without threads" \
+        ./wandiotest dispatch files/big.txt.zst 4 any
+
+echo -n \* Splitting multi-member gzip...
+do_api_test "splitting multi-member gzip" do_split_test gzip
+
+echo -n \* Splitting multi-stream bzip2...
+do_api_test "splitting multi-stream bzip2" do_split_test bzip2
+
+echo -n \* Splitting multi-frame zstd...
+do_api_test "splitting multi-frame zstd" do_split_test "zstd -q"
+
+echo -n \* Splitting single-stream xz...
+do_api_test "splitting single-stream xz" \
+        ./wandiotest splits files/big.txt.xz 5 1
+
+echo -n \* Writing pooled lzo without blocking...
+LIBTRACEIO=pool=1 do_api_test "writing pooled lzo without blocking" \
+        do_lzo_api_test nonblock fast
+
+echo -n \* Closing pooled lzo writers in the background...
+LIBTRACEIO=pool=1 do_api_test "closing pooled lzo writers in the background" \
+        do_lzo_api_test async
+
+echo -n \* Closing writers in the background...
+do_api_test "closing writers in the background" \
+        ./wandiotest async files/big.txt /tmp/wandiowrite.out gzip
+
+echo -n \* Closing pooled writers in the background...
+LIBTRACEIO=pool=1 do_api_test "closing pooled writers in the background" \
+        ./wandiotest async files/big.txt /tmp/wandiowrite.out zstd
+
 echo
 echo "Tests passed: $OK"
 echo "Tests failed: $FAIL"
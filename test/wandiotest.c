@@ -0,0 +1,862 @@
+/*
+ *
+ * Copyright (c) 2007-2019 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libwandio.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libwandio is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwandio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+/* Exercises the parts of the libwandio API that wandiocat has no way of
+ * reaching. Each test is run by do-basic-tests.sh as
+ *
+ *      wandiotest <test> <arguments...>
+ *
+ * and exits with 0 if it passed, after printing why if it didn't.
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "wandio.h"
+
+/* How long to wait for a threaded writer to get data out, in 10ms steps */
+#define WAIT_STEPS 1000
+
+static int fail(const char *why) {
+        fprintf(stderr, "wandiotest: %s\n", why);
+        return 1;
+}
+
+/* Reads everything from a reader, however much of it there is */
+static char *read_all(io_t *io, int64_t *len) {
+        int64_t size = 0, alloced = WANDIO_BUFFER_SIZE;
+        char *data = malloc(alloced);
+        int64_t ret;
+
+        if (!io) {
+                free(data);
+                return NULL;
+        }
+        while ((ret = wandio_read(io, data + size, alloced - size)) > 0) {
+                size += ret;
+                if (alloced - size < WANDIO_BUFFER_SIZE) {
+                        alloced *= 2;
+                        data = realloc(data, alloced);
+                }
+        }
+        wandio_destroy(io);
+        *len = size;
+        return data;
+}
+
+static char *load(const char *filename, int64_t *len) {
+        return read_all(wandio_create(filename), len);
+}
+
+/* Checks that a file decompresses to exactly len bytes of data */
+static bool same(const char *filename, const char *data, int64_t len) {
+        int64_t got;
+        char *read = load(filename, &got);
+        bool ok = read && got == len && memcmp(read, data, len) == 0;
+
+        free(read);
+        return ok;
+}
+
+static int lookup_type(const char *name) {
+        struct wandio_compression_type *type =
+            wandio_lookup_compression_type(name);
+
+        return type ? type->compress_type : WANDIO_COMPRESS_NONE;
+}
+
+/* libwandio can write lzo but not read it, so the caller has to check those
+ * files with lzop instead */
+static bool readable(const char *name) {
+        return lookup_type(name) != WANDIO_COMPRESS_LZO;
+}
+
+/* Flushes a writer part way through, and checks that everything written so
+ * far can be decompressed while the writer is still open. A copy of the
+ * file as it was after the flush is saved, for the caller to try other
+ * tools on */
+static int test_flush(int argc, char *argv[]) {
+        int64_t len, half, got = 0;
+        char *data, *read = NULL;
+        iow_t *iow, *copy;
+        int i;
+
+        if (argc < 5)
+                return fail("usage: flush <input> <output> <method> <copy>");
+        data = load(argv[1], &len);
+        if (!data)
+                return fail("unable to read input");
+        half = len / 2;
+
+        iow = wandio_wcreate(argv[2], lookup_type(argv[3]), 1, 0);
+        if (!iow)
+                return fail("unable to open output");
+        if (wandio_wwrite(iow, data, half) != half ||
+            wandio_wflush(iow) < 0)
+                return fail("unable to write and flush output");
+
+        /* A threaded writer flushes in the background */
+        for (i = 0; i < WAIT_STEPS; i++) {
+                free(read);
+                read = load(argv[2], &got);
+                if (got >= half)
+                        break;
+                usleep(10000);
+        }
+        if (got != half || memcmp(read, data, half) != 0)
+                return fail("flushed data can't be read back");
+        free(read);
+
+        read = read_all(wandio_create_uncompressed(argv[2]), &got);
+        copy = wandio_wcreate(argv[4], WANDIO_COMPRESS_NONE, 0, 0);
+        if (!read || !copy)
+                return fail("unable to copy flushed output");
+        wandio_wwrite(copy, read, got);
+        wandio_wdestroy(copy);
+        free(read);
+
+        /* The rest of the file should still follow on */
+        if (wandio_wwrite(iow, data + half, len - half) != len - half)
+                return fail("unable to write output after flushing");
+        wandio_wdestroy(iow);
+        if (!same(argv[2], data, len))
+                return fail("output doesn't match input");
+        free(data);
+        return 0;
+}
+
+/* Writes part of the input with the prealloc and directwrite options set,
+ * and checks that flushing it, which has to cut the file back to its real
+ * length, doesn't give up the space that was set aside past the end, and
+ * that closing the file does */
+static int test_prealloc(int argc, char *argv[]) {
+        int64_t len, half, reserve;
+        struct stat st;
+        iow_t *iow;
+        char *data;
+        int i;
+
+        if (argc < 4)
+                return fail("usage: prealloc <input> <output> <MB>");
+        data = load(argv[1], &len);
+        if (!data)
+                return fail("unable to read input");
+        /* An odd length leaves a partial block for the flush to pad out */
+        half = len / 2 | 1;
+        reserve = (int64_t)atoi(argv[3]) * 1024 * 1024;
+
+        iow = wandio_wcreate(argv[2], WANDIO_COMPRESS_NONE, 0, 0);
+        if (!iow)
+                return fail("unable to open output");
+        if (wandio_wwrite(iow, data, half) != half || wandio_wflush(iow) < 0)
+                return fail("unable to write and flush output");
+        for (i = 0; i < WAIT_STEPS; i++) {
+                if (stat(argv[2], &st) == 0 && st.st_size == half &&
+                    (int64_t)st.st_blocks * 512 >= half + reserve / 2)
+                        break;
+                usleep(10000);
+        }
+        if (i == WAIT_STEPS)
+                return fail("space past the end was given up by a flush");
+
+        if (wandio_wwrite(iow, data + half, len - half) != len - half)
+                return fail("unable to write output after flushing");
+        wandio_wdestroy(iow);
+        if (stat(argv[2], &st) != 0 ||
+            (int64_t)st.st_blocks * 512 >= len + reserve / 2)
+                return fail("space past the end was kept after closing");
+        if (!same(argv[2], data, len))
+                return fail("output doesn't match input");
+        free(data);
+        return 0;
+}
+
+struct marks_t {
+        pthread_mutex_t mutex;
+        int crossings;
+        int above;
+        bool alternated;
+};
+
+static void crossed(iow_t *iow, int above, void *data) {
+        struct marks_t *m = (struct marks_t *)data;
+
+        (void)iow;
+        pthread_mutex_lock(&m->mutex);
+        if (above == m->above)
+                m->alternated = false;
+        m->above = above;
+        m->crossings++;
+        pthread_mutex_unlock(&m->mutex);
+}
+
+/* Writes to a slow writer in non-blocking mode, and checks that it refuses
+ * data with EAGAIN rather than waiting, that the queue stays bounded and that
+ * the watermarks are crossed alternately, ending up below the low one. A
+ * writer given as fast may keep up, so needn't say EAGAIN at all */
+static int test_nonblock(int argc, char *argv[]) {
+        struct marks_t m = {PTHREAD_MUTEX_INITIALIZER, 0, 0, true};
+        int64_t len, off = 0, ret, queued;
+        int eagains = 0, i;
+        bool fast;
+        iow_t *iow;
+        char *data;
+
+        if (argc < 4)
+                return fail("usage: nonblock <input> <output> <method> "
+                            "[fast]");
+        fast = argc > 4 && strcmp(argv[4], "fast") == 0;
+        data = load(argv[1], &len);
+        if (!data)
+                return fail("unable to read input");
+        iow = wandio_wcreate(argv[2], lookup_type(argv[3]), 9, 0);
+        if (!iow)
+                return fail("unable to open output");
+        if (wandio_wset_nonblocking(iow, 1) != 0 ||
+            wandio_wset_watermarks(iow, WANDIO_BUFFER_SIZE,
+                                   3 * WANDIO_BUFFER_SIZE, crossed, &m) != 0)
+                return fail("writer doesn't support non-blocking mode");
+
+        while (off < len) {
+                ret = wandio_wwrite(iow, data + off, len - off);
+                queued = wandio_wqueued(iow);
+                if (queued > 5 * WANDIO_BUFFER_SIZE)
+                        return fail("queue has grown without bound");
+                if (ret > 0) {
+                        off += ret;
+                        continue;
+                }
+                if (ret == 0 || errno != EAGAIN)
+                        return fail("write failed without EAGAIN");
+                if (queued == 0)
+                        return fail("EAGAIN with nothing queued");
+                eagains++;
+                usleep(10000);
+        }
+        if (eagains == 0 && !fast)
+                return fail("writer never said EAGAIN");
+        for (i = 0; wandio_wflush(iow) < 0 && i < WAIT_STEPS; i++) {
+                if (errno != EAGAIN)
+                        return fail("flush failed without EAGAIN");
+                usleep(10000);
+        }
+        for (i = 0; wandio_wqueued(iow) > 0 && i < WAIT_STEPS; i++)
+                usleep(10000);
+        if (wandio_wqueued(iow) > 0)
+                return fail("queue never drained");
+
+        pthread_mutex_lock(&m.mutex);
+        if ((m.crossings < 2 && !fast) || !m.alternated || m.above)
+                return fail("watermarks weren't crossed alternately");
+        pthread_mutex_unlock(&m.mutex);
+
+        wandio_wdestroy(iow);
+        if (readable(argv[3]) && !same(argv[2], data, len))
+                return fail("output doesn't match input");
+        free(data);
+        return 0;
+}
+
+/* Writes a third of the input to each of three files in turn using a
+ * rotating writer, and checks that each file ends up with its own third and
+ * that a file that was prepared but never rotated to is removed */
+static int test_rotate(int argc, char *argv[]) {
+        char name[4][4096];
+        int64_t len, part;
+        iow_t *iow;
+        char *data;
+        int i;
+
+        if (argc < 4)
+                return fail("usage: rotate <input> <output> <method>");
+        data = load(argv[1], &len);
+        if (!data)
+                return fail("unable to read input");
+        part = len / 3;
+        for (i = 0; i < 4; i++) {
+                snprintf(name[i], sizeof(name[i]), "%s.%d", argv[2], i);
+                unlink(name[i]);
+        }
+
+        iow = wandio_wcreate_rotating(name[0], lookup_type(argv[3]), 1, 0,
+                                      NULL);
+        if (!iow)
+                return fail("unable to open output");
+        if (wandio_wrotate(iow) == 0 || errno != EINVAL)
+                return fail("rotated without a file to rotate to");
+        for (i = 0; i < 3; i++) {
+                if (wandio_wwrite(iow, data + i * part, part) != part)
+                        return fail("unable to write output");
+                if (wandio_wprepare(iow, name[i + 1]) != 0)
+                        return fail("unable to prepare the next file");
+                if (wandio_wprepare(iow, name[i + 1]) == 0 || errno != EBUSY)
+                        return fail("prepared two files at once");
+                if (i < 2 && wandio_wrotate(iow) != 0)
+                        return fail("unable to rotate");
+        }
+        wandio_wdestroy(iow);
+
+        for (i = 0; i < 3; i++) {
+                if (!same(name[i], data + i * part, part))
+                        return fail("output doesn't match input");
+        }
+        if (access(name[3], F_OK) == 0)
+                return fail("unused file was left behind");
+
+        /* Closing while the next file may still be being opened */
+        iow = wandio_wcreate_rotating(name[0], lookup_type(argv[3]), 1, 0,
+                                      NULL);
+        if (!iow || wandio_wprepare(iow, name[3]) != 0)
+                return fail("unable to open output");
+        wandio_wdestroy(iow);
+        if (access(name[3], F_OK) == 0)
+                return fail("unused file was left behind");
+        free(data);
+        return 0;
+}
+
+/* Writes the input to one file per compression method using a tee, in
+ * uneven pieces with a flush part way through, and checks that every file
+ * gets all of it */
+static int test_tee(int argc, char *argv[]) {
+        struct wandio_branch branch[8];
+        char name[8][4096];
+        int64_t len, off, piece;
+        iow_t *iow;
+        char *data;
+        int count = argc - 3, i;
+
+        if (count < 1 || count > 8)
+                return fail("usage: tee <input> <output> <methods...>");
+        data = load(argv[1], &len);
+        if (!data)
+                return fail("unable to read input");
+        memset(branch, 0, sizeof(branch));
+        for (i = 0; i < count; i++) {
+                snprintf(name[i], sizeof(name[i]), "%s.%d", argv[2], i);
+                branch[i].filename = name[i];
+                branch[i].compression_type = lookup_type(argv[i + 3]);
+                branch[i].compression_level = 1;
+        }
+
+        iow = wandio_wcreate_tee(branch, count);
+        if (!iow)
+                return fail("unable to open output");
+        for (off = 0, piece = 1; off < len; off += piece, piece = piece * 3) {
+                if (piece > len - off)
+                        piece = len - off;
+                if (wandio_wwrite(iow, data + off, piece) != piece)
+                        return fail("unable to write output");
+                if (off < len / 2 && off + piece >= len / 2 &&
+                    wandio_wflush(iow) < 0)
+                        return fail("unable to flush output");
+        }
+        wandio_wdestroy(iow);
+        for (i = 0; i < count; i++) {
+                if (!same(name[i], data, len))
+                        return fail("output doesn't match input");
+        }
+
+        /* One branch that can't be opened spoils the lot */
+        branch[count - 1].filename = "/nonexistent/wandiotest";
+        iow = wandio_wcreate_tee(branch, count);
+        if (iow)
+                return fail("opened a tee with a missing branch");
+        free(data);
+        return 0;
+}
+
+/* Divides a file into ranges with wandio_plan_splits(), and checks that they
+ * cover the file between them, that they are at least as many as expected,
+ * and that reading each one by itself and joining them up gives the same
+ * data as reading the whole file */
+static int test_splits(int argc, char *argv[]) {
+        struct wandio_split split[64];
+        int64_t len, got, off = 0, uoff = 0;
+        char *data, *read;
+        struct stat st;
+        int n, want, count, i;
+
+        if (argc < 4)
+                return fail("usage: splits <input> <ranges> <at least>");
+        n = atoi(argv[2]);
+        want = atoi(argv[3]);
+        if (n < 1 || n > 64 || stat(argv[1], &st) != 0)
+                return fail("need between 1 and 64 ranges of a local file");
+        data = load(argv[1], &len);
+        if (!data)
+                return fail("unable to read input");
+
+        count = wandio_plan_splits(argv[1], n, split);
+        if (count < want || count > n)
+                return fail("wrong number of ranges");
+        for (i = 0; i < count; i++) {
+                if (split[i].offset != off || split[i].length <= 0 ||
+                    split[i].uncompressed_offset != uoff)
+                        return fail("ranges don't follow on from each other");
+                read = read_all(wandio_create_split(argv[1], &split[i]), &got);
+                if (!read || got > len - uoff ||
+                    memcmp(read, data + uoff, got) != 0)
+                        return fail("range doesn't match the whole file");
+                free(read);
+                off += split[i].length;
+                uoff += got;
+        }
+        if (off != st.st_size || uoff != len)
+                return fail("ranges don't cover the whole file");
+        free(data);
+        return 0;
+}
+
+struct dispatched_t {
+        pthread_mutex_t mutex;
+        struct wandio_chunk *chunks;
+        uint64_t alloced;
+        uint64_t count;
+        bool lines;
+        bool failed;
+        /* Ask to stop once this chunk is reached, if not 0 */
+        uint64_t stop_at;
+};
+
+/* Keeps a copy of each chunk, by sequence number */
+static int dispatched(const struct wandio_chunk *chunk, void *data) {
+        struct dispatched_t *d = (struct dispatched_t *)data;
+        const char *bytes = (const char *)chunk->data;
+        char *copy = malloc(chunk->len > 0 ? chunk->len : 1);
+        uint64_t old;
+
+        memcpy(copy, chunk->data, chunk->len);
+        pthread_mutex_lock(&d->mutex);
+        while (chunk->seq >= d->alloced) {
+                old = d->alloced;
+                d->alloced = old ? old * 2 : 64;
+                d->chunks = realloc(d->chunks,
+                                    d->alloced * sizeof(struct wandio_chunk));
+                memset(d->chunks + old, 0,
+                       (d->alloced - old) * sizeof(struct wandio_chunk));
+        }
+        if (d->chunks[chunk->seq].data || chunk->len == 0 ||
+            (d->lines && bytes[chunk->len - 1] != '\n'))
+                d->failed = true;
+        free((void *)d->chunks[chunk->seq].data);
+        d->chunks[chunk->seq] = *chunk;
+        d->chunks[chunk->seq].data = copy;
+        d->count++;
+        pthread_mutex_unlock(&d->mutex);
+        return d->stop_at && chunk->seq >= d->stop_at;
+}
+
+static int64_t end_of_line(const void *buffer, int64_t len, void *data) {
+        const char *bytes = (const char *)buffer;
+
+        (void)data;
+        while (len > 0 && bytes[len - 1] != '\n')
+                len--;
+        return len;
+}
+
+/* Hands a file to several workers with wandio_dispatch(), optionally in
+ * whole lines, and checks that the chunks are numbered in order, have the
+ * right offsets and put back together make up the whole file. The input
+ * should end with a newline. Also checks that a callback can stop it */
+static int test_dispatch(int argc, char *argv[]) {
+        struct dispatched_t d;
+        int64_t len, off = 0, ret;
+        uint64_t i;
+        char *data;
+        io_t *io;
+
+        if (argc < 4)
+                return fail("usage: dispatch <input> <workers> <lines|any>");
+        data = load(argv[1], &len);
+        if (!data)
+                return fail("unable to read input");
+        memset(&d, 0, sizeof(d));
+        pthread_mutex_init(&d.mutex, NULL);
+        d.lines = strcmp(argv[3], "lines") == 0;
+
+        io = wandio_create(argv[1]);
+        if (!io)
+                return fail("unable to open input");
+        ret = wandio_dispatch(io, atoi(argv[2]), dispatched,
+                              d.lines ? end_of_line : NULL, &d);
+        wandio_destroy(io);
+        if (ret < 0 || (uint64_t)ret != d.count)
+                return fail("wrong number of chunks");
+        if (d.failed)
+                return fail("chunk was repeated, empty or split a line");
+        for (i = 0; i < d.count; i++) {
+                if (!d.chunks[i].data)
+                        return fail("chunk is missing");
+                if (d.chunks[i].offset != off ||
+                    d.chunks[i].len > len - off ||
+                    memcmp(d.chunks[i].data, data + off, d.chunks[i].len))
+                        return fail("chunk doesn't match input");
+                off += d.chunks[i].len;
+                free((void *)d.chunks[i].data);
+        }
+        if (off != len)
+                return fail("chunks don't cover the input");
+
+        memset(d.chunks, 0, d.alloced * sizeof(struct wandio_chunk));
+        d.count = 0;
+        d.stop_at = 3;
+        io = wandio_create(argv[1]);
+        if (!io)
+                return fail("unable to open input");
+        ret = wandio_dispatch(io, atoi(argv[2]), dispatched,
+                              d.lines ? end_of_line : NULL, &d);
+        wandio_destroy(io);
+        if (d.count > 3 && (ret != -1 || errno != ECANCELED))
+                return fail("callback couldn't stop it");
+        for (i = 0; i < d.alloced; i++)
+                free((void *)d.chunks[i].data);
+        free(d.chunks);
+        free(data);
+        return 0;
+}
+
+/* The most files test_shard can write */
+#define MAX_SHARDS 16
+
+/* Writes the input across several files in pieces of random sizes, some to
+ * the next file in turn and some to a file picked by a random key, then
+ * reads the files back, given in reverse order, and checks that the pieces
+ * are put back together in the order they were written */
+static int test_shard(int argc, char *argv[]) {
+        /* Two writes: one byte, then one claiming to be 2^63 bytes long */
+        static const unsigned char corrupt[] = {
+            0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0,    'x',
+            1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x80};
+        char name[MAX_SHARDS][4096];
+        const char *names[MAX_SHARDS];
+        unsigned int rnd = 1;
+        int64_t len, off, piece, got;
+        int count, i;
+        char *data, *read;
+        iow_t *iow;
+        io_t *io;
+
+        if (argc < 5)
+                return fail("usage: shard <input> <output> <method> <count>");
+        count = atoi(argv[4]);
+        if (count < 1 || count > MAX_SHARDS)
+                return fail("need between 1 and 16 files");
+        data = load(argv[1], &len);
+        if (!data)
+                return fail("unable to read input");
+        for (i = 0; i < count; i++) {
+                snprintf(name[i], sizeof(name[i]), "%s.%d", argv[2], i);
+                names[count - 1 - i] = name[i];
+        }
+
+        iow = wandio_wcreate_sharded(names, count, lookup_type(argv[3]), 1, 0,
+                                     NULL);
+        if (!iow)
+                return fail("unable to open output");
+        for (off = 0; off < len; off += piece) {
+                rnd = rnd * 1103515245 + 12345;
+                piece = 1 + (rnd >> 8) % 65536;
+                if (piece > len - off)
+                        piece = len - off;
+                if ((rnd >> 28) & 1)
+                        got = wandio_wwrite_key(iow, rnd >> 16, data + off,
+                                                piece);
+                else
+                        got = wandio_wwrite(iow, data + off, piece);
+                if (got != piece)
+                        return fail("unable to write output");
+        }
+        wandio_wdestroy(iow);
+
+        read = read_all(wandio_create_sharded(names, count), &got);
+        if (!read || got != len || memcmp(read, data, len) != 0)
+                return fail("merged output doesn't match input");
+        free(read);
+
+        /* A corrupt length in a write's header ends the shard there, rather
+         * than being taken as a write that never finishes */
+        iow = wandio_wcreate(name[0], WANDIO_COMPRESS_NONE, 0, 0);
+        if (!iow || wandio_wwrite(iow, "WANDSHRD", 8) != 8 ||
+            wandio_wwrite(iow, corrupt, sizeof(corrupt)) != sizeof(corrupt))
+                return fail("unable to write corrupt shard");
+        wandio_wdestroy(iow);
+        read = read_all(wandio_create_sharded(names + count - 1, 1), &got);
+        if (!read || got != 1 || read[0] != 'x')
+                return fail("misread a shard with a corrupt header");
+        free(read);
+
+        /* Files that weren't written by a sharded writer are refused */
+        names[0] = argv[1];
+        io = wandio_create_sharded(names, count);
+        if (io || errno != EINVAL)
+                return fail("read a file that wasn't sharded");
+        free(data);
+        return 0;
+}
+
+/* The most producers test_ordered can run */
+#define MAX_PRODUCERS 16
+
+struct ordered_t {
+        iow_t *iow;
+        const char *data;
+        /* Where each write starts, with one extra entry for the end */
+        int64_t *start;
+        int *owner;
+        int nrecords;
+        /* The first write in the second half of the input */
+        int half;
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        /* Number of producers other than the first that have got through
+         * the first half */
+        int finished;
+        int producers;
+        bool failed;
+};
+
+struct producer_t {
+        struct ordered_t *o;
+        int num;
+};
+
+static void ordered_halfway(struct ordered_t *o) {
+        pthread_mutex_lock(&o->mutex);
+        o->finished++;
+        pthread_cond_signal(&o->cond);
+        pthread_mutex_unlock(&o->mutex);
+}
+
+static void *ordered_producer(void *userdata) {
+        struct producer_t *pr = (struct producer_t *)userdata;
+        struct ordered_t *o = pr->o;
+        iow_t *iow = wandio_wproducer(o->iow);
+        int64_t len;
+        int i;
+
+        for (i = 0; iow && i < o->nrecords; i++) {
+                if (i == o->half && pr->num != 0)
+                        ordered_halfway(o);
+                if (o->owner[i] != pr->num)
+                        continue;
+                len = o->start[i + 1] - o->start[i];
+                if (wandio_wwrite_seq(iow, i, o->data + o->start[i], len) !=
+                    len)
+                        o->failed = true;
+                /* Sit on the first write until everybody else has written
+                 * the first half, which they can only do if it gets
+                 * written out */
+                if (i == 0) {
+                        pthread_mutex_lock(&o->mutex);
+                        while (o->finished < o->producers - 1)
+                                pthread_cond_wait(&o->cond, &o->mutex);
+                        pthread_mutex_unlock(&o->mutex);
+                }
+        }
+        if (!iow) {
+                o->failed = true;
+                if (pr->num != 0)
+                        ordered_halfway(o);
+        } else {
+                wandio_wdestroy(iow);
+        }
+        return NULL;
+}
+
+/* Splits the input into small writes of random sizes, shares them out at
+ * random between several producers of an ordered writer, and checks that
+ * they come out in order. The first producer holds on to the first write
+ * until the others have written the first half of the input between them,
+ * which is far more than they can buffer, so they can't unless the merging
+ * thread writes it out without waiting for the producer to hand it over */
+static int test_ordered(int argc, char *argv[]) {
+        struct producer_t pr[MAX_PRODUCERS];
+        pthread_t thread[MAX_PRODUCERS];
+        struct ordered_t o;
+        unsigned int rnd = 1;
+        int64_t len, off;
+        char *data;
+        int i;
+
+        if (argc < 5)
+                return fail("usage: ordered <input> <output> <method> "
+                            "<producers>");
+        memset(&o, 0, sizeof(o));
+        o.producers = atoi(argv[4]);
+        if (o.producers < 2 || o.producers > MAX_PRODUCERS)
+                return fail("need between 2 and 16 producers");
+        data = load(argv[1], &len);
+        if (!data)
+                return fail("unable to read input");
+        o.data = data;
+        /* Writes average 128 bytes, so this is plenty */
+        o.start = malloc((len / 64 + 2) * sizeof(int64_t));
+        o.owner = malloc((len / 64 + 1) * sizeof(int));
+        for (off = 0; off < len; o.nrecords++) {
+                rnd = rnd * 1103515245 + 12345;
+                if (o.nrecords > len / 64)
+                        return fail("too many writes");
+                o.start[o.nrecords] = off;
+                if (off < len / 2) {
+                        o.owner[o.nrecords] =
+                            1 + (rnd >> 16) % (o.producers - 1);
+                        o.half = o.nrecords + 1;
+                } else {
+                        o.owner[o.nrecords] = (rnd >> 16) % o.producers;
+                }
+                off += 1 + (rnd >> 8) % 256;
+                if (off > len)
+                        off = len;
+        }
+        o.start[o.nrecords] = len;
+        o.owner[0] = 0;
+        pthread_mutex_init(&o.mutex, NULL);
+        pthread_cond_init(&o.cond, NULL);
+
+        /* A deadlock would otherwise hang the test script */
+        alarm(WAIT_STEPS / 10);
+        o.iow = wandio_wcreate_multi(argv[2], lookup_type(argv[3]), 1, 0,
+                                     NULL, true);
+        if (!o.iow)
+                return fail("unable to open output");
+        for (i = 0; i < o.producers; i++) {
+                pr[i].o = &o;
+                pr[i].num = i;
+                pthread_create(&thread[i], NULL, ordered_producer, &pr[i]);
+        }
+        for (i = 0; i < o.producers; i++)
+                pthread_join(thread[i], NULL);
+        wandio_wdestroy(o.iow);
+        alarm(0);
+
+        if (o.failed)
+                return fail("unable to write output");
+        if (!same(argv[2], data, len))
+                return fail("output isn't in sequence order");
+        free(o.start);
+        free(o.owner);
+        free(data);
+        return 0;
+}
+
+/* How many writers test_async closes at once */
+#define ASYNC_WRITERS 4
+
+struct closed_t {
+        int fd;
+        pthread_t caller;
+};
+
+static void closed(void *data) {
+        struct closed_t *c = (struct closed_t *)data;
+        char byte = pthread_equal(c->caller, pthread_self()) ? 'i' : 'b';
+
+        if (write(c->fd, &byte, 1) != 1)
+                abort();
+}
+
+/* Closes several writers in the background at once, and checks that each
+ * call-back is called from another thread and only once its file is
+ * complete */
+static int test_async(int argc, char *argv[]) {
+        char name[ASYNC_WRITERS][4096], byte;
+        struct pollfd pfd;
+        struct closed_t c;
+        iow_t *iow[ASYNC_WRITERS];
+        int64_t len;
+        char *data;
+        int fds[2], i;
+
+        if (argc < 4)
+                return fail("usage: async <input> <output> <method>");
+        data = load(argv[1], &len);
+        if (!data || pipe(fds) != 0)
+                return fail("unable to read input");
+        for (i = 0; i < ASYNC_WRITERS; i++) {
+                snprintf(name[i], sizeof(name[i]), "%s.%d", argv[2], i);
+                iow[i] = wandio_wcreate(name[i], lookup_type(argv[3]), 1, 0);
+                if (!iow[i] || wandio_wwrite(iow[i], data, len) != len)
+                        return fail("unable to write output");
+        }
+
+        c.fd = fds[1];
+        c.caller = pthread_self();
+        for (i = 0; i < ASYNC_WRITERS; i++)
+                wandio_wdestroy_async(iow[i], closed, &c);
+
+        pfd.fd = fds[0];
+        pfd.events = POLLIN;
+        for (i = 0; i < ASYNC_WRITERS; i++) {
+                if (poll(&pfd, 1, WAIT_STEPS * 10) != 1 ||
+                    read(fds[0], &byte, 1) != 1)
+                        return fail("call-back wasn't called");
+                if (byte != 'b')
+                        return fail("writer wasn't closed in the background");
+        }
+        for (i = 0; i < ASYNC_WRITERS && readable(argv[3]); i++) {
+                if (!same(name[i], data, len))
+                        return fail("output doesn't match input");
+        }
+        free(data);
+        return 0;
+}
+
+static const struct {
+        const char *name;
+        int (*run)(int argc, char *argv[]);
+} tests[] = {{"flush", test_flush},
+             {"async", test_async},
+             {"prealloc", test_prealloc},
+             {"nonblock", test_nonblock},
+             {"rotate", test_rotate},
+             {"tee", test_tee},
+             {"ordered", test_ordered},
+             {"shard", test_shard},
+             {"dispatch", test_dispatch},
+             {"splits", test_splits},
+             {NULL, NULL}};
+
+int main(int argc, char *argv[]) {
+        int i;
+
+        if (argc < 2)
+                return fail("usage: wandiotest <test> <arguments...>");
+        for (i = 0; tests[i].name; i++) {
+                if (strcmp(tests[i].name, argv[1]) == 0)
+                        return tests[i].run(argc - 1, argv + 1);
+        }
+        return fail("unknown test");
+}
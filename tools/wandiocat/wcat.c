@@ -24,22 +24,72 @@
  *
  */
 
+#define _GNU_SOURCE 1
+#include "config.h"
 #include <ctype.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "wandio.h"
 
+/* The default size of a trained dictionary, same as the zstd command line
+ * tool */
+#define DEFAULT_DICT_SIZE (110 * 1024)
+
+/* The most we ask the kernel to copy in one go */
+#define COPY_CHUNK (1024 * 1024 * 1024)
+
+/* Names for the codec tuning options that can be given with -O */
+static const struct {
+        const char *name;
+        int option;
+} wopt_names[] = {
+    {"zstd-window-log", WANDIO_WOPT_ZSTD_WINDOW_LOG},
+    {"zstd-long", WANDIO_WOPT_ZSTD_LONG},
+    {"zlib-mem-level", WANDIO_WOPT_ZLIB_MEM_LEVEL},
+    {"zlib-strategy", WANDIO_WOPT_ZLIB_STRATEGY},
+    {"lz4-block-size", WANDIO_WOPT_LZ4_BLOCK_SIZE},
+    {"lzma-extreme", WANDIO_WOPT_LZMA_EXTREME},
+    {"lzma-block-size", WANDIO_WOPT_LZMA_BLOCK_SIZE},
+    {"adapt-min-level", WANDIO_WOPT_ADAPT_MIN_LEVEL},
+    {"store-incompressible", WANDIO_WOPT_STORE_INCOMPRESSIBLE},
+    {NULL, WANDIO_WOPT_END}};
+
+#define MAX_WOPTS 16
+
+static int parse_wopt(const char *arg, struct wandio_wopt *wopt) {
+        const char *eq = strchr(arg, '=');
+        int i;
+
+        if (!eq)
+                return -1;
+        for (i = 0; wopt_names[i].name; i++) {
+                if (strlen(wopt_names[i].name) == (size_t)(eq - arg) &&
+                    strncmp(wopt_names[i].name, arg, eq - arg) == 0) {
+                        wopt->option = wopt_names[i].option;
+                        wopt->value = strtoll(eq + 1, NULL, 0);
+                        return 0;
+                }
+        }
+        return -1;
+}
+
 static void printhelp() {
+        int i;
+
         printf("wandiocat: concatenate files into a single compressed file\n");
         printf("\n");
         printf("Available options:\n\n");
         printf(" -z <level>\n");
-        printf("    Sets a compression level for the output file, must be \n");
-        printf("    between 0 (uncompressed) and 9 (max compression)\n");
-        printf("    Default is 0.\n");
+        printf("    Sets a compression level for the output file, usually \n");
+        printf("    between 0 (uncompressed) and 9 (max compression), though\n");
+        printf("    zstd and lz4 support a wider range. Default is 0.\n");
         printf(" -Z <method>\n");
         printf("    Set the compression method. Must be one of 'gzip', \n");
         printf("    'bzip2', 'lzo', 'lzma', 'zstd' or 'lz4'. If not specified, "
@@ -48,6 +98,89 @@ static void printhelp() {
         printf(" -o <file>\n");
         printf("    The name of the output file. If not specified, output\n");
         printf("    is written to standard output.\n");
+        printf(" -O <option>=<value>\n");
+        printf("    Sets a tuning option for the compression method. May be\n");
+        printf("    given more than once. Available options are:\n");
+        printf("    ");
+        for (i = 0; wopt_names[i].name; i++) {
+                printf("%s%s", i ? ", " : "", wopt_names[i].name);
+        }
+        printf("\n");
+        printf(" -T\n");
+        printf("    Train a zstd dictionary using the input files as samples\n");
+        printf("    and write it to the output file. If the output is a\n");
+        printf("    directory, the dictionary is saved there as <id>.dict.\n");
+}
+
+static int train_dict(char *const *filenames, int count, const char *output) {
+        char *dict = malloc(DEFAULT_DICT_SIZE);
+        char path[4096];
+        unsigned int dict_id = 0;
+        struct stat st;
+        int64_t len;
+        iow_t *iow;
+
+        len = wandio_zstd_train_dict(filenames, count, dict, DEFAULT_DICT_SIZE,
+                                     &dict_id);
+        if (len < 0) {
+                free(dict);
+                return 1;
+        }
+
+        if (stat(output, &st) == 0 && S_ISDIR(st.st_mode)) {
+                snprintf(path, sizeof(path), "%s/%u.dict", output, dict_id);
+                output = path;
+        }
+        iow = wandio_wcreate(output, WANDIO_COMPRESS_NONE, 0, 0);
+        if (!iow) {
+                fprintf(stderr, "Failed to open %s\n", output);
+                free(dict);
+                return 1;
+        }
+        wandio_wwrite(iow, dict, len);
+        wandio_wdestroy(iow);
+        fprintf(stderr, "Trained dictionary %u (%" PRId64 " bytes)\n", dict_id,
+                len);
+        free(dict);
+        return 0;
+}
+
+/* Copies the rest of an uncompressed input to an uncompressed output without
+ * bringing the data into userspace, using copy_file_range() between files or
+ * splice() if either end is a pipe. Offset is where to start reading the
+ * input from, or -1 to read from its current position.
+ *
+ * Returns 0 once everything has been copied, -1 if the kernel can't do the
+ * copy for us (in which case nothing has been copied), or 1 if the copy
+ * failed part way through.
+ */
+static int kernel_copy(int in_fd, int64_t offset, int out_fd) {
+        loff_t off = offset;
+        ssize_t ret = -1;
+        bool started = false;
+
+#ifdef HAVE_COPY_FILE_RANGE
+        if (offset >= 0) {
+                while ((ret = copy_file_range(in_fd, &off, out_fd, NULL,
+                                              COPY_CHUNK, 0)) > 0)
+                        started = true;
+                if (ret == 0)
+                        return 0;
+                /* Filesystems that don't support it fail straight away */
+                if (started)
+                        return 1;
+        }
+#endif
+#ifdef HAVE_SPLICE
+        while ((ret = splice(in_fd, offset >= 0 ? &off : NULL, out_fd, NULL,
+                             COPY_CHUNK, SPLICE_F_MOVE)) > 0)
+                started = true;
+        if (ret == 0)
+                return 0;
+#endif
+        (void)in_fd;
+        (void)out_fd;
+        return started ? 1 : -1;
 }
 
 int main(int argc, char *argv[]) {
@@ -55,8 +188,11 @@ int main(int argc, char *argv[]) {
         int compress_type = WANDIO_COMPRESS_NONE;
         char *output = "-";
         int c;
+        int train = 0;
         char *buffer = NULL;
-        while ((c = getopt(argc, argv, "Z:z:o:h")) != -1) {
+        struct wandio_wopt wopts[MAX_WOPTS + 1];
+        int nwopts = 0;
+        while ((c = getopt(argc, argv, "Z:z:o:O:Th")) != -1) {
                 switch (c) {
                 case 'Z': {
                         struct wandio_compression_type *compression_type =
@@ -77,11 +213,25 @@ int main(int argc, char *argv[]) {
                 case 'o':
                         output = optarg;
                         break;
+                case 'O':
+                        if (nwopts >= MAX_WOPTS ||
+                            parse_wopt(optarg, &wopts[nwopts]) < 0) {
+                                fprintf(stderr,
+                                        "Invalid compression option: '%s'\n",
+                                        optarg);
+                                return 1;
+                        }
+                        nwopts++;
+                        break;
+                case 'T':
+                        train = 1;
+                        break;
                 case 'h':
                         printhelp();
                         return 0;
                 case '?':
-                        if (optopt == 'Z' || optopt == 'z' || optopt == 'o')
+                        if (optopt == 'Z' || optopt == 'z' || optopt == 'o' ||
+                            optopt == 'O')
                                 fprintf(stderr,
                                         "Option -%c requires an argument.\n",
                                         optopt);
@@ -98,7 +248,16 @@ int main(int argc, char *argv[]) {
                 }
         }
 
-        iow_t *iow = wandio_wcreate(output, compress_type, compress_level, 0);
+        if (train)
+                return train_dict(argv + optind, argc - optind, output);
+
+        wopts[nwopts].option = WANDIO_WOPT_END;
+        iow_t *iow = wandio_wcreate_opts(output, compress_type, compress_level,
+                                         0, wopts);
+        if (!iow) {
+                fprintf(stderr, "Failed to open %s\n", output);
+                return 1;
+        }
         /* stdout */
         int i;
         int rc = 0;
@@ -122,6 +281,29 @@ int main(int argc, char *argv[]) {
                         continue;
                 }
 
+                /* Raw captures can be copied without passing them through
+                 * our buffer at all */
+                if (compress_type == WANDIO_COMPRESS_NONE ||
+                    compress_level == 0) {
+                        int64_t offset;
+                        int in_fd = wandio_get_fd(ior, &offset);
+                        int out_fd = in_fd < 0 ? -1 : wandio_wget_fd(iow);
+                        int ret = out_fd < 0 ? -1
+                                             : kernel_copy(in_fd, offset,
+                                                           out_fd);
+
+                        if (ret >= 0) {
+                                if (ret > 0) {
+                                        fprintf(stderr,
+                                                "Failed to copy %s: %s\n",
+                                                argv[i], strerror(errno));
+                                        rc++;
+                                }
+                                wandio_destroy(ior);
+                                continue;
+                        }
+                }
+
                 int64_t len;
                 do {
                         len = wandio_read(ior, buffer, WANDIO_BUFFER_SIZE);